@@ -0,0 +1,23 @@
+/* Automatically generated by genmodtable.sh - do not edit
+ *
+ * This file defines a table of all supported proto modules.
+ */
+
+struct proto_module;
+
+/* Automatically generated by proto - do not edit
+ *
+ * This file defines a table of all supported  modules.
+ */
+
+struct _module;
+
+extern const proto_module p_mod_chop;
+extern const proto_module p_mod_null;
+
+extern const proto_module *const supported_protos[] =
+{
+  &p_mod_chop,
+  &p_mod_null,
+  0
+};
@@ -0,0 +1,33 @@
+/* Automatically generated by genmodtable.sh - do not edit
+ *
+ * This file defines a table of all supported steg modules.
+ */
+
+struct steg_module;
+
+/* Automatically generated by steg - do not edit
+ *
+ * This file defines a table of all supported  modules.
+ */
+
+struct _module;
+
+extern const steg_module s_mod_embed;
+extern const steg_module s_mod_h2c;
+extern const steg_module s_mod_http;
+extern const steg_module s_mod_http_apache;
+extern const steg_module s_mod_nosteg;
+extern const steg_module s_mod_nosteg_rr;
+extern const steg_module s_mod_websocket;
+
+extern const steg_module *const supported_stegs[] =
+{
+  &s_mod_embed,
+  &s_mod_h2c,
+  &s_mod_http,
+  &s_mod_http_apache,
+  &s_mod_nosteg,
+  &s_mod_nosteg_rr,
+  &s_mod_websocket,
+  0
+};
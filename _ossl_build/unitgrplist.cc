@@ -0,0 +1,43 @@
+/* Automatically generated by genunitgrps.sh - do not edit
+ *
+ * This file defines the table of unit test groups.
+ */
+
+#include "util.h"
+#include "test/tinytest.h"
+#include "test/unittest.h"
+
+extern struct testcase_t js_capacity_tests[];
+extern struct testcase_t base64_tests[];
+extern struct testcase_t chop_blk_tests[];
+extern struct testcase_t chunked_tests[];
+extern struct testcase_t zlib_tests[];
+extern struct testcase_t cover_source_tests[];
+extern struct testcase_t crypt_tests[];
+extern struct testcase_t h2_session_tests[];
+extern struct testcase_t http_apache_tests[];
+extern struct testcase_t pdf_tests[];
+extern struct testcase_t pdf_tests[];
+extern struct testcase_t shared_cover_cache_tests[];
+extern struct testcase_t socks_tests[];
+extern struct testcase_t timer_wheel_tests[];
+extern struct testcase_t websocket_tests[];
+
+extern const struct testgroup_t unittest_groups[] = {
+  { "js_capacity/", js_capacity_tests },
+  { "base64/", base64_tests },
+  { "chop_blk/", chop_blk_tests },
+  { "chunked/", chunked_tests },
+  { "zlib/", zlib_tests },
+  { "cover_source/", cover_source_tests },
+  { "crypt/", crypt_tests },
+  { "h2_session/", h2_session_tests },
+  { "http_apache/", http_apache_tests },
+  { "pdf/", pdf_tests },
+  { "pdf/", pdf_tests },
+  { "shared_cover_cache/", shared_cover_cache_tests },
+  { "socks/", socks_tests },
+  { "timer_wheel/", timer_wheel_tests },
+  { "websocket/", websocket_tests },
+  END_OF_GROUPS
+};
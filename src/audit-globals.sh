@@ -30,6 +30,12 @@ sed '
 
   /^compression ZLIB_CEILING$/d
   /^compression ZLIB_UINT_MAX$/d
+  /^compression deflate_context::for_thread(compression_format)::gzip_context$/d
+  /^compression deflate_context::for_thread(compression_format)::zlib_context$/d
+  /^compression inflate_context::for_thread()::context$/d
+  /^compression guard variable for deflate_context::for_thread(compression_format)::gzip_context$/d
+  /^compression guard variable for deflate_context::for_thread(compression_format)::zlib_context$/d
+  /^compression guard variable for inflate_context::for_thread()::context$/d
   /^connections cgs$/d
   /^crypt bctx$/d
   /^crypt crypto_initialized$/d
@@ -37,17 +43,27 @@ sed '
   /^main allow_kq$/d
   /^main daemon_mode$/d
   /^main handle_signal_cb(int, short, void\*)::got_sigint$/d
+  /^main max_connections$/d
+  /^main max_connections_per_ip$/d
+  /^main memory_report_interval$/d
   /^main pidfile_name$/d
   /^main registration_helper$/d
   /^main the_event_base$/d
+  /^network accept_paused$/d
+  /^network accept_retry$/d
   /^network listeners$/d
   /^rng rng$/d
+  /^rng (anonymous namespace)::rng_atfork_once$/d
+  /^rng (anonymous namespace)::rng_thread_state()::state$/d
+  /^splice_relay SpliceRelay::splice_refused$/d
   /^subprocess-unix already_waited$/d
+  /^timer_wheel TimerWheel::the_wheel$/d
   /^util log_dest$/d
   /^util log_min_sev$/d
   /^util log_timestamps$/d
   /^util log_ts_base$/d
   /^util-net the_evdns_base$/d
+  /^util-net peer_name_cache$/d
   /^apache_payload_server std::__ioinit$/d
 ')
 
@@ -4,6 +4,8 @@
 #ifndef _COMPRESSION_H
 #define _COMPRESSION_H
 
+#include <string>
+
 enum compression_format {
   c_format_zlib = 0,
   c_format_gzip = 1
@@ -32,4 +34,179 @@ ssize_t compress(const uint8_t *source, size_t slen,
 ssize_t decompress(const uint8_t *source, size_t slen,
                    uint8_t *dest, size_t dlen);
 
+/**
+ * Returns the size of the data compressed in the gzip stream at SOURCE
+ * as recorded in its trailer, so the caller can allocate exactly that
+ * much for decompress().  Returns -1 if SOURCE isn't a gzip stream.
+ */
+ssize_t decompressed_size(const uint8_t *source, size_t slen);
+
+struct evbuffer;
+struct z_stream_s;
+
+/**
+ * A part of a compressed stream compressed ahead of time: raw deflate
+ * blocks ending on a byte boundary and the checksum of the data they
+ * encode.  Segments are spliced into the output of
+ * deflate_context::compress so that the parts of a cover which never
+ * change between messages are compressed only once.  Make them with
+ * deflate_context::precompress.
+ */
+struct deflate_segment
+{
+  std::string blocks;
+  unsigned long check; // crc32 (gzip) or adler32 (zlib) of the data
+  size_t raw_len;
+};
+
+/**
+ * Setting up a deflate stream allocates and clears a few hundred
+ * kilobytes, which costs more than compressing a typical message.  A
+ * deflate_context keeps the stream around and only resets it between
+ * messages.  Contexts are not thread safe, use for_thread() to get the
+ * one belonging to the calling thread.
+ */
+class deflate_context
+{
+public:
+  /** The context of the calling thread producing FMT. */
+  static deflate_context &for_thread(compression_format fmt);
+
+  /** Same as compress() above. */
+  ssize_t compress(const uint8_t *source, size_t slen,
+                   uint8_t *dest, size_t dlen);
+
+  /**
+   * Compresses SLEN bytes at SOURCE and appends the result to DEST.
+   * Returns the number of bytes added to DEST, or -1 on error.
+   */
+  ssize_t compress(const uint8_t *source, size_t slen, struct evbuffer *dest);
+
+  /**
+   * Produces the same stream as compressing PREFIX + SOURCE + SUFFIX
+   * into DEST would, where PREFIX and SUFFIX have been precompressed
+   * by precompress(); only SOURCE is compressed here.
+   *
+   * Returns the amount of data actually written to DEST, or -1 on error.
+   */
+  ssize_t compress(const deflate_segment &prefix,
+                   const uint8_t *source, size_t slen,
+                   const deflate_segment &suffix,
+                   uint8_t *dest, size_t dlen);
+
+  /**
+   * Compresses SLEN bytes at SOURCE into SEGMENT to be used as prefix
+   * (LAST false) or suffix (LAST true) in the above.
+   * Returns false on error.
+   */
+  bool precompress(const uint8_t *source, size_t slen,
+                   deflate_segment &segment, bool last);
+
+  ~deflate_context();
+
+private:
+  deflate_context(compression_format fmt);
+
+  size_t write_header(uint8_t *dest);
+  size_t write_trailer(uint8_t *dest, unsigned long check, size_t raw_len);
+  unsigned long checksum(unsigned long check,
+                         const uint8_t *source, size_t slen);
+  unsigned long checksum_combine(unsigned long check1, unsigned long check2,
+                                 size_t len2);
+
+  compression_format fmt;
+  struct z_stream_s *strm;     // produces the whole stream
+  struct z_stream_s *raw_strm; // produces headerless blocks for splicing
+
+  deflate_context(const deflate_context&);
+  void operator=(const deflate_context&);
+};
+
+/**
+ * The inflate counterpart of deflate_context.  Detects the format of
+ * each stream as decompress() does.
+ */
+class inflate_context
+{
+public:
+  /** The context of the calling thread. */
+  static inflate_context &for_thread();
+
+  /** Same as decompress() above. */
+  ssize_t decompress(const uint8_t *source, size_t slen,
+                     uint8_t *dest, size_t dlen);
+
+  /**
+   * Decompresses SLEN bytes at SOURCE and appends the result to DEST,
+   * however large it turns out to be.  Returns the number of bytes
+   * added to DEST, or -1 on error, in which case DEST may hold part of
+   * the output.
+   */
+  ssize_t decompress(const uint8_t *source, size_t slen,
+                     struct evbuffer *dest);
+
+  ~inflate_context();
+
+private:
+  inflate_context();
+
+  struct z_stream_s *strm;
+
+  inflate_context(const inflate_context&);
+  void operator=(const inflate_context&);
+};
+
+/**
+ * One direction of a compressed channel that lasts as long as the
+ * channel does, such as a chop circuit: raw deflate (no header or
+ * trailer), with a sync flush at the end of every compress() so the
+ * stream_inflater at the other end can recover everything sent so
+ * far, while later data can still refer back to earlier data.
+ *
+ * The window is small, to keep the memory per circuit down, and
+ * nothing is allocated until the first call.
+ */
+class stream_deflater
+{
+public:
+  stream_deflater();
+  ~stream_deflater();
+
+  /**
+   * Compresses and removes the first SLEN bytes of SOURCE and appends
+   * the result to DEST.  Returns the number of bytes added to DEST,
+   * or -1 on error, after which the stream is unusable.
+   */
+  ssize_t compress(struct evbuffer *source, size_t slen,
+                   struct evbuffer *dest);
+
+private:
+  struct z_stream_s *strm;
+
+  stream_deflater(const stream_deflater&);
+  void operator=(const stream_deflater&);
+};
+
+/** The receiving end of a stream_deflater. */
+class stream_inflater
+{
+public:
+  stream_inflater();
+  ~stream_inflater();
+
+  /**
+   * Decompresses and removes all of SOURCE, which continues the
+   * stream where the previous call left off, and appends the result
+   * to DEST.  Returns the number of bytes added to DEST, or -1 if the
+   * stream is corrupt.
+   */
+  ssize_t decompress(struct evbuffer *source, struct evbuffer *dest);
+
+private:
+  struct z_stream_s *strm;
+
+  stream_inflater(const stream_inflater&);
+  void operator=(const stream_inflater&);
+};
+
 #endif
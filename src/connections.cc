@@ -5,15 +5,47 @@
 
 #include "util.h"
 #include "connections.h"
+#include "listener.h"
 #include "protocol.h"
 #include "socks.h"
+#include "uring_transport.h"
 
+#include <algorithm>
+#include <vector>
+#include <tr1/unordered_map>
 #include <tr1/unordered_set>
 
+#include <sys/resource.h>
+#ifndef _WIN32
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#endif
+#ifdef HAVE_LINUX_SOCKIOS_H
+#include <linux/sockios.h>
+#endif
+#if defined HAVE_MALLINFO2 || defined HAVE_MALLINFO
+#include <malloc.h>
+#endif
+
 #include <event2/event.h>
 #include <event2/buffer.h>
 
+using std::tr1::unordered_map;
 using std::tr1::unordered_set;
+using std::vector;
+
+/** File descriptors kept out of the connection limit, for listeners,
+    the DNS resolver, log files and the like. */
+#define RESERVED_FDS 64
+
+/** Never ask for more file descriptors than this (Linux's default
+    fs.nr_open). */
+#define MAX_FD_LIMIT (1 << 20)
+
+/** With the memory report on, the heap cost of creating one in this
+    many connections and circuits is measured. */
+#define MEMORY_SAMPLE_INTERVAL 16
 
 static void close_cleanup_cb(evutil_socket_t, short, void *);
 
@@ -50,6 +82,22 @@ struct conn_global_state
   unsigned int last_conn_serial;
   unsigned int last_ckt_serial;
 
+  /** Connection limits; see conn_global_init. */
+  size_t max_conns;
+  size_t max_conns_per_peer;
+
+  /** Number of open inbound connections from each client address,
+      by peer key.  Addresses with no connections are removed. */
+  unordered_map<unsigned long long, unsigned int> peers;
+
+  /** Periodic memory report; see conn_start_memory_report.  NULL if
+      it is off. */
+  struct event *memory_report;
+  size_t heap_baseline;     // heap in use when the report was started
+  size_t bufferevent_bytes; // heap cost of one socket bufferevent
+  size_t sampled_conns, sampled_conn_bytes;
+  size_t sampled_ckts, sampled_ckt_bytes;
+
   /** True when stegotorus is shutting down: no further connections or
       circuits may be created, and we break out of the event loop when
       the last one (of either) is closed. */
@@ -63,6 +111,10 @@ conn_global_state::conn_global_state(struct event_base *evbase)
   : the_event_base(evbase),
     close_cleanup(0),
     last_conn_serial(0), last_ckt_serial(0),
+    max_conns(0), max_conns_per_peer(0),
+    memory_report(0), heap_baseline(0), bufferevent_bytes(0),
+    sampled_conns(0), sampled_conn_bytes(0),
+    sampled_ckts(0), sampled_ckt_bytes(0),
     shutting_down(false)
 {
   close_cleanup = evtimer_new(evbase, close_cleanup_cb, this);
@@ -80,6 +132,8 @@ conn_global_state::~conn_global_state()
   log_assert(closed_circuits.empty());
 
   event_free(close_cleanup);
+  if (memory_report)
+    event_free(memory_report);
 }
 
 } // anonymous namespace
@@ -108,9 +162,11 @@ close_cleanup_cb(evutil_socket_t, short, void *arg)
       delete *i;
   }
 
-  if (!cgs->shutting_down ||
-      !cgs->circuits.empty() ||
-      !cgs->connections.empty())
+  if (!cgs->shutting_down) {
+    listener_apply_backpressure();
+    return;
+  }
+  if (!cgs->circuits.empty() || !cgs->connections.empty())
     return;
 
   log_debug("finishing shutdown");
@@ -121,11 +177,147 @@ close_cleanup_cb(evutil_socket_t, short, void *arg)
 
 static conn_global_state *cgs = NULL;
 
+/** Bytes handed out by the heap, or 0 if we cannot tell. */
+static size_t
+heap_in_use()
+{
+#if defined HAVE_MALLINFO2
+  struct mallinfo2 mi = mallinfo2();
+  return mi.uordblks + mi.hblkhd;
+#elif defined HAVE_MALLINFO
+  struct mallinfo mi = mallinfo();
+  return (size_t)(unsigned int)mi.uordblks + (unsigned int)mi.hblkhd;
+#else
+  return 0;
+#endif
+}
+
+/**
+   Logs how much memory connections and circuits take.  The cost of an
+   idle connection is what it took to create one (sampled) plus its
+   bufferevent; whatever the heap has grown by beyond that, and beyond
+   the data buffered on connections, is charged to the circuits.
+*/
+static void
+memory_report_cb(evutil_socket_t, short, void *arg)
+{
+  conn_global_state *cgs = (conn_global_state *)arg;
+  size_t heap = heap_in_use();
+  size_t growth = heap > cgs->heap_baseline ? heap - cgs->heap_baseline : 0;
+  size_t n_conns = cgs->connections.size();
+  size_t n_ckts = cgs->circuits.size();
+  size_t idle = 0, buffered = 0;
+
+  for (unordered_set<conn_t *>::iterator i = cgs->connections.begin();
+       i != cgs->connections.end(); i++) {
+    size_t bytes = 0;
+    if ((*i)->buffer)
+      bytes = evbuffer_get_length((*i)->inbound()) +
+        evbuffer_get_length((*i)->outbound());
+    if (bytes == 0)
+      idle++;
+    buffered += bytes;
+  }
+
+  size_t per_conn = cgs->bufferevent_bytes +
+    (cgs->sampled_conns ? cgs->sampled_conn_bytes / cgs->sampled_conns : 0);
+  size_t conn_bytes = std::min(growth, n_conns * per_conn + buffered);
+  size_t per_ckt = n_ckts ? (growth - conn_bytes) / n_ckts : 0;
+
+  log_info("memory: heap %lu bytes, %lu more than at startup",
+           (unsigned long)heap, (unsigned long)growth);
+  log_info("memory: %lu connections (%lu idle) at %lu bytes each when "
+           "idle, %lu bytes buffered on them",
+           (unsigned long)n_conns, (unsigned long)idle,
+           (unsigned long)per_conn, (unsigned long)buffered);
+  log_info("memory: %lu circuits at %lu bytes each (%lu to create)",
+           (unsigned long)n_ckts, (unsigned long)per_ckt,
+           (unsigned long)(cgs->sampled_ckts
+                           ? cgs->sampled_ckt_bytes / cgs->sampled_ckts
+                           : 0));
+}
+
+void
+conn_start_memory_report(unsigned int seconds)
+{
+  log_assert(!cgs->memory_report);
+  if (heap_in_use() == 0) {
+    log_warn("memory report: heap statistics are not available here");
+    return;
+  }
+
+  size_t before = heap_in_use();
+  struct bufferevent *bev =
+    bufferevent_socket_new(cgs->the_event_base, -1, BEV_OPT_CLOSE_ON_FREE);
+  if (bev) {
+    size_t after = heap_in_use();
+    cgs->bufferevent_bytes = after > before ? after - before : 0;
+    bufferevent_free(bev);
+  }
+
+  cgs->memory_report = event_new(cgs->the_event_base, -1, EV_PERSIST,
+                                 memory_report_cb, cgs);
+  if (!cgs->memory_report)
+    log_abort("failed to create memory report event");
+
+  struct timeval tv = { (time_t)seconds, 0 };
+  event_add(cgs->memory_report, &tv);
+  cgs->heap_baseline = heap_in_use();
+}
+
+/** Raises the soft file descriptor limit to the hard limit, and
+    returns the limit in effect. */
+static size_t
+raise_fd_limit()
+{
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl)) {
+    log_warn("getrlimit(RLIMIT_NOFILE): %s", strerror(errno));
+    return 1024;
+  }
+
+  rlim_t want = rl.rlim_max;
+  if (want == RLIM_INFINITY || want > MAX_FD_LIMIT)
+    want = MAX_FD_LIMIT;
+  if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > want)
+    return want;
+
+  if (rl.rlim_cur < want) {
+    rlim_t have = rl.rlim_cur;
+    rl.rlim_cur = want;
+    if (setrlimit(RLIMIT_NOFILE, &rl)) {
+      log_info("could not raise file descriptor limit from %lu to %lu: %s",
+               (unsigned long)have, (unsigned long)want, strerror(errno));
+      return have;
+    }
+    log_debug("raised file descriptor limit from %lu to %lu",
+              (unsigned long)have, (unsigned long)want);
+  }
+  return rl.rlim_cur;
+}
+
 void
-conn_global_init(struct event_base *evbase)
+conn_global_init(struct event_base *evbase, size_t max_conns,
+                 size_t max_conns_per_peer)
 {
   cgs = new conn_global_state(evbase);
-  
+
+  // In server mode each downstream connection may have an upstream
+  // socket of its own, so only half the descriptors are ours to give.
+  size_t fds = raise_fd_limit();
+  size_t fd_conns = fds > RESERVED_FDS + 32 ? (fds - RESERVED_FDS) / 2 : 16;
+
+  if (max_conns == 0)
+    max_conns = fd_conns;
+  else if (max_conns > fd_conns)
+    log_warn("connection limit %lu is more than the file descriptor "
+             "limit (%lu) allows; expect accept failures",
+             (unsigned long)max_conns, (unsigned long)fds);
+
+  cgs->max_conns = max_conns;
+  cgs->max_conns_per_peer = max_conns_per_peer;
+  log_info("allowing %lu connections (%lu per client address)",
+           (unsigned long)max_conns, (unsigned long)max_conns_per_peer);
 }
 
 void
@@ -148,6 +340,12 @@ conn_start_shutdown(int barbaric)
            i != v.end(); i++) 
         (*i)->close();
     }
+  } else {
+    //a circuit may finish at once and leave the set
+    vector<circuit_t *> v(cgs->circuits.begin(), cgs->circuits.end());
+    for (vector<circuit_t *>::iterator i = v.begin(); i != v.end(); i++)
+      if (cgs->circuits.count(*i))
+        (*i)->start_shutdown();
   }
 
   /* Make sure close_cleanup_cb is called at least once after this
@@ -156,6 +354,12 @@ conn_start_shutdown(int barbaric)
   event_active(cgs->close_cleanup, 0, 0);
 }
 
+bool
+conn_shutting_down(void)
+{
+  return cgs->shutting_down;
+}
+
 size_t
 conn_count(void)
 {
@@ -168,6 +372,88 @@ circuit_count(void)
   return cgs->circuits.size();
 }
 
+size_t
+conn_limit(void)
+{
+  return cgs->max_conns;
+}
+
+/** Hashes the address (not the port) of PEERADDR into a nonzero key,
+    or returns 0 for anything that is not an IP address. */
+static unsigned long long
+peer_key(const struct sockaddr *peeraddr, int peerlen)
+{
+  const unsigned char *p;
+  size_t n;
+
+  if (peeraddr->sa_family == AF_INET &&
+      peerlen >= (int)sizeof(struct sockaddr_in)) {
+    p = (const unsigned char *)&((const struct sockaddr_in *)peeraddr)
+      ->sin_addr;
+    n = 4;
+  } else if (peeraddr->sa_family == AF_INET6 &&
+             peerlen >= (int)sizeof(struct sockaddr_in6)) {
+    p = (const unsigned char *)&((const struct sockaddr_in6 *)peeraddr)
+      ->sin6_addr;
+    n = 16;
+  } else
+    return 0;
+
+  // FNV-1a
+  unsigned long long h = 14695981039346656037ULL ^ peeraddr->sa_family;
+  for (size_t i = 0; i < n; i++) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return h ? h : 1;
+}
+
+bool
+conn_admit(const struct sockaddr *peeraddr, int peerlen)
+{
+  size_t count = cgs->connections.size();
+  if (count >= cgs->max_conns) {
+    log_info("refusing connection: limit of %lu reached",
+             (unsigned long)cgs->max_conns);
+    return false;
+  }
+
+  unsigned long long key = peer_key(peeraddr, peerlen);
+  if (!key)
+    return true;
+
+  unordered_map<unsigned long long, unsigned int>::const_iterator p =
+    cgs->peers.find(key);
+  size_t have = p == cgs->peers.end() ? 0 : p->second;
+
+  if (cgs->max_conns_per_peer && have >= cgs->max_conns_per_peer) {
+    log_info("refusing connection: client has its quota of %lu",
+             (unsigned long)cgs->max_conns_per_peer);
+    return false;
+  }
+
+  // Within an eighth of the limit, the last slots go to clients with
+  // less than an even share, so one busy client cannot lock out the
+  // rest.  A new client always has less.
+  if (have > 0 && count >= cgs->max_conns - cgs->max_conns / 8 &&
+      have >= cgs->max_conns / cgs->peers.size()) {
+    log_info("refusing connection: near the limit and client has %lu "
+             "of %lu connections", (unsigned long)have,
+             (unsigned long)count);
+    return false;
+  }
+  return true;
+}
+
+void
+conn_track_peer(conn_t *conn, const struct sockaddr *peeraddr, int peerlen)
+{
+  log_assert(!conn->peer_key);
+  conn->peer_key = peer_key(peeraddr, peerlen);
+  if (conn->peer_key)
+    cgs->peers[conn->peer_key]++;
+}
+
 /**
    Creates a new conn_t from a config_t and a socket.
 */
@@ -179,15 +465,27 @@ conn_create(config_t *cfg, size_t index,
 
   log_assert(!cgs->shutting_down);
 
+  bool sample = cgs->memory_report &&
+    cgs->last_conn_serial % MEMORY_SAMPLE_INTERVAL == 0;
+  size_t heap_before = sample ? heap_in_use() : 0;
+
   conn = cfg->conn_create(index);
   conn->buffer = buf;
   conn->peername = peername;
   conn->serial = ++cgs->last_conn_serial;
+
+  if (sample) {
+    size_t heap_after = heap_in_use();
+    cgs->sampled_conns++;
+    cgs->sampled_conn_bytes += strlen(peername) + 1 +
+      (heap_after > heap_before ? heap_after - heap_before : 0);
+  }
   //keeping track of connection consumption
   time(&conn->creation_time);
 
   cgs->connections.insert(conn);
   log_debug(conn, "new connection");
+  listener_apply_backpressure();
   return conn;
 }
 
@@ -198,8 +496,10 @@ conn_t::~conn_t()
 {
   if (this->peername)
     free((void *)this->peername);
+  if (this->uncork_cb && this->buffer)
+    evbuffer_remove_cb_entry(this->outbound(), this->uncork_cb);
   if (this->buffer)
-    bufferevent_free(this->buffer);
+    UringTransport::free(this->buffer);
 }
 
 void
@@ -216,10 +516,103 @@ conn_t::close()
   cgs->connections.erase(this);
   cgs->closed_connections.insert(this);
 
+  if (this->peer_key) {
+    unordered_map<unsigned long long, unsigned int>::iterator p =
+      cgs->peers.find(this->peer_key);
+    if (p != cgs->peers.end() && --p->second == 0)
+      cgs->peers.erase(p);
+    this->peer_key = 0;
+  }
+
   if (need_event)
     event_active(cgs->close_cleanup, 0, 0);
 }
 
+evutil_socket_t
+conn_t::socket()
+{
+  return this->buffer ? UringTransport::getfd(this->buffer) : 0;
+}
+
+#ifndef _WIN32
+static bool
+set_tcp_option(conn_t *conn, int option, int value, const char *name)
+{
+  if (setsockopt(conn->socket(), IPPROTO_TCP, option,
+                 &value, sizeof value)) {
+    log_debug(conn, "setsockopt(%s, %d): %s", name, value, strerror(errno));
+    return false;
+  }
+  return true;
+}
+#endif
+
+#ifdef TCP_CORK
+static void
+conn_uncork_cb(struct evbuffer *, const struct evbuffer_cb_info *info,
+               void *arg)
+{
+  // Once the kernel has taken a write, whatever is left waits for the
+  // socket to drain below its unsent limit (see limit_unsent), which a
+  // corked partial segment can keep it from doing: let it go then too.
+  if (info->n_deleted)
+    ((conn_t *)arg)->uncork();
+}
+#endif
+
+void
+conn_t::cork()
+{
+#ifdef TCP_CORK
+  if (this->corked || !this->buffer || UringTransport::on_ring(this->buffer))
+    return;
+  if (!set_tcp_option(this, TCP_CORK, 1, "TCP_CORK"))
+    return;
+  if (!this->uncork_cb)
+    this->uncork_cb = evbuffer_add_cb(this->outbound(), conn_uncork_cb,
+                                       this);
+  this->corked = true;
+#endif
+}
+
+void
+conn_t::uncork()
+{
+#ifdef TCP_CORK
+  if (!this->corked)
+    return;
+  set_tcp_option(this, TCP_CORK, 0, "TCP_CORK");
+  this->corked = false;
+#endif
+}
+
+void
+conn_t::limit_unsent(int lowat)
+{
+#ifdef TCP_NOTSENT_LOWAT
+  if (this->buffer)
+    set_tcp_option(this, TCP_NOTSENT_LOWAT, lowat, "TCP_NOTSENT_LOWAT");
+#else
+  (void)lowat;
+#endif
+}
+
+size_t
+conn_t::unsent_bytes()
+{
+  if (!this->buffer)
+    return 0;
+
+  size_t unsent = evbuffer_get_length(this->outbound()) +
+    UringTransport::queued_bytes(this->buffer);
+#ifdef SIOCOUTQNSD
+  int queued;
+  if (ioctl(this->socket(), SIOCOUTQNSD, &queued) == 0 && queued > 0)
+    unsent += queued;
+#endif
+  return unsent;
+}
+
 /** Potentially called during connection construction or destruction. */
 circuit_t *
 conn_t::circuit() const
@@ -239,7 +632,7 @@ conn_send_eof(conn_t *dest)
     conn_do_flush(dest);
   } else if (!dest->write_eof) {
     log_debug(dest, "sending EOF downstream");
-    shutdown(bufferevent_getfd(dest->buffer), SHUT_WR);
+    UringTransport::shutdown_write(dest->buffer);
     dest->write_eof = true;
   }
 }
@@ -250,12 +643,12 @@ conn_send_eof(conn_t *dest)
    that can only send data in small chunks. */
 
 static void
-flush_timer_cb(evutil_socket_t, short, void *arg)
+flush_timer_cb(wheel_timer *, void *arg)
 {
   circuit_t *ckt = (circuit_t *)arg;
   log_debug(ckt, "flush timer expired, %lu bytes available",
-            (unsigned long)
-            evbuffer_get_length(bufferevent_get_input(ckt->up_buffer)));
+            (unsigned long)(ckt->up_buffer ?
+              evbuffer_get_length(bufferevent_get_input(ckt->up_buffer)) : 0));
   circuit_send(ckt);
 }
 
@@ -264,7 +657,7 @@ flush_timer_cb(evutil_socket_t, short, void *arg)
    connections. */
 
 static void
-axe_timer_cb(evutil_socket_t, short, void *arg)
+axe_timer_cb(wheel_timer *, void *arg)
 {
   circuit_t *ckt = (circuit_t *)arg;
   log_warn(ckt, "timeout waiting for new connections");
@@ -279,9 +672,20 @@ circuit_create(config_t *cfg, size_t index)
 
   log_assert(!cgs->shutting_down);
 
+  bool sample = cgs->memory_report &&
+    cgs->last_ckt_serial % MEMORY_SAMPLE_INTERVAL == 0;
+  size_t heap_before = sample ? heap_in_use() : 0;
+
   ckt = cfg->circuit_create(index);
   ckt->serial = ++cgs->last_ckt_serial;
 
+  if (sample) {
+    size_t heap_after = heap_in_use();
+    cgs->sampled_ckts++;
+    cgs->sampled_ckt_bytes +=
+      heap_after > heap_before ? heap_after - heap_before : 0;
+  }
+
   if (cfg->mode == LSN_SOCKS_CLIENT)
     ckt->socks_state = socks_state_new();
 
@@ -293,15 +697,11 @@ circuit_create(config_t *cfg, size_t index)
 circuit_t::~circuit_t()
 {
   if (this->up_buffer)
-    bufferevent_free(this->up_buffer);
+    UringTransport::free(this->up_buffer);
   if (this->up_peer)
     free((void *)this->up_peer);
   if (this->socks_state)
     socks_state_free(this->socks_state);
-  if (this->flush_timer)
-    event_free(this->flush_timer);
-  if (this->axe_timer)
-    event_free(this->axe_timer);
 }
 
 void
@@ -312,10 +712,8 @@ circuit_t::close()
 
   if (this->up_buffer)
     bufferevent_disable(this->up_buffer, EV_READ|EV_WRITE);
-  if (this->flush_timer)
-    event_del(this->flush_timer);
-  if (this->axe_timer)
-    event_del(this->axe_timer);
+  this->flush_timer.disarm();
+  this->axe_timer.disarm();
 
   bool need_event =
     cgs->closed_connections.empty() && cgs->closed_circuits.empty();
@@ -333,6 +731,17 @@ circuit_t::cfg() const
   return 0;
 }
 
+bool
+circuit_t::multiplexed() const
+{
+  return false;
+}
+
+void
+circuit_t::start_shutdown()
+{
+}
+
 void
 circuit_add_upstream(circuit_t *ckt, struct bufferevent *buf, const char *peer)
 {
@@ -393,7 +802,7 @@ circuit_recv_eof(circuit_t *ckt)
   if (!ckt->write_eof) {
     log_debug(ckt, "sending EOF to upstream");
     ckt->write_eof = true;
-    shutdown(bufferevent_getfd(ckt->up_buffer), SHUT_WR);
+    UringTransport::shutdown_write(ckt->up_buffer);
   } else {
     log_debug(ckt, "upstream has already EOFed");
   }
@@ -405,21 +814,16 @@ circuit_arm_flush_timer(circuit_t *ckt, unsigned int milliseconds)
 {
   log_debug(ckt, "flush within %u milliseconds", milliseconds);
 
-  struct timeval tv;
-  tv.tv_sec = milliseconds / 1000;
-  tv.tv_usec = (milliseconds % 1000) * 1000;
-
-  if (!ckt->flush_timer)
-    ckt->flush_timer = evtimer_new(ckt->cfg()->base, flush_timer_cb, ckt);
+  if (!ckt->flush_timer.initialized())
+    ckt->flush_timer.set(flush_timer_cb, ckt);
 
-  evtimer_add(ckt->flush_timer, &tv);
+  ckt->flush_timer.arm(ckt->cfg()->base, milliseconds);
 }
 
 void
 circuit_disarm_flush_timer(circuit_t *ckt)
 {
-  if (ckt->flush_timer)
-    evtimer_del(ckt->flush_timer);
+  ckt->flush_timer.disarm();
 }
 
 void
@@ -427,19 +831,14 @@ circuit_arm_axe_timer(circuit_t *ckt, unsigned int milliseconds)
 {
   log_debug(ckt, "axe after %u milliseconds", milliseconds);
 
-  struct timeval tv;
-  tv.tv_sec = milliseconds / 1000;
-  tv.tv_usec = (milliseconds % 1000) * 1000;
-
-  if (!ckt->axe_timer)
-    ckt->axe_timer = evtimer_new(ckt->cfg()->base, axe_timer_cb, ckt);
+  if (!ckt->axe_timer.initialized())
+    ckt->axe_timer.set(axe_timer_cb, ckt);
 
-  evtimer_add(ckt->axe_timer, &tv);
+  ckt->axe_timer.arm(ckt->cfg()->base, milliseconds);
 }
 
 void
 circuit_disarm_axe_timer(circuit_t *ckt)
 {
-  if (ckt->axe_timer)
-    evtimer_del(ckt->axe_timer);
+  ckt->axe_timer.disarm();
 }
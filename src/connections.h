@@ -8,12 +8,9 @@
 
 #include <event2/bufferevent.h>
 
-#include <time.h> //Keeping track of life length of a connection for debug reason
+#include "timer_wheel.h"
 
-#define MAX_GLOBAL_CONN_COUNT 256 //To prevent the total number of connections
-                                  //created by this instance exceed this number. 
-                                  //I am not sure if it is the best place to 
-                                  //to define this
+#include <time.h> //Keeping track of life length of a connection for debug reason
 
 
 /** This struct defines the state of one downstream socket-level
@@ -31,6 +28,14 @@ struct conn_t {
   bool                read_eof : 1;
   bool                write_eof : 1;
   bool                pending_write_eof : 1;
+  bool                corked : 1;
+
+  /** Uncorks the socket once the kernel takes a write (see cork). */
+  struct evbuffer_cb_entry *uncork_cb;
+
+  /** Key of the client address this connection is counted against,
+      or 0 if it is not (see conn_admit). */
+  unsigned long long  peer_key;
 
   //for debug reason: we want to keep track of connection life length 
   time_t creation_time;
@@ -44,6 +49,9 @@ struct conn_t {
     , read_eof(false)
     , write_eof(false)
     , pending_write_eof(false)
+    , corked(false)
+    , uncork_cb(0)
+    , peer_key(0)
   {}
 
   /** Deallocate a connection.  Normally should not be invoked directly,
@@ -68,9 +76,33 @@ struct conn_t {
   struct evbuffer *outbound()
   { return this->buffer ? bufferevent_get_output(this->buffer) : 0; }
 
-  /** Retrieve the socket opened for this connection. */
-  evutil_socket_t socket()
-  { return this->buffer ? bufferevent_getfd(buffer) : 0; }
+  /** Retrieve the socket opened for this connection, which may be
+      on the io_uring transport. */
+  evutil_socket_t socket();
+
+  /** Hold back partial TCP segments (TCP_CORK) until the kernel
+      takes its first write from the outbound buffer, so that what is
+      queued now leaves in full segments even if the steg module added
+      it in several pieces. Does nothing on the io_uring
+      transport, which takes the outbound buffer all at once. */
+  void cork();
+
+  /** Let out whatever cork() is holding back. Called once the kernel
+      takes a write from the outbound buffer, and after a transmission
+      that went to the socket some other way. */
+  void uncork();
+
+  /** Have the kernel keep at most about LOWAT bytes of this
+      connection's data that it has not yet sent (TCP_NOTSENT_LOWAT).
+      The rest stays in the outbound buffer, where unsent_bytes()
+      sees it. */
+  void limit_unsent(int lowat);
+
+  /** Bytes written to this connection that have not gone out yet:
+      the outbound buffer, what the io_uring transport holds for the
+      kernel, and, where the kernel says, the part of the socket's
+      send queue not yet sent. */
+  size_t unsent_bytes();
 
   /** Called immediately after the TCP handshake completes, for
       incoming connections to server mode.
@@ -119,16 +151,26 @@ struct conn_t {
   virtual void transmit_soon(unsigned long timeout) = 0;
 };
 
-/** Prepare global connection-related state.  Succeeds or crashes.  */
-void conn_global_init(struct event_base *);
+/** Prepare global connection-related state.  Succeeds or crashes.
+    MAX_CONNS caps the number of open connections, and MAX_CONNS_PER_PEER
+    the number of inbound connections from any one client address.
+    If MAX_CONNS is 0, it is derived from the file descriptor limit
+    (which is raised as far as it will go); if MAX_CONNS_PER_PEER is 0,
+    only the fair-share rule of conn_admit applies.  */
+void conn_global_init(struct event_base *, size_t max_conns,
+                      size_t max_conns_per_peer);
 
 /** When all currently-open connections and circuits are closed, stop
     the main event loop and exit the program.  If 'barbaric' is true,
-    forcibly close them all now, then stop the event loop.
+    forcibly close them all now, then stop the event loop; otherwise
+    tell every circuit, see circuit_t::start_shutdown.
     It is a bug to call any function that creates connections or
     circuits after conn_start_shutdown has been called. */
 void conn_start_shutdown(int barbaric);
 
+/** True once conn_start_shutdown has been called. */
+bool conn_shutting_down(void);
+
 /** Create a new inbound connection from a configuration and a
     bufferevent wrapping a socket. */
 conn_t *conn_create(config_t *cfg, size_t index, struct bufferevent *buf,
@@ -137,6 +179,26 @@ conn_t *conn_create(config_t *cfg, size_t index, struct bufferevent *buf,
 /** Report the number of currently-open connections. */
 size_t conn_count(void);
 
+/** Report the maximum number of connections that may be open at once. */
+size_t conn_limit(void);
+
+/** Every SECONDS, log (at info severity) the heap cost of an idle
+    connection and of an active circuit, for capacity planning.  Call
+    once everything else has been set up, since heap growth from this
+    point on is what gets charged to connections and circuits.  */
+void conn_start_memory_report(unsigned int seconds);
+
+/** Decide whether to accept an inbound connection from PEERADDR.
+    It is refused if the connection limit has been reached, if the
+    client already has its quota of connections, or if we are close
+    to the limit and the client has more than an even share of it.  */
+bool conn_admit(const struct sockaddr *peeraddr, int peerlen);
+
+/** Count CONN, an admitted inbound connection, against the quota of
+    PEERADDR until it is closed. */
+void conn_track_peer(conn_t *conn, const struct sockaddr *peeraddr,
+                     int peerlen);
+
 void conn_send_eof(conn_t *conn);
 void conn_do_flush(conn_t *conn);
 
@@ -153,8 +215,8 @@ void conn_do_flush(conn_t *conn);
  */
 
 struct circuit_t {
-  struct event       *flush_timer;
-  struct event       *axe_timer;
+  wheel_timer         flush_timer;
+  wheel_timer         axe_timer;
   struct bufferevent *up_buffer;
   const char         *up_peer;
   socks_state_t      *socks_state;
@@ -167,9 +229,7 @@ struct circuit_t {
   bool                pending_write_eof : 1;
 
   circuit_t()
-    : flush_timer(0)
-    , axe_timer(0)
-    , up_buffer(0)
+    : up_buffer(0)
     , up_peer(0)
     , socks_state(0)
     , serial(0)
@@ -191,6 +251,17 @@ struct circuit_t {
   /** Return the configuration that this circuit belongs to. */
   virtual config_t *cfg() const;
 
+  /** True if this circuit has no downstream connections of its own,
+      but rides on those of another circuit of the same protocol.  Such
+      a circuit can carry traffic as soon as it has an upstream.  */
+  virtual bool multiplexed() const;
+
+  /** Called on every circuit when a normal shutdown begins.  A
+      circuit kept open for upstreams yet to come, rather than for one
+      of its own, should finish now: it will get no more, and it may
+      not open new downstream connections.  */
+  virtual void start_shutdown();
+
   /** Add a downstream connection to this circuit. */
   virtual void add_downstream(conn_t *conn) = 0;
 
@@ -72,10 +72,12 @@ discard_data(char *ptr, size_t size, size_t nmemb, void *userdata)
     @param payload_length the length of the requested file this is equal to
     the size of allocated memory for the buf
     @param buf the alocated memory to store the POST reply
+    @param result if not NULL, gets curl's result code
 
     @return 0 if it fails to retrieve the url
 */
-unsigned long fetch_url_raw(CURL* curl_obj, string& url,  stringstream& buf)
+unsigned long fetch_url_raw(CURL* curl_obj, string& url,  stringstream& buf,
+                            CURLcode* result)
 {
   CURLcode res;
 
@@ -86,6 +88,8 @@ unsigned long fetch_url_raw(CURL* curl_obj, string& url,  stringstream& buf)
 
   /* Perform the request, res will get the return code */ 
   res = curl_easy_perform(curl_obj); //need to be turn to non-blocking
+  if (result)
+    *result = res;
   /* Check for errors */ 
   if(res != CURLE_OK) {
     log_debug("curl_easy_perform() failed: %s\n",
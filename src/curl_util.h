@@ -12,7 +12,8 @@ int wait_on_socket(curl_socket_t sockfd, int for_recv, long timeout_ms);
 
 size_t discard_data(char *ptr, size_t size, size_t nmemb, void *userdata);
 
-unsigned long fetch_url_raw(CURL* curl_obj, std::string& url,  std::stringstream& buf);
+unsigned long fetch_url_raw(CURL* curl_obj, std::string& url,  std::stringstream& buf,
+                            CURLcode* result = NULL);
 
 
 /**
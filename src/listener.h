@@ -21,6 +21,11 @@ struct listener_t
 int listener_open(struct event_base *base, config_t *cfg);
 void listener_close_all(void);
 
+/** Stop accepting on all listeners once the connection limit has been
+    reached, and resume when enough connections have closed.  Called
+    whenever connections are created or deallocated.  */
+void listener_apply_backpressure(void);
+
 std::vector<listener_t *> const& get_all_listeners();
 
 #endif
@@ -12,6 +12,7 @@
 #include "protocol.h"
 #include "steg.h"
 #include "subprocess.h"
+#include "uring_transport.h"
 
 #include <vector>
 #include <string>
@@ -41,6 +42,10 @@ static bool allow_kq = false;
 static bool daemon_mode = false;
 static string pidfile_name;
 static string registration_helper;
+static size_t max_connections = 0;
+static size_t max_connections_per_ip = 0;
+static unsigned int memory_report_interval = 0;
+static bool use_io_uring = false;
 
 /**
    Puts stegotorus's networking subsystem on "closing time" mode. This
@@ -88,6 +93,22 @@ handle_signal_cb(evutil_socket_t fd, short, void *)
   start_shutdown(1, signum == SIGINT ? "SIGINT" : "SIGTERM");
 }
 
+/**
+   This is called when we receive SIGHUP. Asks every configuration
+   to reload its external resources (e.g. the cover databases) in
+   place, connections are not interrupted.
+*/
+static void
+handle_reload_cb(evutil_socket_t, short, void *arg)
+{
+  vector<config_t *> *configs = (vector<config_t *> *)arg;
+
+  log_info("SIGHUP received, reloading");
+  for (vector<config_t *>::iterator i = configs->begin(); i != configs->end();
+       i++)
+    (*i)->reload();
+}
+
 /**
    This is called when we receive a synchronous signal that indicates
    a fatal programming error (SIGSEGV and friends). Unlike the above,
@@ -256,6 +277,31 @@ handle_generic_args(int argc, const char *const *argv,  modus_operandi_t &mo)
       pidfile_name = cur_option->second;
     } else if ((cur_option->first == "daemon") && (cur_option->second == true_string)) {
       daemon_mode = true;
+    } else if (cur_option->first == "max-connections" ||
+               cur_option->first == "max-connections-per-ip") {
+      char *end;
+      unsigned long n = strtoul(cur_option->second.c_str(), &end, 10);
+      if (*end || cur_option->second.empty() ||
+          (n == 0 && cur_option->first == "max-connections")) {
+        fprintf(stderr, "invalid %s '%s'\n", cur_option->first.c_str(),
+                cur_option->second.c_str());
+        exit(1);
+      }
+      if (cur_option->first == "max-connections")
+        max_connections = n;
+      else
+        max_connections_per_ip = n;
+    } else if (cur_option->first == "memory-report") {
+      char *end;
+      unsigned long n = strtoul(cur_option->second.c_str(), &end, 10);
+      if (*end || n == 0 || n > 86400) {
+        fprintf(stderr, "invalid memory-report interval '%s'\n",
+                cur_option->second.c_str());
+        exit(1);
+      }
+      memory_report_interval = n;
+    } else if ((cur_option->first == "io-uring") && (cur_option->second == true_string)) {
+      use_io_uring = true;
     } else {
       //this should never happen cause modus_operandi should have already aborted
       fprintf(stderr, "unrecognizable argument '%s'\n", cur_option->first.c_str());
@@ -278,6 +324,7 @@ main(int argc, const char *const *argv)
   struct event_config *evcfg;
   struct event *sig_int;
   struct event *sig_term;
+  struct event *sig_hup;
   struct event *stdin_eof;
   vector<config_t *> configs;
   modus_operandi_t mo;
@@ -405,7 +452,11 @@ main(int argc, const char *const *argv)
   if (event_base_priority_init(the_event_base, 2))
     log_abort("failed to initialize networking (priority queues)");
 
-  conn_global_init(the_event_base);
+  conn_global_init(the_event_base, max_connections, max_connections_per_ip);
+
+  if (use_io_uring && !UringTransport::init(the_event_base))
+    log_warn("io_uring is not available; staying on %s",
+             event_base_get_method(the_event_base));
 
   log_debug("initialize evdns");
   /* ASN should this happen only when SOCKS is enabled? */
@@ -420,7 +471,10 @@ main(int argc, const char *const *argv)
                          handle_signal_cb, NULL);
   sig_term = evsignal_new(the_event_base, SIGTERM,
                           handle_signal_cb, NULL);
-  if (event_add(sig_int, NULL) || event_add(sig_term, NULL))
+  sig_hup = evsignal_new(the_event_base, SIGHUP,
+                         handle_reload_cb, &configs);
+  if (event_add(sig_int, NULL) || event_add(sig_term, NULL) ||
+      event_add(sig_hup, NULL))
     log_abort("failed to initialize signal handling");
 
 #ifndef _WIN32
@@ -475,6 +529,9 @@ main(int argc, const char *const *argv)
     call_registration_helper(registration_helper);
   }
 
+  if (memory_report_interval)
+    conn_start_memory_report(memory_report_interval);
+
   /* We are go for launch. As a signal to any monitoring process that may
      be running, close stdout now. */
   log_info("%s process %lu now initialized", argv[0], (unsigned long)getpid());
@@ -499,6 +556,9 @@ main(int argc, const char *const *argv)
   log_debug("cleaning up events");
   event_free(sig_int);
   event_free(sig_term);
+  event_free(sig_hup);
+  timer_wheel_free(the_event_base);
+  UringTransport::free_all();
 
   // Free evdns base after that
   evdns_base_free(get_evdns_base(), 0);
@@ -40,6 +40,10 @@ const struct option modus_operandi_t::long_options[] = {
     { "registration-helper", required_argument, NULL, 'r' },
     { "pid-file", required_argument, NULL, 'p' },
     { "daemon", no_argument, NULL, 'd' },
+    { "max-connections", required_argument, NULL, 'm' },
+    { "max-connections-per-ip", required_argument, NULL, 'i' },
+    { "memory-report", required_argument, NULL, 'M' },
+    { "io-uring", no_argument, NULL, 'U' },
     { NULL, 0, NULL, 0 }
   };
 
@@ -246,6 +250,14 @@ modus_operandi_t::usage(void)
           "a relay database\n"
           "--pid-file=<file> ~ write process ID to <file> after startup\n"
           "--daemon ~ run as a daemon\n"
+          "--max-connections=<n> ~ allow at most <n> connections "
+          "(default: as many as the file descriptor limit allows)\n"
+          "--max-connections-per-ip=<n> ~ allow at most <n> connections "
+          "from one client address\n"
+          "--memory-report=<seconds> ~ log the memory taken by connections "
+          "and circuits every <seconds>\n"
+          "--io-uring ~ do the I/O of accepted connections through "
+          "io_uring where the kernel has it\n"
           "--version ~ show version details and exit\n");
 
     exit(1);
@@ -45,7 +45,7 @@ class down_address_t {
 class modus_operandi_t {
  protected:
   /* A string listing valid short options letters.*/
-  const char* const short_options = "hc:l:s:ntkr:p:d";
+  const char* const short_options = "hc:l:s:ntkr:p:dm:i:M:U";
   const std::vector<std::string> config_valid_extra_key_words = {"protocols"};
   /* An array describing valid long options. */
   static const struct option long_options[];
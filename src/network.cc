@@ -9,6 +9,7 @@
 #include "connections.h"
 #include "socks.h"
 #include "protocol.h"
+#include "uring_transport.h"
 
 #include <vector>
 
@@ -23,8 +24,21 @@ using std::vector;
 /** All our listeners. */
 static vector<listener_t *> listeners;
 
+/** True while the listeners are not accepting connections. */
+static bool accept_paused;
+
+/** Fires when it is time to try accepting again after accept() ran
+    out of file descriptors. */
+static struct event *accept_retry;
+
+/** How long to wait before retrying, after running out of file
+    descriptors. */
+#define ACCEPT_RETRY_MSEC 500
+
 static void listener_close(listener_t *lsn);
 
+static void listener_error_cb(struct evconnlistener *evcl, void *arg);
+
 static void client_listener_cb(struct evconnlistener *evcl, evutil_socket_t fd,
                                struct sockaddr *sourceaddr, int socklen,
                                void *closure);
@@ -45,6 +59,7 @@ static void downstream_event_cb(struct bufferevent *bev, short what, void *arg);
 
 static void create_outbound_connections(circuit_t *ckt, bool is_socks);
 static void create_outbound_connections_socks(circuit_t *ckt);
+static void start_multiplexed_circuit(circuit_t *ckt);
 
 vector<listener_t *> const& get_all_listeners()
 {
@@ -91,6 +106,10 @@ listener_open(struct event_base *base, config_t *cfg)
         return 0;
       }
 
+      evconnlistener_set_error_cb(lsn->listener, listener_error_cb);
+      if (accept_paused)
+        evconnlistener_disable(lsn->listener);
+
       listeners.push_back(lsn);
       log_debug("now listening on %s for protocol %s",
                 lsn->address, cfg->name());
@@ -127,6 +146,87 @@ listener_close_all(void)
        i != listeners.end(); i++)
     listener_close(*i);
   listeners.clear();
+
+  if (accept_retry) {
+    event_free(accept_retry);
+    accept_retry = NULL;
+  }
+}
+
+/**
+   Turns accepting on or off for every listener.  While it is off, new
+   connections wait in the kernel's accept queue, and once that fills,
+   clients back off.
+*/
+static void
+listener_set_accepting(bool on)
+{
+  if (accept_paused == !on)
+    return;
+  accept_paused = !on;
+
+  for (vector<listener_t *>::iterator i = listeners.begin();
+       i != listeners.end(); i++)
+    if (on)
+      evconnlistener_enable((*i)->listener);
+    else
+      evconnlistener_disable((*i)->listener);
+}
+
+void
+listener_apply_backpressure(void)
+{
+  size_t limit = conn_limit();
+
+  // Leave it to the retry timer if we ran out of descriptors.
+  if (accept_retry && evtimer_pending(accept_retry, NULL))
+    return;
+
+  if (!accept_paused && conn_count() >= limit) {
+    log_info("connection limit of %lu reached; no longer accepting",
+             (unsigned long)limit);
+    listener_set_accepting(false);
+  } else if (accept_paused && conn_count() < limit - limit/16) {
+    log_info("%lu connections open; accepting again",
+             (unsigned long)conn_count());
+    listener_set_accepting(true);
+  }
+}
+
+static void
+accept_retry_cb(evutil_socket_t, short, void *)
+{
+  listener_set_accepting(true);
+  listener_apply_backpressure();
+}
+
+/**
+   Called when accept() fails.  If we have run out of file descriptors,
+   the pending connection stays in the queue and the listener would
+   fire again immediately, so stop accepting for a while.
+*/
+static void
+listener_error_cb(struct evconnlistener *evcl, void *)
+{
+  int err = EVUTIL_SOCKET_ERROR();
+  struct event_base *base = evconnlistener_get_base(evcl);
+
+  if (err != EMFILE && err != ENFILE && err != ENOBUFS && err != ENOMEM) {
+    log_warn("accept failed: %s", evutil_socket_error_to_string(err));
+    return;
+  }
+
+  log_warn("accept failed: %s; pausing with %lu connections open",
+           evutil_socket_error_to_string(err), (unsigned long)conn_count());
+
+  if (!accept_retry) {
+    accept_retry = evtimer_new(base, accept_retry_cb, NULL);
+    if (!accept_retry)
+      log_abort("failed to create accept retry event");
+  }
+  struct timeval tv = { 0, ACCEPT_RETRY_MSEC * 1000 };
+  listener_set_accepting(false);
+  evtimer_add(accept_retry, &tv);
 }
 
 /**
@@ -148,7 +248,7 @@ client_listener_cb(struct evconnlistener *, evutil_socket_t fd,
   log_info("%s: new connection to %sclient from %s",
            lsn->address, is_socks ? "socks " : "", peername);
 
-  buf = bufferevent_socket_new(lsn->cfg->base, fd, BEV_OPT_CLOSE_ON_FREE);
+  buf = UringTransport::socket_new(lsn->cfg->base, fd);
   if (!buf) {
     log_warn("%s: failed to create buffer for new connection from %s",
              lsn->address, peername);
@@ -161,7 +261,7 @@ client_listener_cb(struct evconnlistener *, evutil_socket_t fd,
   if (!ckt) {
     log_warn("%s: failed to create circuit for new connection from %s",
              lsn->address, peername);
-    bufferevent_free(buf);
+    UringTransport::free(buf);
     free(peername);
     return;
   }
@@ -173,6 +273,8 @@ client_listener_cb(struct evconnlistener *, evutil_socket_t fd,
     bufferevent_setcb(buf, socks_read_cb, upstream_flush_cb,
                       upstream_event_cb, ckt);
     bufferevent_enable(buf, EV_READ|EV_WRITE);
+  } else if (ckt->multiplexed()) {
+    start_multiplexed_circuit(ckt);
   } else {
     bufferevent_setcb(buf, upstream_read_cb, upstream_flush_cb,
                       upstream_event_cb, ckt);
@@ -198,7 +300,13 @@ server_listener_cb(struct evconnlistener *, evutil_socket_t fd,
   log_assert(lsn->cfg->mode == LSN_SIMPLE_SERVER);
   log_info("%s: new connection to server from %s", lsn->address, peername);
 
-  buf = bufferevent_socket_new(lsn->cfg->base, fd, BEV_OPT_CLOSE_ON_FREE);
+  if (!conn_admit(peeraddr, peerlen)) {
+    evutil_closesocket(fd);
+    free(peername);
+    return;
+  }
+
+  buf = UringTransport::socket_new(lsn->cfg->base, fd);
   if (!buf) {
     log_warn("%s: failed to create buffer for new connection from %s",
              lsn->address, peername);
@@ -208,14 +316,15 @@ server_listener_cb(struct evconnlistener *, evutil_socket_t fd,
   }
 
   conn = conn_create(lsn->cfg, lsn->index, buf, peername);
-  conn->connected = 1;
   if (!conn) {
     log_warn("%s: failed to create connection structure for %s",
              lsn->address, peername);
-    bufferevent_free(buf);
+    UringTransport::free(buf);
     free(peername);
     return;
   }
+  conn->connected = 1;
+  conn_track_peer(conn, peeraddr, peerlen);
 
   /* If appropriate at this point, connect to upstream. */
   if (conn->maybe_open_upstream() < 0) {
@@ -257,6 +366,10 @@ socks_read_cb(struct bufferevent *bev, void *arg)
     log_assert(status != ST_SENT_REPLY); /* we shouldn't be here then */
 
     if (status == ST_HAVE_ADDR) {
+      if (ckt->multiplexed()) {
+        start_multiplexed_circuit(ckt);
+        return;
+      }
       bufferevent_disable(bev, EV_READ|EV_WRITE); /* wait for connection */
       create_outbound_connections_socks(ckt);
       return;
@@ -419,7 +532,7 @@ upstream_flush_cb(struct bufferevent *bev, void *arg)
   if (remain == 0 && ckt->connected && ckt->pending_write_eof) {
     if (!ckt->write_eof) {
       log_debug(ckt, "sending EOF upstream");
-      shutdown(bufferevent_getfd(bev), SHUT_WR);
+      UringTransport::shutdown_write(bev);
       ckt->write_eof = true;
     }
     if (ckt->read_eof && ckt->write_eof)
@@ -518,7 +631,9 @@ downstream_connect_cb(struct bufferevent *bev, short what, void *arg)
     bufferevent_setcb(conn->buffer, downstream_read_cb,
                       downstream_flush_cb, downstream_event_cb, conn);
 
-    bufferevent_enable(ckt->up_buffer, EV_READ|EV_WRITE);
+    /* A circuit that only carries others has no upstream of its own. */
+    if (ckt->up_buffer)
+      bufferevent_enable(ckt->up_buffer, EV_READ|EV_WRITE);
     bufferevent_enable(conn->buffer, EV_READ|EV_WRITE);
     conn->connected = 1;
 
@@ -694,7 +809,7 @@ create_one_outbound_connection(circuit_t *ckt, struct evutil_addrinfo *addr,
   //connection. This can easily happen because browsers now a days
   //open connections aggresively and the protocol (like chops) can
   //multiply that number
-  if (conn_count() >= MAX_GLOBAL_CONN_COUNT)
+  if (conn_count() >= conn_limit())
     {
       log_warn(ckt, "global maximum number of connection is reached. global number of conn: %lu. unable to create more connection", conn_count());
       return false;
@@ -757,7 +872,13 @@ create_outbound_connections(circuit_t *ckt, bool is_socks)
 void
 circuit_reopen_downstreams(circuit_t *ckt)
 {
-  if (conn_count() >= MAX_GLOBAL_CONN_COUNT) {
+  if (conn_shutting_down()) {
+    //no new connections now; the axe timer ends the circuit if it
+    //cannot finish on those it has
+    log_debug(ckt, "shutting down, not reopening downstreams");
+    return;
+  }
+  if (conn_count() >= conn_limit()) {
     //maybe we just need to wait a bit
       log_warn(ckt, "global maximum number of connection is reached. global number of conn: %lu. unable to create more connection", conn_count());
       
@@ -816,10 +937,39 @@ create_outbound_connections_socks(circuit_t *ckt)
     bufferevent_free(buf);
 }
 
+/**
+   Start a circuit which rides on the downstream connections of
+   another (see circuit_t::multiplexed).  There are none to wait for,
+   so a SOCKS client is told at once that it is connected (the
+   destination is ignored, as for any protocol that sets
+   ignore_socks_destination), and traffic flows right away.
+*/
+static void
+start_multiplexed_circuit(circuit_t *ckt)
+{
+  if (ckt->socks_state) {
+    socks_send_reply(ckt->socks_state,
+                     bufferevent_get_output(ckt->up_buffer), 0);
+    socks_state_free(ckt->socks_state);
+    ckt->socks_state = NULL;
+  }
+
+  log_debug(ckt, "riding on an existing circuit");
+  bufferevent_setcb(ckt->up_buffer, upstream_read_cb, upstream_flush_cb,
+                    upstream_event_cb, ckt);
+  bufferevent_enable(ckt->up_buffer, EV_READ|EV_WRITE);
+  circuit_send(ckt);
+}
+
 void
 circuit_do_flush(circuit_t *ckt)
 {
   log_debug(ckt, "flushing");
+  if (!ckt->up_buffer) {
+    /* It only carries other circuits, which flush on their own. */
+    ckt->close();
+    return;
+  }
   size_t remain = evbuffer_get_length(bufferevent_get_output(ckt->up_buffer));
   ckt->pending_write_eof = true;
 
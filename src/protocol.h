@@ -94,6 +94,11 @@ struct config_t
       argument to get_listen_addrs or get_target_addrs that retrieved
       the address to which the socket is bound.  */
   virtual conn_t *conn_create(size_t index) = 0;
+
+  /** Reload whatever external resources (e.g. cover databases) this
+      configuration depends on, without disturbing the existing
+      connections. Called on SIGHUP. The default does nothing. */
+  virtual void reload() {}
 };
 
 int config_is_supported(const char *name);
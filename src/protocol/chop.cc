@@ -25,9 +25,11 @@
 #include "modus_operandi.h"
 #include "chop_blk.h"
 #include "chop_handshaker.h"
+#include "compression.h"
 #include "connections.h"
 #include "protocol.h"
 #include "rng.h"
+#include "socks.h"
 #include "steg.h"
 
 #include "transparent_proxy.h"
@@ -38,6 +40,46 @@
 
 #define MAX_CONN_PER_CIRCUIT 8
 
+// The largest ACK payload: high sequence number and a 256-bit window.
+#define ACK_MAX_LEN 36
+
+// The most anyone asks of pick_connection: everything one
+// transmission can carry, less one block's framing.
+#define MAX_DESIRED (MAX_BLOCK_SIZE - MIN_BLOCK_SIZE - 1)
+
+// Downstream sockets keep no more than this much unsent data in the
+// kernel; the rest waits in the outbound buffer, where
+// pick_connection can see it and send elsewhere while it drains.
+#define UNSENT_LOWAT (16 * 1024)
+
+// pick_connection passes over a connection with more than this much
+// unsent while another one has room.
+#define BUSY_UNSENT MAX_BLOCK_SIZE
+
+// Upstream data goes through the deflater this much at a time. If a
+// chunk of at least COMPRESS_SAMPLE bytes shrinks by less than a
+// tenth, the next COMPRESS_BYPASS bytes are sent as they are.
+#define COMPRESS_CHUNK 16384
+#define COMPRESS_SAMPLE 1024
+#define COMPRESS_BYPASS (256 * 1024)
+
+// Parity groups shrink as ACKs show more gaps: a group of N
+// transmissions for a gap rate of PARITY_GAP_SHARE/N.
+#define PARITY_GAP_SHARE 0.5
+
+// A stream may have this many bytes on their way before the other
+// end passes some of them upstream and says so.
+#define STREAM_WINDOW (256 * 1024)
+// The most of one stream's data framed before the others get a turn.
+#define STREAM_CHUNK 4096
+// A client circuit carrying streams sends its FIN after this long
+// without any.
+#define STREAM_IDLE_MS (30 * 1000)
+
+// The server holds a hanging request this long for data to answer it
+// with, before it answers with chaff.
+#define HANGING_REQUEST_MS (5 * 1000)
+
 using std::tr1::unordered_map;
 using std::tr1::unordered_set;
 using std::vector;
@@ -50,31 +92,40 @@ namespace {
 
 struct chop_conn_t;
 struct chop_circuit_t;
+struct chop_stream_t;
 struct chop_config_t;
 
 typedef unordered_map<uint32_t, chop_circuit_t *> chop_circuit_table;
+typedef std::map<uint32_t, chop_stream_t *> chop_stream_table;
 
 struct chop_conn_t : conn_t
 {
   chop_config_t *config;
   chop_circuit_t *upstream;
   steg_t *steg;
-  struct evbuffer *recv_pending;
-  uint8_t *originally_received; //Keep a copy of pending in case we need 
-  size_t received_length;
-  //to become a transparent proxy
-  struct event *must_send_timer;
+  struct evbuffer *recv_pending; // NULL until something is received
+  // Everything received before the handshake was settled, in case we
+  // need to become a transparent proxy; NULL afterward.
+  struct evbuffer *received_snapshot;
+  size_t snapshotted_input; // input bytes already in the snapshot
+  wheel_timer must_send_timer;
   bool sent_handshake : 1;
   bool no_more_transmissions : 1;
+  bool answered : 1; // a block has come back on it
+  bool carried_data : 1; // and one of them had upstream data
 
   CONN_DECLARE_METHODS(chop);
 
   int recv_handshake();
   int send(struct evbuffer *block);
 
+  void snapshot_input();
+  void drop_snapshot();
+  void transparentize();
+
   void send();
   bool must_send_p() const;
-  static void must_send_timeout(evutil_socket_t, short, void *arg);
+  static void must_send_timeout(wheel_timer *, void *arg);
 
   /**
    In case the connection is transparentized or needed to be closed
@@ -103,6 +154,57 @@ struct chop_circuit_t : circuit_t
   bool received_fin : 1;
   bool sent_fin : 1;
   bool upstream_eof : 1;
+  bool ack_due : 1; // an ACK rides with the next transmission
+  bool peer_inflates : 1; // the other end takes compressed blocks
+  bool peer_deflates : 1; // the client would send them
+  bool announce_inflate : 1; // tell the client we take them too
+  bool peer_takes_parity : 1; // the other end rebuilds from PAR blocks
+  bool peer_sends_parity : 1; // and sends them; keep copies to use them
+  bool announce_parity : 1; // tell the client we take or send them
+
+  // Upstream data compressed but not sent yet, and the streams; all
+  // NULL until compression is first used in that direction.
+  struct evbuffer *compressed_pending;
+  stream_deflater *deflater;
+  stream_inflater *inflater;
+  size_t compress_bypass; // bytes still to send uncompressed
+  unsigned long long compressed_in;  // raw bytes through the deflater
+  unsigned long long compressed_out; // and what they became
+
+  // Parity for the transmissions sent, and copies of the blocks
+  // received, for forward error correction; NULL until it is used in
+  // that direction.
+  parity_encoder *parity_out;
+  parity_decoder *parity_in;
+  unsigned long long parity_groups;
+  unsigned long long parity_bytes;
+  unsigned long long parity_rebuilt; // blocks
+
+  // Cover bytes sent and data bytes they carried, for transmissions
+  // that upstream data filled (bulk) and ones it did not (interactive).
+  unsigned long long cover_bytes[2];
+  unsigned long long goodput_bytes[2];
+
+  // The streams of a circuit that carries many upstream connections
+  // (see chop_stream_t), their frames not sent yet, and what has been
+  // received of the next frame; the buffers are NULL for a circuit
+  // with an upstream of its own.
+  chop_stream_table streams;
+  struct evbuffer *frames_out;
+  struct evbuffer *frames_in;
+  uint32_t last_stream_id; // the highest opened
+  uint32_t next_turn; // the stream to frame data from first
+  wheel_timer idle_timer;
+  unsigned long streams_carried;
+  unsigned long conns_added; // downstream connections, over its life
+
+  // The client's requests kept open for the server to answer as soon
+  // as it has data, as many as the server has been answering with
+  // data lately; and how long data waited for a transmission.
+  unsigned int hanging_target;
+  double data_waiting_since; // 0 when none is waiting
+  double data_wait_total;
+  unsigned long data_waits;
 
   //For debug and tracking performance we keep track of average room
   //desirable and offered size
@@ -119,21 +221,49 @@ struct chop_circuit_t : circuit_t
 
   int send_special(opcode_t f, struct evbuffer *payload);
   int send_targeted(chop_conn_t *conn);
-  int send_targeted(chop_conn_t *conn, size_t blocksize);
-  int send_targeted(chop_conn_t *conn, size_t d, size_t p, opcode_t f,
-                    struct evbuffer *payload);
-  int maybe_send_ack();
+  /**
+     fill one transmission of ROOM bytes on CONN with as many blocks
+     as fit: the pending ACK, the steg's protocol data, then upstream
+     data, padding the rest.
+  */
+  int send_packed(chop_conn_t *conn, size_t room);
+  size_t packed_length(size_t data, size_t steg_data) const;
+  bool compressing() const;
+  size_t pending_data() const;
+  int compress_upstream(size_t want);
+  int inflate_block(struct evbuffer *data);
+  bool sending_parity() const;
+  size_t parity_group_size() const;
+  int recv_parity(struct evbuffer *data, steg_config_t *steg_cfg);
+
+  bool carries_streams() const { return frames_out != NULL; }
+  void carry_streams();
+  virtual void start_shutdown();
+  void attach_stream(chop_stream_t *stream, uint32_t id);
+  void detach_stream(chop_stream_t *stream);
+  chop_stream_t *open_stream(uint32_t id);
+  void end_streams();
+  void grant_credit(chop_stream_t *stream);
+  struct evbuffer *upstream_input() const;
+  struct evbuffer *upstream_output() const;
+  size_t stream_data() const;
+  int frame_streams(size_t want);
+  int recv_frames();
+  static void idle_timeout(wheel_timer *, void *arg);
+
+  void keep_requests_hanging();
+  void note_data_waiting(size_t before, size_t after);
+
+  void maybe_send_ack();
+  int send_ack();
   int retransmit();
+  void report_efficiency();
 
   /** 
       check all conn for steg protocol data and send them
       if there's any
   */
   int send_all_steg_data();
-  /** the same as send targeted but it reads the data from
-      conn->steg->cfg()->protocol_data and set opcode = op_STEG0
-  */
-  int send_targeted_steg_data(chop_conn_t *conn, size_t blocksize);
 
   /**
      checks the steg module of all connections to see if they have
@@ -173,7 +303,7 @@ struct chop_circuit_t : circuit_t
       return max_idle_min * 60 * 1000;
 
     //Anti dos measures
-    size_t memory_consumed = evbuffer_get_length(bufferevent_get_input(up_buffer));
+    size_t memory_consumed = evbuffer_get_length(upstream_input());
 
     unsigned int max_penalty_mins = std::min(max_idle_min-1, ui64_log2(memory_consumed)) + 2;
     unsigned int penalty_mins = rng_range_geom(max_penalty_mins, std::min((unsigned int)(max_penalty_mins - 1), dead_cycles));
@@ -195,18 +325,70 @@ struct chop_circuit_t : circuit_t
   }
 };
 
+/**
+   One upstream connection carried, with others, by a multiplexed
+   chop circuit.  To the rest of the program it is a circuit of its
+   own, with an upstream buffer and the usual callbacks, but it has no
+   downstream connections, keys or sequence numbers: its data goes
+   out as stream frames (see chop_blk.h) in the upstream data of the
+   circuit that carries it, and comes back the same way.  So the
+   connections a browser opens at once share one handshake, one set
+   of cover connections and one reliability window.
+
+   Each direction of a stream has a window of STREAM_WINDOW bytes,
+   which the receiver opens again with WND frames as its upstream
+   takes the data, so one slow reader does not fill the circuit's
+   buffers for all the others.  Either direction can be closed alone
+   with a FIN frame.
+*/
+struct chop_stream_t : circuit_t
+{
+  chop_config_t *config;
+  chop_circuit_t *carrier; // NULL once it has left the circuit
+  uint32_t stream_id;
+  size_t send_window; // bytes the other end will still take
+  size_t recv_window; // bytes we will still take
+  size_t credit; // bytes passed upstream since the last WND frame
+  struct evbuffer_cb_entry *drained_cb;
+  bool announced : 1; // the other end knows of the stream
+  bool sent_fin : 1;
+  bool received_fin : 1;
+  bool upstream_eof : 1;
+  bool reset : 1; // by the other end, which needs no RST back
+
+  chop_stream_t(chop_config_t *cfg);
+  virtual ~chop_stream_t();
+  virtual void close();
+  virtual config_t *cfg() const;
+  virtual bool multiplexed() const;
+  virtual void add_downstream(conn_t *);
+  virtual void drop_downstream(conn_t *);
+  virtual int send();
+  virtual int send_eof();
+
+  /** Upstream data the stream may send now. */
+  size_t sendable() const;
+  void watch_output();
+  static void output_drained(struct evbuffer *,
+                             const struct evbuffer_cb_info *info, void *arg);
+};
+
 struct chop_config_t : config_t
 {
   //we store protocol config to be able to treat them uniformly independant of
   //the fact that they came from command line or from yaml config file
   const std::vector<std::string> arg_option_list = {"name", "mode", "up-address", "server-key",
                                                     "passphrase", "cover-server",
-                                                    "minimum-noise-to-signal"};
+                                                    "minimum-noise-to-signal",
+                                                    "hanging-requests"};
 
   const std::vector<std::string> binary_option_list = {"trace-packets",
                                                        "disable-encryption",
                                                        "disable-retransmit",
-                                                       "enable-retransmit"};
+                                                       "enable-retransmit",
+                                                       "compress",
+                                                       "fec",
+                                                       "multiplex"};
 
   config_dict_t chop_user_config;
   std::list<config_dict_t> steg_user_conf_list;
@@ -219,6 +401,16 @@ struct chop_config_t : config_t
   bool trace_packet_data;
   bool encryption;
   bool retransmit;
+  bool compress; // compress upstream data, if the other end takes it
+  bool fec; // send parity blocks, if the other end takes them
+  bool multiplex; // carry all upstream connections on one circuit
+  unsigned int hanging_requests; // client requests kept open, at most
+
+  // The client circuit new streams go on (see chop_stream_t), and
+  // what circuit_create is making when it is not a plain circuit.
+  chop_circuit_t *stream_circuit;
+  bool creating_stream;
+  bool creating_stream_circuit;
 
     /* Performance calculators */
   unsigned long total_transmited_data_bytes;
@@ -240,6 +432,9 @@ struct chop_config_t : config_t
      approperiate keys for the handshake
    */
   void init_handshake_encryption();
+
+  /** The circuit a new client stream goes on, opened if need be. */
+  chop_circuit_t *circuit_for_streams();
   /* Transparent proxy and cover server */
   std::string cover_server_address; //is the server that is going to serve covers
   TransparentProxy* transparent_proxy;
@@ -295,6 +490,8 @@ struct chop_config_t : config_t
 
   CONFIG_DECLARE_METHODS(chop);
 
+  virtual void reload();
+
   DISALLOW_COPY_AND_ASSIGN(chop_config_t);
 };
 
@@ -313,6 +510,13 @@ chop_config_t::chop_config_t()
   trace_packet_data = true;
   encryption = true;
   retransmit = true;
+  compress = false;
+  fec = false;
+  multiplex = false;
+  hanging_requests = 0;
+  stream_circuit = NULL;
+  creating_stream = false;
+  creating_stream_circuit = false;
   noise2signal = 0;
 }
 
@@ -402,6 +606,36 @@ chop_config_t::init_from_protocol_config_dict() {
     retransmit = true;
   }
 
+  if (user_specified("compress")) {
+    compress = (modus_operandi_t::uniformize_boolean_value(chop_user_config["compress"]) == true_string);
+  }
+
+  if (user_specified("fec")) {
+    fec = (modus_operandi_t::uniformize_boolean_value(chop_user_config["fec"]) == true_string);
+  }
+
+  if (user_specified("multiplex")) {
+    multiplex = (modus_operandi_t::uniformize_boolean_value(chop_user_config["multiplex"]) == true_string);
+    // the server follows what each client's handshake says
+    if (multiplex && mode == LSN_SIMPLE_SERVER)
+      log_info("chop: multiplex is a client option, ignored by the server");
+  }
+
+  if (user_specified("hanging-requests")) {
+    int n = atoi(chop_user_config["hanging-requests"].c_str());
+    if (n < 0 || n > MAX_CONN_PER_CIRCUIT) {
+      log_warn("chop: hanging-requests must be between 0 and %d",
+               MAX_CONN_PER_CIRCUIT);
+      return false;
+    }
+    hanging_requests = n;
+    // the server holds whichever requests the client says it may
+    if (hanging_requests && mode == LSN_SIMPLE_SERVER) {
+      log_info("chop: hanging-requests is a client option, ignored by the server");
+      hanging_requests = 0;
+    }
+  }
+
   if (user_specified("minimum-noise-to-signal")) {
     noise2signal = atoi(chop_user_config["minimum-noise-to-signal"].c_str());
   }
@@ -478,6 +712,8 @@ bool chop_config_t::init(const YAML::Node& protocol_node)
         return false;
       }
       down_addresses.push_back(addr);
+      if (!listen_down) //we'll need the name for the Host header
+        prefetch_peer_names(addr);
 
       if (!steg_is_supported(cur_steg["name"].as<std::string>().c_str())) {
         log_warn("chop: steganographer '%s' not supported", cur_steg["name"].as<std::string>().c_str());
@@ -583,6 +819,8 @@ bool chop_config_t::init(unsigned int n_options, const char *const *options)
       return false;
     }
     down_addresses.push_back(addr);
+    if (!listen_down) //we'll need the name for the Host header
+      prefetch_peer_names(addr);
     cur_op++;
     //from now on till we reach another steg, all
     //all the options of the curren steg
@@ -634,6 +872,14 @@ chop_config_t::get_steg(size_t n) const
   return NULL;
 }
 
+void
+chop_config_t::reload()
+{
+  for (vector<steg_config_t *>::iterator i = steg_targets.begin();
+       i != steg_targets.end(); i++)
+    (*i)->reload();
+}
+
 // Circuit methods
 
 void
@@ -666,8 +912,19 @@ chop_config_t::init_handshake_encryption()
 circuit_t *
 chop_config_t::circuit_create(size_t)
 {
+  // The server opens streams as the client's frames ask for them.
+  if (creating_stream)
+    return new chop_stream_t(this);
+
+  if (multiplex && mode != LSN_SIMPLE_SERVER && !creating_stream_circuit) {
+    chop_stream_t *stream = new chop_stream_t(this);
+    circuit_for_streams()->attach_stream(stream, 0);
+    return stream;
+  }
+
   chop_circuit_t *ckt = new chop_circuit_t(retransmit);
   ckt->config = this;
+  ckt->hanging_target = hanging_requests ? 1 : 0;
 
   key_generator *kgen = 0;
 
@@ -717,6 +974,23 @@ chop_config_t::circuit_create(size_t)
   return ckt;
 }
 
+chop_circuit_t *
+chop_config_t::circuit_for_streams()
+{
+  // One that has begun to close takes no new streams.
+  if (stream_circuit &&
+      (stream_circuit->upstream_eof || stream_circuit->received_fin))
+    stream_circuit = NULL;
+
+  if (!stream_circuit) {
+    creating_stream_circuit = true;
+    stream_circuit = dynamic_cast<chop_circuit_t *>(::circuit_create(this, 0));
+    creating_stream_circuit = false;
+    stream_circuit->carry_streams();
+  }
+  return stream_circuit;
+}
+
 /** This has to be here for the unfortunate macro game 
     inline is added so gcc ignore the Wunused-function warning */
 inline chop_circuit_t::chop_circuit_t()
@@ -738,6 +1012,16 @@ chop_circuit_t::~chop_circuit_t()
   delete send_hdr_crypt;
   delete recv_crypt;
   delete recv_hdr_crypt;
+  delete deflater;
+  delete inflater;
+  delete parity_out;
+  delete parity_in;
+  if (compressed_pending)
+    evbuffer_free(compressed_pending);
+  if (frames_out)
+    evbuffer_free(frames_out);
+  if (frames_in)
+    evbuffer_free(frames_in);
 }
 
 void
@@ -749,6 +1033,19 @@ chop_circuit_t::close()
              upstream_eof ? '+' : '-',
              (unsigned long)downstreams.size());
   }
+  report_efficiency();
+  log_info(this, "carried %lu upstream connections over %lu cover connections",
+           carries_streams() ? streams_carried : 1, conns_added);
+  if (data_waits)
+    log_info(this, "data waited %.1f ms on average for a transmission, "
+             "%lu times", data_wait_total * 1000 / data_waits, data_waits);
+
+  if (carries_streams()) {
+    end_streams();
+    idle_timer.disarm();
+    if (config->stream_circuit == this)
+      config->stream_circuit = NULL;
+  }
 
   for (unordered_set<chop_conn_t *>::iterator i = downstreams.begin();
        i != downstreams.end(); i++) {
@@ -790,6 +1087,7 @@ chop_circuit_t::add_downstream(chop_conn_t *conn)
   log_assert(!conn->upstream);
   conn->upstream = this;
   downstreams.insert(conn);
+  conns_added++;
 
   log_debug(this, "added connection <%d.%d> to %s, now %lu",
             serial, conn->serial, conn->peername,
@@ -816,6 +1114,16 @@ chop_circuit_t::drop_downstream(chop_conn_t *conn)
   log_debug(this, "dropped connection <%d.%d> to %s, now %lu",
             serial, conn->serial, conn->peername,
             (unsigned long)downstreams.size());
+
+  // A hanging request the server answered with data says more might
+  // be wanted; one it answered with chaff, fewer.
+  if (hanging_target && conn->answered) {
+    if (conn->carried_data && hanging_target < config->hanging_requests)
+      hanging_target++;
+    else if (!conn->carried_data && hanging_target > 1)
+      hanging_target--;
+    log_debug(this, "keeping %u requests hanging", hanging_target);
+  }
   // If that was the last connection on this circuit AND we've both
   // received and sent a FIN, close the circuit.  Otherwise, if we're
   // the server, arm a timer that will kill off this circuit in a
@@ -828,10 +1136,12 @@ chop_circuit_t::drop_downstream(chop_conn_t *conn)
       circuit_do_flush(this);
     } else if (config->mode == LSN_SIMPLE_SERVER) {
       circuit_arm_axe_timer(this, axe_interval());
-    } else {
+    } else if (!hanging_target) {
       circuit_arm_flush_timer(this, flush_interval());
     }
   }
+  if (hanging_target && !received_fin)
+    keep_requests_hanging();
 }
 
 void
@@ -851,17 +1161,18 @@ chop_circuit_t::send()
       log_debug("Error in transmiting steg protocol data");
     }
 
-  struct evbuffer *xmit_pending = bufferevent_get_input(up_buffer);
-  size_t avail = evbuffer_get_length(xmit_pending);
+  size_t avail = pending_data();
   size_t avail0 = avail;
   bool no_target_connection = false;
+  note_data_waiting(0, avail);
 
   if (downstreams.empty()) {
     log_debug(this, "no downstream connections");
     no_target_connection = true;
   } else {
     bool did_retransmit = false;
-    if (avail == 0 && !(upstream_eof && !sent_fin) && config->retransmit) {
+    if (avail == 0 && !(upstream_eof && !sent_fin) && !ack_due &&
+        config->retransmit) {
       // Consider retransmission.
       evbuffer *block = 0;
       for (transmit_queue::iterator i = tx_queue.begin();
@@ -870,7 +1181,8 @@ chop_circuit_t::send()
         transmit_elt &el = *i;
         size_t lo = MIN_BLOCK_SIZE + el.hdr.dlen();
         size_t room;
-        chop_conn_t *conn = pick_connection(lo, lo, &room);
+        chop_conn_t *conn = pick_connection(el.hdr.dlen(), el.hdr.dlen(),
+                                            &room);
         if (!conn)
           continue;
         log_assert(lo <= room);
@@ -900,7 +1212,7 @@ chop_circuit_t::send()
                   log_get_timestamp(), this->serial,
                   this->recv_queue.window(),
                   (unsigned long)evbuffer_get_length(
-                                bufferevent_get_input(this->up_buffer)),
+                                this->upstream_input()),
                   (unsigned long)el.hdr.seqno(),
                   (unsigned long)el.hdr.dlen(),
                   (unsigned long)el.hdr.plen(),
@@ -917,7 +1229,8 @@ chop_circuit_t::send()
       do {
         log_debug(this, "%lu bytes to send", (unsigned long)avail);
         size_t blocksize;
-        chop_conn_t *target = pick_connection(avail, 0, &blocksize);
+        chop_conn_t *target = pick_connection(packed_length(avail, 0), 0,
+                                              &blocksize);
         if (!target) {
           // this is not an error; it can happen e.g. when the server has
           // something to send immediately and the client hasn't spoken yet
@@ -926,12 +1239,13 @@ chop_circuit_t::send()
           break;
         }
 
-        if (send_targeted(target, blocksize))
+        if (send_packed(target, blocksize))
           return -1;
 
-        avail = evbuffer_get_length(xmit_pending);
+        avail = pending_data();
       } while (avail > 0);
   }
+  note_data_waiting(avail0, avail);
 
   if (avail0 == avail) { // no forward progress
     dead_cycles++;
@@ -943,7 +1257,7 @@ chop_circuit_t::send()
     if (no_target_connection) {
       log_debug(this, "number of open connections on this circuit %u, golobally %u", (unsigned int)downstreams.size(), (unsigned int) conn_count());
       if (config->mode != LSN_SIMPLE_SERVER &&
-          (int)downstreams.size() < min(MAX_CONN_PER_CIRCUIT, ((int)(MAX_GLOBAL_CONN_COUNT - conn_count() + (int)circuit_count() - 1)/(int)circuit_count()))) //min(8, and ceilling of (MAX - count)/no of circ) 
+          (int)downstreams.size() < min(MAX_CONN_PER_CIRCUIT, ((int)conn_limit() - (int)conn_count() + (int)circuit_count() - 1)/(int)circuit_count())) //min(8, and ceilling of (limit - count)/no of circ)
         circuit_reopen_downstreams(this);
       else {
         log_debug(this,"no more connection available at this time");
@@ -955,6 +1269,37 @@ chop_circuit_t::send()
   return check_for_eof();
 }
 
+/**
+   The client keeps hanging_target requests open, so that the server
+   always has one to answer as soon as it has data, instead of
+   waiting for the client's next poll.
+*/
+void
+chop_circuit_t::keep_requests_hanging()
+{
+  while (downstreams.size() < hanging_target && conn_count() < conn_limit()) {
+    size_t before = downstreams.size();
+    circuit_reopen_downstreams(this);
+    if (downstreams.size() <= before)
+      break;
+  }
+}
+
+/** Times how long upstream data waits for a transmission to carry
+    it; BEFORE and AFTER are what was pending around one. */
+void
+chop_circuit_t::note_data_waiting(size_t before, size_t after)
+{
+  double now = log_get_timestamp();
+  if (after < before && data_waiting_since) {
+    data_wait_total += now - data_waiting_since;
+    data_waits++;
+    data_waiting_since = 0;
+  }
+  if (after && !data_waiting_since)
+    data_waiting_since = now;
+}
+
 int
 chop_circuit_t::send_all_steg_data()
 {
@@ -1001,15 +1346,15 @@ chop_circuit_t::send_all_steg_data()
     //queue because we are called by the this->send which will
     //send those anyways
     while(avail > 0) {
-      size_t desired;
-      if (avail > SECTION_LEN)
-        desired = SECTION_LEN;
-      else
-        desired = avail;
+      // Whatever else is pending rides along with the steg data.
+      size_t desired = min(packed_length(evbuffer_get_length(
+                                           upstream_input()),
+                                         avail),
+                           (size_t)MAX_DESIRED);
 
       desired += MIN_BLOCK_SIZE;
 
-      size_t lo = MIN_BLOCK_SIZE + (desired == MIN_BLOCK_SIZE ? 0 : 1);
+      size_t lo = MIN_BLOCK_SIZE + 1;
 
       log_debug(this, "target block size %lu bytes", (unsigned long)desired);
 
@@ -1027,7 +1372,7 @@ chop_circuit_t::send_all_steg_data()
         log_debug(target, "offers %lu bytes (%s)", (unsigned long)room,
                   target->steg->cfg()->name());
 
-        if (send_targeted_steg_data(target, room))
+        if (send_packed(target, room))
           return -1;
       }
       else {
@@ -1149,7 +1494,7 @@ chop_circuit_t::send_special(opcode_t f, struct evbuffer *payload)
             log_get_timestamp(), this->serial,
             this->recv_queue.window(),
             (unsigned long)evbuffer_get_length(
-                              bufferevent_get_input(this->up_buffer)),
+                              this->upstream_input()),
             (unsigned long)seqno,
             (unsigned long)d,
             (unsigned long)p,
@@ -1169,15 +1514,12 @@ chop_circuit_t::send_special(opcode_t f, struct evbuffer *payload)
 int
 chop_circuit_t::send_targeted(chop_conn_t *conn)
 {
-  //Priority with steg data
-  bool steg_data_available = false;
-  size_t avail = evbuffer_get_length(conn->steg->cfg()->protocol_data_out);
-  if (avail > 0)
-    steg_data_available = true;
-  else
-    avail = evbuffer_get_length(bufferevent_get_input(up_buffer));
+  size_t steg_avail =
+    evbuffer_get_length(conn->steg->cfg()->protocol_data_out);
+  size_t avail = pending_data();
 
-  if (avail == 0 && !(upstream_eof && !sent_fin) && config->retransmit) {
+  if (avail == 0 && steg_avail == 0 && !(upstream_eof && !sent_fin) &&
+      !ack_due && config->retransmit) {
     // Consider retransmission if we have nothing new to send.
     evbuffer *block = evbuffer_new();
     if (!block)
@@ -1217,7 +1559,7 @@ chop_circuit_t::send_targeted(chop_conn_t *conn)
                   log_get_timestamp(), this->serial,
                   this->recv_queue.window(),
                   (unsigned long)evbuffer_get_length(
-                              bufferevent_get_input(this->up_buffer)),
+                              this->upstream_input()),
                   (unsigned long)el.hdr.seqno(),
                   (unsigned long)el.hdr.dlen(),
                   (unsigned long)el.hdr.plen(),
@@ -1227,24 +1569,23 @@ chop_circuit_t::send_targeted(chop_conn_t *conn)
       }
     }
   }
-      
-  if (avail > SECTION_LEN)
-    avail = SECTION_LEN;
-  avail += MIN_BLOCK_SIZE;
+
+  size_t desired = min(packed_length(avail, steg_avail),
+                       (size_t)MAX_DESIRED) + MIN_BLOCK_SIZE;
 
   // If we have any data to transmit, ensure we do not send a block
   // that contains no data at all.
-  size_t lo = MIN_BLOCK_SIZE + (avail == MIN_BLOCK_SIZE ? 0 : 1);
+  size_t lo = MIN_BLOCK_SIZE + (avail || steg_avail ? 1 : 0);
 
   // If this connection has not yet sent a handshake, it will need to.
   size_t hi = MAX_BLOCK_SIZE;
   if (!conn->sent_handshake) {
     lo += HANDSHAKE_LEN;
     hi += HANDSHAKE_LEN;
-    avail += HANDSHAKE_LEN;
+    desired += HANDSHAKE_LEN;
   }
 
-  size_t room = conn->steg->transmit_room(avail, lo, hi);
+  size_t room = conn->steg->transmit_room(desired, lo, hi);
   if (room == 0)
     log_abort(conn, "must send but cannot send");
   if (room < lo || room >= hi)
@@ -1254,149 +1595,494 @@ chop_circuit_t::send_targeted(chop_conn_t *conn)
   log_debug(conn, "requests %lu bytes (%s)", (unsigned long)room,
             conn->steg->cfg()->name());
 
-  return steg_data_available ? 
-    send_targeted_steg_data(conn, room) :
-    send_targeted(conn, room);
+  return send_packed(conn, room);
 }
 
-int
-chop_circuit_t::send_targeted(chop_conn_t *conn, size_t blocksize)
+// The data section size to ask of pick_connection or transmit_room
+// so that DATA bytes of upstream data, STEG_DATA bytes of steg
+// protocol data and the pending ACK all fit: their packed length,
+// less the framing of the one block the caller accounts for.
+size_t
+chop_circuit_t::packed_length(size_t data, size_t steg_data) const
 {
-  size_t lo = MIN_BLOCK_SIZE, hi = MAX_BLOCK_SIZE;
-  if (!conn->sent_handshake) {
-    lo += HANDSHAKE_LEN;
-    hi += HANDSHAKE_LEN;
-  }
-  log_assert(blocksize >= lo && blocksize <= hi);
-
-  struct evbuffer *xmit_pending = bufferevent_get_input(up_buffer);
-  size_t avail = evbuffer_get_length(xmit_pending);
-  opcode_t op = op_DAT;
-  
-  //The original code 
-  /*if (avail > blocksize - lo)
-    avail = blocksize - lo;
-    else if (avail > SECTION_LEN)
-    avail = SECTION_LEN;*/
+  size_t len = data + (data + SECTION_LEN - 1) / SECTION_LEN * MIN_BLOCK_SIZE;
+  len += steg_data +
+    (steg_data + SECTION_LEN - 1) / SECTION_LEN * MIN_BLOCK_SIZE;
+  if (ack_due)
+    len += MIN_BLOCK_SIZE + ACK_MAX_LEN;
+  return len > MIN_BLOCK_SIZE ? len - MIN_BLOCK_SIZE : 0;
+}
 
-  if (avail > blocksize - lo || avail > SECTION_LEN)
-    avail = min(blocksize - lo, SECTION_LEN);
-  else if (upstream_eof && !sent_fin)
-    // this block will carry the last byte of real data to be sent in
-    // this direction; mark it as such
-    op = op_FIN;
+/** Whether upstream data goes out compressed, when it pays. */
+bool
+chop_circuit_t::compressing() const
+{
+  return config->compress && peer_inflates;
+}
 
-  return send_targeted(conn, avail, (blocksize - lo) - avail,
-                       op, xmit_pending);
+/**
+   Upstream data waiting to be sent, as it will go out: with
+   compression on, what is still raw counts at the ratio so far.
+   Stream data counts as far as the streams' windows let it go.
+*/
+size_t
+chop_circuit_t::pending_data() const
+{
+  size_t raw = evbuffer_get_length(upstream_input());
+  if (carries_streams())
+    raw += stream_data();
+  size_t packed = compressed_pending ?
+    evbuffer_get_length(compressed_pending) : 0;
+
+  if (raw > 0 && compressing() && !compress_bypass && compressed_in > 0)
+    // + the flush that ends each chunk
+    raw = raw * compressed_out / compressed_in +
+      (raw + COMPRESS_CHUNK - 1) / COMPRESS_CHUNK * 6;
+  return raw + packed;
 }
 
+/**
+   Runs upstream data through the deflater, a chunk at a time, until
+   WANT compressed bytes are waiting or it runs out, and stops
+   compressing for a while when a chunk barely shrinks.
+*/
 int
-chop_circuit_t::send_targeted_steg_data(chop_conn_t *conn, size_t blocksize)
+chop_circuit_t::compress_upstream(size_t want)
 {
-  size_t lo = MIN_BLOCK_SIZE, hi = MAX_BLOCK_SIZE;
-  if (!conn->sent_handshake) {
-    lo += HANDSHAKE_LEN;
-    hi += HANDSHAKE_LEN;
+  struct evbuffer *input = upstream_input();
+
+  if (!compressed_pending) {
+    compressed_pending = evbuffer_new();
+    deflater = new stream_deflater;
+    if (!compressed_pending) {
+      log_warn(this, "memory allocation failure");
+      return -1;
+    }
+  }
+
+  while (evbuffer_get_length(compressed_pending) < want &&
+         !compress_bypass && evbuffer_get_length(input) > 0) {
+    size_t n = min(evbuffer_get_length(input), (size_t)COMPRESS_CHUNK);
+    ssize_t c = deflater->compress(input, n, compressed_pending);
+    if (c < 0) {
+      log_warn(this, "compression failure");
+      return -1;
+    }
+    compressed_in += n;
+    compressed_out += c;
+
+    if (n >= COMPRESS_SAMPLE && (size_t)c * 10 > n * 9) {
+      log_debug(this, "%lu bytes compressed to %lu; sending the next %u "
+                "uncompressed", (unsigned long)n, (unsigned long)c,
+                COMPRESS_BYPASS);
+      compress_bypass = COMPRESS_BYPASS;
+    }
   }
-  log_assert(blocksize >= lo && blocksize <= hi);
+  return 0;
+}
+
+/** Replaces the contents of a compressed block with the data. */
+int
+chop_circuit_t::inflate_block(struct evbuffer *data)
+{
+  if (!inflater)
+    inflater = new stream_inflater;
 
-  size_t avail = evbuffer_get_length(conn->steg->cfg()->protocol_data_out);
-  opcode_t op = op_STEG0;
+  struct evbuffer *raw = evbuffer_new();
+  if (!raw) {
+    log_warn(this, "memory allocation failure");
+    return -1;
+  }
+  if (inflater->decompress(data, raw) < 0 ||
+      evbuffer_add_buffer(data, raw)) {
+    log_warn(this, "protocol error: bad compressed block");
+    evbuffer_free(raw);
+    return -1;
+  }
+  evbuffer_free(raw);
+  return 0;
+}
 
-  if (avail > blocksize - lo || avail > SECTION_LEN)
-    avail = min(blocksize - lo, SECTION_LEN);
-  else if (upstream_eof && !sent_fin)
-    // this block will carry the last byte of real data to be sent in
-    // this direction; mark it as such
-    op = op_STEG_FIN;
+/** Whether transmissions go out protected by parity. */
+bool
+chop_circuit_t::sending_parity() const
+{
+  return config->fec && peer_takes_parity;
+}
 
-  return send_targeted(conn, avail, (blocksize - lo) - avail,
-                       op, conn->steg->cfg()->protocol_data_out);
+/** Transmissions per parity group: fewer, the more gaps the other
+    end's ACKs have been showing. */
+size_t
+chop_circuit_t::parity_group_size() const
+{
+  double rate = tx_queue.gap_rate();
+  if (rate * PARITY_MAX_GROUP <= PARITY_GAP_SHARE)
+    return PARITY_MAX_GROUP;
+  return std::max((size_t)1, (size_t)(PARITY_GAP_SHARE / rate));
 }
 
+/**
+   Rebuilds whatever a PAR block allows of a transmission that has
+   not arrived, and queues its blocks as though it had.  The steg
+   data among them goes to STEG_CFG, that of the connection that
+   brought the parity.
+*/
 int
-chop_circuit_t::send_targeted(chop_conn_t *conn, size_t d, size_t p, opcode_t f,
-                              struct evbuffer *payload)
+chop_circuit_t::recv_parity(struct evbuffer *data, steg_config_t *steg_cfg)
 {
-  log_assert(payload || d == 0);
-  log_assert(d <= SECTION_LEN);
-  log_assert(p <= SECTION_LEN);
+  vector<rebuilt_block> got;
+  if (!parity_in)
+    return 0;
+  if (parity_in->rebuild(data, recv_queue, got) < 0) {
+    log_warn(this, "protocol error: bad parity block");
+    return 0;
+  }
 
-  if (tx_queue.full()) {
+  for (size_t i = 0; i < got.size(); i++) {
+    rebuilt_block &b = got[i];
+    char fallbackbuf[4];
+    log_debug(this, "rebuilt block %u <d=%lu f=%s> from parity",
+              b.seqno, (unsigned long)evbuffer_get_length(b.data),
+              opname(b.op, fallbackbuf));
+    parity_rebuilt++;
+
+    switch (b.op) {
+    case op_RST:
+      recv_block(b.seqno, b.op, b.data, steg_cfg);
+      break;
+    case op_ACK:
+    case op_PAR:
+      // an old ACK is of no use, and parity never covers parity
+      evbuffer_drain(b.data, evbuffer_get_length(b.data));
+      recv_queue.insert(b.seqno, op_DAT, b.data, steg_cfg);
+      break;
+    default:
+      recv_queue.insert(b.seqno, b.op, b.data, steg_cfg);
+      break;
+    }
+  }
+  return 0;
+}
+
+int
+chop_circuit_t::send_packed(chop_conn_t *conn, size_t room)
+{
+  struct packed_block
+  {
+    opcode_t op;
+    struct evbuffer *source; // the data comes from here
+    size_t d;
+    size_t p;
+  };
+
+  size_t shake = conn->sent_handshake ? 0 : HANDSHAKE_LEN;
+  log_assert(room >= MIN_BLOCK_SIZE + shake &&
+             room <= MAX_BLOCK_SIZE + shake);
+
+  // Padding may take one block of its own; see below.
+  uint32_t slots = tx_queue.free_slots();
+  if (slots < 2) {
     log_warn(conn, "transmit queue full, cannot send");
     return -1;
   }
+  slots--;
 
-  struct evbuffer *data = evbuffer_new();
-  if (!data) {
-    log_warn(conn, "memory allocation failure");
-    return -1;
+  vector<packed_block> plan;
+  size_t left = room - shake;
+
+  // The ACK goes first, so a full transmission never crowds it out.
+  struct evbuffer *ackp = NULL;
+  if (ack_due) {
+    ackp = recv_queue.gen_ack();
+    if (!ackp) {
+      log_warn(conn, "memory allocation failure");
+      return -1;
+    }
+    size_t d = evbuffer_get_length(ackp);
+    if (left >= MIN_BLOCK_SIZE + d) {
+      packed_block b = { op_ACK, ackp, d, 0 };
+      plan.push_back(b);
+      left -= MIN_BLOCK_SIZE + d;
+    } else {
+      evbuffer_free(ackp);
+      ackp = NULL;
+    }
   }
 
-  if (evbuffer_remove_buffer(payload, data, d) != (int)d) {
-    log_warn(conn, "failed to extract payload");
-    evbuffer_free(data);
+  // An empty compressed block tells the client we take them.
+  if (announce_inflate && left >= MIN_BLOCK_SIZE && plan.size() < slots) {
+    packed_block b = { op_ZDAT, NULL, 0, 0 };
+    plan.push_back(b);
+    left -= MIN_BLOCK_SIZE;
+  }
+
+  // Likewise an empty parity block.  A closed group's parity goes
+  // next, with whatever transmission has room for it.
+  bool announcing = false;
+  if (announce_parity && left >= MIN_BLOCK_SIZE && plan.size() < slots) {
+    packed_block b = { op_PAR, NULL, 0, 0 };
+    plan.push_back(b);
+    left -= MIN_BLOCK_SIZE;
+    announcing = true;
+  }
+  // The client keeps copies of our blocks from the announcement on,
+  // so the first group cannot start before it.
+  if (sending_parity() && !parity_out && (announcing || !announce_parity))
+    parity_out = new parity_encoder;
+  struct evbuffer *parp = NULL;
+  if (parity_out && parity_out->due() &&
+      left >= MIN_BLOCK_SIZE + parity_out->parity_len() &&
+      plan.size() < slots) {
+    size_t groupsize = parity_out->size();
+    parp = parity_out->take();
+    if (!parp) {
+      log_warn(conn, "memory allocation failure");
+      if (ackp)
+        evbuffer_free(ackp);
+      return -1;
+    }
+    size_t d = evbuffer_get_length(parp);
+    packed_block b = { op_PAR, parp, d, 0 };
+    plan.push_back(b);
+    left -= MIN_BLOCK_SIZE + d;
+    parity_groups++;
+    parity_bytes += d;
+    log_debug(conn, "parity for %lu transmissions, %lu bytes",
+              (unsigned long)groupsize, (unsigned long)d);
+  }
+
+  struct evbuffer *steg_data = conn->steg->cfg()->protocol_data_out;
+  size_t avail = evbuffer_get_length(steg_data);
+  while (avail > 0 && left > MIN_BLOCK_SIZE && plan.size() < slots) {
+    size_t d = min(min(avail, (size_t)SECTION_LEN), left - MIN_BLOCK_SIZE);
+    packed_block b = { op_STEG0, steg_data, d, 0 };
+    plan.push_back(b);
+    avail -= d;
+    left -= MIN_BLOCK_SIZE + d;
+  }
+
+  // Streams' data is framed as it is needed, so that a stream which
+  // starts in the middle of another's bulk transfer waits no longer
+  // than one transmission.
+  if (carries_streams() && left > MIN_BLOCK_SIZE &&
+      frame_streams(left - MIN_BLOCK_SIZE))
     return -1;
+
+  // Upstream data, compressed if anything already is; raw data
+  // only goes out once all compressed data has.
+  struct evbuffer *xmit_pending = upstream_input();
+  size_t raw0 = evbuffer_get_length(xmit_pending);
+  struct evbuffer *source = xmit_pending;
+  opcode_t op_data = op_DAT, op_last = op_FIN;
+  if (compressing()) {
+    if (left > MIN_BLOCK_SIZE && compress_upstream(left - MIN_BLOCK_SIZE))
+      return -1;
+    if (compressed_pending && evbuffer_get_length(compressed_pending) > 0) {
+      source = compressed_pending;
+      op_data = op_ZDAT;
+      op_last = op_ZFIN;
+    }
+  }
+  avail = evbuffer_get_length(source);
+  bool fin_pending = upstream_eof && !sent_fin &&
+    (source == xmit_pending || evbuffer_get_length(xmit_pending) == 0);
+  while ((avail > 0 || fin_pending) &&
+         left >= MIN_BLOCK_SIZE + (avail > 0 ? 1 : 0) &&
+         plan.size() < slots) {
+    size_t d = min(min(avail, (size_t)SECTION_LEN), left - MIN_BLOCK_SIZE);
+    // the block that carries the last byte of real data to be sent
+    // in this direction is marked as such
+    opcode_t op = (d == avail && fin_pending) ? op_last : op_data;
+    packed_block b = { op, source, d, 0 };
+    plan.push_back(b);
+    avail -= d;
+    left -= MIN_BLOCK_SIZE + d;
+    if (op == op_last)
+      break;
   }
 
-  // The transmit queue takes ownership of 'data' at this point.
-  uint32_t seqno = tx_queue.enqueue(f, data, p);
+  // Send at least one block, even if there is no real data to send.
+  if (plan.empty()) {
+    packed_block b = { op_DAT, xmit_pending, 0, 0 };
+    plan.push_back(b);
+    left -= MIN_BLOCK_SIZE;
+  }
 
-  struct evbuffer *block = evbuffer_new();
-  if (!block) {
-    log_warn(conn, "memory allocation failure");
-    return -1;
+  // Whatever room is left becomes padding, from the last block back.
+  // A block pads at most SECTION_LEN, so a sparse transmission may
+  // need one more, empty, block; no more, as a whole transmission is
+  // smaller than MAX_BLOCK_SIZE.
+  for (size_t i = plan.size(); i > 0 && left > 0; i--) {
+    size_t take = min(left, SECTION_LEN - plan[i-1].p);
+    plan[i-1].p += take;
+    left -= take;
   }
-  if (tx_queue.transmit(seqno, block, *send_hdr_crypt, *send_crypt)) {
-    log_warn(conn, "encryption failure for block %u", seqno);
-    evbuffer_free(block);
-    return -1;
+  if (left > 0) {
+    packed_block b = { op_DAT, xmit_pending, 0, 0 };
+    if (left >= MIN_BLOCK_SIZE) {
+      b.p = left - MIN_BLOCK_SIZE;
+    } else {
+      log_assert(plan.back().p >= MIN_BLOCK_SIZE - left);
+      plan.back().p -= MIN_BLOCK_SIZE - left;
+    }
+    plan.push_back(b);
   }
 
-  if (conn->send(block)) {
-    evbuffer_free(block);
+  struct evbuffer *out = evbuffer_new();
+  if (!out) {
+    log_warn(conn, "memory allocation failure");
+    if (ackp)
+      evbuffer_free(ackp);
+    if (parp)
+      evbuffer_free(parp);
     return -1;
   }
-  evbuffer_free(block);
 
-  //if we don't do retransmit we need to remove the block
-  //from the queue not make full. because the only way that
-  //ACK remove lost payload is by retransmission.
+  // The transmission joins the open parity group, if its parity
+  // would fit in a block; one that would not closes the group.
+  bool protect = parity_out && !parity_out->due();
+  if (protect) {
+    size_t len = 0;
+    for (size_t i = 0; i < plan.size(); i++)
+      len += parity_encoder::serialized_len(plan[i].op, plan[i].d);
+    if (len <= PARITY_MAX_MEMBER && plan.size() <= 255) {
+      parity_out->begin_member(tx_queue.next_seqno(), plan.size());
+    } else {
+      parity_out->close();
+      protect = false;
+    }
+  }
 
-  char fallbackbuf[4];
-  log_debug(conn, "transmitted block %u <d=%lu p=%lu f=%s>",
-            seqno, (unsigned long)d, (unsigned long)p,
-            opname(f, fallbackbuf));
+  for (size_t i = 0; i < plan.size(); i++) {
+    packed_block &b = plan[i];
+    struct evbuffer *data;
+    if (b.op == op_ACK) {
+      data = ackp;
+      ackp = NULL;
+    } else if (b.op == op_PAR && b.d) {
+      data = parp;
+      parp = NULL;
+    } else {
+      data = evbuffer_new();
+      if (!data ||
+          (b.d && evbuffer_remove_buffer(b.source, data, b.d) != (int)b.d)) {
+        log_warn(conn, "failed to extract payload");
+        if (data)
+          evbuffer_free(data);
+        evbuffer_free(out);
+        return -1;
+      }
+    }
 
-  if (config->trace_packets) {
-    fprintf(stderr,
-            "T:%.4f: ckt %u <ntp %u outq %lu>: "
-            "send %lu <d=%lu p=%lu f=%s>\n",
-            log_get_timestamp(), this->serial,
-            this->recv_queue.window(),
-            (unsigned long)evbuffer_get_length(
-                              bufferevent_get_input(this->up_buffer)),
-            (unsigned long)seqno,
-            (unsigned long)d,
-            (unsigned long)p,
-            opname(f, fallbackbuf));
-    config->total_transmited_data_bytes += d;
-    log_debug(this, "efficiency: %f", config->total_transmited_data_bytes/(double)(config->total_transmited_cover_bytes));
+    if (protect)
+      parity_out->add_block(b.op, data);
+
+    // The transmit queue takes ownership of 'data' at this point.
+    uint32_t seqno = tx_queue.enqueue(b.op, data, b.p);
+    if (tx_queue.transmit(seqno, out, *send_hdr_crypt, *send_crypt)) {
+      log_warn(conn, "encryption failure for block %u", seqno);
+      evbuffer_free(out);
+      return -1;
+    }
+
+    char fallbackbuf[4];
+    log_debug(conn, "transmitted block %u <d=%lu p=%lu f=%s> (%lu of %lu)",
+              seqno, (unsigned long)b.d, (unsigned long)b.p,
+              opname(b.op, fallbackbuf),
+              (unsigned long)i + 1, (unsigned long)plan.size());
+
+    if (config->trace_packets)
+      fprintf(stderr,
+              "T:%.4f: ckt %u <ntp %u outq %lu>: "
+              "send %lu <d=%lu p=%lu f=%s>\n",
+              log_get_timestamp(), this->serial,
+              this->recv_queue.window(),
+              (unsigned long)evbuffer_get_length(xmit_pending),
+              (unsigned long)seqno,
+              (unsigned long)b.d,
+              (unsigned long)b.p,
+              opname(b.op, fallbackbuf));
+
+    if (b.op == op_ACK) {
+      ack_due = false;
+      if (log_do_debug()) {
+        std::ostringstream ackdump;
+        debug_ack_contents(data, ackdump);
+        log_debug(this, "sent ACK: %s", ackdump.str().c_str());
+      }
+    }
+    if (b.op == op_ZDAT && b.d == 0)
+      announce_inflate = false;
+    if (b.op == op_PAR && b.d == 0)
+      announce_parity = false;
+    if (b.op == op_FIN || b.op == op_ZFIN) {
+      sent_fin = true;
+      read_eof = true;
+    }
+    if (((b.op == op_DAT || b.op == op_ZDAT || b.op == op_STEG0) &&
+         b.d > 0) ||
+        b.op == op_FIN || b.op == op_ZFIN)
+      // We are making forward progress if we are _either_ sending or
+      // receiving data.
+      dead_cycles = 0;
   }
-  if (f == op_FIN || f == op_STEG_FIN) {
-    sent_fin = true;
-    read_eof = true;
+
+  unsigned long cover0 = config->total_transmited_cover_bytes;
+  if (conn->send(out)) {
+    evbuffer_free(out);
+    return -1;
   }
-  if ((f == op_DAT && d > 0) || 
-      (f == op_STEG0 && d > 0) ||
-      f == op_FIN ||
-      f == op_STEG_FIN)
-    // We are making forward progress if we are _either_ sending or
-    // receiving data.
-    dead_cycles = 0;
+  evbuffer_free(out);
+
+  // Goodput is the upstream data taken in, whether it went out raw
+  // or through the deflater.
+  size_t goodput = raw0 - evbuffer_get_length(xmit_pending);
+  if (source == xmit_pending && compress_bypass)
+    compress_bypass -= min(compress_bypass, goodput);
+
+  // The transmission is bulk if upstream data was left over for the
+  // next one, interactive if it took everything there was.
+  int bulk = pending_data() > 0 ? 1 : 0;
+  cover_bytes[bulk] += config->total_transmited_cover_bytes - cover0;
+
+  // A group closes when it is full, or when the burst it protects is
+  // over, so that the tail of a burst gets its parity promptly.
+  if (protect && (!bulk || parity_out->size() >= parity_group_size()))
+    parity_out->close();
+  goodput_bytes[bulk] += goodput;
+  config->total_transmited_data_bytes += goodput;
+
+  if (config->trace_packets)
+    log_debug(this, "efficiency: %f",
+              config->total_transmited_data_bytes /
+              (double)config->total_transmited_cover_bytes);
+
   return 0;
 }
 
+/** Logs the cover bytes spent per byte of upstream data delivered. */
+void
+chop_circuit_t::report_efficiency()
+{
+  if (!cover_bytes[0] && !cover_bytes[1])
+    return;
+
+  log_info(this, "sent %llu bytes in %llu cover bytes: "
+           "bulk %.2f, interactive %.2f cover bytes per byte",
+           goodput_bytes[0] + goodput_bytes[1],
+           cover_bytes[0] + cover_bytes[1],
+           goodput_bytes[1] ? cover_bytes[1] / (double)goodput_bytes[1] : 0.0,
+           goodput_bytes[0] ? cover_bytes[0] / (double)goodput_bytes[0] : 0.0);
+  if (compressed_in)
+    log_info(this, "compressed %llu of those bytes to %llu (%.2f)",
+             compressed_in, compressed_out,
+             compressed_out / (double)compressed_in);
+  if (parity_groups || parity_rebuilt)
+    log_info(this, "sent %llu parity bytes for %llu groups; "
+             "rebuilt %llu blocks from parity received",
+             parity_bytes, parity_groups, parity_rebuilt);
+}
+
 // N.B. 'desired' is the desired size of the _data section_, and
 // 'blocksize' on output is the size to make the _entire block_.
 chop_conn_t *
@@ -1405,13 +2091,16 @@ chop_circuit_t::pick_connection(size_t desired, size_t minimum,
 {
   size_t maxbelow = 0;
   size_t minabove = MAX_BLOCK_SIZE + 1;
+  size_t busyroom = 0;
+  size_t leastunsent = SIZE_MAX;
   chop_conn_t *targbelow = 0;
   chop_conn_t *targabove = 0;
+  chop_conn_t *targbusy = 0;
 
   log_assert(minimum <= SECTION_LEN);
 
-  if (desired > SECTION_LEN)
-    desired = SECTION_LEN;
+  if (desired > MAX_DESIRED)
+    desired = MAX_DESIRED;
 
   // If we have any data to transmit, ensure we do not send a block
   // that contains no data at all.
@@ -1476,6 +2165,21 @@ chop_circuit_t::pick_connection(size_t desired, size_t minimum,
         log_debug(this, "no req: %lu avg des: %f avg act: %f", number_of_room_requests, avg_desirable_size, avg_available_size);
     }
     
+    // Steer away from connections whose queues are not draining,
+    // unless they are all like that; then use the least backed up.
+    if (downstreams.size() > 1) {
+      size_t unsent = conn->unsent_bytes();
+      if (unsent > BUSY_UNSENT) {
+        log_debug(conn, "busy: %lu bytes unsent", (unsigned long)unsent);
+        if (unsent < leastunsent) {
+          leastunsent = unsent;
+          busyroom = room;
+          targbusy = conn;
+        }
+        continue;
+      }
+    }
+
     if (room >= desired + shake) {
       if (room < minabove) {
         minabove = room;
@@ -1495,16 +2199,20 @@ chop_circuit_t::pick_connection(size_t desired, size_t minimum,
 
   // If we have a connection that can take all the data, use it.
   // Otherwise, use the connection that can take as much of the data
-  // as possible.  As a special case, if no connection can take data,
+  // as possible.  A busy connection is used only if nothing else has
+  // room.  As a special case, if no connection can take data,
   // targbelow, targabove, maxbelow, and minabove will all still have
   // their initial values, so we'll return NULL and set blocksize to 0,
   // which callers know how to handle.
   if (targabove) {
     *blocksize = minabove;
     return targabove;
-  } else {
+  } else if (targbelow || !targbusy) {
     *blocksize = maxbelow;
     return targbelow;
+  } else {
+    *blocksize = busyroom;
+    return targbusy;
   }
 }
 
@@ -1554,7 +2262,7 @@ inline chop_conn_t* chop_circuit_t::check_for_steg_protocol_data()
 }
 
 
-int
+void
 chop_circuit_t::maybe_send_ack()
 {
   // Send acks aggressively if we are experiencing dead cycles *and*
@@ -1565,23 +2273,33 @@ chop_circuit_t::maybe_send_ack()
   //If we don't retransmit we shouldn't send ACK either because it will consume
   //all the channel if a block is lost
   if (!config->retransmit)
-    return 0;
+    return;
   log_debug(this, "considering ACK");
   if (recv_queue.window() - last_acked < 32 &&
       (!dead_cycles || recv_queue.empty()))
     {
       log_debug(this, "back log size only %u, not sending ACK", recv_queue.window() - last_acked);
-      return 0;
+      return;
     }
 
-  evbuffer *ackp = recv_queue.gen_ack();
-  if (log_do_debug()) {
-    std::ostringstream ackdump;
-    debug_ack_contents(ackp, ackdump);
-    log_debug(this, "sending ACK: %s", ackdump.str().c_str());
-  }
+  // The ACK itself is generated when it is packed into a transmission,
+  // so it is as current as it can be.
   last_acked = recv_queue.window();
-  return send_special(op_ACK, ackp);
+  ack_due = true;
+}
+
+// Sends the pending ACK when there is nothing else to carry it.
+int
+chop_circuit_t::send_ack()
+{
+  size_t room;
+  chop_conn_t *conn = pick_connection(ACK_MAX_LEN, ACK_MAX_LEN, &room);
+  if (!conn) {
+    log_debug(this, "no usable connection for ACK; it waits for the next "
+              "transmission");
+    return 0;
+  }
+  return send_packed(conn, room);
 }
 
 // Some blocks are to be processed immediately upon receipt.
@@ -1594,9 +2312,22 @@ int
 chop_circuit_t::recv_block(uint32_t seqno, opcode_t op, 
                            evbuffer *data, steg_config_t *steg_cfg)
 {
+  // Only a peer that takes parity sends it.  From then on, a copy of
+  // each block is kept until the parity of its group has come.
+  if (op == op_PAR)
+    peer_takes_parity = peer_sends_parity = true;
+  if (peer_sends_parity && !recv_queue.received(seqno) &&
+      seqno - recv_queue.window() <= 255) {
+    if (!parity_in)
+      parity_in = new parity_decoder;
+    parity_in->keep(seqno, op, data);
+  }
+
   switch (op) {
   case op_DAT:
   case op_FIN:
+  case op_ZDAT:
+  case op_ZFIN:
   case op_STEG0:   // steganography modules
   case op_STEG_FIN:
 
@@ -1625,6 +2356,11 @@ chop_circuit_t::recv_block(uint32_t seqno, opcode_t op,
     retransmit();
     goto zap;
 
+  case op_PAR:
+    recv_parity(data, steg_cfg);
+    evbuffer_free(data);
+    goto zap;
+
   case op_XXX:
   default:
     char fallbackbuf[4];
@@ -1655,6 +2391,7 @@ chop_circuit_t::process_queue()
   while ((blk = recv_queue.remove_next()).data) {
     switch (blk.op) {
     case op_FIN:
+    case op_ZFIN:
       if (received_fin) {
         log_info(this, "protocol error: duplicate FIN");
         pending_error = true;
@@ -1664,6 +2401,15 @@ chop_circuit_t::process_queue()
       pending_fin = true;
       // fall through - block may have data
     case op_DAT:
+    case op_ZDAT:
+      if (blk.op == op_ZDAT || blk.op == op_ZFIN) {
+        // only a peer that takes compressed blocks sends them
+        peer_inflates = true;
+        if (inflate_block(blk.data)) {
+          pending_error = true;
+          break;
+        }
+      }
       if (evbuffer_get_length(blk.data)) {
         if (received_fin) {
           log_info(this, "protocol error: data after FIN");
@@ -1676,10 +2422,12 @@ chop_circuit_t::process_queue()
           log_debug(this, "writing into upstream buffer");
           if (this->write_eof)
             log_abort(this, "writing into upstream buffer after eof?");
-          if (evbuffer_add_buffer(bufferevent_get_output(up_buffer),
+          if (evbuffer_add_buffer(upstream_output(),
                                   blk.data)) {
             log_warn(this, "buffer transfer failure");
             pending_error = true;
+          } else if (carries_streams() && recv_frames()) {
+            pending_error = true;
           }
         }
       }
@@ -1721,11 +2469,18 @@ chop_circuit_t::process_queue()
     if (pending_fin && !received_fin) {
       circuit_recv_eof(this);
       received_fin = true;
+      // The client closes a circuit of streams once it has none; the
+      // server has nothing to wait for either, and answers with a FIN.
+      if (carries_streams()) {
+        end_streams();
+        upstream_eof = true;
+      }
     }
     if (pending_error && !sent_error) {
       // there's no point sending an RST in response to an RST or a
       // duplicate FIN
-      if (blk.op != op_RST && blk.op != op_FIN && blk.op != op_STEG_FIN)
+      if (blk.op != op_RST && blk.op != op_FIN && blk.op != op_ZFIN &&
+          blk.op != op_STEG_FIN)
         send_special(op_RST, 0);
       sent_error = true;
     }
@@ -1736,14 +2491,16 @@ chop_circuit_t::process_queue()
   if (sent_error)
     return -1;
 
-  if (maybe_send_ack())
-    return -1;
+  maybe_send_ack();
 
-  // It may have become possible to send queued data or a FIN.
-  if (evbuffer_get_length(bufferevent_get_input(up_buffer))
-      || (upstream_eof && !sent_fin))
+  // It may have become possible to send queued data or a FIN.  Any
+  // ACK goes along with them.
+  if (pending_data() || (upstream_eof && !sent_fin))
     return send();
 
+  if (ack_due && send_ack())
+    return -1;
+
   return check_for_eof();
 }
 
@@ -1788,9 +2545,10 @@ chop_circuit_t::retransmit()
        i != tx_queue.end();
        ++i) {
     transmit_elt &el = *i;
-    size_t lo = MIN_BLOCK_SIZE + el.hdr.dlen(); //we don't need to add the min block size as it is done in pick_connections, maybe we sends these with double headers
+    size_t lo = MIN_BLOCK_SIZE + el.hdr.dlen();
     size_t room;
-    chop_conn_t *conn = pick_connection(lo, lo, &room);
+    // pick_connection takes the size of the data section
+    chop_conn_t *conn = pick_connection(el.hdr.dlen(), el.hdr.dlen(), &room);
     if (!conn)
       continue;
     log_assert(lo <= room);
@@ -1820,7 +2578,7 @@ chop_circuit_t::retransmit()
               log_get_timestamp(), this->serial,
               this->recv_queue.window(),
               (unsigned long)evbuffer_get_length(
-                                                 bufferevent_get_input(this->up_buffer)),
+                                                 this->upstream_input()),
               (unsigned long)el.hdr.seqno(),
               (unsigned long)el.hdr.dlen(),
               (unsigned long)el.hdr.plen(),
@@ -1833,6 +2591,443 @@ chop_circuit_t::retransmit()
   
   return 0;
 }
+// Stream methods
+
+/** Makes this a circuit which carries streams instead of an
+    upstream of its own. */
+void
+chop_circuit_t::carry_streams()
+{
+  frames_out = evbuffer_new();
+  frames_in = evbuffer_new();
+  if (!frames_out || !frames_in)
+    log_abort(this, "memory allocation failure");
+  idle_timer.set(idle_timeout, this);
+
+  // Nor has it a SOCKS request of its own to answer.
+  up_peer = xstrdup("(streams)");
+  if (socks_state) {
+    socks_state_free(socks_state);
+    socks_state = NULL;
+  }
+}
+
+/** The client numbers its streams; the server takes the ID the
+    client gave. */
+void
+chop_circuit_t::attach_stream(chop_stream_t *stream, uint32_t id)
+{
+  if (!id)
+    id = ++last_stream_id;
+
+  stream->carrier = this;
+  stream->stream_id = id;
+  streams[id] = stream;
+  streams_carried++;
+  idle_timer.disarm();
+
+  log_debug(this, "carrying stream %u, now %lu", id,
+            (unsigned long)streams.size());
+}
+
+void
+chop_circuit_t::detach_stream(chop_stream_t *stream)
+{
+  log_assert(stream->carrier == this);
+  streams.erase(stream->stream_id);
+  stream->carrier = NULL;
+
+  // The other end is told of a stream that did not finish both ways,
+  // if it knows of it and has not reset it itself.
+  if (stream->announced && !stream->reset && !sent_fin &&
+      !(stream->sent_fin && stream->received_fin) &&
+      add_stream_frame(frames_out, stream->stream_id, sf_RST, NULL, 0))
+    log_warn(this, "memory allocation failure");
+
+  log_debug(this, "dropped stream %u, now %lu", stream->stream_id,
+            (unsigned long)streams.size());
+
+  //once no other stream can come, there is nothing to wait for
+  if (streams.empty() && config->mode != LSN_SIMPLE_SERVER && !upstream_eof)
+    idle_timer.arm(config->base,
+                   config->stream_circuit == this ? STREAM_IDLE_MS : 0);
+}
+
+/** Opens the server's end of a stream the client has begun. */
+chop_stream_t *
+chop_circuit_t::open_stream(uint32_t id)
+{
+  last_stream_id = id;
+  config->creating_stream = true;
+  chop_stream_t *stream =
+    dynamic_cast<chop_stream_t *>(circuit_create(config, 0));
+  config->creating_stream = false;
+
+  attach_stream(stream, id);
+  stream->announced = true;
+  if (circuit_open_upstream(stream)) {
+    log_warn(this, "failed to begin upstream connection for stream %u", id);
+    stream->close();
+    return NULL;
+  }
+  return stream;
+}
+
+/** The circuit is going: its streams go with it, but for those that
+    have finished both ways and are only flushing their upstream. */
+void
+chop_circuit_t::end_streams()
+{
+  chop_stream_table gone;
+  gone.swap(streams);
+  for (chop_stream_table::iterator i = gone.begin(); i != gone.end(); ++i) {
+    chop_stream_t *stream = i->second;
+    stream->carrier = NULL;
+    if (!(stream->sent_fin && stream->received_fin))
+      stream->close();
+  }
+}
+
+/** Opens the other end's window on STREAM by what its upstream has
+    taken since the last time. */
+void
+chop_circuit_t::grant_credit(chop_stream_t *stream)
+{
+  // If no more is coming, there is no window to keep open.
+  if (sent_fin || stream->received_fin) {
+    stream->credit = 0;
+    return;
+  }
+
+  if (add_stream_credit(frames_out, stream->stream_id, stream->credit)) {
+    log_warn(this, "memory allocation failure");
+    return;
+  }
+  stream->recv_window += stream->credit;
+  stream->credit = 0;
+
+  // The client does not wait for its next poll to tell the server;
+  // the server's WND goes with whatever it sends next.
+  if (config->mode != LSN_SIMPLE_SERVER)
+    circuit_arm_flush_timer(this, 0);
+}
+
+/** Where the upstream data to send comes from: the upstream
+    connection, or the frames of the streams carried. */
+struct evbuffer *
+chop_circuit_t::upstream_input() const
+{
+  return carries_streams() ? frames_out : bufferevent_get_input(up_buffer);
+}
+
+/** Where the upstream data received goes. */
+struct evbuffer *
+chop_circuit_t::upstream_output() const
+{
+  return carries_streams() ? frames_in : bufferevent_get_output(up_buffer);
+}
+
+/** The frames frame_streams() would make if it could, framing
+    included. */
+size_t
+chop_circuit_t::stream_data() const
+{
+  if (sent_fin)
+    return 0;
+
+  size_t len = 0;
+  for (chop_stream_table::const_iterator i = streams.begin();
+       i != streams.end(); ++i) {
+    const chop_stream_t *stream = i->second;
+    size_t d = stream->sendable();
+    size_t frames = (d + STREAM_CHUNK - 1) / STREAM_CHUNK;
+    if (!frames && !stream->announced)
+      frames = 1;
+    if (stream->upstream_eof && !stream->sent_fin &&
+        d == evbuffer_get_length(bufferevent_get_input(stream->up_buffer)))
+      frames++;
+    len += d + frames * STREAM_HEADER_LEN;
+  }
+  return len;
+}
+
+/**
+   Frames the streams' upstream data, as much as their windows let
+   through, until at least WANT bytes of frames wait to be sent.
+   The streams take turns, a chunk at a time, so a bulk transfer
+   does not hold up the others; a stream's FIN follows its last
+   byte, and one that has ended both ways then closes.
+*/
+int
+chop_circuit_t::frame_streams(size_t want)
+{
+  if (sent_fin)
+    return 0;
+
+  vector<chop_stream_t *> finished;
+  bool progress = true;
+  while (progress && evbuffer_get_length(frames_out) < want) {
+    progress = false;
+    chop_stream_table::iterator i = streams.lower_bound(next_turn);
+    for (size_t n = 0;
+         n < streams.size() && evbuffer_get_length(frames_out) < want;
+         n++, ++i) {
+      if (i == streams.end())
+        i = streams.begin();
+      chop_stream_t *stream = i->second;
+      next_turn = stream->stream_id + 1;
+
+      struct evbuffer *input = bufferevent_get_input(stream->up_buffer);
+      size_t avail = evbuffer_get_length(input);
+      size_t d = min(min(avail, stream->send_window), (size_t)STREAM_CHUNK);
+
+      // The first frame of a stream opens it, data or not.
+      if (d > 0 || !stream->announced) {
+        if (add_stream_frame(frames_out, stream->stream_id, sf_DAT,
+                             input, d)) {
+          log_warn(this, "memory allocation failure");
+          return -1;
+        }
+        stream->send_window -= d;
+        stream->announced = true;
+        progress = true;
+      }
+
+      if (stream->upstream_eof && !stream->sent_fin && d == avail) {
+        if (add_stream_frame(frames_out, stream->stream_id, sf_FIN,
+                             NULL, 0)) {
+          log_warn(this, "memory allocation failure");
+          return -1;
+        }
+        log_debug(stream, "sent FIN on stream %u", stream->stream_id);
+        stream->sent_fin = true;
+        stream->read_eof = true;
+        progress = true;
+        if (stream->write_eof)
+          finished.push_back(stream);
+      }
+    }
+  }
+
+  for (size_t i = 0; i < finished.size(); i++)
+    finished[i]->close();
+  return 0;
+}
+
+/** Passes the whole frames received on to their streams, opening
+    those the client has begun if we are the server. */
+int
+chop_circuit_t::recv_frames()
+{
+  stream_frame f;
+  int got;
+  while ((got = take_stream_frame(frames_in, f)) > 0) {
+    chop_stream_t *stream = NULL;
+    chop_stream_table::iterator i = streams.find(f.stream);
+    if (i != streams.end())
+      stream = i->second;
+    else if (config->mode == LSN_SIMPLE_SERVER && f.stream > last_stream_id &&
+             (f.type == sf_DAT || f.type == sf_FIN))
+      stream = open_stream(f.stream);
+
+    switch (f.type) {
+    case sf_DAT:
+      if (!stream) {
+        // It has closed here, and the other end has a RST coming.
+        evbuffer_drain(frames_in, f.len);
+      } else if (stream->received_fin || f.len > stream->recv_window) {
+        log_info(stream, "protocol error: data %s on stream %u",
+                 stream->received_fin ? "after FIN" : "beyond the window",
+                 f.stream);
+        evbuffer_drain(frames_in, f.len);
+        stream->close();
+      } else if (f.len) {
+        stream->recv_window -= f.len;
+        stream->watch_output();
+        if (evbuffer_remove_buffer(frames_in,
+                                   bufferevent_get_output(stream->up_buffer),
+                                   f.len) != (int)f.len) {
+          log_warn(this, "buffer transfer failure");
+          return -1;
+        }
+      }
+      break;
+
+    case sf_FIN:
+      evbuffer_drain(frames_in, f.len);
+      if (stream && !stream->received_fin) {
+        log_debug(stream, "received FIN on stream %u", f.stream);
+        stream->received_fin = true;
+        circuit_recv_eof(stream);
+        if (stream->read_eof && stream->write_eof)
+          stream->close();
+      }
+      break;
+
+    case sf_WND: {
+      uint8_t c[4];
+      if (f.len != sizeof c ||
+          evbuffer_remove(frames_in, c, sizeof c) != (int)sizeof c) {
+        log_warn(this, "protocol error: bad WND frame");
+        return -1;
+      }
+      if (stream)
+        stream->send_window += (uint32_t(c[0]) << 24) |
+          (uint32_t(c[1]) << 16) | (uint32_t(c[2]) << 8) | c[3];
+      break;
+    }
+
+    case sf_RST:
+      evbuffer_drain(frames_in, f.len);
+      if (stream) {
+        log_debug(stream, "stream %u reset by the other end", f.stream);
+        stream->reset = true;
+        stream->close();
+      }
+      break;
+    }
+  }
+
+  if (got < 0) {
+    log_warn(this, "protocol error: unknown stream frame");
+    return -1;
+  }
+  return 0;
+}
+
+/** No more streams will come: a client circuit carrying streams
+    finishes once it has none, and at once if it has none now.  With no
+    connection left to send its FIN on, it cannot open one, so it just
+    closes. */
+void
+chop_circuit_t::start_shutdown()
+{
+  if (!carries_streams() || config->mode == LSN_SIMPLE_SERVER)
+    return;
+  if (config->stream_circuit == this)
+    config->stream_circuit = NULL;
+  if (!streams.empty() || upstream_eof)
+    return;
+
+  idle_timer.disarm();
+  if (downstreams.empty())
+    close();
+  else
+    circuit_send_eof(this);
+}
+
+void
+chop_circuit_t::idle_timeout(wheel_timer *, void *arg)
+{
+  chop_circuit_t *ckt = (chop_circuit_t *)arg;
+  if (!ckt->streams.empty() || ckt->upstream_eof)
+    return;
+
+  log_debug(ckt, "no streams for %u seconds, closing", STREAM_IDLE_MS / 1000);
+  if (ckt->config->stream_circuit == ckt)
+    ckt->config->stream_circuit = NULL;
+  circuit_send_eof(ckt);
+}
+
+chop_stream_t::chop_stream_t(chop_config_t *cfg)
+  : config(cfg), carrier(NULL), stream_id(0),
+    send_window(STREAM_WINDOW), recv_window(STREAM_WINDOW), credit(0),
+    drained_cb(NULL), announced(false), sent_fin(false),
+    received_fin(false), upstream_eof(false), reset(false)
+{
+}
+
+chop_stream_t::~chop_stream_t()
+{
+}
+
+void
+chop_stream_t::close()
+{
+  if (drained_cb) {
+    evbuffer_remove_cb_entry(bufferevent_get_output(up_buffer), drained_cb);
+    drained_cb = NULL;
+  }
+  if (carrier)
+    carrier->detach_stream(this);
+
+  circuit_t::close();
+}
+
+config_t *
+chop_stream_t::cfg() const
+{
+  return config;
+}
+
+bool
+chop_stream_t::multiplexed() const
+{
+  return true;
+}
+
+void
+chop_stream_t::add_downstream(conn_t *conn)
+{
+  log_assert(carrier);
+  carrier->add_downstream(conn);
+}
+
+void
+chop_stream_t::drop_downstream(conn_t *conn)
+{
+  if (carrier)
+    carrier->drop_downstream(conn);
+}
+
+int
+chop_stream_t::send()
+{
+  // An error is the carrying circuit's, and closes it.
+  if (carrier)
+    circuit_send(carrier);
+  return 0;
+}
+
+int
+chop_stream_t::send_eof()
+{
+  upstream_eof = true;
+  return send();
+}
+
+size_t
+chop_stream_t::sendable() const
+{
+  return min(evbuffer_get_length(bufferevent_get_input(up_buffer)),
+             send_window);
+}
+
+/** From now on, what the upstream takes is counted as credit for
+    the other end. */
+void
+chop_stream_t::watch_output()
+{
+  if (!drained_cb)
+    drained_cb = evbuffer_add_cb(bufferevent_get_output(up_buffer),
+                                 output_drained, this);
+}
+
+void
+chop_stream_t::output_drained(struct evbuffer *,
+                              const struct evbuffer_cb_info *info, void *arg)
+{
+  chop_stream_t *stream = (chop_stream_t *)arg;
+  if (!info->n_deleted || !stream->carrier)
+    return;
+
+  // Half a window at a time keeps the WND frames few, and the other
+  // end is never short of window while we have nothing buffered.
+  stream->credit += info->n_deleted;
+  if (stream->credit >= STREAM_WINDOW / 2)
+    stream->carrier->grant_credit(stream);
+}
+
 // Connection methods
 
 conn_t *
@@ -1847,22 +3042,26 @@ chop_config_t::conn_create(size_t index)
     return 0;
   }
 
-  conn->recv_pending = evbuffer_new();
+  if (mode == LSN_SIMPLE_SERVER && transparent_proxy)
+    conn->received_snapshot = evbuffer_new();
   return conn;
 }
 
 chop_conn_t::chop_conn_t()
-  :upstream(NULL), must_send_timer(NULL), sent_handshake(false)
+  :upstream(NULL), recv_pending(NULL), received_snapshot(NULL),
+   snapshotted_input(0),
+   sent_handshake(false), answered(false), carried_data(false)
 {
 }
 
 chop_conn_t::~chop_conn_t()
 {
-  if (this->must_send_timer)
-    event_free(this->must_send_timer);
   if (steg)
     delete steg;
-  evbuffer_free(recv_pending);
+  if (recv_pending)
+    evbuffer_free(recv_pending);
+  if (received_snapshot)
+    evbuffer_free(received_snapshot);
 }
 
 void
@@ -1882,10 +3081,7 @@ chop_conn_t::close()
 void
 chop_conn_t::emancipate_from_upstream()
 {
-  if (this->must_send_timer) {
-    event_del(this->must_send_timer);
-    must_send_timer = NULL;
-  }
+  must_send_timer.disarm();
 
   if (upstream)
     upstream->drop_downstream(this);
@@ -1915,7 +3111,15 @@ chop_conn_t::send(struct evbuffer *block)
                 upstream ? upstream->circuit_id : 0);
     /*hear we need to cook the handshake */
     uint8_t conn_handshake[HANDSHAKE_LEN];
-    ChopHandshaker handshaker(upstream->circuit_id);
+    ChopHandshaker handshaker(upstream->circuit_id,
+                              HANDSHAKE_CAN_INFLATE |
+                              (config->compress ? HANDSHAKE_WANTS_DEFLATE : 0) |
+                              HANDSHAKE_TAKES_PARITY |
+                              (config->fec ? HANDSHAKE_WANTS_PARITY : 0) |
+                              (upstream->carries_streams() ?
+                               HANDSHAKE_MULTIPLEX : 0) |
+                              (upstream->hanging_target ?
+                               HANDSHAKE_HANGING : 0));
     handshaker.generate(conn_handshake, *(config->handshake_encryptor));
     
     if (evbuffer_prepend(block, (void *)conn_handshake,
@@ -1925,7 +3129,18 @@ chop_conn_t::send(struct evbuffer *block)
     }
   }
 
+  if (!sent_handshake)
+    limit_unsent(UNSENT_LOWAT);
+
+  // Whatever pieces the steg writes the cover in, it goes out as
+  // full segments.
+  cork();
+
   int transmission_size = steg->transmit(block);
+  // A steg that writes the socket itself (http_apache through libcurl)
+  // leaves nothing here for the outbound buffer to drain.
+  if (!evbuffer_get_length(outbound()))
+    uncork();
   if (transmission_size < 0) {
     log_warn(this, "failed to transmit block");
     return -1;
@@ -1933,10 +3148,7 @@ chop_conn_t::send(struct evbuffer *block)
 
   config->total_transmited_cover_bytes += transmission_size;
   sent_handshake = true;
-  if (must_send_timer) {
-    evtimer_del(must_send_timer);
-    must_send_timer = NULL;
-  }
+  must_send_timer.disarm();
   return 0;
 }
 
@@ -1987,9 +3199,9 @@ chop_conn_t::recv_handshake()
     //upstream circuit but not close it
     emancipate_from_upstream();
     
-    if (config->transparent_proxy) {
+    if (received_snapshot) {
       log_debug("stegotorus turning into a transparent proxy.");
-      config->transparent_proxy->transparentize_connection(this, originally_received, received_length);
+      transparentize();
       return 1;
     }
     
@@ -2016,7 +3228,10 @@ chop_conn_t::recv_handshake()
       log_warn(this, "failed to create new circuit");
       return -1;
     }
-    if (circuit_open_upstream(ck)) {
+    // A circuit of streams opens an upstream connection for each.
+    if (handshaker.features & HANDSHAKE_MULTIPLEX) {
+      ck->carry_streams();
+    } else if (circuit_open_upstream(ck)) {
       log_warn(this, "failed to begin upstream connection");
       ck->close();
       return -1;
@@ -2026,39 +3241,123 @@ chop_conn_t::recv_handshake()
     out.first->second = ck;
   }
 
+  // Every connection of a circuit brings the same flags.
+  if (handshaker.features & HANDSHAKE_CAN_INFLATE)
+    ck->peer_inflates = true;
+  if ((handshaker.features & HANDSHAKE_WANTS_DEFLATE) && !ck->peer_deflates) {
+    ck->peer_deflates = true;
+    ck->announce_inflate = true;
+  }
+  // A client learns that we send parity from the empty PAR block, so
+  // announce it before the first group even if the client sends none.
+  if ((handshaker.features & HANDSHAKE_TAKES_PARITY) &&
+      !ck->peer_takes_parity) {
+    ck->peer_takes_parity = true;
+    if (config->fec)
+      ck->announce_parity = true;
+  }
+  if ((handshaker.features & HANDSHAKE_WANTS_PARITY) &&
+      !ck->peer_sends_parity) {
+    ck->peer_sends_parity = true;
+    ck->announce_parity = true;
+  }
+
+  // Hold a hanging request till there is data to answer it with,
+  // rather than answering it with chaff as soon as the steg module
+  // would.
+  if ((handshaker.features & HANDSHAKE_HANGING) && must_send_p())
+    transmit_soon(HANGING_REQUEST_MS);
+
   ck->add_downstream(this);
   return 0;
 }
 
+/**
+   Appends whatever arrived since the last call to the snapshot of
+   the connection's input. Bytes the steg module left in the input
+   buffer last time are already there, so each byte is copied once,
+   and only until the handshake is settled.
+*/
+void
+chop_conn_t::snapshot_input()
+{
+  struct evbuffer *input = bufferevent_get_input(buffer);
+  size_t avail = evbuffer_get_length(input);
+  if (avail <= snapshotted_input)
+    return;
+
+  struct evbuffer_ptr pos;
+  if (evbuffer_ptr_set(input, &pos, snapshotted_input, EVBUFFER_PTR_SET))
+    log_abort(this, "was not able to snapshot received data");
+
+  int nvec = evbuffer_peek(input, avail - snapshotted_input, &pos, NULL, 0);
+  struct evbuffer_iovec *v =
+    (struct evbuffer_iovec *)xzalloc(nvec * sizeof(struct evbuffer_iovec));
+  evbuffer_peek(input, avail - snapshotted_input, &pos, v, nvec);
+
+  size_t left = avail - snapshotted_input;
+  for (int i = 0; i < nvec && left > 0; i++) {
+    size_t len = min(v[i].iov_len, left);
+    if (evbuffer_add(received_snapshot, v[i].iov_base, len))
+      log_abort(this, "was not able to snapshot received data");
+    left -= len;
+  }
+  free(v);
+}
+
+/** The handshake was verified: stop keeping the snapshot. */
+void
+chop_conn_t::drop_snapshot()
+{
+  if (received_snapshot) {
+    evbuffer_free(received_snapshot);
+    received_snapshot = NULL;
+  }
+}
+
+/**
+   Hands the connection, with everything received on it so far, to
+   the transparent proxy. The snapshot already holds whatever is still
+   in the input buffer, so that is discarded rather than sent twice.
+*/
+void
+chop_conn_t::transparentize()
+{
+  log_assert(received_snapshot);
+  struct evbuffer *input = bufferevent_get_input(buffer);
+  evbuffer_drain(input, evbuffer_get_length(input));
+
+  config->transparent_proxy->transparentize_connection(this, received_snapshot);
+  drop_snapshot();
+}
+
 int
 chop_conn_t::recv()
 {
-  //TODO: This is too slow, we need to do it more cleverly.
-  //we keep a copy of value of recv_pending, in case we need to
-  //transparentize the connection
-  if (config->mode == LSN_SIMPLE_SERVER && config->transparent_proxy) {
-    received_length = evbuffer_get_length(bufferevent_get_input(buffer));
-    originally_received = new uint8_t[received_length];
-    log_assert(originally_received);
-    if (evbuffer_copyout(bufferevent_get_input(buffer), originally_received, received_length) != (ssize_t) received_length)
-      log_abort("was not able to make a copy of received data");
-  }
+  if (received_snapshot)
+    snapshot_input();
+
+  // Allocated on first use, since many connections never receive.
+  if (!recv_pending && !(recv_pending = evbuffer_new()))
+    return -1;
 
   if (steg->receive(recv_pending)) {
-    if ((config->mode == LSN_SIMPLE_SERVER ) && config->transparent_proxy) {
+    if (received_snapshot) {
       //If steg fails in recovering the data
       //then maybe it wasn't an steg data to begin with
       //so we have transparent proxy we will become 
       //transparent at this moment
       log_debug("stegotorus turning into a transparent proxy.");
-      config->transparent_proxy->transparentize_connection(this, originally_received, received_length);
-
-      delete[] originally_received;
+      emancipate_from_upstream();
+      transparentize();
       return 0;
     }
     else
       return -1;
   }
+  if (received_snapshot)
+    snapshotted_input = evbuffer_get_length(bufferevent_get_input(buffer));
+
   // If that succeeded but did not copy anything into recv_pending,
   // wait for more data.
   if (evbuffer_get_length(recv_pending) == 0)
@@ -2077,10 +3376,19 @@ chop_conn_t::recv()
       return 0;
     }
 
-    // We're the server. Try to receive a handshake.
+    // We're the server.  A connection still flushing what its circuit
+    // sent before closing can bring blocks the client sent before it
+    // heard of that; we no longer have the keys for them, and they
+    // are no handshake.
+    if (pending_write_eof) {
+      log_debug(this, "discarding blocks after circuit closed");
+      evbuffer_drain(recv_pending, evbuffer_get_length(recv_pending));
+      return 0;
+    }
+
+    // Otherwise, try to receive a handshake.
     int handshake_result = recv_handshake();
-    if (config->transparent_proxy) 
-      delete [] originally_received; //done with this
+    drop_snapshot(); //settled either way, done with this
 
     switch(handshake_result) 
       {
@@ -2150,7 +3458,7 @@ chop_conn_t::recv()
                 log_get_timestamp(), upstream->serial,
                 upstream->recv_queue.window(),
                 (unsigned long)evbuffer_get_length(
-                                  bufferevent_get_input(upstream->up_buffer)),
+                                  upstream->upstream_input()),
                 c[0], c[1], c[2], c[3], c[4], c[5], c[6], c[7],
                 opname(c[8], fallbackbuf),
                 c[9], c[10], c[11], c[12], c[13], c[14], c[15]);
@@ -2187,7 +3495,7 @@ chop_conn_t::recv()
       fprintf(stderr, "T:%.4f: ckt %u <ntp %u outq %lu>: recv %lu <d=%lu p=%lu f=%s r=%u>\n",
               log_get_timestamp(), upstream->serial,
               upstream->recv_queue.window(),
-              (unsigned long)evbuffer_get_length(bufferevent_get_input(upstream->up_buffer)),
+              (unsigned long)evbuffer_get_length(upstream->upstream_input()),
               (unsigned long)hdr.seqno(),
               (unsigned long)hdr.dlen(),
               (unsigned long)hdr.plen(),
@@ -2212,6 +3520,11 @@ chop_conn_t::recv()
       return -1;
     }
 
+    answered = true;
+    if (hdr.dlen() && (hdr.opcode() == op_DAT || hdr.opcode() == op_FIN ||
+                       hdr.opcode() == op_ZDAT || hdr.opcode() == op_ZFIN))
+      carried_data = true;
+
     if (upstream->recv_block(hdr.seqno(), hdr.opcode(), data, this->steg->cfg())) {
       log_warn(this, "failed to insert the data in recv queue");
       return -1; // insert() logs an error
@@ -2258,10 +3571,7 @@ void
 chop_conn_t::cease_transmission()
 {
   no_more_transmissions = true;
-  if (must_send_timer) {
-    evtimer_del(must_send_timer);
-    must_send_timer = NULL;
-  }
+  must_send_timer.disarm();
   
   conn_do_flush(this);
 }
@@ -2269,25 +3579,17 @@ chop_conn_t::cease_transmission()
 void
 chop_conn_t::transmit_soon(unsigned long milliseconds)
 {
-  struct timeval tv;
-
   log_debug(this, "must send within %lu milliseconds", milliseconds);
 
-  tv.tv_sec = milliseconds / 1000;
-  tv.tv_usec = (milliseconds % 1000) * 1000;
-
-  if (!must_send_timer)
-    must_send_timer = evtimer_new(config->base, must_send_timeout, this);
-  evtimer_add(must_send_timer, &tv);
+  if (!must_send_timer.initialized())
+    must_send_timer.set(must_send_timeout, this);
+  must_send_timer.arm(config->base, milliseconds);
 }
 
 void
 chop_conn_t::send()
 {
-  if (must_send_timer) {
-    evtimer_del(must_send_timer);
-    must_send_timer = NULL;
-  }
+  must_send_timer.disarm();
 
   if (!steg) {
     log_warn(this, "send() called with no steg module available");
@@ -2358,11 +3660,11 @@ chop_conn_t::send()
 bool
 chop_conn_t::must_send_p() const
 {
-  return must_send_timer && evtimer_pending(must_send_timer, 0);
+  return must_send_timer.pending();
 }
 
 /* static */ void
-chop_conn_t::must_send_timeout(evutil_socket_t, short, void *arg)
+chop_conn_t::must_send_timeout(wheel_timer *, void *arg)
 {
   static_cast<chop_conn_t *>(arg)->send();
 }
@@ -41,6 +41,9 @@ opname(unsigned int o, char fallbackbuf[c_genric_opname_buffer_size])
   case op_FIN: return "FIN";
   case op_RST: return "RST";
   case op_ACK: return "ACK";
+  case op_ZDAT: return "ZDAT";
+  case op_ZFIN: return "ZFIN";
+  case op_PAR: return "PAR";
   case op_STEG0: return "STEG DAT";
   case op_STEG_FIN: return "STEG FIN";
   default:
@@ -240,7 +243,8 @@ ack_payload::serialize() const
 }
 
 transmit_queue::transmit_queue(bool intend_to_retransmit = true)
-  : next_to_ack(0), next_to_send(0), overwrite_allowed(not intend_to_retransmit)
+  : next_to_ack(0), next_to_send(0), gaps(0), delivered(0),
+    overwrite_allowed(not intend_to_retransmit)
 {
 }
 
@@ -268,6 +272,7 @@ transmit_queue::enqueue(opcode_t f, evbuffer *data, uint16_t padding)
 
   elt.hdr = header(seqno, evbuffer_get_length(data), padding, f);
   elt.data = data;
+  elt.gap = false;
 
   next_to_send++;
   return seqno;
@@ -343,6 +348,15 @@ transmit_queue::retransmit(transmit_elt &elt,
 int
 transmit_queue::process_ack(evbuffer *data)
 {
+  // ACKs travel on whichever connection is free, so an older one can
+  // arrive after a newer one; it has nothing left to tell us.
+  uint8_t hsnwire[4];
+  if (evbuffer_copyout(data, hsnwire, 4) == 4 && next_to_ack >= 1 &&
+      (uint32_t(hsnwire[0]) << 24 | uint32_t(hsnwire[1]) << 16 |
+       uint32_t(hsnwire[2]) <<  8 | uint32_t(hsnwire[3])) < next_to_ack-1) {
+    evbuffer_free(data);
+    return 0;
+  }
 
   ack_payload ack(data, next_to_ack);
 
@@ -358,20 +372,36 @@ transmit_queue::process_ack(evbuffer *data)
     if (cbuf[j].data) {
       evbuffer_free(cbuf[j].data);
       cbuf[j].data = 0;
+      delivered++;
     }
   }
 
-  if (next_to_ack == next_to_send)
-    return 0;
-
-  for (uint32_t i = next_to_ack; i < next_to_send; i++) {
-    uint8_t j = i & 0xFF;
-    if (cbuf[j].data && ack.block_received(i)) {
-      evbuffer_free(cbuf[j].data);
-      cbuf[j].data = 0;
+  if (next_to_ack != next_to_send) {
+    // Anything still outstanding below the last block received is a
+    // gap; count each one once.
+    uint32_t last = next_to_ack;
+    for (uint32_t i = next_to_ack; i < next_to_send; i++) {
+      uint8_t j = i & 0xFF;
+      if (cbuf[j].data && ack.block_received(i)) {
+        evbuffer_free(cbuf[j].data);
+        cbuf[j].data = 0;
+        delivered++;
+        last = i;
+      }
+    }
+    for (uint32_t i = next_to_ack; i < last; i++) {
+      uint8_t j = i & 0xFF;
+      if (cbuf[j].data && !cbuf[j].gap) {
+        cbuf[j].gap = true;
+        gaps++;
+      }
     }
   }
 
+  if (gaps + delivered > 4096) {
+    gaps /= 2;
+    delivered /= 2;
+  }
   return 0;
 }
 
@@ -463,6 +493,302 @@ reassembly_queue::gen_ack() //const
   return payload.serialize();
 }
 
+void
+parity_encoder::begin_member(uint32_t first, uint8_t count)
+{
+  log_assert(!closed && members.size() < PARITY_MAX_GROUP);
+  members.push_back(std::make_pair(first, count));
+  pos = 0;
+}
+
+void
+parity_encoder::add_block(opcode_t op, evbuffer *data)
+{
+  size_t d = op == op_PAR ? 0 : evbuffer_get_length(data);
+  log_assert(pos + serialized_len(op, d) <= PARITY_MAX_MEMBER);
+  if (body.size() < pos + serialized_len(op, d))
+    body.resize(pos + serialized_len(op, d), 0);
+
+  body[pos++] ^= uint8_t(op);
+  body[pos++] ^= (d >> 8) & 0xFF;
+  body[pos++] ^= (d     ) & 0xFF;
+  if (d == 0)
+    return;
+
+  uint8_t *p = evbuffer_pullup(data, d);
+  log_assert(p);
+  for (size_t i = 0; i < d; i++)
+    body[pos++] ^= p[i];
+}
+
+evbuffer *
+parity_encoder::take()
+{
+  log_assert(closed);
+  evbuffer *wire = evbuffer_new();
+  if (!wire)
+    return 0;
+
+  size_t len = parity_len();
+  evbuffer_iovec v;
+  if (evbuffer_reserve_space(wire, len, &v, 1) != 1 || v.iov_len < len) {
+    evbuffer_free(wire);
+    return 0;
+  }
+
+  uint8_t *p = (uint8_t *)v.iov_base;
+  *p++ = members.size();
+  for (size_t i = 0; i < members.size(); i++) {
+    uint32_t s = members[i].first;
+    *p++ = (s >> 24) & 0xFF;
+    *p++ = (s >> 16) & 0xFF;
+    *p++ = (s >>  8) & 0xFF;
+    *p++ = (s      ) & 0xFF;
+    *p++ = members[i].second;
+  }
+  if (!body.empty())
+    memcpy(p, &body[0], body.size());
+
+  v.iov_len = len;
+  if (evbuffer_commit_space(wire, &v, 1)) {
+    evbuffer_free(wire);
+    return 0;
+  }
+
+  body.clear();
+  members.clear();
+  pos = 0;
+  closed = false;
+  return wire;
+}
+
+parity_decoder::parity_decoder()
+{
+  memset(kept, 0, sizeof kept);
+}
+
+parity_decoder::~parity_decoder()
+{
+  for (int i = 0; i < 256; i++)
+    if (kept[i].data)
+      evbuffer_free(kept[i].data);
+}
+
+void
+parity_decoder::keep(uint32_t seqno, opcode_t op, evbuffer *data)
+{
+  kept_block &k = kept[seqno & 0xFF];
+  if (k.data) {
+    evbuffer_free(k.data);
+    k.data = 0;
+  }
+
+  // No group can hold a transmission with a longer block.
+  size_t d = op == op_PAR ? 0 : evbuffer_get_length(data);
+  if (d > PARITY_MAX_MEMBER)
+    return;
+
+  k.data = evbuffer_new();
+  if (k.data && d && evbuffer_add(k.data, evbuffer_pullup(data, d), d)) {
+    evbuffer_free(k.data);
+    k.data = 0;
+  }
+  k.seqno = seqno;
+  k.op = op;
+}
+
+int
+parity_decoder::rebuild(evbuffer *parity, const reassembly_queue &queue,
+                        std::vector<rebuilt_block> &out)
+{
+  size_t len = evbuffer_get_length(parity);
+  if (len == 0)
+    return 0;
+
+  const uint8_t *p = evbuffer_pullup(parity, len);
+  if (!p || p[0] == 0 || p[0] > PARITY_MAX_GROUP || len < 1 + 5 * size_t(p[0]))
+    return -1;
+
+  size_t n = p[0];
+  uint32_t first[PARITY_MAX_GROUP];
+  uint8_t count[PARITY_MAX_GROUP];
+  for (size_t i = 0; i < n; i++) {
+    const uint8_t *m = p + 1 + 5 * i;
+    first[i] = ((uint32_t(m[0]) << 24) |
+                (uint32_t(m[1]) << 16) |
+                (uint32_t(m[2]) <<  8) |
+                (uint32_t(m[3])      ));
+    count[i] = m[4];
+    if (count[i] == 0)
+      return -1;
+  }
+
+  const uint8_t *body = p + 1 + 5 * n;
+  size_t blen = len - (1 + 5 * n);
+  int rv = rebuild_group(n, first, count, body, blen, queue, out);
+
+  // The copies of the group have served their purpose either way.
+  for (size_t i = 0; i < n; i++)
+    for (uint32_t j = 0; j < count[i]; j++) {
+      kept_block &k = kept[(first[i] + j) & 0xFF];
+      if (k.data && k.seqno == first[i] + j) {
+        evbuffer_free(k.data);
+        k.data = 0;
+      }
+    }
+  return rv;
+}
+
+int
+parity_decoder::rebuild_group(size_t n, const uint32_t *first,
+                              const uint8_t *count,
+                              const uint8_t *parity_body, size_t blen,
+                              const reassembly_queue &queue,
+                              std::vector<rebuilt_block> &out)
+{
+  size_t missing = n;
+  for (size_t i = 0; i < n; i++)
+    for (uint32_t j = 0; j < count[i]; j++)
+      if (!queue.received(first[i] + j)) {
+        if (missing != n) {
+          log_debug("more than one transmission of the group is missing");
+          return 0;
+        }
+        missing = i;
+        break;
+      }
+  if (missing == n)
+    return 0;
+
+  std::vector<uint8_t> body(parity_body, parity_body + blen);
+  for (size_t i = 0; i < n; i++) {
+    if (i == missing)
+      continue;
+    size_t pos = 0;
+    for (uint32_t j = 0; j < count[i]; j++) {
+      const kept_block &k = kept[(first[i] + j) & 0xFF];
+      if (!k.data || k.seqno != first[i] + j) {
+        log_debug("block %u is no longer at hand", first[i] + j);
+        return 0;
+      }
+      size_t d = evbuffer_get_length(k.data);
+      if (pos + 3 + d > blen)
+        return -1;
+      body[pos++] ^= uint8_t(k.op);
+      body[pos++] ^= (d >> 8) & 0xFF;
+      body[pos++] ^= (d     ) & 0xFF;
+      if (d) {
+        const uint8_t *q = evbuffer_pullup(k.data, d);
+        for (size_t x = 0; x < d; x++)
+          body[pos++] ^= q[x];
+      }
+    }
+  }
+
+  // What is left is the serialization of the missing transmission.
+  std::vector<rebuilt_block> got;
+  size_t pos = 0;
+  bool ok = true;
+  for (uint32_t j = 0; j < count[missing]; j++) {
+    if (pos + 3 > blen) {
+      ok = false;
+      break;
+    }
+    unsigned int op = body[pos];
+    size_t d = (size_t(body[pos+1]) << 8) | body[pos+2];
+    pos += 3;
+    if (!opcode_valid(op) || pos + d > blen || (op == op_PAR && d)) {
+      ok = false;
+      break;
+    }
+
+    rebuilt_block b = { first[missing] + j, opcode_t(op), evbuffer_new() };
+    if (!b.data || (d && evbuffer_add(b.data, &body[pos], d))) {
+      if (b.data)
+        evbuffer_free(b.data);
+      ok = false;
+      break;
+    }
+    pos += d;
+    got.push_back(b);
+  }
+
+  int rv = 0;
+  for (size_t i = 0; i < got.size(); i++) {
+    // blocks of the transmission that did arrive are left alone
+    if (!ok || queue.received(got[i].seqno)) {
+      evbuffer_free(got[i].data);
+    } else {
+      out.push_back(got[i]);
+      rv++;
+    }
+  }
+  return ok ? rv : -1;
+}
+
+int
+add_stream_frame(evbuffer *out, uint32_t stream, stream_frame_t type,
+                 evbuffer *payload, size_t len)
+{
+  log_assert(len <= STREAM_MAX_PAYLOAD);
+  log_assert(!len || (payload && evbuffer_get_length(payload) >= len));
+
+  uint8_t hdr[STREAM_HEADER_LEN];
+  hdr[0] = (stream >> 24) & 0xFF;
+  hdr[1] = (stream >> 16) & 0xFF;
+  hdr[2] = (stream >>  8) & 0xFF;
+  hdr[3] = (stream      ) & 0xFF;
+  hdr[4] = uint8_t(type);
+  hdr[5] = (len >> 8) & 0xFF;
+  hdr[6] = (len     ) & 0xFF;
+
+  if (evbuffer_add(out, hdr, STREAM_HEADER_LEN))
+    return -1;
+  if (len && evbuffer_remove_buffer(payload, out, len) != (int)len)
+    return -1;
+  return 0;
+}
+
+int
+add_stream_credit(evbuffer *out, uint32_t stream, uint32_t credit)
+{
+  uint8_t c[4];
+  c[0] = (credit >> 24) & 0xFF;
+  c[1] = (credit >> 16) & 0xFF;
+  c[2] = (credit >>  8) & 0xFF;
+  c[3] = (credit      ) & 0xFF;
+
+  evbuffer *payload = evbuffer_new();
+  if (!payload)
+    return -1;
+  int rv = (evbuffer_add(payload, c, sizeof c) ||
+            add_stream_frame(out, stream, sf_WND, payload, sizeof c)) ? -1 : 0;
+  evbuffer_free(payload);
+  return rv;
+}
+
+int
+take_stream_frame(evbuffer *in, stream_frame &frame)
+{
+  uint8_t hdr[STREAM_HEADER_LEN];
+  if (evbuffer_copyout(in, hdr, STREAM_HEADER_LEN) <
+      (ev_ssize_t)STREAM_HEADER_LEN)
+    return 0;
+
+  if (hdr[4] > sf_LAST)
+    return -1;
+
+  frame.stream = (uint32_t(hdr[0]) << 24) | (uint32_t(hdr[1]) << 16) |
+                 (uint32_t(hdr[2]) <<  8) |  uint32_t(hdr[3]);
+  frame.type = stream_frame_t(hdr[4]);
+  frame.len = (uint16_t(hdr[5]) << 8) | hdr[6];
+
+  if (evbuffer_get_length(in) < STREAM_HEADER_LEN + frame.len)
+    return 0;
+  evbuffer_drain(in, STREAM_HEADER_LEN);
+  return 1;
+}
+
 } // namespace chop_blk
 
 // Local Variables:
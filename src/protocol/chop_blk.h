@@ -7,6 +7,7 @@
 
 #include <tr1/unordered_set>
 #include <ostream>
+#include <vector>
 
 struct steg_config_t;
 
@@ -69,7 +70,10 @@ enum opcode_t
   op_FIN = 2,       // No further transmissions (pass data along if any)
   op_RST = 3,       // Protocol error, close circuit now
   op_ACK = 4,       // Acknowledge data received
-  op_RESERVED0 = 5, // 4 -- 127 reserved for future definition
+  op_ZDAT = 5,      // DAT, compressed (see stream_deflater)
+  op_ZFIN = 6,      // FIN, compressed
+  op_PAR = 7,       // Parity of earlier transmissions (see parity_encoder)
+  op_RESERVED0 = 8, // 8 -- 127 reserved for future definition
   op_STEG0 = 128,   // 128 -- 255 reserved for steganography modules
   op_STEG_FIN = 129,
   op_LAST = 255
@@ -281,8 +285,9 @@ public:
  {
    header hdr;
    evbuffer *data;
+   bool gap; // an ACK has reported it missing while a later block arrived
 
-   transmit_elt() : hdr(), data(0) {}
+   transmit_elt() : hdr(), data(0), gap(false) {}
  };
 
  class transmit_queue
@@ -291,6 +296,11 @@ public:
    uint32_t next_to_ack;
    uint32_t next_to_send;
 
+   // Blocks ACKs have shown as gaps, and blocks acknowledged, with
+   // both halved now and then so that they follow recent conditions.
+   uint32_t gaps;
+   uint32_t delivered;
+
    bool overwrite_allowed;
 
    transmit_queue(const transmit_queue&) DELETE_METHOD;
@@ -315,6 +325,12 @@ public:
    bool full() const
    { return (not overwrite_allowed) and (next_to_send - next_to_ack > 255); }
 
+   /**
+    * The number of blocks that can be pushed before full() is true.
+    */
+   uint32_t free_slots() const
+   { return overwrite_allowed ? 256 : 256 - (next_to_send - next_to_ack); }
+
    /**
     * True if we ought to rekey soon, i.e. the sequence number is in
     * danger of wrapping around.
@@ -366,6 +382,15 @@ public:
     */
    int process_ack(evbuffer *data);
 
+   /**
+    * The fraction of recent blocks that an ACK has shown missing
+    * while a later one had arrived: lost, or held up on a stalled
+    * connection.  Blocks the far side rebuilt from parity before it
+    * acknowledged anything do not count.
+    */
+   double gap_rate() const
+   { return gaps ? gaps / double(gaps + delivered) : 0; }
+
    /**
     * Iteration over the transmit queue produces each block which has
     * been enqueued but not yet discarded by process_ack.  Used for
@@ -479,6 +504,19 @@ public:
    */
   bool empty() const { return count == 0; }
 
+  /**
+   * True if the block with sequence number SEQNO has arrived, whether
+   * or not it has been processed yet.
+   */
+  bool received(uint32_t seqno) const
+  {
+    if (seqno < next_to_process)
+      return true;
+    if (seqno - next_to_process > 255)
+      return false;
+    return cbuf[seqno & 0xFF].data != 0;
+  }
+
   /**
    * Reset the expected next sequence number to zero.  The queue must
    * be empty.  This is done as the last step of a rekeying cycle.
@@ -492,6 +530,191 @@ public:
   evbuffer *gen_ack(); // const;
 };
 
+/* Forward error correction.  Each transmission (the blocks packed
+   into one cover) can join a parity group; once the group is closed,
+   a PAR block carrying the XOR of its transmissions rides along with
+   a later transmission.  If one transmission of the group never
+   arrives, or is held up on a stalled connection, the receiver
+   rebuilds its blocks from the parity and the others, without waiting
+   for an ACK and a retransmission.
+
+   A transmission is serialized, for this purpose, as each of its
+   blocks in turn: the opcode (1 byte), the data length (2 bytes), and
+   the data.  PAR blocks count as having no data, so that parity never
+   covers parity.  The data section of a PAR block is
+
+   | N | first seqno (4) | count (1) | ... N times | XOR |
+
+   listing the sequence number of the first block and the number of
+   blocks of each of the N transmissions, followed by the XOR of their
+   serializations, each zero-filled to the length of the longest.  A
+   PAR block with no data at all has no members; it only tells the
+   receiver that the sender understands parity.  */
+
+const size_t PARITY_MAX_GROUP = 16;
+const size_t PARITY_HEADER_LEN = 1 + 5 * PARITY_MAX_GROUP;
+// The longest serialization that fits in a PAR block's data section.
+const size_t PARITY_MAX_MEMBER = SECTION_LEN - PARITY_HEADER_LEN;
+
+class parity_encoder
+{
+  std::vector<uint8_t> body;
+  std::vector<std::pair<uint32_t, uint8_t> > members;
+  size_t pos;  // where the next block of the current member goes
+  bool closed;
+
+  parity_encoder(const parity_encoder&) DELETE_METHOD;
+  parity_encoder& operator=(const parity_encoder&) DELETE_METHOD;
+
+public:
+  parity_encoder() : pos(0), closed(false) {}
+
+  /** Length of the serialization of a block with opcode OP and
+      D bytes of data. */
+  static size_t serialized_len(opcode_t op, size_t d)
+  { return 3 + (op == op_PAR ? 0 : d); }
+
+  /** Number of transmissions in the group. */
+  size_t size() const { return members.size(); }
+
+  /** True once the group is closed and its parity waits to be sent;
+      until it is, no transmission can join another group. */
+  bool due() const { return closed; }
+
+  /** Length of the data section of the PAR block for the group. */
+  size_t parity_len() const
+  { return 1 + 5 * members.size() + body.size(); }
+
+  /**
+   * Start adding a transmission of COUNT blocks, the first of which
+   * has sequence number FIRST, to the group.  Each of the blocks must
+   * then be passed to add_block() in order.  The group must not be
+   * full or closed.
+   */
+  void begin_member(uint32_t first, uint8_t count);
+  void add_block(opcode_t op, evbuffer *data);
+
+  /** Close the group, if it has any members. */
+  void close() { closed = !members.empty(); }
+
+  /**
+   * Return the data section of the PAR block for the closed group,
+   * and start a new, empty group.
+   */
+  evbuffer *take();
+};
+
+struct rebuilt_block
+{
+  uint32_t seqno;
+  opcode_t op;
+  evbuffer *data;
+};
+
+class parity_decoder
+{
+  // Copies of recently received blocks, for want of which the
+  // receiver could not undo the XOR of the others in a group.
+  struct kept_block
+  {
+    uint32_t seqno;
+    opcode_t op;
+    evbuffer *data;
+  };
+  kept_block kept[256];
+
+  int rebuild_group(size_t n, const uint32_t *first, const uint8_t *count,
+                    const uint8_t *body, size_t blen,
+                    const reassembly_queue &queue,
+                    std::vector<rebuilt_block> &out);
+
+  parity_decoder(const parity_decoder&) DELETE_METHOD;
+  parity_decoder& operator=(const parity_decoder&) DELETE_METHOD;
+
+public:
+  parity_decoder();
+  ~parity_decoder();
+
+  /**
+   * Keep a copy of the block SEQNO, with opcode OP and data section
+   * DATA, as received.  DATA is not consumed.
+   */
+  void keep(uint32_t seqno, opcode_t op, evbuffer *data);
+
+  /**
+   * Rebuild what can be rebuilt of the transmission that is missing
+   * from the group of the PAR block data section PARITY, given what
+   * has arrived on QUEUE.  The blocks are appended to OUT, which takes
+   * ownership of their data.  Returns the number of blocks rebuilt,
+   * which is 0 unless exactly one transmission of the group is
+   * missing, or -1 if PARITY is malformed.  PARITY is not consumed.
+   * The copies of the group's blocks are dropped either way.
+   */
+  int rebuild(evbuffer *parity, const reassembly_queue &queue,
+              std::vector<rebuilt_block> &out);
+};
+
+/* A multiplexed circuit carries many upstream connections, or
+   "streams", over the same blocks.  Its upstream data, in either
+   direction, is then a sequence of stream frames rather than the
+   bytes of one connection:
+
+   | 0 | 1 | 2 | 3 | 4 | 5 | 6 | ...
+   |   Stream ID   | T |   L   | payload (L bytes)
+
+   all numbers in network byte order.  Frames are cut from this
+   sequence wherever the blocks happen to end, and may be compressed
+   with it, so a frame can straddle blocks.  The client numbers its
+   streams from 1 up, and a frame for an ID above any it has seen
+   opens a stream at the server.  The types are:
+
+   DAT  the payload is data for the stream
+   FIN  the sender has no more data for the stream; the other
+        direction stays open
+   WND  the payload is a 4-byte count of bytes the sender has passed
+        on to its upstream, which the other end may now send on top
+        of its window
+   RST  the stream is gone: close it without waiting for data  */
+
+enum stream_frame_t
+{
+  sf_DAT = 0,
+  sf_FIN = 1,
+  sf_WND = 2,
+  sf_RST = 3,
+  sf_LAST = sf_RST
+};
+
+const size_t STREAM_HEADER_LEN = 7;
+const size_t STREAM_MAX_PAYLOAD = UINT16_MAX;
+
+struct stream_frame
+{
+  uint32_t stream;
+  stream_frame_t type;
+  uint16_t len;
+};
+
+/**
+ * Append a frame of type TYPE for STREAM to OUT, moving LEN bytes of
+ * its payload from the front of PAYLOAD, which may be NULL if LEN is
+ * 0.  LEN must not exceed STREAM_MAX_PAYLOAD.  Returns 0 on success,
+ * -1 on failure.
+ */
+int add_stream_frame(evbuffer *out, uint32_t stream, stream_frame_t type,
+                     evbuffer *payload, size_t len);
+
+/** Append a WND frame granting CREDIT more bytes for STREAM. */
+int add_stream_credit(evbuffer *out, uint32_t stream, uint32_t credit);
+
+/**
+ * If a whole frame is at the front of IN, parse its header into
+ * FRAME, drain the header, and return 1; the payload is then the
+ * next FRAME.len bytes of IN.  Returns 0 if the frame is not all
+ * there yet, -1 if its type is unknown.
+ */
+int take_stream_frame(evbuffer *in, stream_frame &frame);
+
 } // namespace chop_blk
 
 #endif /* chop_blk.h */
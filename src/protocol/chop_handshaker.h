@@ -24,6 +24,11 @@
    | 0 | 1 | 2 | 3 | 4 | 5 | 6 | 7 | 8 | 9 | A | B | C | D | E | F |
    | Enc_ecb(Circuit ID + Padding) | SHA-256(Circuit ID + Padding) |
 
+   The padding starts with HANDSHAKE_FEATURE_TAG and a word of
+   feature flags, so a client can tell the server what it can do.
+   An older client's padding is all random and lacks the tag (but
+   for one chance in 2^32), and an older server ignores the padding.
+
    It is not the most secure header more secure header out-there
    TODO: Make a secure header with Elligator algorithm
 
@@ -35,13 +40,25 @@ const size_t CIRCUIT_ID_LEN = sizeof(uint32_t);
 const size_t PADDING_LEN = 12;
 const size_t HANDSHAKE_DIGEST_LENGTH = HANDSHAKE_LEN - CIRCUIT_ID_LEN - PADDING_LEN;
 
+const uint32_t HANDSHAKE_FEATURE_TAG = 0x5a6f7043;
+
+/* Feature flags */
+const uint32_t HANDSHAKE_CAN_INFLATE = 1;  // takes compressed data blocks
+const uint32_t HANDSHAKE_WANTS_DEFLATE = 2; // would send them, if the server takes them
+const uint32_t HANDSHAKE_TAKES_PARITY = 4; // rebuilds lost blocks from PAR blocks
+const uint32_t HANDSHAKE_WANTS_PARITY = 8; // would send them, if the server takes them
+const uint32_t HANDSHAKE_MULTIPLEX = 16; // the circuit carries streams (see chop_blk.h)
+const uint32_t HANDSHAKE_HANGING = 32; // hold the request till there is data for it
+
 class ChopHandshaker
 {
 
 public:
   uint32_t circuit_id;
+  uint32_t features;
    
-  ChopHandshaker(uint32_t conn_circuit_id = 0) : circuit_id(conn_circuit_id) {};
+  ChopHandshaker(uint32_t conn_circuit_id = 0, uint32_t conn_features = 0)
+    : circuit_id(conn_circuit_id), features(conn_features) {};
 
   /** 
      Generates the handshake for a connection whose circuit_id is already
@@ -57,6 +74,8 @@ public:
     log_debug("circ id to send %u", circuit_id);
     id_cat_padding[0] = circuit_id;
     rng_bytes((uint8_t*)(id_cat_padding + 1),  PADDING_LEN);
+    id_cat_padding[1] = HANDSHAKE_FEATURE_TAG;
+    id_cat_padding[2] = features;
     ec.encrypt(handshake, (const uint8_t*)id_cat_padding);
     sha256((uint8_t*)(id_cat_padding), CIRCUIT_ID_LEN + PADDING_LEN, digest_buffer);
     memcpy((uint8_t*)(handshake + CIRCUIT_ID_LEN + PADDING_LEN), digest_buffer, HANDSHAKE_DIGEST_LENGTH);
@@ -66,7 +85,8 @@ public:
 
   /**
      Verifies the handshake and extract the circuit id and store
-     it in the class member circuit_id
+     it in the class member circuit_id, and the feature flags in
+     features
 
      @return false in case verification fails 
   */
@@ -81,6 +101,7 @@ public:
       return false; //not a valid handshake
 
     circuit_id = id_cat_padding[0];
+    features = id_cat_padding[1] == HANDSHAKE_FEATURE_TAG ? id_cat_padding[2] : 0;
     log_debug("retrieved circ id %u", circuit_id);
     return true;
     
@@ -11,6 +11,8 @@
 #include "util.h"
 #include "connections.h"
 #include "protocol.h"
+#include "splice_relay.h"
+#include "uring_transport.h"
 
 
 namespace {
@@ -46,8 +48,13 @@ namespace {
   {
     null_config_t *config;
     null_conn_t *downstream;
+    SpliceRelay *relay;
 
     CIRCUIT_DECLARE_METHODS(null);
+
+    bool maybe_splice();
+    void stop_splicing();
+    static void splice_done_cb(SpliceRelay *relay, int error, void *arg);
   };
 }
 
@@ -210,17 +217,19 @@ null_config_t::circuit_create(size_t)
 }
 
 null_circuit_t::null_circuit_t()
-  : downstream(NULL)
+  : downstream(NULL), relay(NULL)
 {
 }
 
 null_circuit_t::~null_circuit_t()
 {
+  stop_splicing();
 }
 
 void
 null_circuit_t::close()
 {
+  stop_splicing();
   if (downstream) {
     /* break the circular reference before deallocating the
        downstream connection */
@@ -267,15 +276,99 @@ null_circuit_t::drop_downstream(conn_t *cn)
 
   log_debug(this, "dropped connection <%d.%d> to %s",
             this->serial, conn->serial, conn->peername);
+  if (this->relay) {
+    // The relay was still using the socket; nothing more will come
+    // from upstream either.
+    stop_splicing();
+    this->read_eof = true;
+  }
   this->downstream = NULL;
   conn->upstream = NULL;
   circuit_do_flush(this);
 }
 
+/**
+   Once both sides are connected there is nothing left for us to do
+   but copy bytes, so hand both sockets to a splice relay, along with
+   whatever is already buffered. Returns true if the relay took over.
+*/
+bool
+null_circuit_t::maybe_splice()
+{
+  null_conn_t *down = this->downstream;
+  if (this->relay || !SpliceRelay::available())
+    return false;
+  if (!down || !down->buffer || !down->connected ||
+      !this->up_buffer || !this->connected || this->socks_state)
+    return false;
+  // the ring has reads and sends of its own in flight on these
+  if (UringTransport::on_ring(down->buffer) ||
+      UringTransport::on_ring(this->up_buffer))
+    return false;
+  if (this->read_eof || this->write_eof || this->pending_read_eof ||
+      this->pending_write_eof || down->read_eof || down->write_eof ||
+      down->pending_write_eof)
+    return false;
+
+  bufferevent_disable(down->buffer, EV_READ|EV_WRITE);
+  bufferevent_disable(this->up_buffer, EV_READ|EV_WRITE);
+
+  struct evbuffer *to_up = bufferevent_get_output(this->up_buffer);
+  evbuffer_add_buffer(to_up, down->inbound());
+  evbuffer_add_buffer(down->outbound(), bufferevent_get_input(this->up_buffer));
+
+  this->relay = SpliceRelay::create(this->config->base,
+                                    down->socket(),
+                                    bufferevent_getfd(this->up_buffer),
+                                    down->outbound(), to_up,
+                                    splice_done_cb, this);
+  if (!this->relay) {
+    bufferevent_enable(down->buffer, EV_READ|EV_WRITE);
+    bufferevent_enable(this->up_buffer, EV_READ|EV_WRITE);
+    return false;
+  }
+
+  log_debug(this, "splicing to %s", down->peername);
+  return true;
+}
+
+void
+null_circuit_t::stop_splicing()
+{
+  if (this->relay) {
+    delete this->relay;
+    this->relay = NULL;
+  }
+}
+
+/** Both directions have finished (or failed): close everything. The
+    relay already passed the EOFs on. */
+void
+null_circuit_t::splice_done_cb(SpliceRelay *, int error, void *arg)
+{
+  null_circuit_t *ckt = (null_circuit_t *)arg;
+
+  if (error)
+    log_info(ckt, "relay error: %s", strerror(error));
+  else
+    log_debug(ckt, "relay finished after %lu/%lu bytes",
+              (unsigned long)ckt->relay->relayed(true),
+              (unsigned long)ckt->relay->relayed(false));
+
+  ckt->stop_splicing();
+  ckt->read_eof = ckt->write_eof = true;
+  if (ckt->downstream)
+    ckt->downstream->read_eof = ckt->downstream->write_eof = true;
+  ckt->close();
+}
+
 /* Send data from the upstream buffer. */
 int
 null_circuit_t::send()
 {
+  if (maybe_splice())
+    return 0;
+
   log_debug(this, "sending %lu bytes",
             (unsigned long)
             evbuffer_get_length(bufferevent_get_input(this->up_buffer)));
@@ -358,6 +451,9 @@ int
 null_conn_t::recv()
 {
   log_assert(this->upstream);
+  if (this->upstream->maybe_splice())
+    return 0;
+
   log_debug(this, "receiving %lu bytes",
             (unsigned long)evbuffer_get_length(this->inbound()));
   return evbuffer_add_buffer(bufferevent_get_output(this->upstream->up_buffer),
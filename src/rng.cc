@@ -9,10 +9,130 @@
 #include <cmath>
 #include <algorithm>
 
+#include <pthread.h>
 #include <openssl/rand.h>
 
 /* OpenSSL's rng is global, automatically seeds itself, and does not
-   appear to need to be torn down explicitly. */
+   appear to need to be torn down explicitly.  However it takes a lock
+   and goes through several layers for every call, which is a lot for
+   the handful of bytes that most of our draws need.  So each thread
+   runs its own ChaCha20 keystream, keyed from RAND_bytes, and serves
+   draws from a buffer of it.  After every refill the first block of
+   the new output replaces the key ("fast key erasure"), and served
+   bytes are wiped, so a compromise of the state does not reveal past
+   output.  The key is re-drawn from OpenSSL periodically and in the
+   child after a fork.  */
+
+namespace {
+
+const size_t RNG_BLOCK_SIZE = 64;
+const size_t RNG_BUF_BLOCKS = 16;
+const size_t RNG_BUF_SIZE = RNG_BLOCK_SIZE * RNG_BUF_BLOCKS;
+const size_t RNG_KEY_SIZE = 32;
+const unsigned int RNG_RESEED_INTERVAL = 1 << 16; // refills, i.e. ~64MB
+
+/* Plain data, so that the thread_local below needs no constructor and
+   starts out all-zero, i.e. unseeded. */
+struct rng_state
+{
+  uint32_t key[RNG_KEY_SIZE / 4];
+  uint64_t counter;
+  unsigned int refills;
+  bool seeded;
+  size_t avail; // unserved bytes at the end of buf
+  uint8_t buf[RNG_BUF_SIZE];
+};
+
+rng_state &
+rng_thread_state()
+{
+  static thread_local rng_state state;
+  return state;
+}
+
+/* Only the thread that called fork() exists in the child, and it must
+   not produce the same output as its parent. */
+void
+rng_atfork_child()
+{
+  rng_state &st = rng_thread_state();
+  st.seeded = false;
+  st.avail = 0;
+}
+
+pthread_once_t rng_atfork_once = PTHREAD_ONCE_INIT;
+
+void
+rng_register_atfork()
+{
+  pthread_atfork(NULL, NULL, rng_atfork_child);
+}
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTERROUND(a, b, c, d)                  \
+  a += b; d ^= a; d = ROTL32(d, 16);              \
+  c += d; b ^= c; b = ROTL32(b, 12);              \
+  a += b; d ^= a; d = ROTL32(d, 8);               \
+  c += d; b ^= c; b = ROTL32(b, 7)
+
+/* The ChaCha20 block function (RFC 7539) with a 64-bit block counter
+   and an all-zero nonce. */
+void
+chacha20_block(const uint32_t key[8], uint64_t counter, uint8_t out[64])
+{
+  uint32_t in[16] = {
+    0x61707865, 0x3320646e, 0x79622d32, 0x6b206574, // "expand 32-byte k"
+    key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+    uint32_t(counter), uint32_t(counter >> 32), 0, 0
+  };
+  uint32_t x[16];
+  memcpy(x, in, sizeof x);
+
+  for (int i = 0; i < 10; i++) {
+    QUARTERROUND(x[0], x[4], x[8],  x[12]);
+    QUARTERROUND(x[1], x[5], x[9],  x[13]);
+    QUARTERROUND(x[2], x[6], x[10], x[14]);
+    QUARTERROUND(x[3], x[7], x[11], x[15]);
+    QUARTERROUND(x[0], x[5], x[10], x[15]);
+    QUARTERROUND(x[1], x[6], x[11], x[12]);
+    QUARTERROUND(x[2], x[7], x[8],  x[13]);
+    QUARTERROUND(x[3], x[4], x[9],  x[14]);
+  }
+
+  for (int i = 0; i < 16; i++) {
+    uint32_t v = x[i] + in[i];
+    out[4*i]     = uint8_t(v);
+    out[4*i + 1] = uint8_t(v >> 8);
+    out[4*i + 2] = uint8_t(v >> 16);
+    out[4*i + 3] = uint8_t(v >> 24);
+  }
+}
+
+#undef QUARTERROUND
+#undef ROTL32
+
+void
+rng_refill(rng_state &st)
+{
+  if (!st.seeded || st.refills >= RNG_RESEED_INTERVAL) {
+    pthread_once(&rng_atfork_once, rng_register_atfork);
+    int rv = RAND_bytes((uint8_t *)st.key, sizeof st.key);
+    log_assert(rv);
+    st.counter = 0;
+    st.refills = 0;
+    st.seeded = true;
+  }
+
+  for (size_t i = 0; i < RNG_BUF_BLOCKS; i++)
+    chacha20_block(st.key, st.counter++, st.buf + i * RNG_BLOCK_SIZE);
+  st.refills++;
+
+  memcpy(st.key, st.buf, RNG_KEY_SIZE);
+  memset(st.buf, 0, RNG_KEY_SIZE);
+  st.avail = RNG_BUF_SIZE - RNG_KEY_SIZE;
+}
+
+} // anonymous namespace
 
 /**
  * Fills 'buf' with 'buflen' random bytes.  Cannot fail.
@@ -20,9 +140,20 @@
 void
 rng_bytes(uint8_t *buf, size_t buflen)
 {
-  log_assert(buflen < INT_MAX);
-  int rv = RAND_bytes(buf, (int)buflen);
-  log_assert(rv);
+  rng_state &st = rng_thread_state();
+
+  while (buflen > 0) {
+    if (st.avail == 0)
+      rng_refill(st);
+
+    size_t n = std::min(buflen, st.avail);
+    uint8_t *src = st.buf + RNG_BUF_SIZE - st.avail;
+    memcpy(buf, src, n);
+    memset(src, 0, n);
+    st.avail -= n;
+    buf += n;
+    buflen -= n;
+  }
 }
 
 /**
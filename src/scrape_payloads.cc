@@ -0,0 +1,92 @@
+/* Copyright 2012 vmon
+   See LICENSE for other credits and copying information
+
+   Standalone front end to the payload scraper, so the cover database
+   of an http_apache server can be built or refreshed without blocking
+   (or restarting) a running bridge. The new database is swapped in
+   atomically once it is complete.
+*/
+
+#include <fstream>
+#include <string>
+#include <sstream>
+#include <boost/filesystem.hpp>
+
+#include <unistd.h>
+
+using namespace std;
+
+#include "util.h"
+#include "crypt.h"
+#include "payload_server.h"
+#include "curl_util.h"
+#include "http_steg_mods/file_steg.h"
+
+#include "payload_scraper.h"
+
+static const char *argv0;
+
+static void ATTR_NORETURN
+usage()
+{
+  fprintf(stderr,
+          "usage: %s [-j jobs] [-l cover-list] [-a apache-conf] [-f] [-v] "
+          "database cover-server\n"
+          "  -j  number of parallel fetchers (default: one per core)\n"
+          "  -l  file containing the urls of the covers\n"
+          "  -a  apache config to find the DocumentRoot\n"
+          "  -f  full scrape, re-fetch covers even if they are unchanged\n"
+          "  -v  log debug messages\n",
+          argv0);
+  exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+  int c;
+  unsigned int no_of_jobs = 0;
+  bool incremental = true;
+  string cover_list;
+  string apache_conf = "/etc/httpd/conf/httpd.conf";
+
+  argv0 = argv[0];
+  log_set_method(LOG_METHOD_STDERR, NULL);
+
+  while ((c = getopt(argc, argv, "j:l:a:fv")) != -1) {
+    switch (c) {
+    case 'j':
+      no_of_jobs = strtoul(optarg, NULL, 10);
+      break;
+    case 'l':
+      cover_list = optarg;
+      break;
+    case 'a':
+      apache_conf = optarg;
+      break;
+    case 'f':
+      incremental = false;
+      break;
+    case 'v':
+      log_set_min_severity("debug");
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if (argc - optind != 2)
+    usage();
+
+  init_crypto();
+
+  PayloadScraper scraper(argv[optind], argv[optind + 1], cover_list, apache_conf);
+  scraper.set_no_of_workers(no_of_jobs);
+
+  int result = scraper.scrape(incremental);
+  if (result < 0)
+    log_warn("failed to scrape %s", argv[optind + 1]);
+
+  free_crypto();
+  return result < 0 ? 1 : 0;
+}
@@ -0,0 +1,314 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "splice_relay.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+bool SpliceRelay::splice_refused = false;
+
+static inline bool
+retriable(int err)
+{
+  return err == EAGAIN || err == EWOULDBLOCK || err == EINTR;
+}
+
+bool
+SpliceRelay::available()
+{
+#ifdef HAVE_SPLICE
+  return !splice_refused;
+#else
+  return false;
+#endif
+}
+
+SpliceRelay::SpliceRelay()
+  : cb(NULL), cb_arg(NULL), finished(false)
+{
+  memset(&forward, 0, sizeof forward);
+  memset(&backward, 0, sizeof backward);
+  forward.pipe_fds[0] = forward.pipe_fds[1] = -1;
+  backward.pipe_fds[0] = backward.pipe_fds[1] = -1;
+}
+
+SpliceRelay::~SpliceRelay()
+{
+  direction *dirs[] = { &forward, &backward };
+  for (size_t i = 0; i < sizeof dirs / sizeof dirs[0]; i++) {
+    direction &d = *dirs[i];
+    if (d.read_ev)
+      event_free(d.read_ev);
+    if (d.write_ev)
+      event_free(d.write_ev);
+    if (d.pending)
+      evbuffer_free(d.pending);
+    for (int j = 0; j < 2; j++)
+      if (d.pipe_fds[j] >= 0)
+        close(d.pipe_fds[j]);
+  }
+}
+
+SpliceRelay *
+SpliceRelay::create(struct event_base *base,
+                    evutil_socket_t fd_a, evutil_socket_t fd_b,
+                    struct evbuffer *to_a, struct evbuffer *to_b,
+                    done_cb cb, void *arg)
+{
+  if (!available())
+    return NULL;
+
+  SpliceRelay *relay = new SpliceRelay;
+  relay->cb = cb;
+  relay->cb_arg = arg;
+
+  if (!relay->setup(relay->forward, base, fd_a, fd_b, to_b) ||
+      !relay->setup(relay->backward, base, fd_b, fd_a, to_a)) {
+    // Nothing has been read yet, so the caller can carry on as if
+    // we had never been asked; put back what we took from it.
+    if (to_b && relay->forward.pending)
+      evbuffer_add_buffer(to_b, relay->forward.pending);
+    if (to_a && relay->backward.pending)
+      evbuffer_add_buffer(to_a, relay->backward.pending);
+    delete relay;
+    return NULL;
+  }
+
+  // The first callbacks do the work, so that the caller never sees
+  // the done callback before we have returned.
+  relay->update_events(relay->forward);
+  relay->update_events(relay->backward);
+  return relay;
+}
+
+bool
+SpliceRelay::setup(direction &d, struct event_base *base,
+                   evutil_socket_t src, evutil_socket_t dst,
+                   struct evbuffer *initial)
+{
+  d.relay = this;
+  d.src = src;
+  d.dst = dst;
+  d.reading = false;
+
+  d.pending = evbuffer_new();
+  if (!d.pending)
+    return false;
+  if (initial && evbuffer_add_buffer(d.pending, initial))
+    return false;
+
+#ifdef HAVE_SPLICE
+  if (pipe(d.pipe_fds)) {
+    log_warn("splice relay: pipe: %s", strerror(errno));
+    return false;
+  }
+  for (int i = 0; i < 2; i++)
+    if (evutil_make_socket_nonblocking(d.pipe_fds[i]) ||
+        fcntl(d.pipe_fds[i], F_SETFD, FD_CLOEXEC))
+      return false;
+#ifdef F_SETPIPE_SZ
+  // Best effort: with a pipe as large as the high watermark, the
+  // watermark rather than the pipe decides when to stop reading.
+  fcntl(d.pipe_fds[1], F_SETPIPE_SZ, MAX_OUTPUT);
+#endif
+#else
+  d.copy = true;
+#endif
+
+  d.read_ev = event_new(base, src, EV_READ|EV_PERSIST, read_cb, &d);
+  d.write_ev = event_new(base, dst, EV_WRITE|EV_PERSIST, write_cb, &d);
+  return d.read_ev && d.write_ev;
+}
+
+/**
+   Once splice has been refused, whatever is in the pipe goes into
+   the pending buffer, behind what was already there, and the
+   direction carries on copying through it.
+*/
+static int
+drain_pipe(struct evbuffer *pending, int pipe_fd, size_t &in_pipe)
+{
+  while (in_pipe > 0) {
+    int n = evbuffer_read(pending, pipe_fd, in_pipe);
+    if (n <= 0)
+      return -1;
+    in_pipe -= n;
+  }
+  return 0;
+}
+
+/** Reads from the source, up to the high watermark. */
+int
+SpliceRelay::fill(direction &d)
+{
+  while (!d.read_eof && d.queued() < MAX_OUTPUT) {
+    size_t room = MAX_OUTPUT - d.queued();
+    ssize_t n;
+
+#ifdef HAVE_SPLICE
+    if (!d.copy) {
+      n = splice(d.src, NULL, d.pipe_fds[1], NULL, room,
+                 SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+      if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+        log_info("splice relay: splice refused (%s), copying instead",
+                 strerror(errno));
+        splice_refused = true;
+        d.copy = true;
+        if (drain_pipe(d.pending, d.pipe_fds[0], d.in_pipe))
+          return -1;
+        continue;
+      }
+      if (n > 0)
+        d.in_pipe += n;
+    } else
+#endif
+    {
+      n = evbuffer_read(d.pending, d.src, room);
+    }
+
+    if (n == 0) {
+      d.read_eof = true;
+    } else if (n < 0) {
+      if (retriable(errno)) {
+        // Either the socket is empty or the pipe is full, and we
+        // cannot tell which; in the second case the read event would
+        // keep firing, so wait for the pipe to drain first.
+        if (d.in_pipe > 0)
+          d.stalled = true;
+        break;
+      }
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/** Writes out what is queued, the pending buffer first. */
+int
+SpliceRelay::flush(direction &d)
+{
+  while (evbuffer_get_length(d.pending) > 0) {
+    int n = evbuffer_write(d.pending, d.dst);
+    if (n < 0) {
+      if (retriable(errno))
+        return 0;
+      return -1;
+    }
+    d.total += n;
+  }
+
+#ifdef HAVE_SPLICE
+  while (d.in_pipe > 0) {
+    ssize_t n = splice(d.pipe_fds[0], NULL, d.dst, NULL, d.in_pipe,
+                       SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+    if (n < 0) {
+      if (retriable(errno))
+        return 0;
+      if (errno == EINVAL || errno == ENOSYS) {
+        splice_refused = true;
+        d.copy = true;
+        if (drain_pipe(d.pending, d.pipe_fds[0], d.in_pipe))
+          return -1;
+        return flush(d);
+      }
+      return -1;
+    }
+    d.in_pipe -= n;
+    d.total += n;
+    d.stalled = false;
+  }
+#endif
+
+  return 0;
+}
+
+/**
+   Moves what can be moved without blocking in one direction and
+   passes EOF on once everything before it is out. Returns -1 with
+   errno set on error.
+*/
+int
+SpliceRelay::pump(direction &d)
+{
+  if (d.done)
+    return 0;
+
+  if (d.reading && fill(d))
+    return -1;
+  if (flush(d))
+    return -1;
+
+  if (d.read_eof && d.queued() == 0) {
+    shutdown(d.dst, SHUT_WR);
+    d.done = true;
+  }
+
+  update_events(d);
+  return 0;
+}
+
+/** Applies the watermarks to the direction's events. */
+void
+SpliceRelay::update_events(direction &d)
+{
+  bool want_read;
+  if (d.done || d.read_eof || d.stalled || finished)
+    want_read = false;
+  else if (d.reading)
+    want_read = d.queued() < MAX_OUTPUT;
+  else
+    want_read = d.queued() <= MAX_OUTPUT/2;
+
+  if (want_read != d.reading) {
+    if (want_read)
+      event_add(d.read_ev, NULL);
+    else
+      event_del(d.read_ev);
+    d.reading = want_read;
+  }
+
+  // Until the first flush we do not know whether the destination
+  // would block, so anything queued means wait for it to be writable.
+  bool want_write = !finished && d.queued() > 0;
+  if (want_write)
+    event_add(d.write_ev, NULL);
+  else
+    event_del(d.write_ev);
+}
+
+void
+SpliceRelay::finish(int error)
+{
+  if (finished)
+    return;
+  finished = true;
+
+  update_events(forward);
+  update_events(backward);
+
+  cb(this, error, cb_arg); // may delete us
+}
+
+void
+SpliceRelay::read_cb(evutil_socket_t, short, void *arg)
+{
+  direction *d = (direction *)arg;
+  SpliceRelay *relay = d->relay;
+
+  if (relay->pump(*d))
+    relay->finish(errno ? errno : EIO);
+  else if (relay->forward.done && relay->backward.done)
+    relay->finish(0);
+}
+
+void
+SpliceRelay::write_cb(evutil_socket_t fd, short what, void *arg)
+{
+  // A write may let the direction read again, which pump checks.
+  read_cb(fd, what, arg);
+}
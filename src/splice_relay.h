@@ -0,0 +1,109 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#ifndef SPLICE_RELAY_H
+#define SPLICE_RELAY_H
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+/**
+   Relays bytes between two connected sockets without bringing them
+   into user space, by splice()ing each direction through a pipe.
+
+   Used once a connection no longer needs to be looked at: the
+   transparent proxy after it has taken a connection over, and the
+   null protocol. The sockets stay owned by whoever owns their
+   bufferevents; those must be disabled for as long as the relay
+   runs, and the relay never closes the sockets itself.
+
+   Flow control matches the bufferevent relays it replaces: a
+   direction stops reading once MAX_OUTPUT bytes are queued for its
+   destination and resumes when that has drained to half. EOF on one
+   side is passed on as a shutdown(SHUT_WR) of the other, after
+   everything before it has been written.
+*/
+class SpliceRelay
+{
+public:
+  /**
+     Called once both directions have reached EOF (error == 0) or
+     either has failed (error is the errno). The relay is inert by
+     then and the callback may delete it.
+  */
+  typedef void (*done_cb)(SpliceRelay *relay, int error, void *arg);
+
+  enum { MAX_OUTPUT = 512*1024 };
+
+  /**
+     Starts relaying between fd_a and fd_b.
+
+     @param to_a, to_b data already read off the other socket (or
+            queued for this one) that must go out first; drained into
+            the relay. Either may be NULL.
+
+     @return NULL if splice is not available, in which case the
+             caller should keep relaying through bufferevents.
+  */
+  static SpliceRelay *create(struct event_base *base,
+                             evutil_socket_t fd_a, evutil_socket_t fd_b,
+                             struct evbuffer *to_a, struct evbuffer *to_b,
+                             done_cb cb, void *arg);
+
+  ~SpliceRelay();
+
+  /** True if create() may succeed on this system. */
+  static bool available();
+
+  /** Bytes moved a->b and b->a so far. */
+  size_t relayed(bool a_to_b) const
+  { return a_to_b ? forward.total : backward.total; }
+
+private:
+  struct direction {
+    SpliceRelay *relay;
+    evutil_socket_t src, dst;
+    int pipe_fds[2];
+    size_t in_pipe;           // bytes sitting in the pipe
+    struct evbuffer *pending; // bytes that must go out before the pipe's
+    struct event *read_ev, *write_ev;
+    size_t total;
+    bool reading : 1;
+    bool read_eof : 1;
+    bool stalled : 1;         // the pipe filled before the watermark did
+    bool done : 1;
+    bool copy : 1;            // splice refused these sockets; copy instead
+
+    size_t queued() const
+    { return in_pipe + evbuffer_get_length(pending); }
+  };
+
+  direction forward, backward;
+  done_cb cb;
+  void *cb_arg;
+  bool finished;
+
+  SpliceRelay();
+  SpliceRelay(const SpliceRelay&);
+  SpliceRelay& operator=(const SpliceRelay&);
+
+  bool setup(direction &d, struct event_base *base,
+             evutil_socket_t src, evutil_socket_t dst,
+             struct evbuffer *initial);
+
+  int fill(direction &d);
+  int flush(direction &d);
+  int pump(direction &d);
+  void update_events(direction &d);
+  void finish(int error);
+
+  static void read_cb(evutil_socket_t, short, void *arg);
+  static void write_cb(evutil_socket_t, short, void *arg);
+
+  /** Set once splice has been refused, so later connections do not
+      bother trying. */
+  static bool splice_refused;
+};
+
+#endif
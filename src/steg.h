@@ -68,6 +68,10 @@ struct steg_config_t
               //to send as the result of the (non)process
   }
 
+  /** Reload the external resources of the steg module (e.g. the
+      cover database) without restarting. The default does nothing. */
+  virtual void reload() {}
+
 };
 
 /** A 'steg_t' object handles the actual steganography for one
@@ -3,12 +3,14 @@
 #include <vector>
 #include <boost/filesystem.hpp>
 #include <assert.h>
+#include <unistd.h>
+
+#include <event2/event.h>
 
 using namespace std;
 using namespace boost::filesystem;
 
 #include "util.h"
-#include "curl_util.h"
 #include "crypt.h"
 #include "rng.h"
 #include "apache_payload_server.h"
@@ -24,14 +26,24 @@ using namespace boost::filesystem;
 
 typedef string (*RetrievingFunc)(const string&);
 
-ApachePayloadServer::ApachePayloadServer(MachineSide init_side, const string& database_filename, const string& cover_server, const string& cover_list)
+ApachePayloadServer::ApachePayloadServer(MachineSide init_side, const string& database_filename, const string& cover_server, const string& cover_list, const string& cover_origins)
   :PayloadServer(init_side),_database_filename(database_filename),
    _apache_host_name((cover_server.empty()) ? "127.0.0.1" : cover_server),
+   _cover_list(cover_list),
    c_max_buffer_size(HTTP_PAYLOAD_BUF_SIZE),
-   _payload_cache(this, &ApachePayloadServer::fetch_hashed_url, 
-   c_PAYLOAD_CACHE_ELEMENT_CAPACITY),   
+   _cover_source(NULL),
+   _payload_cache(new PayloadCache(this, &ApachePayloadServer::fetch_hashed_url, 
+   c_PAYLOAD_CACHE_ELEMENT_CAPACITY)),
+   _payload_cache_capacity(c_PAYLOAD_CACHE_ELEMENT_CAPACITY),
+   _shared_cover_cache(NULL),
+   _reloaded_index(NULL),
+   _reload_done_event(NULL),
+   _reload_cb(NULL),
+   _reload_cb_arg(NULL),
    chosen_payload_choice_strategy(/*c_random_payload_choice*/c_most_efficient_payload_choice)
 {
+  _reload_notifier[0] = _reload_notifier[1] = -1;
+
   /* Ideally this should check the side and on client side
      it should not attempt openning the the database file but
      for now we keep it for testing */
@@ -41,66 +53,22 @@ ApachePayloadServer::ApachePayloadServer(MachineSide init_side, const string& da
   std::ifstream payload_info_stream;
 
   if (_side == server_side) {
-    //Initializing type specific data, we initiate with max_capacity = 0, count = 0
-    //I don't think we need this as we have the default constructor doing the same
-    TypeDetail init_empty_type;
-    for(unsigned int cur_type = 1; cur_type < c_no_of_steg_protocol+1; cur_type++)
-      _payload_database.type_detail[cur_type] = init_empty_type;
-    //it should be like this but beacause they are not pointers 
-    //we are in trouble need to change the type to pointer
-    //_payload_database.type_detail = new TypeDetail[c_no_of_steg_protocol];
-
     if (!boost::filesystem::exists(_database_filename)) {
-        log_debug("payload database does not exists.");
-        log_debug("scarping payloads to create the database...");
-
-        PayloadScraper my_scraper(_database_filename, _apache_host_name,  cover_list);
-        my_scraper.scrape();
-
-      }
-    
-    payload_info_stream.open(_database_filename, std::ifstream::in);
-    if (!payload_info_stream.is_open()) {
-      log_abort("Cannot open payload info file.");
+      //we start with nothing to serve and the database is scraped
+      //and swapped in on the reload thread
+      log_info("payload database %s does not exist, scraping it in the background", _database_filename.c_str());
+      compute_uri_dict_mac();
+      if (!open_reload_notifier())
+        log_abort("cannot scrape the payload database in the background");
+      _reload_thread = std::thread(&ApachePayloadServer::build_payload_index, this, URIDict());
     }
-      
-    unsigned long file_id;
-    while (payload_info_stream >> file_id) {
-      PayloadInfo cur_payload_info;
-
-      if (_payload_database.payloads.find(cur_payload_info.url_hash) != _payload_database.payloads.end()) {
-        log_warn("duplicate url in the url list: %s", cur_payload_info.url.c_str());
-        continue;
-      }
-
-      payload_info_stream >>  cur_payload_info.type;
-      payload_info_stream >>  cur_payload_info.url_hash;
-      payload_info_stream >>  cur_payload_info.capacity;
-      payload_info_stream >>  cur_payload_info.length;
-      payload_info_stream >>  cur_payload_info.url;
-      payload_info_stream >>  cur_payload_info.absolute_url_is_absolute;
-      payload_info_stream >>  cur_payload_info.absolute_url;
-
-        
-      _payload_database.payloads.insert(pair<string, PayloadInfo>(cur_payload_info.url_hash, cur_payload_info));
-      _payload_database.sorted_payloads.push_back(EfficiencyIndicator(cur_payload_info.url_hash, cur_payload_info.length));
-                                                  
-      //update type related global data 
-      _payload_database.type_detail[cur_payload_info.type].count++;
-      if (cur_payload_info.capacity > _payload_database.type_detail[cur_payload_info.type].max_capacity)
-        _payload_database.type_detail[cur_payload_info.type].max_capacity = cur_payload_info.capacity;
+    else {
+      if (!load_payload_database(_database_filename, _payload_database))
+        log_abort("payload info file corrupted.");
 
-    } // while
-     
-    if (payload_info_stream.bad())
-      log_abort("payload info file corrupted.");
-        
-    _payload_database.sorted_payloads.sort();
-    
-    log_debug("loaded %ld payloads from %s\n", _payload_database.payloads.size(), _database_filename.c_str());
-    
-    //This is how server side initiates the uri dict
-    init_uri_dict();
+      //This is how server side initiates the uri dict
+      init_uri_dict();
+    }
   }
   else{ //client side
     payload_info_stream.open(_database_filename, std::ifstream::in);
@@ -114,17 +82,203 @@ ApachePayloadServer::ApachePayloadServer(MachineSide init_side, const string& da
 
   }
     
-  //init curl
-  if (!(_curl_obj = curl_easy_init()))
-    log_abort("Failed to initiate the curl object");
+  //only the server serves covers
+  if (_side == server_side)
+    _cover_source = CoverSource::create(_apache_host_name, cover_origins);
 
-  curl_easy_setopt(_curl_obj, CURLOPT_HEADER, 1L);
-  curl_easy_setopt(_curl_obj, CURLOPT_HTTP_CONTENT_DECODING, 0L);
-  curl_easy_setopt(_curl_obj, CURLOPT_HTTP_TRANSFER_DECODING, 0L);
-  curl_easy_setopt(_curl_obj, CURLOPT_WRITEFUNCTION, curl_read_data_cb);
+}
+
+bool
+ApachePayloadServer::load_payload_database(const string& database_filename, PayloadDatabase& database)
+{
+  //Initializing type specific data, we initiate with max_capacity = 0, count = 0
+  //I don't think we need this as we have the default constructor doing the same
+  TypeDetail init_empty_type;
+  for(unsigned int cur_type = 1; cur_type < c_no_of_steg_protocol+1; cur_type++)
+    database.type_detail[cur_type] = init_empty_type;
+  //it should be like this but beacause they are not pointers 
+  //we are in trouble need to change the type to pointer
+  //_payload_database.type_detail = new TypeDetail[c_no_of_steg_protocol];
+
+  std::ifstream payload_info_stream(database_filename, std::ifstream::in);
+  if (!payload_info_stream.is_open()) {
+    log_warn("Cannot open payload info file %s.", database_filename.c_str());
+    return false;
+  }
+      
+  unsigned long file_id;
+  while (payload_info_stream >> file_id) {
+    PayloadInfo cur_payload_info;
+
+    payload_info_stream >>  cur_payload_info.type;
+    payload_info_stream >>  cur_payload_info.url_hash;
+    payload_info_stream >>  cur_payload_info.capacity;
+    payload_info_stream >>  cur_payload_info.length;
+    payload_info_stream >>  cur_payload_info.url;
+    payload_info_stream >>  cur_payload_info.absolute_url_is_absolute;
+    payload_info_stream >>  cur_payload_info.absolute_url;
+
+    if (database.payloads.find(cur_payload_info.url_hash) != database.payloads.end()) {
+      log_warn("duplicate url in the url list: %s", cur_payload_info.url.c_str());
+      continue;
+    }
+
+    database.payloads.insert(pair<string, PayloadInfo>(cur_payload_info.url_hash, cur_payload_info));
+    database.sorted_payloads.push_back(EfficiencyIndicator(cur_payload_info.url_hash, cur_payload_info.length));
+                                                  
+    //update type related global data 
+    database.type_detail[cur_payload_info.type].count++;
+    if (cur_payload_info.capacity > database.type_detail[cur_payload_info.type].max_capacity)
+      database.type_detail[cur_payload_info.type].max_capacity = cur_payload_info.capacity;
+
+  } // while
+     
+  if (payload_info_stream.bad())
+    return false;
+        
+  database.sorted_payloads.sort();
+    
+  log_debug("loaded %ld payloads from %s\n", database.payloads.size(), database_filename.c_str());
+  return true;
 
 }
 
+bool
+ApachePayloadServer::reload(struct event_base* base, void (*reload_cb)(void*), void* reload_cb_arg)
+{
+  if (_side != server_side) {
+    log_debug("only the server side has a payload database to reload");
+    return false;
+  }
+
+  if (_reload_thread.joinable()) {
+    log_warn("payload database reload is already in progress");
+    return false;
+  }
+
+  if (!watch_reloads(base, reload_cb, reload_cb_arg))
+    return false;
+
+  log_info("reloading payload database %s", _database_filename.c_str());
+  //the thread gets its own copy of the dict, it must not touch
+  //anything the event loop is using
+  _reload_thread = std::thread(&ApachePayloadServer::build_payload_index, this, uri_dict);
+  return true;
+
+}
+
+bool
+ApachePayloadServer::open_reload_notifier()
+{
+  if (_reload_notifier[0] >= 0)
+    return true;
+
+  if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, _reload_notifier)) {
+    log_warn("failed to create reload notification socket: %s", strerror(errno));
+    _reload_notifier[0] = _reload_notifier[1] = -1;
+    return false;
+  }
+  return true;
+
+}
+
+bool
+ApachePayloadServer::watch_reloads(struct event_base* base, void (*reload_cb)(void*), void* reload_cb_arg)
+{
+  if (!_reload_done_event) {
+    if (!open_reload_notifier())
+      return false;
+    _reload_done_event = event_new(base, _reload_notifier[0], EV_READ | EV_PERSIST, reload_done_cb, this);
+    event_add(_reload_done_event, NULL);
+  }
+
+  _reload_cb = reload_cb;
+  _reload_cb_arg = reload_cb_arg;
+  return true;
+
+}
+
+void
+ApachePayloadServer::build_payload_index(URIDict previous_dict)
+{
+  PayloadIndex* new_index = new PayloadIndex;
+
+  if (!boost::filesystem::exists(_database_filename)) {
+    log_info("scraping payloads to create the database %s", _database_filename.c_str());
+    PayloadScraper scraper(_database_filename, _apache_host_name, _cover_list);
+    scraper.scrape();
+  }
+
+  if (load_payload_database(_database_filename, new_index->payload_database) &&
+      new_index->payload_database.payloads.size()) {
+    build_uri_dict(new_index->payload_database, previous_dict, new_index->uri_dict, new_index->uri_decode_book);
+    compute_uri_dict_mac(new_index->uri_dict, new_index->uri_dict.size(), new_index->uri_dict_mac);
+  }
+  else {
+    log_warn("new payload database is corrupted or empty, keeping the current one");
+    delete new_index;
+    new_index = NULL;
+  }
+
+  //the event loop won't look at _reloaded_index till it reads from
+  //the notifier
+  _reloaded_index = new_index;
+  char done = 1;
+  if (send(_reload_notifier[1], &done, 1, 0) != 1)
+    log_warn("failed to notify the event loop about the reloaded database");
+
+}
+
+void
+ApachePayloadServer::reload_done_cb(evutil_socket_t fd, short, void* arg)
+{
+  ApachePayloadServer* payload_server = (ApachePayloadServer*) arg;
+  char done;
+
+  if (recv(fd, &done, 1, 0) != 1)
+    return;
+
+  payload_server->_reload_thread.join();
+  PayloadIndex* new_index = payload_server->_reloaded_index;
+  payload_server->_reloaded_index = NULL;
+  if (!new_index)
+    return;
+
+  bool mac_changed = memcmp(new_index->uri_dict_mac, payload_server->_uri_dict_mac, SHA256_DIGEST_LENGTH);
+
+  //publish: after the swaps new_index holds the retired state
+  swap(payload_server->_payload_database, new_index->payload_database);
+  swap(payload_server->uri_dict, new_index->uri_dict);
+  swap(payload_server->uri_decode_book, new_index->uri_decode_book);
+  memcpy(payload_server->_uri_dict_mac, new_index->uri_dict_mac, SHA256_DIGEST_LENGTH);
+
+  //covers might have changed on the cover server, so we start with a
+  //fresh cache and the cached covers retire with the old database
+  new_index->payload_cache = payload_server->_payload_cache;
+  payload_server->_payload_cache = new PayloadCache(payload_server, &ApachePayloadServer::fetch_hashed_url, payload_server->_payload_cache_capacity);
+  if (payload_server->_shared_cover_cache)
+    payload_server->_shared_cover_cache->clear();
+
+  struct timeval next_round = {0, 0};
+  if (event_base_once(event_get_base(payload_server->_reload_done_event), -1, EV_TIMEOUT, retire_payload_index_cb, new_index, &next_round))
+    log_abort("failed to schedule retirement of the old payload database");
+
+  log_info("payload database reloaded with %lu payloads, uri dict has %s",
+           (unsigned long)payload_server->_payload_database.payloads.size(),
+           mac_changed ? "changed" : "not changed");
+
+  if (mac_changed && payload_server->_reload_cb)
+    payload_server->_reload_cb(payload_server->_reload_cb_arg);
+
+}
+
+void
+ApachePayloadServer::retire_payload_index_cb(evutil_socket_t, short, void* arg)
+{
+  log_debug("releasing the retired payload database");
+  delete (PayloadIndex*) arg;
+}
+
 unsigned int
 ApachePayloadServer::find_client_payload(char* buf, int len, int type)
 {
@@ -139,6 +293,10 @@ ApachePayloadServer::find_client_payload(char* buf, int len, int type)
 int
 ApachePayloadServer::get_payload( int contentType, int cap, char** buf, int* size, double noise2signal, std::string* payload_id_hash)
 {
+  if (_payload_database.payloads.empty()) {
+    log_debug("no payload to serve till the database is scraped");
+    return 0;
+  }
 
   for(unsigned int search_tries = 0; search_tries < c_MAX_SEARCH_TRIES; search_tries++) /* each payload which is found but is corrupted */ {
     int found = 0, numCandidate = 0;
@@ -204,10 +362,12 @@ ApachePayloadServer::get_payload( int contentType, int cap, char** buf, int* siz
                   numCandidate,
                   cap);
 
-        std::string url_to_resource = (itr_best->absolute_url_is_absolute ? "" : "http://" + _apache_host_name + "/") + (itr_best->absolute_url);
+        //relative to the doc root unless absolute, the cover source
+        //decides which server (or disk) it comes from
+        std::string url_to_resource = itr_best->absolute_url;
         for(unsigned int fetch_tries = 0; fetch_tries < c_MAX_FETCH_TRIES; fetch_tries++) {
           log_debug("attempt %i to fetch %s", fetch_tries + 1, url_to_resource.c_str());
-          string& best_payload = _payload_cache(url_to_resource); //this is a permanent object in cache so it is ok to get a reference to it.
+          string& best_payload = (*_payload_cache)(url_to_resource); //this is a permanent object in cache so it is ok to get a reference to it.
           //if curl fails the size will be zero. we disqualify the resource because it might be
           //removed from the cover server and try again
           if (!best_payload.empty() != 0) {
@@ -221,7 +381,7 @@ ApachePayloadServer::get_payload( int contentType, int cap, char** buf, int* siz
             //drop the empty string from the cache, force
             //retriving
             log_warn("error in retrieving cover %s", url_to_resource.c_str());
-            _payload_cache.drop(url_to_resource);
+            _payload_cache->drop(url_to_resource);
             
           }
         } // tries < MAX_FETCH_TRIES
@@ -246,23 +406,30 @@ ApachePayloadServer::get_payload( int contentType, int cap, char** buf, int* siz
    This function is supposed to be given to the cache class to be used to retrieve the
    the element when it isn't in the hash table
 
-   @param url_hash the sha-1 hash of the url
+   @param url_hash the cover's url, relative to the cover server's
+          doc root unless absolute
  */
 string
 ApachePayloadServer::fetch_hashed_url(const string& url)
 {
-  stringstream tmp_stream_buf;
-  string payload_uri = url;
-
-  log_debug("asking cover server for payload %s", payload_uri.c_str());
-  size_t payload_size = fetch_url_raw(_curl_obj, payload_uri, tmp_stream_buf);
-  if (payload_size == 0) {
-    log_warn("Failed fetch the url %s", payload_uri.c_str()); //here we should signal that we failed
-    //to retreieve the file and mark it as unacceptable
+  string cover;
+  if (_shared_cover_cache && _shared_cover_cache->lookup(url, cover)) {
+    log_debug("shared cover cache HIT");
+    return cover;
+  }
+
+  if (!_cover_source) {
+    log_warn("no cover source to fetch %s from", url.c_str());
     return string();
   }
 
-  return tmp_stream_buf.str();
+  //an empty string tells get_payload we failed to retrieve the
+  //file so it gets marked as unacceptable
+  cover = _cover_source->fetch(url);
+  if (_shared_cover_cache && !cover.empty())
+    _shared_cover_cache->insert(url, cover);
+
+  return cover;
 
 }
 
@@ -275,20 +442,29 @@ ApachePayloadServer::init_uri_dict()
       return false;
     }
 
-  uri_dict.clear();
-  uri_decode_book.clear();
+  build_uri_dict(_payload_database, URIDict(), uri_dict, uri_decode_book);
+
+  compute_uri_dict_mac();
+  return true;
 
-  PayloadDict::iterator itr_payloads;
-  unsigned long i = 0;
+}
 
-  for (itr_payloads = _payload_database.payloads.begin(); itr_payloads != _payload_database.payloads.end(); itr_payloads++, i++) {
+void
+ApachePayloadServer::build_uri_dict(const PayloadDatabase& database, const URIDict& previous_dict, URIDict& new_dict, map<string, unsigned long>& decode_book)
+{
+  new_dict = previous_dict;
+  decode_book.clear();
 
-    uri_dict.push_back(URIEntry((*itr_payloads).second.url));
-    uri_decode_book[itr_payloads->second.url] = i;
-  }
+  for (unsigned long i = 0; i < new_dict.size(); i++)
+    decode_book[new_dict[i].URL] = i;
 
-  compute_uri_dict_mac();
-  return true;
+  for (PayloadDict::const_iterator itr_payloads = database.payloads.begin(); itr_payloads != database.payloads.end(); itr_payloads++) {
+    if (decode_book.find(itr_payloads->second.url) != decode_book.end())
+      continue;
+
+    decode_book[itr_payloads->second.url] = new_dict.size();
+    new_dict.push_back(URIEntry(itr_payloads->second.url));
+  }
 
 }
 
@@ -329,18 +505,76 @@ ApachePayloadServer::export_dict(iostream& dict_stream)
   
 }
 
+void
+ApachePayloadServer::export_dict(iostream& dict_stream, size_t first, size_t count)
+{
+  for(size_t i = first; i < first + count && i < uri_dict.size(); i++)
+    dict_stream << uri_dict[i].URL.c_str() << endl;
+
+}
+
+bool
+ApachePayloadServer::append_uri_dict(istream& dict_stream, size_t first)
+{
+  if (first == 0) {
+    uri_dict.clear();
+    uri_decode_book.clear();
+  }
+  else if (first != uri_dict.size()) {
+    log_debug("uri dict chunk starts at %lu but we have %lu entries", (unsigned long)first, (unsigned long)uri_dict.size());
+    return false;
+  }
+
+  string cur_url;
+  while (dict_stream >> cur_url) {
+    uri_decode_book[cur_url] = uri_dict.size();
+    uri_dict.push_back(URIEntry(cur_url));
+  }
+
+  log_debug("uri dictionary has %lu entries now", uri_dict.size());
+  compute_uri_dict_mac();
+
+  return !dict_stream.bad();
+
+}
+
 const uint8_t*
 ApachePayloadServer::compute_uri_dict_mac()
 {
-  stringstream dict_str_stream;
-  export_dict(dict_str_stream);
-  
-  sha256((const uint8_t*)dict_str_stream.str().c_str(), dict_str_stream.str().size(), _uri_dict_mac);
+  compute_uri_dict_mac(uri_dict, uri_dict.size(), _uri_dict_mac);
 
   return _uri_dict_mac;
 
 }
 
+bool
+ApachePayloadServer::uri_dict_prefix_mac(size_t prefix_len, uint8_t* mac)
+{
+  if (prefix_len > uri_dict.size())
+    return false;
+
+  if (prefix_len == uri_dict.size())
+    memcpy(mac, _uri_dict_mac, SHA256_DIGEST_LENGTH);
+  else
+    compute_uri_dict_mac(uri_dict, prefix_len, mac);
+
+  return true;
+
+}
+
+void
+ApachePayloadServer::compute_uri_dict_mac(const URIDict& dict, size_t prefix_len, uint8_t* mac)
+{
+  log_assert(prefix_len <= dict.size());
+
+  stringstream dict_str_stream;
+  for(URIDict::const_iterator itr_uri = dict.begin(); itr_uri != dict.begin() + prefix_len; itr_uri++)
+    dict_str_stream << itr_uri->URL.c_str() << endl;
+  
+  sha256((const uint8_t*)dict_str_stream.str().c_str(), dict_str_stream.str().size(), mac);
+
+}
+
 bool
 ApachePayloadServer::store_dict(char* dict_buf, size_t dict_buf_size)
 {
@@ -366,8 +600,41 @@ ApachePayloadServer::store_dict(char* dict_buf, size_t dict_buf_size)
 ApachePayloadServer::~ApachePayloadServer()
 {
   /* always cleanup */ 
-  log_debug("cleaning up curl easy handle for payload retrieval");
-  curl_easy_cleanup(_curl_obj);
+  log_debug("cleaning up the cover source");
+  delete _cover_source;
+
+  if (_reload_thread.joinable())
+    _reload_thread.join();
+  delete _reloaded_index;
+
+  if (_reload_done_event)
+    event_free(_reload_done_event);
+  if (_reload_notifier[0] >= 0) {
+    evutil_closesocket(_reload_notifier[0]);
+    evutil_closesocket(_reload_notifier[1]);
+  }
+
+  delete _payload_cache;
+  delete _shared_cover_cache;
+
+}
+
+bool
+ApachePayloadServer::use_shared_cover_cache(const string& segment_name, size_t budget)
+{
+  if (_side != server_side || _shared_cover_cache)
+    return false;
+
+  if (!(_shared_cover_cache = SharedCoverCache::attach(segment_name, budget)))
+    return false;
+
+  //the covers we hold so far are in our own cache only, they go and
+  //are fetched again through the shared one
+  delete _payload_cache;
+  _payload_cache_capacity = c_PAYLOAD_CACHE_CAPACITY_WITH_SHARED;
+  _payload_cache = new PayloadCache(this, &ApachePayloadServer::fetch_hashed_url, _payload_cache_capacity);
+
+  return true;
 
 }
 
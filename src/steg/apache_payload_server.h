@@ -3,9 +3,12 @@
 
 #include <openssl/sha.h> 
 #include <unordered_map>
+#include <thread>
 
 #include "payload_lru_cache.h"
 #include "payload_server.h"
+#include "cover_source.h"
+#include "shared_cover_cache.h"
 
 
 class PayloadScraper; /* Just tell ApachePayloadServer that such a
@@ -29,6 +32,38 @@ class URIEntry
 
 typedef vector<URIEntry> URIDict;
 
+class ApachePayloadServer;
+typedef PayloadLRUCache<std::string, std::string, ApachePayloadServer, unordered_map> PayloadCache;
+
+/**
+   Everything the server derives from the payload database file. On
+   reload a new index is built by a helper thread, away from the event
+   loop, and is then published by the event loop swapping it with the
+   live one. All readers live on the event loop, so nobody can observe
+   a half published index. The retired index, including the covers
+   cached under it, is only freed after the event loop has gone around
+   once more, so a response which is still using one of its covers is
+   never left dangling.
+*/
+struct PayloadIndex
+{
+  PayloadDatabase payload_database;
+  URIDict uri_dict;
+  map<string, unsigned long> uri_decode_book;
+  uint8_t uri_dict_mac[SHA256_DIGEST_LENGTH];
+
+  PayloadCache* payload_cache; //only set for a retired index
+
+  PayloadIndex()
+    : payload_cache(NULL)
+  {}
+
+  ~PayloadIndex()
+  {
+    delete payload_cache;
+  }
+};
+
 class ApachePayloadServer: public PayloadServer
 {
   friend class PayloadScraper; /* We need the url retrieving capabilities in
@@ -36,13 +71,14 @@ class ApachePayloadServer: public PayloadServer
  protected:
   string _database_filename;
   string _apache_host_name;
+  string _cover_list; //what the scraper reads if there is no database
   
   const unsigned long c_max_buffer_size;
   const static unsigned int c_MAX_FETCH_TRIES = 3; //no of attemps in fetching a cover in case of curl error
   const static unsigned int c_MAX_SEARCH_TRIES = 3; //no of attemps in searching a suitable cover in case
   //the cover is corrupted.
 
-  CURL* _curl_obj; //this is used to communicate with http server
+  CoverSource* _cover_source; //where the covers are fetched from, server side only
 
   //This is too keep the dict in sync between client and server
   uint8_t _uri_dict_mac[SHA256_DIGEST_LENGTH];
@@ -62,15 +98,79 @@ class ApachePayloadServer: public PayloadServer
      on the server, for now we work with number of payload and can 
      be improved to the limit by total size
    */
-  PayloadLRUCache<std::string, std::string, ApachePayloadServer, unordered_map> _payload_cache;
+  PayloadCache* _payload_cache;
+  size_t _payload_cache_capacity;
+
+  /* With a shared cover cache the covers are held once for all the
+     servers of the host, and the process only keeps the few it is
+     using in its own cache. */
+  static const size_t c_PAYLOAD_CACHE_CAPACITY_WITH_SHARED = 16;
+  SharedCoverCache* _shared_cover_cache;
   /**
      This function is supposed to be given to the cache class to be used to retrieve the
      the element when it isn't in the hash table
 
-     @param url_hash the sha-1 hash of the url
+     @param url_hash the cover's url, relative to the cover server's
+            doc root unless absolute
   */
   string fetch_hashed_url(const string& url_hash);
 
+  /**
+     reads the payload database file prepared by scraper into database.
+     It touches no member so it can run on the reload thread.
+
+     @return false if the file is corrupted
+  */
+  static bool load_payload_database(const string& database_filename, PayloadDatabase& database);
+
+  /**
+     Builds the uri dict and its decode book from the payload database.
+     The urls of the previous dict keep their index and new urls are
+     appended, so a peer using the previous dict is still understood.
+
+     @param previous_dict the dict the peers may still be using
+  */
+  static void build_uri_dict(const PayloadDatabase& database, const URIDict& previous_dict, URIDict& new_dict, map<string, unsigned long>& decode_book);
+
+  /**
+     computes the sha256 of the first prefix_len urls of the given dict
+     as the peers compute it.
+  */
+  static void compute_uri_dict_mac(const URIDict& dict, size_t prefix_len, uint8_t* mac);
+
+  /* Reload */
+  std::thread _reload_thread;
+  PayloadIndex* _reloaded_index; //built by _reload_thread
+  evutil_socket_t _reload_notifier[2]; //the reload thread tells the event
+                                      //loop it's done through this pair
+  struct event* _reload_done_event;
+  void (*_reload_cb)(void*);
+  void* _reload_cb_arg;
+
+  /**
+     The body of the reload thread. It scrapes the covers first if the
+     database does not exist.
+  */
+  void build_payload_index(URIDict previous_dict);
+
+  /**
+     Creates the socket pair the reload thread notifies through,
+     unless it exists already.
+  */
+  bool open_reload_notifier();
+
+  /**
+     Runs on the event loop when the reload thread is done and swaps
+     the new index in.
+  */
+  static void reload_done_cb(evutil_socket_t fd, short what, void* arg);
+
+  /**
+     frees a retired index once the event loop has processed everything
+     which was pending when it was retired
+  */
+  static void retire_payload_index_cb(evutil_socket_t fd, short what, void* arg);
+
  public:
   enum PayloadChoiceStrategy {
     c_most_efficient_payload_choice,
@@ -109,6 +209,36 @@ class ApachePayloadServer: public PayloadServer
   */
   void export_dict(iostream& dict_stream);
 
+  /**
+     Same as above but only exports count urls starting from first,
+     used to send the dict to the client in chunks.
+  */
+  void export_dict(iostream& dict_stream, size_t first, size_t count);
+
+  /**
+     As the dict is append-only, its size acts as its version and a
+     client which has synced the first n urls has a valid prefix of the
+     server's dict. This computes the mac the client would have for
+     that prefix so the server can verify it before sending the rest.
+
+     @param prefix_len the number of urls the client claims to have
+     @param mac the buffer to store the sha256 of the prefix
+
+     @return false if the dict is shorter than prefix_len
+  */
+  bool uri_dict_prefix_mac(size_t prefix_len, uint8_t* mac);
+
+  /**
+     Used by the client to add a chunk of the dict received from the
+     server. A chunk starting at 0 replaces the current dict.
+
+     @param dict_stream urls separated by end of line
+     @param first the index of the first url in the chunk
+
+     @return false if the chunk doesn't start where our dict ends
+  */
+  bool append_uri_dict(istream& dict_stream, size_t first);
+
   /**
      stores the dict in a file for later use by client side.
 
@@ -121,8 +251,46 @@ class ApachePayloadServer: public PayloadServer
   /**
      The constructor reads the payload database prepared by scraper
      and initialize the payload table.
+
+     @param cover_origins if not empty, the covers are fetched from this
+            pool of origins rather than cover_server, see CoverOriginPool
     */
-  ApachePayloadServer(MachineSide init_side, const string& database_filename, const string& cover_server, const string& cover_list); 
+  ApachePayloadServer(MachineSide init_side, const string& database_filename, const string& cover_server, const string& cover_list, const string& cover_origins = ""); 
+
+  /**
+     Re-reads the payload database in a helper thread and swaps it in
+     when it is ready, without disturbing the connections being served.
+     Only meaningful on the server side.
+
+     @param base the event loop the payload server is used from
+     @param reload_cb if not NULL, is called with reload_cb_arg from the
+            event loop after the new database has been swapped in, if it
+            has changed the uri dict mac.
+
+     @return false if the reload couldn't start, for example because
+             another reload is still in progress
+  */
+  bool reload(struct event_base* base, void (*reload_cb)(void*) = NULL, void* reload_cb_arg = NULL);
+
+  /**
+     Has the event loop swap in the databases the reload thread builds,
+     calling reload_cb as reload() does. The server side calls it once
+     its event loop exists, for the database scraped in the background
+     when there was none at start up.
+  */
+  bool watch_reloads(struct event_base* base, void (*reload_cb)(void*) = NULL, void* reload_cb_arg = NULL);
+
+  /**
+     Keeps the covers in a shared memory cache, shared with the other
+     servers using the same segment name, see SharedCoverCache.
+
+     @param segment_name the name of the POSIX shared memory segment
+     @param budget the size of the cache in bytes if we create it
+
+     @return false if the shared cache couldn't be set up, the server
+             then goes on with its own cache
+  */
+  bool use_shared_cover_cache(const string& segment_name, size_t budget);
 
   /** virtual functions */
   virtual unsigned int find_client_payload(char* buf, int len, int type);
@@ -153,8 +321,12 @@ class ApachePayloadServer: public PayloadServer
     _payload_database.adjust_type_max_capacity(payload_id_hash);
   }
 
+  virtual void restrict_capacity(const std::string& payload_id_hash, unsigned int capacity) {
+    _payload_database.restrict_capacity(payload_id_hash, capacity);
+  }
+
   /** 
-      Destructor to clean up curl
+      Destructor to clean up the cover source
   */
   ~ApachePayloadServer();
 
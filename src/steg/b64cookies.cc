@@ -3,6 +3,7 @@
  */
 
 #include "util.h"
+#include "rng.h"
 #include "b64cookies.h"
 
 size_t
@@ -34,12 +35,12 @@ gen_one_cookie(char *&outbuf, const char *&inbuf, size_t inlen)
   }
 
   if (inlen < 10) {
-    namelen = rand() % 5 + 1;
+    namelen = rng_int(5) + 1;
   } else {
-    namelen = rand() % 10 + 1;
+    namelen = rng_int(10) + 1;
   }
 
-  cookielen = rand() % (inlen * 2 / 3);
+  cookielen = rng_int(inlen * 2 / 3);
   if (cookielen > inlen - namelen)
     cookielen = inlen - namelen;
 
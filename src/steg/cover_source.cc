@@ -0,0 +1,473 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <strings.h>
+
+using namespace std;
+
+#include "util.h"
+#include "rng.h"
+#include "curl_util.h"
+#include "cover_source.h"
+
+CoverSource*
+CoverSource::create(const string& cover_server, const string& cover_origins,
+                    const string& apache_conf)
+{
+  if (!cover_origins.empty()) {
+    vector<CoverOriginPool::OriginSpec> origins;
+    if (!CoverOriginPool::parse_origin_list(cover_origins, origins))
+      log_abort("invalid cover origin list '%s', expected "
+                "host[:port][*weight],...", cover_origins.c_str());
+
+    log_info("fetching covers from a pool of %lu origins",
+             (unsigned long)origins.size());
+    return new CoverOriginPool(origins);
+  }
+
+  string host = cover_server.empty() ? "127.0.0.1" : cover_server;
+  CoverSource* http_source = new HTTPCoverSource(host);
+
+  //same test as the scraper uses to decide it can walk the doc root
+  if (host == "127.0.0.1" || host == "localhost") {
+    string doc_root = apache_doc_root(apache_conf);
+    struct stat st;
+    if (!doc_root.empty() && stat(doc_root.c_str(), &st) == 0 &&
+        S_ISDIR(st.st_mode)) {
+      log_info("reading covers from %s", doc_root.c_str());
+      return new LocalCoverSource(doc_root, http_source);
+    }
+  }
+
+  return http_source;
+}
+
+string
+CoverSource::apache_doc_root(const string& apache_conf)
+{
+  ifstream conf(apache_conf.c_str());
+  if (!conf.is_open()) {
+    log_debug("cannot open apache config file %s", apache_conf.c_str());
+    return string();
+  }
+
+  string line;
+  while (getline(conf, line)) {
+    size_t start = line.find_first_not_of(" \t");
+    if (start == string::npos || line[start] == '#')
+      continue;
+    if (line.compare(start, strlen("DocumentRoot"), "DocumentRoot"))
+      continue;
+
+    string doc_root = line.substr(start + strlen("DocumentRoot"));
+    doc_root.erase(remove(doc_root.begin(), doc_root.end(), '\"'), doc_root.end());
+    doc_root.erase(0, doc_root.find_first_not_of(" \t"));
+    doc_root.erase(doc_root.find_last_not_of(" \t\r\n") + 1);
+    if (doc_root.empty())
+      continue;
+    if (doc_root[doc_root.length() - 1] != '/')
+      doc_root.push_back('/');
+    return doc_root;
+  }
+
+  log_debug("DocumentRoot isn't specified in %s", apache_conf.c_str());
+  return string();
+}
+
+/* HTTPCoverSource */
+
+HTTPCoverSource::HTTPCoverSource(const string& host)
+  : _host(host), _server_failed(false)
+{
+  if (!(_curl_obj = curl_easy_init()))
+    log_abort("Failed to initiate the curl object");
+
+  curl_easy_setopt(_curl_obj, CURLOPT_HEADER, 1L);
+  curl_easy_setopt(_curl_obj, CURLOPT_HTTP_CONTENT_DECODING, 0L);
+  curl_easy_setopt(_curl_obj, CURLOPT_HTTP_TRANSFER_DECODING, 0L);
+  curl_easy_setopt(_curl_obj, CURLOPT_WRITEFUNCTION, curl_read_data_cb);
+  curl_easy_setopt(_curl_obj, CURLOPT_CONNECTTIMEOUT_MS, c_CONNECT_TIMEOUT_MS);
+}
+
+HTTPCoverSource::~HTTPCoverSource()
+{
+  curl_easy_cleanup(_curl_obj);
+}
+
+string
+HTTPCoverSource::fetch(const string& cover)
+{
+  stringstream response;
+  string url = is_absolute_url(cover) ? cover : "http://" + _host + "/" + cover;
+
+  CURLcode result;
+  long response_code = 0;
+
+  log_debug("asking cover server for payload %s", url.c_str());
+  bool fetched = fetch_url_raw(_curl_obj, url, response, &result) != 0;
+  if (fetched)
+    curl_easy_getinfo(_curl_obj, CURLINFO_RESPONSE_CODE, &response_code);
+  _server_failed = server_failure(result, response_code);
+  if (!fetched || _server_failed) {
+    log_warn("Failed fetch the url %s", url.c_str());
+    return string();
+  }
+
+  return response.str();
+}
+
+bool
+HTTPCoverSource::server_failure(CURLcode result, long response_code)
+{
+  switch (result) {
+  case CURLE_OK:
+    return response_code >= 500;
+
+  //we only set a connect timeout, so a timeout is one
+  case CURLE_COULDNT_RESOLVE_HOST:
+  case CURLE_COULDNT_CONNECT:
+  case CURLE_OPERATION_TIMEDOUT:
+    return true;
+
+  default:
+    return false;
+  }
+}
+
+namespace {
+size_t
+ignore_response(void*, size_t size, size_t nmemb, void*)
+{
+  return size * nmemb;
+}
+}
+
+CURL*
+HTTPCoverSource::new_probe() const
+{
+  CURL* probe = curl_easy_init();
+  if (!probe)
+    log_abort("Failed to initiate the curl object");
+
+  string url = "http://" + _host + "/";
+  curl_easy_setopt(probe, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(probe, CURLOPT_NOBODY, 1L);
+  curl_easy_setopt(probe, CURLOPT_WRITEFUNCTION, ignore_response);
+  curl_easy_setopt(probe, CURLOPT_CONNECTTIMEOUT_MS, c_CONNECT_TIMEOUT_MS);
+  curl_easy_setopt(probe, CURLOPT_TIMEOUT_MS, c_PROBE_TIMEOUT_MS);
+  curl_easy_setopt(probe, CURLOPT_NOSIGNAL, 1L);
+  return probe;
+}
+
+/* LocalCoverSource */
+
+LocalCoverSource::LocalCoverSource(const string& doc_root, CoverSource* fallback)
+  : _doc_root(doc_root), _fallback(fallback)
+{
+  if (_doc_root.empty() || _doc_root[_doc_root.length() - 1] != '/')
+    _doc_root.push_back('/');
+}
+
+LocalCoverSource::~LocalCoverSource()
+{
+  delete _fallback;
+}
+
+namespace {
+struct mime_type
+{
+  const char* extension;
+  const char* type;
+};
+
+/* What a stock apache mime.types says for the covers we can use. */
+const mime_type mime_types[] = {
+  { "html", "text/html" },
+  { "htm",  "text/html" },
+  { "js",   "application/javascript" },
+  { "pdf",  "application/pdf" },
+  { "swf",  "application/x-shockwave-flash" },
+  { "jpg",  "image/jpeg" },
+  { "jpeg", "image/jpeg" },
+  { "png",  "image/png" },
+  { "gif",  "image/gif" },
+  { "css",  "text/css" },
+  { "txt",  "text/plain" },
+};
+
+const char*
+content_type_of(const string& path)
+{
+  size_t dot = path.rfind('.');
+  size_t slash = path.rfind('/');
+  if (dot == string::npos || (slash != string::npos && dot < slash))
+    return "text/html"; //apache serves the index of a directory
+
+  const char* ext = path.c_str() + dot + 1;
+  for (size_t i = 0; i < sizeof mime_types / sizeof mime_types[0]; i++)
+    if (!strcasecmp(ext, mime_types[i].extension))
+      return mime_types[i].type;
+
+  return "application/octet-stream";
+}
+
+string
+http_date(time_t t)
+{
+  struct tm tm;
+  char buf[64];
+  gmtime_r(&t, &tm);
+  strftime(buf, sizeof buf, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  return buf;
+}
+}
+
+string
+LocalCoverSource::response_header(const string& path, size_t length, time_t mtime)
+{
+  ostringstream header;
+  header << "HTTP/1.1 200 OK\r\n"
+         << "Date: " << http_date(time(NULL)) << "\r\n"
+         << "Server: Apache\r\n"
+         << "Last-Modified: " << http_date(mtime) << "\r\n"
+         << "Accept-Ranges: bytes\r\n"
+         << "Content-Length: " << length << "\r\n"
+         << "Content-Type: " << content_type_of(path) << "\r\n"
+         << "\r\n";
+  return header.str();
+}
+
+string
+LocalCoverSource::fetch(const string& cover)
+{
+  if (is_absolute_url(cover))
+    return _fallback ? _fallback->fetch(cover) : string();
+
+  //the names come from our own database, but never leave the doc root
+  if (cover.find("..") != string::npos) {
+    log_warn("refusing to serve %s from outside the doc root", cover.c_str());
+    return string();
+  }
+
+  string path = _doc_root + (cover.length() && cover[0] == '/' ? cover.substr(1) : cover);
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    log_warn("cannot open cover %s: %s", path.c_str(), strerror(errno));
+    return _fallback ? _fallback->fetch(cover) : string();
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    log_warn("cover %s is not a non-empty file", path.c_str());
+    close(fd);
+    return _fallback ? _fallback->fetch(cover) : string();
+  }
+
+  void* body = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (body == MAP_FAILED) {
+    log_warn("cannot map cover %s: %s", path.c_str(), strerror(errno));
+    return string();
+  }
+
+  string response = response_header(path, st.st_size, st.st_mtime);
+  response.reserve(response.size() + st.st_size);
+  response.append((const char*)body, st.st_size);
+  munmap(body, st.st_size);
+
+  return response;
+}
+
+/* CoverOriginPool */
+
+bool
+CoverOriginPool::parse_origin_list(const string& list, vector<OriginSpec>& origins)
+{
+  origins.clear();
+
+  stringstream items(list);
+  string item;
+  while (getline(items, item, ',')) {
+    OriginSpec origin;
+    origin.weight = 1;
+
+    size_t star = item.find('*');
+    origin.host = item.substr(0, star);
+    if (star != string::npos) {
+      string weight = item.substr(star + 1);
+      char* end;
+      unsigned long w = strtoul(weight.c_str(), &end, 10);
+      if (weight.empty() || *end || w == 0 || w > 1000)
+        return false;
+      origin.weight = w;
+    }
+
+    if (origin.host.empty() || origin.host.find_first_of(" \t/") != string::npos)
+      return false;
+    origins.push_back(origin);
+  }
+
+  return !origins.empty();
+}
+
+CoverOriginPool::CoverOriginPool(const vector<OriginSpec>& origins)
+{
+  if (!(_probes = curl_multi_init()))
+    log_abort("Failed to initiate the curl multi object");
+
+  for (size_t i = 0; i < origins.size(); i++) {
+    Origin origin;
+    origin.source = new HTTPCoverSource(origins[i].host);
+    origin.weight = origins[i].weight;
+    origin.failures = 0;
+    origin.misses = 0;
+    origin.down_until = 0;
+    origin.probe = NULL;
+    _origins.push_back(origin);
+  }
+}
+
+CoverOriginPool::~CoverOriginPool()
+{
+  for (size_t i = 0; i < _origins.size(); i++) {
+    if (_origins[i].probe) {
+      curl_multi_remove_handle(_probes, _origins[i].probe);
+      curl_easy_cleanup(_origins[i].probe);
+    }
+    delete _origins[i].source;
+  }
+  curl_multi_cleanup(_probes);
+}
+
+size_t
+CoverOriginPool::healthy() const
+{
+  size_t n = 0;
+  for (size_t i = 0; i < _origins.size(); i++)
+    if (!_origins[i].down_until)
+      n++;
+  return n;
+}
+
+void
+CoverOriginPool::mark_down(Origin& origin, time_t now)
+{
+  unsigned int shift = origin.failures < c_MAX_BACKOFF_SHIFT ?
+    origin.failures : c_MAX_BACKOFF_SHIFT;
+  origin.failures++;
+  origin.misses = 0;
+  origin.down_until = now + (c_RETRY_INTERVAL << shift);
+  log_warn("cover origin %s is down, checking it again in %lu seconds",
+           origin.source->host().c_str(),
+           (unsigned long)(origin.down_until - now));
+}
+
+void
+CoverOriginPool::check_down_origins(time_t now)
+{
+  int running;
+  curl_multi_perform(_probes, &running);
+
+  CURLMsg* msg;
+  int queued;
+  while ((msg = curl_multi_info_read(_probes, &queued))) {
+    if (msg->msg != CURLMSG_DONE)
+      continue;
+    CURL* probe = msg->easy_handle;
+    CURLcode result = msg->data.result; //msg goes with the handle
+
+    long response_code = 0;
+    curl_easy_getinfo(probe, CURLINFO_RESPONSE_CODE, &response_code);
+    curl_multi_remove_handle(_probes, probe);
+    curl_easy_cleanup(probe);
+
+    for (size_t i = 0; i < _origins.size(); i++) {
+      Origin& origin = _origins[i];
+      if (origin.probe != probe)
+        continue;
+      origin.probe = NULL;
+      //to come back the origin has to answer, not just accept
+      if (result == CURLE_OK && response_code < 500) {
+        log_info("cover origin %s is back", origin.source->host().c_str());
+        origin.down_until = 0;
+        origin.failures = 0;
+      } else
+        mark_down(origin, now);
+    }
+  }
+
+  //an origin stays out of the pool while its check runs
+  bool started = false;
+  for (size_t i = 0; i < _origins.size(); i++) {
+    Origin& origin = _origins[i];
+    if (!origin.down_until || now < origin.down_until || origin.probe)
+      continue;
+    origin.probe = origin.source->new_probe();
+    curl_multi_add_handle(_probes, origin.probe);
+    started = true;
+  }
+  if (started)
+    curl_multi_perform(_probes, &running);
+}
+
+int
+CoverOriginPool::pick(const vector<bool>& tried) const
+{
+  unsigned int total = 0;
+  for (size_t i = 0; i < _origins.size(); i++)
+    if (!tried[i] && !_origins[i].down_until)
+      total += _origins[i].weight;
+
+  if (total == 0)
+    return -1;
+
+  unsigned int r = rng_int(total);
+  for (size_t i = 0; i < _origins.size(); i++) {
+    if (tried[i] || _origins[i].down_until)
+      continue;
+    if (r < _origins[i].weight)
+      return i;
+    r -= _origins[i].weight;
+  }
+
+  return -1;
+}
+
+string
+CoverOriginPool::fetch(const string& cover)
+{
+  time_t now = time(NULL);
+  check_down_origins(now);
+
+  //an absolute url names its own server, which says nothing about
+  //the health of our origins
+  if (is_absolute_url(cover))
+    return _origins[0].source->fetch(cover);
+
+  vector<bool> tried(_origins.size(), false);
+  for (int i; (i = pick(tried)) >= 0; ) {
+    tried[i] = true;
+    Origin& origin = _origins[i];
+    string response = origin.source->fetch(cover);
+    if (!response.empty()) {
+      origin.misses = 0;
+      return response;
+    }
+    //a cover the origin lacks or a broken transfer is not enough to
+    //tell it is down, unless it keeps happening
+    if (origin.source->server_failed() || ++origin.misses >= c_MAX_MISSES)
+      mark_down(origin, now);
+  }
+
+  log_warn("no cover origin could serve %s", cover.c_str());
+  return string();
+}
@@ -0,0 +1,206 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+#ifndef _COVER_SOURCE_H
+#define _COVER_SOURCE_H
+
+#include <string>
+#include <vector>
+#include <time.h>
+#include <curl/curl.h>
+
+/**
+   Where the apache payload server gets the covers it serves. A cover
+   is named as the payload database names it: either by its path
+   relative to the cover server's document root, or by an absolute
+   url. fetch returns the cover the way the cover server serves it,
+   headers included, or an empty string if it can't be had.
+*/
+class CoverSource
+{
+ public:
+  virtual ~CoverSource() {}
+
+  virtual std::string fetch(const std::string& cover) = 0;
+
+  /** @return true if cover is an absolute url rather than a path */
+  static bool is_absolute_url(const std::string& cover)
+  {
+    return cover.find("://") != std::string::npos;
+  }
+
+  /**
+     Picks the backend for the given cover servers.
+
+     @param cover_server the cover server of the protocol. If it is this
+            machine and apache_conf gives its DocumentRoot, the covers
+            are read off the disk.
+     @param cover_origins if not empty, a list of origins serving the
+            same covers, see CoverOriginPool, used instead of cover_server
+     @param apache_conf the apache config file to find the doc root in
+  */
+  static CoverSource* create(const std::string& cover_server,
+                             const std::string& cover_origins,
+                             const std::string& apache_conf = "/etc/httpd/conf/httpd.conf");
+
+  /**
+     Reads the DocumentRoot off an apache config file.
+
+     @return the doc root ending with '/', or empty if not found
+  */
+  static std::string apache_doc_root(const std::string& apache_conf);
+};
+
+/**
+   Fetches covers from one http server with curl. This is what the
+   payload server always did.
+*/
+class HTTPCoverSource : public CoverSource
+{
+ protected:
+  std::string _host; //host[:port]
+  CURL* _curl_obj;
+  bool _server_failed; //by the last fetch
+
+  static const long c_CONNECT_TIMEOUT_MS = 5000;
+  static const long c_PROBE_TIMEOUT_MS = 10000;
+
+ public:
+  explicit HTTPCoverSource(const std::string& host);
+  virtual ~HTTPCoverSource();
+
+  /** An error response (5xx) is no cover: it gives an empty string. */
+  virtual std::string fetch(const std::string& cover);
+
+  /**
+     Health check: a curl handle asking the server for the head of its
+     root page, for the caller to run without blocking (on a multi
+     handle) and free.
+  */
+  CURL* new_probe() const;
+
+  /**
+     @return true if the last fetch failed for the server's sake
+             rather than the cover's: see server_failure
+  */
+  bool server_failed() const { return _server_failed; }
+
+  /**
+     Tells a failure of the server from one of a request: no
+     connection could be made, or the server answered with an error
+     (5xx). A missing cover or a broken transfer is not one.
+
+     @param result curl's result for the request
+     @param response_code the http status, 0 if none came
+  */
+  static bool server_failure(CURLcode result, long response_code);
+
+  const std::string& host() const { return _host; }
+
+ private:
+  HTTPCoverSource(const HTTPCoverSource&);
+  HTTPCoverSource& operator=(const HTTPCoverSource&);
+};
+
+/**
+   Reads the covers straight off the document root of a cover server
+   running on this machine, and makes up the headers apache would have
+   sent with them, so a cover costs a page cache hit instead of a
+   loopback http round trip. Absolute urls are not on our disk and go
+   to the fallback, and so do covers missing from it, which the cover
+   server may still serve (e.g. through an alias or a handler).
+*/
+class LocalCoverSource : public CoverSource
+{
+ protected:
+  std::string _doc_root; //ends with '/'
+  CoverSource* _fallback; //owned, may be NULL
+
+ public:
+  LocalCoverSource(const std::string& doc_root, CoverSource* fallback);
+  virtual ~LocalCoverSource();
+
+  virtual std::string fetch(const std::string& cover);
+
+  /**
+     The response header for a cover file of the given length and
+     modification time, as apache would write it.
+  */
+  static std::string response_header(const std::string& path, size_t length,
+                                     time_t mtime);
+
+ private:
+  LocalCoverSource(const LocalCoverSource&);
+  LocalCoverSource& operator=(const LocalCoverSource&);
+};
+
+/**
+   A weighted pool of origin servers which serve the same covers. Each
+   fetch goes to an origin chosen at random in proportion to its
+   weight; if it fails the next one is tried. An origin is taken out
+   of the pool when it cannot be connected to or answers with a server
+   error, or after a few failed fetches in a row. It is health checked
+   again after a while, backing off while it keeps failing. The health
+   checks run in the background: each fetch starts those due and
+   collects those done without waiting for any.
+*/
+class CoverOriginPool : public CoverSource
+{
+ public:
+  struct OriginSpec
+  {
+    std::string host;
+    unsigned int weight;
+  };
+
+  /**
+     Parses a comma separated list of host[:port][*weight], weight
+     being 1 unless given.
+
+     @return false if the list is empty or malformed
+  */
+  static bool parse_origin_list(const std::string& list,
+                                std::vector<OriginSpec>& origins);
+
+  explicit CoverOriginPool(const std::vector<OriginSpec>& origins);
+  virtual ~CoverOriginPool();
+
+  virtual std::string fetch(const std::string& cover);
+
+  size_t size() const { return _origins.size(); }
+  size_t healthy() const;
+
+ protected:
+  struct Origin
+  {
+    HTTPCoverSource* source;
+    unsigned int weight;
+    unsigned int failures; //consecutive health checks, for the back off
+    unsigned int misses; //failed fetches in a row, while in the pool
+    time_t down_until; //0 while in the pool
+    CURL* probe; //the health check in flight, or NULL
+  };
+
+  std::vector<Origin> _origins;
+  CURLM* _probes;
+
+  static const time_t c_RETRY_INTERVAL = 5; //seconds, doubled per failure
+  static const unsigned int c_MAX_BACKOFF_SHIFT = 6;
+  static const unsigned int c_MAX_MISSES = 3;
+
+  /**
+     Re-admits the origins whose health check has passed and starts
+     those due, without blocking.
+  */
+  void check_down_origins(time_t now);
+  void mark_down(Origin& origin, time_t now);
+
+  /** @return index of a weighted random origin in the pool, or -1 */
+  int pick(const std::vector<bool>& tried) const;
+
+ private:
+  CoverOriginPool(const CoverOriginPool&);
+  CoverOriginPool& operator=(const CoverOriginPool&);
+};
+
+#endif
@@ -0,0 +1,815 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "h2_session.h"
+
+#include <event2/buffer.h>
+#include <algorithm>
+
+using std::string;
+
+namespace {
+const char PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+const size_t PREFACE_LEN = sizeof PREFACE - 1;
+
+enum {
+  FRAME_DATA = 0, FRAME_HEADERS = 1, FRAME_PRIORITY = 2, FRAME_RST_STREAM = 3,
+  FRAME_SETTINGS = 4, FRAME_PUSH_PROMISE = 5, FRAME_PING = 6, FRAME_GOAWAY = 7,
+  FRAME_WINDOW_UPDATE = 8, FRAME_CONTINUATION = 9
+};
+
+enum {
+  FLAG_END_STREAM = 0x1, FLAG_ACK = 0x1, FLAG_END_HEADERS = 0x4,
+  FLAG_PADDED = 0x8, FLAG_PRIORITY = 0x20
+};
+
+enum {
+  FLOW_CONTROL_ERROR = 0x3
+};
+
+enum {
+  SETTINGS_HEADER_TABLE_SIZE = 1, SETTINGS_ENABLE_PUSH = 2,
+  SETTINGS_MAX_CONCURRENT_STREAMS = 3, SETTINGS_INITIAL_WINDOW_SIZE = 4,
+  SETTINGS_MAX_FRAME_SIZE = 5
+};
+
+const size_t HPACK_DEFAULT_TABLE_SIZE = 4096;
+const size_t HPACK_ENTRY_OVERHEAD = 32;
+const uint32_t MAX_WINDOW = 0x7fffffff;
+
+const h2_header STATIC_TABLE[] = {
+  h2_header(":authority", ""), h2_header(":method", "GET"),
+  h2_header(":method", "POST"), h2_header(":path", "/"),
+  h2_header(":path", "/index.html"), h2_header(":scheme", "http"),
+  h2_header(":scheme", "https"), h2_header(":status", "200"),
+  h2_header(":status", "204"), h2_header(":status", "206"),
+  h2_header(":status", "304"), h2_header(":status", "400"),
+  h2_header(":status", "404"), h2_header(":status", "500"),
+  h2_header("accept-charset", ""), h2_header("accept-encoding", "gzip, deflate"),
+  h2_header("accept-language", ""), h2_header("accept-ranges", ""),
+  h2_header("accept", ""), h2_header("access-control-allow-origin", ""),
+  h2_header("age", ""), h2_header("allow", ""),
+  h2_header("authorization", ""), h2_header("cache-control", ""),
+  h2_header("content-disposition", ""), h2_header("content-encoding", ""),
+  h2_header("content-language", ""), h2_header("content-length", ""),
+  h2_header("content-location", ""), h2_header("content-range", ""),
+  h2_header("content-type", ""), h2_header("cookie", ""),
+  h2_header("date", ""), h2_header("etag", ""),
+  h2_header("expect", ""), h2_header("expires", ""),
+  h2_header("from", ""), h2_header("host", ""),
+  h2_header("if-match", ""), h2_header("if-modified-since", ""),
+  h2_header("if-none-match", ""), h2_header("if-range", ""),
+  h2_header("if-unmodified-since", ""), h2_header("last-modified", ""),
+  h2_header("link", ""), h2_header("location", ""),
+  h2_header("max-forwards", ""), h2_header("proxy-authenticate", ""),
+  h2_header("proxy-authorization", ""), h2_header("range", ""),
+  h2_header("referer", ""), h2_header("refresh", ""),
+  h2_header("retry-after", ""), h2_header("server", ""),
+  h2_header("set-cookie", ""), h2_header("strict-transport-security", ""),
+  h2_header("transfer-encoding", ""), h2_header("user-agent", ""),
+  h2_header("vary", ""), h2_header("via", ""),
+  h2_header("www-authenticate", ""),
+};
+const size_t STATIC_TABLE_LEN = sizeof STATIC_TABLE / sizeof STATIC_TABLE[0];
+
+/** headers which change on every message, not worth a table entry */
+bool
+changes_every_time(const string& name)
+{
+  return name == ":path" || name == "cookie" || name == "content-length";
+}
+
+void
+add_int(string& out, uint8_t first, unsigned int prefix_bits, size_t value)
+{
+  size_t max = (1 << prefix_bits) - 1;
+  if (value < max) {
+    out += (char)(first | value);
+    return;
+  }
+  out += (char)(first | max);
+  for (value -= max; value >= 128; value >>= 7)
+    out += (char)(0x80 | (value & 0x7f));
+  out += (char)value;
+}
+
+void
+add_string(string& out, const string& s)
+{
+  add_int(out, 0, 7, s.size());
+  out += s;
+}
+
+int
+read_int(const uint8_t*& p, const uint8_t* end, unsigned int prefix_bits, size_t& value)
+{
+  if (p >= end)
+    return -1;
+  size_t max = (1 << prefix_bits) - 1;
+  value = *p++ & max;
+  if (value < max)
+    return 0;
+  for (unsigned int shift = 0; p < end && shift <= 21; shift += 7) {
+    uint8_t b = *p++;
+    value += (size_t)(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return 0;
+  }
+  return -1;
+}
+
+int
+read_string(const uint8_t*& p, const uint8_t* end, string& s)
+{
+  if (p >= end)
+    return -1;
+  bool huffman = *p & 0x80;
+  size_t len;
+  if (read_int(p, end, 7, len))
+    return -1;
+  if (huffman) {
+    log_warn("hpack: Huffman coded strings are not supported");
+    return -1;
+  }
+  if (len > (size_t)(end - p))
+    return -1;
+  s.assign((const char*)p, len);
+  p += len;
+  return 0;
+}
+
+uint32_t
+get_uint32(const uint8_t* p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+    ((uint32_t)p[2] << 8) | p[3];
+}
+
+void
+frame_header(uint8_t h[], size_t len, uint8_t type, uint8_t flags, uint32_t stream)
+{
+  h[0] = len >> 16;
+  h[1] = len >> 8;
+  h[2] = len;
+  h[3] = type;
+  h[4] = flags;
+  h[5] = (stream >> 24) & 0x7f;
+  h[6] = stream >> 16;
+  h[7] = stream >> 8;
+  h[8] = stream;
+}
+
+void
+add_setting(uint8_t*& p, uint16_t id, uint32_t value)
+{
+  *p++ = id >> 8;
+  *p++ = id;
+  *p++ = value >> 24;
+  *p++ = value >> 16;
+  *p++ = value >> 8;
+  *p++ = value;
+}
+}
+
+HpackTable::HpackTable()
+  : _size(0), _max_size(HPACK_DEFAULT_TABLE_SIZE)
+{
+}
+
+const h2_header*
+HpackTable::get(size_t index) const
+{
+  if (!index)
+    return NULL;
+  if (index <= STATIC_TABLE_LEN)
+    return &STATIC_TABLE[index - 1];
+  index -= STATIC_TABLE_LEN + 1;
+  return index < _dynamic.size() ? &_dynamic[index] : NULL;
+}
+
+ssize_t
+HpackTable::find(const h2_header& header) const
+{
+  ssize_t name_at = 0;
+  for (size_t i = 0; i < STATIC_TABLE_LEN + _dynamic.size(); i++) {
+    const h2_header& entry = i < STATIC_TABLE_LEN ? STATIC_TABLE[i] :
+      _dynamic[i - STATIC_TABLE_LEN];
+    if (entry.first != header.first)
+      continue;
+    if (entry.second == header.second)
+      return i + 1;
+    if (!name_at)
+      name_at = -(ssize_t)(i + 1);
+  }
+  return name_at;
+}
+
+void
+HpackTable::evict(size_t to)
+{
+  while (_size > to) {
+    const h2_header& oldest = _dynamic.back();
+    _size -= oldest.first.size() + oldest.second.size() + HPACK_ENTRY_OVERHEAD;
+    _dynamic.pop_back();
+  }
+}
+
+void
+HpackTable::add(const h2_header& header)
+{
+  size_t size = header.first.size() + header.second.size() + HPACK_ENTRY_OVERHEAD;
+  if (size > _max_size) { //it empties the table and is not added
+    evict(0);
+    return;
+  }
+  evict(_max_size - size);
+  _dynamic.push_front(header);
+  _size += size;
+}
+
+void
+HpackTable::resize(size_t max_size)
+{
+  _max_size = max_size;
+  evict(max_size);
+}
+
+void
+HpackEncoder::encode(const h2_header_list& headers, string& block)
+{
+  for (auto h = headers.begin(); h != headers.end(); h++) {
+    ssize_t index = _table.find(*h);
+    if (index > 0) {
+      add_int(block, 0x80, 7, index);
+      continue;
+    }
+
+    bool indexed = !changes_every_time(h->first);
+    if (indexed) //literal with incremental indexing
+      add_int(block, 0x40, 6, -index);
+    else //literal without indexing
+      add_int(block, 0x00, 4, -index);
+    if (!index)
+      add_string(block, h->first);
+    add_string(block, h->second);
+    if (indexed)
+      _table.add(*h);
+  }
+}
+
+int
+HpackDecoder::decode(const uint8_t* block, size_t len, h2_header_list& headers)
+{
+  const uint8_t* p = block;
+  const uint8_t* end = block + len;
+  size_t index;
+
+  while (p < end) {
+    uint8_t b = *p;
+    if (b & 0x80) { //indexed
+      if (read_int(p, end, 7, index))
+        return -1;
+      const h2_header* entry = _table.get(index);
+      if (!entry) {
+        log_warn("hpack: no header at index %lu", (unsigned long)index);
+        return -1;
+      }
+      headers.push_back(*entry);
+      continue;
+    }
+
+    if ((b & 0xe0) == 0x20) { //dynamic table size update
+      if (read_int(p, end, 5, index) || index > HPACK_DEFAULT_TABLE_SIZE)
+        return -1;
+      _table.resize(index);
+      continue;
+    }
+
+    //a literal, with incremental indexing or not
+    bool indexed = (b & 0xc0) == 0x40;
+    if (read_int(p, end, indexed ? 6 : 4, index))
+      return -1;
+    h2_header header;
+    if (index) {
+      const h2_header* entry = _table.get(index);
+      if (!entry) {
+        log_warn("hpack: no header name at index %lu", (unsigned long)index);
+        return -1;
+      }
+      header.first = entry->first;
+    } else if (read_string(p, end, header.first))
+      return -1;
+    if (read_string(p, end, header.second))
+      return -1;
+    if (indexed)
+      _table.add(header);
+    headers.push_back(header);
+  }
+
+  return 0;
+}
+
+H2Session::H2Session(bool is_client)
+  : _is_client(is_client), _started(false), _got_preface(is_client),
+    _going_away(false),
+    _next_stream(1), _last_peer_stream(0),
+    _send_window(c_DEFAULT_WINDOW), _recv_window(c_RECV_WINDOW),
+    _peer_initial_window(c_DEFAULT_WINDOW),
+    _peer_max_frame_size(c_DEFAULT_MAX_FRAME_SIZE),
+    _peer_max_streams(c_MAX_CONCURRENT_STREAMS),
+    _header_stream(0), _header_ends_stream(false)
+{
+}
+
+H2Session::~H2Session()
+{
+  for (auto s = _streams.begin(); s != _streams.end(); s++)
+    if (s->second.pending)
+      evbuffer_free(s->second.pending);
+}
+
+int
+H2Session::fail(const char* why)
+{
+  log_warn("h2: %s", why);
+  _going_away = true;
+  return -1;
+}
+
+/** Fails the session, telling the peer why in a GOAWAY. */
+int
+H2Session::go_away(evbuffer* out, uint32_t error, const char* why)
+{
+  uint32_t last = _is_client ? 0 : _last_peer_stream;
+  uint8_t payload[8] = { (uint8_t)(last >> 24), (uint8_t)(last >> 16),
+                         (uint8_t)(last >> 8), (uint8_t)last,
+                         (uint8_t)(error >> 24), (uint8_t)(error >> 16),
+                         (uint8_t)(error >> 8), (uint8_t)error };
+  add_frame(out, FRAME_GOAWAY, 0, 0, payload, sizeof payload);
+  return fail(why);
+}
+
+int
+H2Session::add_frame(evbuffer* out, uint8_t type, uint8_t flags,
+                     uint32_t stream, const void* payload, size_t len)
+{
+  uint8_t h[c_FRAME_HEADER_LEN];
+  frame_header(h, len, type, flags, stream);
+  if (evbuffer_add(out, h, sizeof h) || (len && evbuffer_add(out, payload, len)))
+    return -1;
+  return 0;
+}
+
+int
+H2Session::add_window_update(evbuffer* out, uint32_t stream, uint32_t increment)
+{
+  uint8_t inc[4] = { (uint8_t)(increment >> 24), (uint8_t)(increment >> 16),
+                     (uint8_t)(increment >> 8), (uint8_t)increment };
+  return add_frame(out, FRAME_WINDOW_UPDATE, 0, stream, inc, sizeof inc);
+}
+
+int
+H2Session::add_header_block(evbuffer* out, uint32_t stream, const string& block,
+                            bool end_stream)
+{
+  size_t at = 0;
+  do {
+    size_t n = std::min(block.size() - at, _peer_max_frame_size);
+    uint8_t flags = at + n == block.size() ? FLAG_END_HEADERS : 0;
+    uint8_t type = FRAME_CONTINUATION;
+    if (!at) {
+      type = FRAME_HEADERS;
+      if (end_stream)
+        flags |= FLAG_END_STREAM;
+    }
+    if (add_frame(out, type, flags, stream, block.data() + at, n))
+      return -1;
+    at += n;
+  } while (at < block.size());
+  return 0;
+}
+
+int
+H2Session::start(evbuffer* out)
+{
+  if (_started)
+    return 0;
+  _started = true;
+
+  if (_is_client && evbuffer_add(out, PREFACE, PREFACE_LEN))
+    return -1;
+
+  uint8_t settings[3 * 6];
+  uint8_t* p = settings;
+  add_setting(p, SETTINGS_ENABLE_PUSH, 0);
+  add_setting(p, SETTINGS_MAX_CONCURRENT_STREAMS, c_MAX_CONCURRENT_STREAMS);
+  add_setting(p, SETTINGS_INITIAL_WINDOW_SIZE, c_STREAM_RECV_WINDOW);
+  if (add_frame(out, FRAME_SETTINGS, 0, 0, settings, sizeof settings) ||
+      add_window_update(out, 0, c_RECV_WINDOW - c_DEFAULT_WINDOW))
+    return -1;
+
+  return 0;
+}
+
+uint32_t
+H2Session::send_request(const h2_header_list& headers, evbuffer* out)
+{
+  log_assert(_is_client);
+  if (start(out))
+    return 0;
+  if (_going_away || _streams.size() >= _peer_max_streams || _next_stream > MAX_WINDOW)
+    return 0;
+
+  string block;
+  _encoder.encode(headers, block);
+  uint32_t id = _next_stream;
+  if (add_header_block(out, id, block, true))
+    return 0;
+  _next_stream += 2;
+
+  Stream& s = _streams[id];
+  s.message.stream = id;
+  s.local_ended = true;
+  s.send_window = _peer_initial_window;
+  return id;
+}
+
+int
+H2Session::send_response(uint32_t stream, const h2_header_list& headers,
+                         const uint8_t* body, size_t body_len, evbuffer* out)
+{
+  log_assert(!_is_client);
+  if (start(out))
+    return -1;
+
+  auto it = _streams.find(stream);
+  if (it == _streams.end() || it->second.local_ended) {
+    log_warn("h2: no request on stream %u to answer", stream);
+    return -1;
+  }
+
+  string block;
+  _encoder.encode(headers, block);
+  if (add_header_block(out, stream, block, !body_len))
+    return -1;
+
+  if (!body_len) {
+    it->second.local_ended = true;
+    forget_if_closed(stream);
+    return 0;
+  }
+
+  it->second.pending = evbuffer_new();
+  if (!it->second.pending || evbuffer_add(it->second.pending, body, body_len))
+    return -1;
+  return flush(out);
+}
+
+size_t
+H2Session::blocked_bytes() const
+{
+  size_t n = 0;
+  for (auto s = _streams.begin(); s != _streams.end(); s++)
+    if (s->second.pending)
+      n += evbuffer_get_length(s->second.pending);
+  return n;
+}
+
+/** Sends the bodies waiting, oldest stream first, as the windows allow. */
+int
+H2Session::flush(evbuffer* out)
+{
+  for (auto it = _streams.begin(); it != _streams.end(); ) {
+    Stream& s = it->second;
+    while (s.pending) {
+      size_t left = evbuffer_get_length(s.pending);
+      int32_t window = std::min(_send_window, s.send_window);
+      if (window <= 0)
+        break;
+      size_t n = std::min(std::min(left, _peer_max_frame_size), (size_t)window);
+      bool last = n == left;
+
+      uint8_t h[c_FRAME_HEADER_LEN];
+      frame_header(h, n, FRAME_DATA, last ? FLAG_END_STREAM : 0, it->first);
+      if (evbuffer_add(out, h, sizeof h) ||
+          evbuffer_remove_buffer(s.pending, out, n) != (int)n)
+        return -1;
+      _send_window -= n;
+      s.send_window -= n;
+
+      if (last) {
+        evbuffer_free(s.pending);
+        s.pending = NULL;
+        s.local_ended = true;
+      }
+    }
+
+    if (s.local_ended && s.remote_ended)
+      it = _streams.erase(it);
+    else
+      it++;
+  }
+  return 0;
+}
+
+void
+H2Session::forget_if_closed(uint32_t stream)
+{
+  auto it = _streams.find(stream);
+  if (it == _streams.end() || !it->second.local_ended || !it->second.remote_ended)
+    return;
+  if (it->second.pending)
+    evbuffer_free(it->second.pending);
+  _streams.erase(it);
+}
+
+void
+H2Session::end_remote(uint32_t stream)
+{
+  Stream& s = _streams[stream];
+  s.remote_ended = true;
+  received.push_back(H2Message());
+  received.back().stream = stream;
+  received.back().headers.swap(s.message.headers);
+  received.back().body.swap(s.message.body);
+  forget_if_closed(stream);
+}
+
+int
+H2Session::receive(evbuffer* in, evbuffer* out)
+{
+  if (start(out))
+    return -1;
+
+  if (!_got_preface) {
+    size_t avail = evbuffer_get_length(in);
+    size_t n = std::min(avail, PREFACE_LEN);
+    if (!n)
+      return 0;
+    if (memcmp(evbuffer_pullup(in, n), PREFACE, n))
+      return fail("not an HTTP/2 connection preface");
+    if (avail < PREFACE_LEN)
+      return 0;
+    evbuffer_drain(in, PREFACE_LEN);
+    _got_preface = true;
+  }
+
+  for (;;) {
+    size_t avail = evbuffer_get_length(in);
+    if (avail < c_FRAME_HEADER_LEN)
+      break;
+
+    uint8_t h[c_FRAME_HEADER_LEN];
+    evbuffer_copyout(in, h, sizeof h);
+    size_t len = ((size_t)h[0] << 16) | ((size_t)h[1] << 8) | h[2];
+    if (len > c_DEFAULT_MAX_FRAME_SIZE)
+      return fail("frame larger than we allow");
+    if (avail < c_FRAME_HEADER_LEN + len)
+      break;
+
+    const uint8_t* frame = evbuffer_pullup(in, c_FRAME_HEADER_LEN + len);
+    if (!frame)
+      return fail("cannot pull up a frame");
+    int rv = handle_frame(h[3], h[4], get_uint32(h + 5) & MAX_WINDOW,
+                          frame + c_FRAME_HEADER_LEN, len, out);
+    evbuffer_drain(in, c_FRAME_HEADER_LEN + len);
+    if (rv)
+      return -1;
+  }
+
+  return flush(out);
+}
+
+int
+H2Session::handle_frame(uint8_t type, uint8_t flags, uint32_t stream,
+                        const uint8_t* payload, size_t len, evbuffer* out)
+{
+  if (_header_stream && type != FRAME_CONTINUATION)
+    return fail("header block interrupted");
+
+  switch (type) {
+  case FRAME_DATA:
+    return handle_data(flags, stream, payload, len, out);
+
+  case FRAME_HEADERS:
+    return handle_headers(flags, stream, payload, len);
+
+  case FRAME_CONTINUATION:
+    if (!_header_stream || stream != _header_stream)
+      return fail("CONTINUATION out of a header block");
+    _header_block.append((const char*)payload, len);
+    if (flags & FLAG_END_HEADERS)
+      return end_header_block();
+    return 0;
+
+  case FRAME_SETTINGS:
+    if (stream)
+      return fail("SETTINGS on a stream");
+    return handle_settings(flags, payload, len, out);
+
+  case FRAME_PING:
+    if (stream || len != 8)
+      return fail("malformed PING");
+    if (!(flags & FLAG_ACK) && add_frame(out, FRAME_PING, FLAG_ACK, 0, payload, len))
+      return -1;
+    return 0;
+
+  case FRAME_GOAWAY:
+    log_debug("h2: peer is going away");
+    _going_away = true;
+    return 0;
+
+  case FRAME_RST_STREAM: {
+    if (!stream || len != 4)
+      return fail("malformed RST_STREAM");
+    log_debug("h2: peer reset stream %u, error %u", stream, get_uint32(payload));
+    auto it = _streams.find(stream);
+    if (it != _streams.end()) {
+      if (it->second.pending)
+        evbuffer_free(it->second.pending);
+      _streams.erase(it);
+    }
+    return 0;
+  }
+
+  case FRAME_WINDOW_UPDATE: {
+    if (len != 4)
+      return fail("malformed WINDOW_UPDATE");
+    uint32_t increment = get_uint32(payload) & MAX_WINDOW;
+    if (!increment)
+      return fail("WINDOW_UPDATE of 0");
+    if (!stream) {
+      if ((int64_t)_send_window + increment > MAX_WINDOW)
+        return fail("connection window overflow");
+      _send_window += increment;
+      return 0;
+    }
+    auto it = _streams.find(stream);
+    if (it != _streams.end()) {
+      if ((int64_t)it->second.send_window + increment > MAX_WINDOW)
+        return fail("stream window overflow");
+      it->second.send_window += increment;
+    }
+    return 0;
+  }
+
+  case FRAME_PUSH_PROMISE:
+    return fail("PUSH_PROMISE though we disabled push");
+
+  default: //PRIORITY and extensions
+    return 0;
+  }
+}
+
+int
+H2Session::handle_settings(uint8_t flags, const uint8_t* payload, size_t len,
+                           evbuffer* out)
+{
+  if (flags & FLAG_ACK)
+    return len ? fail("SETTINGS ack with a payload") : 0;
+  if (len % 6)
+    return fail("malformed SETTINGS");
+
+  for (const uint8_t* p = payload; p < payload + len; p += 6) {
+    uint16_t id = (p[0] << 8) | p[1];
+    uint32_t value = get_uint32(p + 2);
+    switch (id) {
+    case SETTINGS_MAX_CONCURRENT_STREAMS:
+      _peer_max_streams = value;
+      break;
+
+    case SETTINGS_INITIAL_WINDOW_SIZE: {
+      if (value > MAX_WINDOW)
+        return fail("initial window too large");
+      int64_t delta = (int64_t)value - _peer_initial_window;
+      for (auto s = _streams.begin(); s != _streams.end(); s++)
+        s->second.send_window += delta;
+      _peer_initial_window = value;
+      break;
+    }
+
+    case SETTINGS_MAX_FRAME_SIZE:
+      if (value < c_DEFAULT_MAX_FRAME_SIZE || value > 0xffffff)
+        return fail("bad maximum frame size");
+      _peer_max_frame_size = value;
+      break;
+
+    case SETTINGS_HEADER_TABLE_SIZE:
+      //our encoder never grows its table past the default
+      if (value < HPACK_DEFAULT_TABLE_SIZE)
+        return fail("peer wants a smaller header table than we support");
+      break;
+
+    default: //SETTINGS_ENABLE_PUSH (we never push) and the rest
+      break;
+    }
+  }
+
+  return add_frame(out, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+}
+
+int
+H2Session::handle_headers(uint8_t flags, uint32_t stream, const uint8_t* payload,
+                          size_t len)
+{
+  if (!stream)
+    return fail("HEADERS on stream 0");
+
+  size_t at = 0, pad = 0;
+  if (flags & FLAG_PADDED) {
+    if (!len)
+      return fail("malformed HEADERS");
+    pad = payload[0];
+    at = 1;
+  }
+  if (flags & FLAG_PRIORITY)
+    at += 5;
+  if (at + pad > len)
+    return fail("malformed HEADERS");
+
+  if (_is_client) {
+    if (!_streams.count(stream))
+      return fail("a response on a stream we did not open");
+  } else if (!_streams.count(stream)) {
+    if (!(stream & 1) || stream <= _last_peer_stream)
+      return fail("bad stream id for a request");
+    if (_streams.size() >= c_MAX_CONCURRENT_STREAMS)
+      return fail("more streams than we allow");
+    _last_peer_stream = stream;
+    Stream& s = _streams[stream];
+    s.message.stream = stream;
+    s.send_window = _peer_initial_window;
+  }
+
+  _header_stream = stream;
+  _header_ends_stream = flags & FLAG_END_STREAM;
+  _header_block.assign((const char*)payload + at, len - at - pad);
+  if (flags & FLAG_END_HEADERS)
+    return end_header_block();
+  return 0;
+}
+
+int
+H2Session::end_header_block()
+{
+  uint32_t stream = _header_stream;
+  _header_stream = 0;
+
+  h2_header_list headers;
+  if (_decoder.decode((const uint8_t*)_header_block.data(), _header_block.size(), headers))
+    return fail("malformed header block");
+  _header_block.clear();
+
+  h2_header_list& message_headers = _streams[stream].message.headers;
+  message_headers.insert(message_headers.end(), headers.begin(), headers.end());
+  if (_header_ends_stream)
+    end_remote(stream);
+  return 0;
+}
+
+int
+H2Session::handle_data(uint8_t flags, uint32_t stream, const uint8_t* payload,
+                       size_t len, evbuffer* out)
+{
+  if (!stream)
+    return fail("DATA on stream 0");
+
+  //the whole frame counts, padding included
+  if (len > (size_t)_recv_window)
+    return go_away(out, FLOW_CONTROL_ERROR, "peer overran the connection window");
+  _recv_window -= len;
+  if (_recv_window <= (int32_t)c_RECV_WINDOW / 2) {
+    if (add_window_update(out, 0, c_RECV_WINDOW - _recv_window))
+      return -1;
+    _recv_window = c_RECV_WINDOW;
+  }
+
+  auto it = _streams.find(stream);
+  if (it == _streams.end() || it->second.remote_ended) {
+    log_debug("h2: DATA on closed stream %u", stream);
+    return 0;
+  }
+
+  size_t at = 0, pad = 0;
+  if (flags & FLAG_PADDED) {
+    if (!len)
+      return fail("malformed DATA");
+    pad = payload[0];
+    at = 1;
+  }
+  if (at + pad > len)
+    return fail("malformed DATA");
+
+  //the stream window is never replenished: it caps the body
+  Stream& s = it->second;
+  if (len > (size_t)s.recv_window)
+    return go_away(out, FLOW_CONTROL_ERROR, "peer overran a stream window");
+  s.recv_window -= len;
+
+  s.message.body.append((const char*)payload + at, len - at - pad);
+  if (flags & FLAG_END_STREAM)
+    end_remote(stream);
+  return 0;
+}
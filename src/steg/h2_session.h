@@ -0,0 +1,228 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+#ifndef _H2_SESSION_H
+#define _H2_SESSION_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <stdint.h>
+
+#include "payload_server.h"
+
+struct evbuffer;
+
+typedef std::pair<std::string, std::string> h2_header;
+typedef std::vector<h2_header> h2_header_list;
+
+/**
+   The HPACK (RFC 7541) header table: the static table followed by
+   the dynamic one, newest entry first.
+*/
+class HpackTable
+{
+ public:
+  HpackTable();
+
+  /** @return NULL if there is no entry at index */
+  const h2_header* get(size_t index) const;
+
+  /**
+     Looks a header up for the encoder.
+
+     @return the index of the entry holding both name and value, or
+             else minus the index of one holding the name, or 0
+  */
+  ssize_t find(const h2_header& header) const;
+
+  void add(const h2_header& header);
+  void resize(size_t max_size);
+
+  size_t max_size() const { return _max_size; }
+
+ private:
+  std::deque<h2_header> _dynamic;
+  size_t _size;
+  size_t _max_size;
+
+  void evict(size_t to);
+};
+
+/**
+   Writes header blocks. Strings are sent literally, never Huffman
+   coded, and headers which differ from one message to the next are
+   kept out of the dynamic table, so that the ones repeated on every
+   stream of a connection shrink to a byte or two.
+*/
+class HpackEncoder
+{
+ public:
+  void encode(const h2_header_list& headers, std::string& block);
+
+ private:
+  HpackTable _table;
+};
+
+/**
+   Reads the header blocks of the peer. Huffman coded strings are
+   refused: the peer is another stegotorus.
+*/
+class HpackDecoder
+{
+ public:
+  /** @return 0 on success, -1 on a malformed block */
+  int decode(const uint8_t* block, size_t len, h2_header_list& headers);
+
+ private:
+  HpackTable _table;
+};
+
+/** A request or a response whose stream the peer has ended. */
+struct H2Message
+{
+  uint32_t stream;
+  h2_header_list headers;
+  std::string body;
+};
+
+/**
+   The framing layer of an HTTP/2 connection over cleartext (h2c,
+   with prior knowledge), for the h2c steg module to carry covers on.
+
+   It keeps the connection state which has nothing to do with the
+   covers: the preface and settings, pings, stream ids, header
+   compression and both directions of flow control. Each side gives
+   the other a stream window as large as the largest cover body and
+   never replenishes it, so that no body can grow past that, and a
+   large connection window, replenished as bodies come in. A peer
+   overrunning a window fails the session with FLOW_CONTROL_ERROR. On
+   the server side, response bodies wait in the session until the
+   client's windows let them out.
+
+   Every method writing frames writes them to out, the connection's
+   outbound buffer.
+*/
+class H2Session
+{
+ public:
+  static const size_t c_FRAME_HEADER_LEN = 9;
+  static const size_t c_DEFAULT_MAX_FRAME_SIZE = 16384;
+  static const uint32_t c_DEFAULT_WINDOW = 65535;
+  static const uint32_t c_RECV_WINDOW = 1 << 20; //connection level
+  static const uint32_t c_STREAM_RECV_WINDOW = HTTP_PAYLOAD_BUF_SIZE; //a cover body fits
+  static const uint32_t c_MAX_CONCURRENT_STREAMS = 100; //we allow the peer
+
+  H2Session(bool is_client);
+  ~H2Session();
+
+  /**
+     The client sends the connection preface and its settings, the
+     server its settings. Called on first use by the other methods.
+  */
+  int start(evbuffer* out);
+
+  /**
+     Parses the frames in `in`, answering settings and pings and
+     applying window updates. The messages the peer ends are queued in
+     received.
+
+     @return 0, or -1 on a protocol error after which the connection
+             cannot be used; a flow control error has a GOAWAY written
+             to out first
+  */
+  int receive(evbuffer* in, evbuffer* out);
+
+  /**
+     Client: opens a stream carrying a request without a body.
+
+     @return the stream id, or 0 if no more streams can be opened
+  */
+  uint32_t send_request(const h2_header_list& headers, evbuffer* out);
+
+  /**
+     Server: answers a stream. The body goes out as far as the
+     windows allow and the rest waits for window updates.
+
+     @return 0 or -1
+  */
+  int send_response(uint32_t stream, const h2_header_list& headers,
+                    const uint8_t* body, size_t body_len, evbuffer* out);
+
+  /** Streams opened and not ended in both directions. */
+  size_t open_streams() const { return _streams.size(); }
+
+  /** How many streams the peer lets us have open at once. */
+  size_t peer_max_streams() const { return _peer_max_streams; }
+
+  /** Response bytes waiting for the client's windows. */
+  size_t blocked_bytes() const;
+
+  /** The peer sent GOAWAY or we hit a protocol error. */
+  bool going_away() const { return _going_away; }
+
+  std::deque<H2Message> received;
+
+ private:
+  struct Stream
+  {
+    Stream() : remote_ended(false), local_ended(false), send_window(0),
+               recv_window(c_STREAM_RECV_WINDOW), pending(NULL) {}
+
+    H2Message message;
+    bool remote_ended;
+    bool local_ended;
+    int32_t send_window;
+    int32_t recv_window; //what the peer may still send on it
+    evbuffer* pending; //body waiting for the windows
+  };
+
+  H2Session(const H2Session&);
+  H2Session& operator=(const H2Session&);
+
+  int handle_frame(uint8_t type, uint8_t flags, uint32_t stream,
+                   const uint8_t* payload, size_t len, evbuffer* out);
+  int handle_settings(uint8_t flags, const uint8_t* payload, size_t len, evbuffer* out);
+  int handle_data(uint8_t flags, uint32_t stream, const uint8_t* payload,
+                  size_t len, evbuffer* out);
+  int handle_headers(uint8_t flags, uint32_t stream, const uint8_t* payload,
+                     size_t len);
+  int end_header_block();
+  int add_header_block(evbuffer* out, uint32_t stream, const std::string& block,
+                       bool end_stream);
+  void end_remote(uint32_t stream);
+  void forget_if_closed(uint32_t stream);
+  int flush(evbuffer* out);
+  int fail(const char* why);
+  int go_away(evbuffer* out, uint32_t error, const char* why);
+
+  static int add_frame(evbuffer* out, uint8_t type, uint8_t flags,
+                       uint32_t stream, const void* payload, size_t len);
+  static int add_window_update(evbuffer* out, uint32_t stream, uint32_t increment);
+
+  bool _is_client;
+  bool _started;
+  bool _got_preface;
+  bool _going_away;
+
+  HpackEncoder _encoder;
+  HpackDecoder _decoder;
+
+  std::map<uint32_t, Stream> _streams; //ordered, oldest first
+  uint32_t _next_stream; //client: the id of the next request
+  uint32_t _last_peer_stream; //server: the highest id the client used
+
+  int32_t _send_window; //connection level
+  int32_t _recv_window; //connection level
+  uint32_t _peer_initial_window;
+  size_t _peer_max_frame_size;
+  size_t _peer_max_streams;
+
+  //a header block being continued
+  uint32_t _header_stream;
+  bool _header_ends_stream;
+  std::string _header_block;
+};
+
+#endif
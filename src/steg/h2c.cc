@@ -0,0 +1,422 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+/**
+   The http steg carried over HTTP/2 in cleartext (h2c, with prior
+   knowledge). The covers and the way the data is hidden in them are
+   those of the http steg: the client's data goes in the cookie of a
+   request and the server's in the body of the response, by the
+   FileStegMod of its type. What changes is that a connection is not
+   used for one request only: the client keeps up to --max-streams
+   requests open on it at once and the server answers each stream in
+   turn, so the circuit needs fewer connections and the headers
+   repeated on every request are sent once per connection.
+ */
+
+#include <event2/buffer.h>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+#include "util.h"
+#include "connections.h"
+#include "protocol.h"
+#include "steg.h"
+
+#include "payload_server.h"
+#include "base64.h"
+#include "b64cookies.h"
+#include "http_steg_mods/file_steg.h"
+
+#include "http.h"
+#include "h2_session.h"
+
+namespace {
+  struct h2c_steg_config_t : http_steg_config_t
+  {
+    static const size_t c_DEFAULT_MAX_STREAMS = 8;
+    size_t max_streams; //client: requests open at once on a connection
+
+    void h2c_steg_config_common_init();
+    STEG_CONFIG_DECLARE_METHODS(h2c);
+  };
+
+  struct h2c_steg_t : http_steg_t
+  {
+    h2c_steg_config_t *h2c_config;
+    H2Session session;
+
+    //client: the cover type each open stream asked for
+    map<uint32_t, int> stream_types;
+    //server: the streams still to answer and the type they asked for
+    deque<pair<uint32_t, int> > unanswered;
+    //server: brings the next answer due, see transmit
+    wheel_timer answer_timer;
+
+    h2c_steg_t(h2c_steg_config_t *cf, conn_t *cn);
+    STEG_DECLARE_METHODS(h2c);
+
+    int client_transmit(evbuffer *source, evbuffer *dest);
+    int server_transmit(evbuffer *source, evbuffer *dest);
+    int client_receive(evbuffer *source, evbuffer *dest);
+    int server_receive(evbuffer *source, evbuffer *dest);
+
+    static void answer_next_cb(wheel_timer *, void *arg);
+  };
+}
+
+STEG_DEFINE_MODULE(h2c);
+
+h2c_steg_config_t::h2c_steg_config_t(config_t *cfg, const std::vector<std::string>& options)
+  : http_steg_config_t(cfg, options, true)
+{
+  h2c_steg_config_common_init();
+}
+
+h2c_steg_config_t::h2c_steg_config_t(config_t *cfg, const YAML::Node& options)
+  : http_steg_config_t(cfg, options, true)
+{
+  h2c_steg_config_common_init();
+}
+
+void
+h2c_steg_config_t::h2c_steg_config_common_init()
+{
+  max_streams = c_DEFAULT_MAX_STREAMS;
+  if (!http_steg_user_configs["max-streams"].empty()) {
+    int n = atoi(http_steg_user_configs["max-streams"].c_str());
+    if (n <= 0 || n > (int)H2Session::c_MAX_CONCURRENT_STREAMS)
+      log_abort("h2c steg: max-streams must be between 1 and %u",
+                H2Session::c_MAX_CONCURRENT_STREAMS);
+    max_streams = n;
+  }
+}
+
+h2c_steg_config_t::~h2c_steg_config_t()
+{
+}
+
+steg_t *
+h2c_steg_config_t::steg_create(conn_t *conn)
+{
+  return new h2c_steg_t(this, conn);
+}
+
+h2c_steg_t::h2c_steg_t(h2c_steg_config_t *cf, conn_t *cn)
+  : http_steg_t((http_steg_config_t*)cf, cn), h2c_config(cf),
+    session(cf->is_clientside)
+{
+  if (!cf->is_clientside)
+    answer_timer.set(answer_next_cb, this);
+}
+
+h2c_steg_t::~h2c_steg_t()
+{
+}
+
+steg_config_t *
+h2c_steg_t::cfg()
+{
+  return h2c_config;
+}
+
+/**
+   Splits the header of an HTTP/1 message into its start line and the
+   HTTP/2 headers, leaving out those HTTP/2 does not carry.
+*/
+static string
+http1_to_h2_headers(const char *hdr, size_t len, h2_header_list& headers)
+{
+  string text(hdr, len);
+  size_t eol = text.find("\r\n");
+  if (eol == string::npos)
+    return string();
+
+  for (size_t at = eol + 2; at < text.size(); ) {
+    size_t end = text.find("\r\n", at);
+    if (end == string::npos)
+      end = text.size();
+    if (end == at) //the blank line
+      break;
+    string line = text.substr(at, end - at);
+    at = end + 2;
+
+    size_t colon = line.find(':');
+    if (colon == string::npos)
+      continue;
+    string name = line.substr(0, colon);
+    transform(name.begin(), name.end(), name.begin(), ::tolower);
+    if (name == "host" || name == "connection" || name == "keep-alive" ||
+        name == "proxy-connection" || name == "transfer-encoding" ||
+        name == "upgrade" || name == "te" || name == "cookie")
+      continue;
+    size_t value = line.find_first_not_of(" \t", colon + 1);
+    headers.push_back(h2_header(name, value == string::npos ? "" : line.substr(value)));
+  }
+
+  return text.substr(0, eol);
+}
+
+static const string*
+find_header(const h2_header_list& headers, const char *name)
+{
+  for (auto h = headers.begin(); h != headers.end(); h++)
+    if (h->first == name)
+      return &h->second;
+  return NULL;
+}
+
+size_t
+h2c_steg_t::transmit_room(size_t pref, size_t lo, size_t hi)
+{
+  if (session.going_away())
+    return 0;
+
+  if (config->is_clientside) {
+    if (session.open_streams() >= min(h2c_config->max_streams,
+                                      session.peer_max_streams()))
+      return 0;
+  } else {
+    //no request to answer, or the client is not reading the answers
+    if (unanswered.empty() || session.blocked_bytes() >= H2Session::c_RECV_WINDOW)
+      return 0;
+    type = unanswered.front().second;
+    have_received = true;
+  }
+
+  return http_steg_t::transmit_room(pref, lo, hi);
+}
+
+int
+h2c_steg_t::transmit(evbuffer *source)
+{
+  evbuffer *dest = conn->outbound();
+  size_t before = evbuffer_get_length(dest);
+
+  int rval = config->is_clientside ? client_transmit(source, dest) :
+    server_transmit(source, dest);
+  if (rval < 0)
+    return rval;
+
+  return evbuffer_get_length(dest) - before;
+}
+
+int
+h2c_steg_t::client_transmit(evbuffer *source, evbuffer *dest)
+{
+  char buf[10000];
+  size_t payload_len = 0;
+  for (int cnt = 0; !payload_len; cnt++) {
+    if (cnt == 10)
+      return -1;
+    payload_len = config->payload_server->find_client_payload(buf, sizeof(buf) - 1,
+                                                              TYPE_HTTP_REQUEST);
+  }
+  buf[payload_len] = 0;
+
+  //the method, path and the headers of the template request
+  h2_header_list template_headers;
+  string request_line = http1_to_h2_headers(buf, payload_len, template_headers);
+  size_t method_end = request_line.find(' ');
+  size_t path_end = request_line.rfind(' ');
+  if (method_end == string::npos || path_end <= method_end) {
+    log_warn(conn, "h2c: bad request line in the request template");
+    return -1;
+  }
+
+  if (peer_dnsname.empty())
+    peer_dnsname = lookup_peer_name_from_ip(conn->peername);
+
+  h2_header_list headers;
+  headers.push_back(h2_header(":method", request_line.substr(0, method_end)));
+  headers.push_back(h2_header(":scheme", "http"));
+  headers.push_back(h2_header(":authority", peer_dnsname));
+  headers.push_back(h2_header(":path", request_line.substr(method_end + 1,
+                                                           path_end - method_end - 1)));
+  headers.insert(headers.end(), template_headers.begin(), template_headers.end());
+
+  //the data goes in the cookie, as with http
+  size_t sbuflen = evbuffer_get_length(source);
+  const char *data = (const char *)evbuffer_pullup(source, sbuflen);
+  if (!data) {
+    log_warn(conn, "evbuffer_pullup failed");
+    return -1;
+  }
+  vector<char> encoded(sbuflen * 4 + 4);
+  vector<char> cookies(sbuflen * 8 + 8);
+  base64::encoder E(false, '-', '_', '.');
+  size_t len = E.encode(data, sbuflen, encoded.data());
+  len += E.encode_end(encoded.data() + len);
+  size_t cookie_len = gen_b64_cookies(cookies.data(), encoded.data(), len);
+  headers.push_back(h2_header("cookie", string(cookies.data(), cookie_len)));
+
+  uint32_t stream = session.send_request(headers, dest);
+  if (!stream) {
+    log_warn(conn, "h2c: cannot open a stream");
+    return -1;
+  }
+  stream_types[stream] = config->payload_server->find_uri_type(buf, payload_len);
+  evbuffer_drain(source, sbuflen);
+
+  log_debug(conn, "CLIENT requested type %d on stream %u with %lu bytes",
+            stream_types[stream], stream, (unsigned long)sbuflen);
+  return 0;
+}
+
+int
+h2c_steg_t::server_transmit(evbuffer *source, evbuffer *dest)
+{
+  log_assert(!unanswered.empty());
+  uint32_t stream = unanswered.front().first;
+  int type = unanswered.front().second;
+
+  if (!config->payload_server->is_activated_valid_content_type(type)) {
+    log_warn("The content type %i requested by client is not valid or activated", type);
+    return -1;
+  }
+  log_assert(config->file_steg_mods.find(type) != config->file_steg_mods.end());
+
+  uint8_t hdr[MAX_RESP_HDR_SIZE];
+  size_t hdr_len;
+  const uint8_t *body;
+  ssize_t body_len = config->file_steg_mods[type]->embed_in_cover(source, hdr, &hdr_len, &body);
+  if (body_len < 0)
+    return -1;
+
+  h2_header_list cover_headers;
+  string status_line = http1_to_h2_headers((const char *)hdr, hdr_len, cover_headers);
+  size_t status_at = status_line.find(' ');
+  if (status_at == string::npos) {
+    log_warn(conn, "h2c: bad status line in the cover");
+    return -1;
+  }
+
+  h2_header_list headers;
+  headers.push_back(h2_header(":status", status_line.substr(status_at + 1, 3)));
+  headers.insert(headers.end(), cover_headers.begin(), cover_headers.end());
+  if (session.send_response(stream, headers, body, body_len, dest))
+    return -1;
+
+  log_debug(conn, "SERVER answered stream %u with %ld bytes of type %d",
+            stream, (long)body_len, type);
+  unanswered.pop_front();
+
+  //chop disarms the must send timer once we return, so the next
+  //answer due is brought on from outside of it
+  if (!unanswered.empty())
+    answer_timer.arm(config->cfg->base, 0);
+  return 0;
+}
+
+/* static */ void
+h2c_steg_t::answer_next_cb(wheel_timer *, void *arg)
+{
+  h2c_steg_t *steg = static_cast<h2c_steg_t *>(arg);
+  if (!steg->unanswered.empty())
+    steg->conn->transmit_soon(WAIT_BEFORE_TRANSMIT);
+}
+
+int
+h2c_steg_t::receive(evbuffer *dest)
+{
+  evbuffer *source = conn->inbound();
+
+  if (config->is_clientside)
+    return client_receive(source, dest);
+
+  return server_receive(source, dest);
+}
+
+int
+h2c_steg_t::server_receive(evbuffer *source, evbuffer *dest)
+{
+  if (session.receive(source, conn->outbound()))
+    return RECV_BAD;
+
+  size_t unanswered_before = unanswered.size();
+  for (; !session.received.empty(); session.received.pop_front()) {
+    const H2Message& request = session.received.front();
+    const string *method = find_header(request.headers, ":method");
+    const string *path = find_header(request.headers, ":path");
+    const string *cookie = find_header(request.headers, "cookie");
+    if (!method || !path || !cookie) {
+      log_warn(conn, "h2c: request on stream %u lacks a method, path or cookie",
+               request.stream);
+      return RECV_BAD;
+    }
+
+    if (cookie->size() > MAX_COOKIE_SIZE * 3/2) {
+      log_warn(conn, "cookie too big: %lu (max %lu)",
+               (unsigned long)cookie->size(), (unsigned long)MAX_COOKIE_SIZE);
+      return RECV_BAD;
+    }
+
+    char outbuf[MAX_COOKIE_SIZE * 3/2];
+    char outbuf2[MAX_COOKIE_SIZE];
+    memset(outbuf, 0, sizeof(outbuf));
+    size_t cookielen = unwrap_b64_cookies(outbuf, cookie->data(), cookie->size());
+
+    base64::decoder D('-', '_', '.');
+    memset(outbuf2, 0, sizeof(outbuf2));
+    int sofar = D.decode(outbuf, cookielen+1, outbuf2);
+    if (sofar <= 0)
+      log_warn(conn, "base64 decode failed\n");
+    if (sofar >= MAX_COOKIE_SIZE) {
+      log_warn(conn, "cookie decode buffer overflow\n");
+      return RECV_BAD;
+    }
+
+    if (evbuffer_add(dest, outbuf2, sofar)) {
+      log_debug(conn, "Failed to transfer buffer");
+      return RECV_BAD;
+    }
+
+    string request_line = *method + " " + *path + " HTTP/1.1\r\n";
+    int type = config->payload_server->find_uri_type(request_line.data(),
+                                                     request_line.size());
+    unanswered.push_back(make_pair(request.stream, type));
+  }
+
+  if (unanswered.size() > unanswered_before)
+    conn->transmit_soon(WAIT_BEFORE_TRANSMIT);
+  return RECV_GOOD;
+}
+
+int
+h2c_steg_t::client_receive(evbuffer *source, evbuffer *dest)
+{
+  if (session.receive(source, conn->outbound()))
+    return RECV_BAD;
+
+  for (; !session.received.empty(); session.received.pop_front()) {
+    const H2Message& response = session.received.front();
+    auto stream_type = stream_types.find(response.stream);
+    log_assert(stream_type != stream_types.end());
+    int type = stream_type->second;
+    stream_types.erase(stream_type);
+
+    const string *status = find_header(response.headers, ":status");
+    if (!status || *status != "200") {
+      log_warn(conn, "h2c: stream %u answered with status %s", response.stream,
+               status ? status->c_str() : "(none)");
+      return RECV_BAD;
+    }
+
+    auto steg_mod = config->file_steg_mods.find(type);
+    if (steg_mod == config->file_steg_mods.end() || !steg_mod->second) {
+      log_warn(conn, "h2c: no steg mod for type %d of stream %u", type,
+               response.stream);
+      return RECV_BAD;
+    }
+
+    log_debug(conn, "receiving a payload of type %i on stream %u", type,
+              response.stream);
+    if (steg_mod->second->extract_from_cover((const uint8_t *)response.body.data(),
+                                             response.body.size(), dest) < 0)
+      return RECV_BAD;
+  }
+
+  return RECV_GOOD;
+}
@@ -39,6 +39,13 @@ using namespace std;
 #include "http.h"
 
 STEG_DEFINE_MODULE(http);
+
+static bool
+valid_js_encoding(const string& name)
+{
+  return name == "hex" || name == "alnum";
+}
+
 void
 http_steg_config_t::init_http_steg_config_t(bool init_payload_server)
 { 
@@ -85,7 +92,48 @@ http_steg_config_t::store_options(const std::vector<string>& options)
       }
       http_steg_user_configs["cover-list"] = *(cur_option + 1);
       cur_option++;
+
+    } else if (*cur_option == "--cover-origins") {
+      if (cur_option + 1 == options.end()) {
+        log_warn("http_steg: option --cover-origins requires a list of host[:port][*weight]");
+        goto usage;
+      }
+      http_steg_user_configs["cover-origins"] = *(cur_option + 1);
+      cur_option++;
+
+    } else if (*cur_option == "--shared-cover-cache") {
+      if (cur_option + 1 == options.end()) {
+        log_warn("http_steg: option --shared-cover-cache requires its size in megabytes");
+        goto usage;
+      }
+      http_steg_user_configs["shared-cover-cache"] = *(cur_option + 1);
+      cur_option++;
       
+    } else if (*cur_option == "--max-streams") {
+      if (cur_option + 1 == options.end()) {
+        log_warn("http_steg: option --max-streams requires a number of streams");
+        goto usage;
+      }
+      http_steg_user_configs["max-streams"] = *(cur_option + 1);
+      cur_option++;
+
+    } else if (*cur_option == "--precompress-covers") {
+      http_steg_user_configs["precompress-covers"] = "true";
+
+    } else if (*cur_option == "--chunked-responses") {
+      http_steg_user_configs["chunked-responses"] = "true";
+
+    } else if (*cur_option == "--use-curl") {
+      http_steg_user_configs["use-curl"] = "true";
+
+    } else if (*cur_option == "--js-encoding" || *cur_option == "--html-encoding") {
+      if (cur_option + 1 == options.end() || !valid_js_encoding(*(cur_option + 1))) {
+        log_warn("http_steg: option %s requires hex or alnum", cur_option->c_str());
+        goto usage;
+      }
+      http_steg_user_configs[cur_option->substr(2)] = *(cur_option + 1);
+      cur_option++;
+
     } else {
       log_warn("chop: unrecognized option '%s'", cur_option->c_str());
       goto usage;
@@ -98,7 +146,12 @@ usage:
   log_abort("http steg syntax:\n"
            "\thttp <down_address> [steg-options]\n"
            "\t\tdown_address ~ host:port\n"
-           "\t\tsteg-options ~ --stegmod \n"
+           "\t\tsteg-options ~ --stegmod --precompress-covers --use-curl\n"
+           "\t\t\t--chunked-responses\n"
+           "\t\t\t--cover-origins <host[:port][*weight],...>\n"
+           "\t\t\t--shared-cover-cache <megabytes>\n"
+           "\t\t\t--max-streams <requests open at once, h2c only>\n"
+           "\t\t\t--js-encoding <hex|alnum> --html-encoding <hex|alnum>\n"
            "Examples:\n"
            "http 192.168.1.99:11253 stegmod javascript\n"
            "http 192.168.1.99:11253");
@@ -125,12 +178,26 @@ http_steg_config_t::store_options(const YAML::Node& options)
             (current_field_name == "name") ||
             (current_field_name == "down-address") ||
             (current_field_name == "steg-mod") ||
-            (current_field_name == "cover-list")
+            (current_field_name == "cover-list") ||
+            (current_field_name == "cover-origins") ||
+            (current_field_name == "shared-cover-cache") ||
+            (current_field_name == "precompress-covers") ||
+            (current_field_name == "chunked-responses") ||
+            (current_field_name == "max-streams") ||
+            (current_field_name == "use-curl") ||
+            (current_field_name == "js-encoding") ||
+            (current_field_name == "html-encoding")
               )) {
           log_warn("http steg: invalid config keyword %s", current_field_name.c_str());
           return false;
         }
           http_steg_user_configs[current_field_name] = cur_conf_field.second.as<std::string>();
+          if ((current_field_name == "js-encoding" ||
+               current_field_name == "html-encoding") &&
+              !valid_js_encoding(http_steg_user_configs[current_field_name])) {
+            log_warn("http steg: %s must be hex or alnum", current_field_name.c_str());
+            return false;
+          }
 
       }
   }  catch( YAML::RepresentationException &e ) {
@@ -163,6 +230,22 @@ void http_steg_config_t::init_file_steg_mods()
   file_steg_mods[HTTP_CONTENT_JAVASCRIPT] = new JSSteg(payload_server, noise2signal);
   file_steg_mods[HTTP_CONTENT_HTML] = new HTMLSteg(payload_server, noise2signal);
 
+  //compress the unchanging parts of the covers only once
+  if (http_steg_user_configs["precompress-covers"] == "true")
+    ((SWFSteg*)file_steg_mods[HTTP_CONTENT_SWF])->precompress_cover = true;
+
+  //the client needs no telling, the response header says
+  if (http_steg_user_configs["chunked-responses"] == "true")
+    for (auto cur_mod : file_steg_mods)
+      if (cur_mod.second)
+        cur_mod.second->chunked_responses = true;
+
+  //the other side has to be told the same, nothing in the cover says
+  if (http_steg_user_configs["js-encoding"] == "alnum")
+    ((JSSteg*)file_steg_mods[HTTP_CONTENT_JAVASCRIPT])->encoding = JS_ENCODING_ALNUM;
+  if (http_steg_user_configs["html-encoding"] == "alnum")
+    ((HTMLSteg*)file_steg_mods[HTTP_CONTENT_HTML])->encoding = JS_ENCODING_ALNUM;
+
 
   //TODO: for now only one steg module can be mentioned for testing.
   //It should be that a comma separated list should be able to
@@ -280,13 +363,14 @@ buf_dump(unsigned char* buf, int len, FILE *out)
 
 http_steg_t::http_steg_t(http_steg_config_t *cf, conn_t *cn)
   : config(cf), conn(cn),
-    have_transmitted(false), have_received(false)
+    have_transmitted(false), have_received(false), skipping_cover(false),
+    chunked_body(NULL)
 {
-  memset(peer_dnsname, 0, sizeof peer_dnsname);
 }
 
 http_steg_t::~http_steg_t()
 {
+  delete chunked_body;
 }
 
 steg_config_t *
@@ -328,6 +412,9 @@ http_steg_t::transmit_room(size_t pref, size_t lo, size_t hi)
     //type = HTTP_CONTENT_JAVASCRIPT;
     log_debug(conn, "checking available capacity for type %u", type);
     hi = config->payload_server->_payload_database.typed_maximum_capacity(type);
+    auto steg_mod = config->file_steg_mods.find(type);
+    if (steg_mod != config->file_steg_mods.end() && steg_mod->second)
+      hi = steg_mod->second->room_in_capacity(hi);
     // switch (type)
     //   {
     //     //TODO: This needs to be handle by the SWFSteg i.e. the
@@ -380,42 +467,27 @@ http_steg_t::transmit_room(size_t pref, size_t lo, size_t hi)
 
 }
 
-int
-lookup_peer_name_from_ip(const char* p_ip, char* p_name)  
+/**
+   Returns the dns name of the peer at p_ip (ip:port) if it is in the
+   resolver cache, otherwise its numeric address as getnameinfo would.
+   The lookup happens in the background, so the next connections get
+   the name.
+*/
+std::string
+lookup_peer_name_from_ip(const char* p_ip)
 {
-  struct addrinfo* ailist;
-  struct addrinfo* aip;
-  struct addrinfo hint;
-  int res;
-  char buf[128];
-
-  hint.ai_flags = AI_CANONNAME;
-  hint.ai_family = PF_UNSPEC;
-  hint.ai_socktype = 0;
-  hint.ai_protocol = 0;
-  hint.ai_addrlen = 0;
-  hint.ai_canonname = NULL;
-  hint.ai_addr = NULL;
-  hint.ai_next = NULL;
-
-  strcpy(buf, p_ip);
-  buf[strchr(buf, ':') - buf] = 0;
-
-  if ((res = getaddrinfo(buf, NULL, &hint, &ailist))) {
-    log_warn("getaddrinfo(%s) failed: %s", p_ip, gai_strerror(res));
-    return 0;
+  const char* name = lookup_peer_name(p_ip);
+  if (name)
+    return name;
+
+  //numeric address without the port
+  const char* port = strrchr(p_ip, ':');
+  size_t len = port ? (size_t)(port - p_ip) : strlen(p_ip);
+  if (p_ip[0] == '[' && len >= 2) { //ipv6
+    p_ip++;
+    len -= 2;
   }
-
-  for (aip = ailist; aip != NULL; aip = aip->ai_next) {
-    char buf[512];
-    if (getnameinfo(aip->ai_addr, sizeof(struct sockaddr),
-        buf, 512, NULL, 0, 0) == 0) {
-      strcpy(p_name, buf);
-      return 1;
-    }
-  }
-
-  return 0;
+  return std::string(p_ip, len);
 }
 
 int
@@ -459,8 +531,8 @@ http_steg_t::http_client_cookie_transmit (evbuffer *source, conn_t *conn)
   }
   buf[payload_len] = 0;
 
-  if (peer_dnsname[0] == '\0')
-    lookup_peer_name_from_ip(conn->peername, peer_dnsname);
+  if (peer_dnsname.empty())
+    peer_dnsname = lookup_peer_name_from_ip(conn->peername);
 
   memset(data2, 0, sbuflen*4);
   len  = E.encode(data, sbuflen, data2);
@@ -490,12 +562,12 @@ http_steg_t::http_client_cookie_transmit (evbuffer *source, conn_t *conn)
   }
   transmit_len += 6;
 
-  rval = evbuffer_add(dest, peer_dnsname, strlen(peer_dnsname));
+  rval = evbuffer_add(dest, peer_dnsname.data(), peer_dnsname.size());
   if (rval) {
     log_warn("error adding peername field\n");
     goto err;
   }
-  transmit_len += strlen(peer_dnsname);
+  transmit_len += peer_dnsname.size();
 
   rval = evbuffer_add(dest, strstr(buf, "\r\n"), payload_len - (unsigned int) (strstr(buf, "\r\n") - buf));
   if (rval) {
@@ -548,10 +620,10 @@ int gen_uri_field(char* uri, unsigned int uri_sz, char* data, int datalen) {
   so_far = 5;
 
   while (datalen > 0) {
-    unsigned int r = rand() % 4;
+    unsigned int r = rng_int(4);
 
     if (r == 1) {
-      r = rand() % 46;
+      r = rng_int(46);
       if (r < 20)
         uri[so_far++] = 'g' + r;
       else
@@ -563,7 +635,7 @@ int gen_uri_field(char* uri, unsigned int uri_sz, char* data, int datalen) {
       datalen--;
     }
 
-    r = rand() % 8;
+    r = rng_int(8);
 
     if (r == 0 && datalen > 0)
       uri[so_far++] = '/';
@@ -577,7 +649,7 @@ int gen_uri_field(char* uri, unsigned int uri_sz, char* data, int datalen) {
     }
   }
 
-  switch(rand()%4){
+  switch(rng_int(4)){
   case 1:
     memcpy(uri+so_far, ".htm ", 6);
     break;
@@ -616,8 +688,8 @@ http_steg_t::http_client_uri_transmit (evbuffer *source, conn_t *conn)
   int len =0;
   char buf[10000];
 
-  if (peer_dnsname[0] == '\0')
-    lookup_peer_name_from_ip(conn->peername, peer_dnsname);
+  if (peer_dnsname.empty())
+    peer_dnsname = lookup_peer_name_from_ip(conn->peername);
 
   nv = evbuffer_peek(source, slen, NULL, NULL, 0);
   iv = (evbuffer_iovec *)xzalloc(sizeof(struct evbuffer_iovec) * nv);
@@ -651,7 +723,7 @@ http_steg_t::http_client_uri_transmit (evbuffer *source, conn_t *conn)
 
   if (evbuffer_add(dest, outbuf, datalen)  ||  // add uri field
       evbuffer_add(dest, "HTTP/1.1\r\nHost: ", 19) ||
-      evbuffer_add(dest, peer_dnsname, strlen(peer_dnsname)) ||
+      evbuffer_add(dest, peer_dnsname.data(), peer_dnsname.size()) ||
       evbuffer_add(dest, strstr(buf, "\r\n"), len - (unsigned int) (strstr(buf, "\r\n") - buf))  ||  // add everything but first line
       evbuffer_add(dest, "\r\n", 2)) {
       log_debug("error ***********************");
@@ -839,6 +911,16 @@ http_steg_t::http_client_receive(evbuffer *source, evbuffer *dest)
 {
   int rval = RECV_BAD;
 
+  if (skipping_cover) {
+    bool done;
+    rval = FileStegMod::skip_cover_rest(source, &done);
+    if (done) {
+      skipping_cover = false;
+      conn->expect_close();
+    }
+    return rval;
+  }
+
   //basic sanity check
   if (!(0 < type && type  <= (signed) c_no_of_steg_protocol && (config->file_steg_mods.find(type) != config->file_steg_mods.end())))
     {
@@ -848,7 +930,9 @@ http_steg_t::http_client_receive(evbuffer *source, evbuffer *dest)
   //This just to make sure that the steg mod is initialized. if the content isn't actually of type .type, then the steg mod will reject it
   //gracefully
   log_debug(conn, "receiving a payload of type %i", type);
-  rval = config->file_steg_mods[type]->http_client_receive(conn, dest, source);
+  bool cover_continues = false;
+  rval = config->file_steg_mods[type]->http_client_receive(conn, dest, source, &chunked_body, &cover_continues);
+  skipping_cover = cover_continues;
 
   // type = HTTP_CONTENT_HTML;
   // switch(type) {
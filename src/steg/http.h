@@ -8,8 +8,8 @@
                                     //wait before transmiting no matter what to 
                                     //keep the cover looks real
 
-int
-lookup_peer_name_from_ip(const char* p_ip, char* p_name);
+std::string
+lookup_peer_name_from_ip(const char* p_ip);
 
   struct http_steg_config_t : steg_config_t
   {
@@ -71,11 +71,13 @@ lookup_peer_name_from_ip(const char* p_ip, char* p_name);
   {
     http_steg_config_t *config;
     conn_t *conn;
-    char peer_dnsname[512];
+    std::string peer_dnsname; // for the Host header, set on first use
 
     bool have_transmitted : 1;
     bool have_received : 1;
+    bool skipping_cover : 1; //the data came early, the rest of its cover is still coming
     int type;
+    FileStegMod::ChunkedBody* chunked_body; //a chunked response being received
 
     http_steg_t(http_steg_config_t *cf, conn_t *cn);
     STEG_DECLARE_METHODS(http);
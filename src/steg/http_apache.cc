@@ -15,6 +15,7 @@ using namespace std;
 #include "protocol.h"
 #include "steg.h"
 #include "rng.h"
+#include "compression.h"
 
 
 #include "payload_server.h"
@@ -47,19 +48,47 @@ namespace  {
   struct http_apache_steg_config_t : http_steg_config_t
   {
 
+    /* By default the client writes its request straight into the
+       connection's bufferevent and parses the response from it, as the
+       other http stegs do. With --use-curl it goes through libcurl
+       instead, as it used to. */
+    bool use_curl;
+
     CURLM *_curl_multi_handle; //this is the  curl handle to manange nonblocking 
                                //connections used to communicate with http server
     int _curl_running_handle; //number of concurrent transfer
 
+    /* Easy handles of closed connections, reset and ready for the
+       next one. A handle is several kilobytes, and only a connection
+       that has started a request holds one. */
+    std::vector<CURL*> _idle_curl_handles;
+    static const size_t c_MAX_IDLE_CURL_HANDLES = 64;
+
+    CURL* acquire_curl_handle();
+    void release_curl_handle(CURL* handle);
+
     unsigned long uri_byte_cut = 0; /* The number of byte of the message that
                                     can be stored in url. It is zero by default
                                     as before we initialize the dict it contains 
-                                    no uri*/
+                                    no uri. The server fixes it once its dict
+                                    has urls, and the clients adopt it: it is
+                                    shared by all the connections.*/
 
     op_apache_steg_code _cur_operation;
 
     bool uri_dict_up2date;
-    static const char c_end_of_dict[];
+
+    /* The uri dict is append-only so its size serves as its version.
+       The server sends it in compressed chunks and the client acks each
+       chunk with the mac of what it has, so the transfer resumes from
+       there after a disconnection. Once the client has the whole dict
+       the server answers its mac with the byte cut to use. */
+    static const size_t c_DICT_CHUNK_SIZE = 256; //no of urls per chunk
+    static const size_t c_DICT_CHUNK_HEADER_SIZE = 4 * sizeof(uint32_t);
+    //a chunk is c_DICT_CHUNK_SIZE urls, which are at most a few kB each
+    static const size_t c_MAX_DICT_CHUNK_LEN = c_DICT_CHUNK_SIZE * 8192;
+    size_t _pushed_dict_size; //server side: the dict size last pushed on reload
+    size_t _stored_dict_size; //client side: the dict size last stored on disk
     
     stringstream dict_stream; /*we receive the dictionary in form
                                 of a stream */
@@ -72,19 +101,58 @@ namespace  {
      bool init_uri_dict();
 
     //Dictionary communications
+    /** Processes every operation in protocol_data_in that has fully
+        arrived, as several can come in the same block.
+
+        @return the number of bytes written in protocol_data_out in reply
+    */
     virtual size_t process_protocol_data();
-    /** Writes the SHA256 mac of the uri_dict into
-        the porotocol_buffer to send it to the peep
 
-        return true in the case of success
+    /** Processes the operation at the head of protocol_data_in, if it
+        has fully arrived.
+
+        @return the number of bytes written in protocol_data_out in reply
+    */
+    size_t process_protocol_operation();
+    /** Writes the size and the SHA256 mac of the uri_dict into
+        the porotocol_buffer to send it to the peer
+
+        @return the number of bytes written in the buffer
     */
-    bool send_dict_mac();
+    size_t send_dict_mac();
 
     /** 
-        write the uri dict in a protocol_data to be send to the client
+        write a compressed chunk of the uri dict in protocol_data to be
+        send to the client
+
+        @param first the index of the first url of the chunk
         @return the number of bytes written in the buffer
     */
-    size_t send_dict_to_peer();
+    size_t send_dict_to_peer(size_t first);
+
+    /** 
+        The number of bytes of the message coded in the url index when
+        the peers share no_of_uris urls.
+    */
+    static unsigned long compute_uri_byte_cut(size_t no_of_uris)
+    {
+      unsigned long byte_cut;
+      for(byte_cut = 0; (no_of_uris /=256) > 0; byte_cut++);
+      return byte_cut;
+    }
+
+    /**
+       Server side: re-read the payload database in the background,
+       if the uri dict changes, the client is updated through the
+       usual dict exchange.
+    */
+    virtual void reload();
+
+    /**
+       called by the payload server once the reloaded uri dict is in
+       place and differs from the previous one.
+    */
+    static void uri_dict_reloaded_cb(void* arg);
 
     /**
        is called by either constructor to perform the actual act of initialization.
@@ -124,6 +192,8 @@ namespace  {
     http_apache_steg_t(http_apache_steg_config_t *cf, conn_t *cn);
 
     virtual int http_client_uri_transmit (struct evbuffer *source, conn_t *conn);
+    int http_client_native_transmit(struct evbuffer *source, size_t payload_len,
+                                    const string& path);
     virtual int http_server_receive(conn_t *conn, struct evbuffer *dest, struct evbuffer* source);
 
     virtual int http_server_receive_cookie(char* p, struct evbuffer *dest);
@@ -146,6 +216,8 @@ namespace  {
 
     static void curl_socket_event_cb(int fd, short kind,  void *userp);
 
+    void prepare_curl_request();
+
     /**
        gets call everytime that curl deal with the event, to check for
        all easy handles that are done and get rid of them.
@@ -167,14 +239,15 @@ namespace  {
 
 }
 
-const char http_apache_steg_config_t::c_end_of_dict[] = "\r\n";
 
 STEG_DEFINE_MODULE(http_apache);
 
 http_apache_steg_config_t::http_apache_steg_config_t(config_t *cfg, const YAML::Node& options)
   : http_steg_config_t(cfg, options, false),
     _cur_operation(op_STEG_NO_OP),
-    uri_dict_up2date(false)
+    uri_dict_up2date(false),
+    _pushed_dict_size(0),
+    _stored_dict_size(0)
 {
   //all we do is to store the option and call the common "constructor"
   store_options(options);
@@ -186,7 +259,9 @@ http_apache_steg_config_t::http_apache_steg_config_t(config_t *cfg, const YAML::
 http_apache_steg_config_t::http_apache_steg_config_t(config_t *cfg, const std::vector<std::string>& options)
   : http_steg_config_t(cfg, options, false),
     _cur_operation(op_STEG_NO_OP),
-    uri_dict_up2date(false)
+    uri_dict_up2date(false),
+    _pushed_dict_size(0),
+    _stored_dict_size(0)
 {
 
   store_options(options);
@@ -199,7 +274,7 @@ void
 http_apache_steg_config_t::http_apache_steg_config_common_init(config_t *cfg)
 {
   string payload_filename;
-  string cover_server, cover_list;
+  string cover_server, cover_list, cover_origins;
 
   if (is_clientside)
     payload_filename = "apache_payload/client_list.txt";
@@ -216,21 +291,38 @@ http_apache_steg_config_t::http_apache_steg_config_common_init(config_t *cfg)
       cover_list = http_steg_user_configs["cover-list"] != "" ?
         http_steg_user_configs["cover-list"] : "";
     }
+    cover_origins = http_steg_user_configs["cover-origins"];
 
   }
 
-  payload_server = new ApachePayloadServer(is_clientside ? client_side : server_side, payload_filename, cover_server, cover_list);
+  payload_server = new ApachePayloadServer(is_clientside ? client_side : server_side, payload_filename, cover_server, cover_list, cover_origins);
+
+  //servers fetching from the same place share one cover cache
+  if (!is_clientside && !http_steg_user_configs["shared-cover-cache"].empty()) {
+    const string& megabytes = http_steg_user_configs["shared-cover-cache"];
+    char* end;
+    unsigned long budget = strtoul(megabytes.c_str(), &end, 10);
+    if (*end || budget == 0 || budget > 65536)
+      log_abort("shared-cover-cache must be its size in megabytes, not %s", megabytes.c_str());
+
+    string segment = SharedCoverCache::segment_name(cover_server + "|" + cover_origins);
+    ((ApachePayloadServer*)payload_server)->use_shared_cover_cache(segment, budget << 20);
+  }
 
   init_file_steg_mods();
 
   if (!is_clientside) {//on server side the dictionary is ready to be used
-    size_t no_of_uris = ((ApachePayloadServer*)payload_server)->uri_dict.size();
-    for(uri_byte_cut = 0; (no_of_uris /=256) > 0; uri_byte_cut++);
+    //and its byte cut is fixed from now on
     ((ApachePayloadServer*)payload_server)->chosen_payload_choice_strategy = ApachePayloadServer::c_most_efficient_payload_choice; //This is hard coded now but it should become user's choice
-
+    _pushed_dict_size = ((ApachePayloadServer*)payload_server)->uri_dict.size();
+    uri_byte_cut = compute_uri_byte_cut(_pushed_dict_size);
   }
+  else
+    _stored_dict_size = ((ApachePayloadServer*)payload_server)->uri_dict.size();
 
-  if (!(_curl_multi_handle = curl_multi_init()))
+  use_curl = http_steg_user_configs["use-curl"] == "true";
+  _curl_multi_handle = NULL;
+  if (use_curl && !(_curl_multi_handle = curl_multi_init()))
     log_abort("failed to initiate curl multi object.");
 
   if (!(protocol_data_in || protocol_data_out)) {
@@ -243,9 +335,13 @@ http_apache_steg_config_t::~http_apache_steg_config_t()
 {
   //delete payload_server; maybe we don't need it
   /* always cleanup */ 
-  log_debug("steg config is releasing mulit handle");
-  log_debug("%u handles are still running",_curl_running_handle);
-  curl_multi_cleanup(_curl_multi_handle);
+  if (_curl_multi_handle) {
+    log_debug("steg config is releasing mulit handle");
+    log_debug("%u handles are still running",_curl_running_handle);
+    curl_multi_cleanup(_curl_multi_handle);
+  }
+  for (size_t i = 0; i < _idle_curl_handles.size(); i++)
+    curl_easy_cleanup(_idle_curl_handles[i]);
 
   delete payload_server;
   payload_server = NULL;
@@ -262,6 +358,7 @@ http_apache_steg_t::http_apache_steg_t(http_apache_steg_config_t *cf, conn_t *cn
   : http_steg_t((http_steg_config_t*)cf, cn), _apache_config(cf),     
     c_min_uri_length(0),
     c_max_uri_length(2000),
+    _curl_easy_handle(NULL),
     _curl_client_event(NULL),
     curl_inbound(NULL)
 {
@@ -269,20 +366,70 @@ http_apache_steg_t::http_apache_steg_t(http_apache_steg_config_t *cf, conn_t *cn
   if (!_apache_config->payload_server)
     log_abort("payload server is not initialized.");
 
-  //FIXME: If server doesn't use _curl_easy_handle then we should 
-  //only initialize it for the client side
-  //we need to use a fresh curl easy object because we might have
-  //multiple connection at a time. 
-  //FIX ME:It might be a way to recycle these objects
-  _curl_easy_handle = curl_easy_init();
-  if (!_curl_easy_handle)
+  /** setup the buffer we communicate with chop */
+  //Every connection checks if the dict is valid
+  if (_apache_config->is_clientside && !_apache_config->uri_dict_up2date
+      && _apache_config->_cur_operation == op_STEG_NO_OP) { //Request for uri dict validation
+    _apache_config->send_dict_mac();
+  }
+
+  //A database being scraped in the background is swapped in by the
+  //event loop, which only exists once connections come in
+  if (!_apache_config->is_clientside)
+    ((ApachePayloadServer*)_apache_config->payload_server)->watch_reloads(_apache_config->cfg->base, http_apache_steg_config_t::uri_dict_reloaded_cb, _apache_config);
+
+  //The curl handle and the response buffer are only needed once
+  //the client sends its request; see prepare_curl_request.
+}
+
+CURL*
+http_apache_steg_config_t::acquire_curl_handle()
+{
+  if (!_idle_curl_handles.empty()) {
+    CURL* handle = _idle_curl_handles.back();
+    _idle_curl_handles.pop_back();
+    return handle;
+  }
+
+  CURL* handle = curl_easy_init();
+  if (!handle)
     log_abort("failed to initiate curl");
+  return handle;
+}
+
+void
+http_apache_steg_config_t::release_curl_handle(CURL* handle)
+{
+  //it is harmless if the handle is not in the multi handle
+  curl_multi_remove_handle(_curl_multi_handle, handle);
+  if (_idle_curl_handles.size() >= c_MAX_IDLE_CURL_HANDLES) {
+    curl_easy_cleanup(handle);
+    return;
+  }
+
+  curl_easy_reset(handle);
+  _idle_curl_handles.push_back(handle);
+}
+
+/**
+   Takes a curl handle from the pool for this connection's request,
+   and the evbuffer the response goes into.
+*/
+void
+http_apache_steg_t::prepare_curl_request()
+{
+  if (!curl_inbound)
+    curl_inbound = evbuffer_new();
+
+  if (_curl_easy_handle)
+    return;
+
+  _curl_easy_handle = _apache_config->acquire_curl_handle();
 
   curl_easy_setopt(_curl_easy_handle, CURLOPT_HEADER, 1L);
   curl_easy_setopt(_curl_easy_handle, CURLOPT_HTTP_CONTENT_DECODING, 0L);
   curl_easy_setopt(_curl_easy_handle, CURLOPT_HTTP_TRANSFER_DECODING, 0L);
   curl_easy_setopt(_curl_easy_handle, CURLOPT_VERBOSE, 1L);
-  //curl_easy_setopt(_curl_easy_handle, CURLOPT_WRITEFUNCTION, read_data_cb);
   //Libevent should be able to take care of this we might need to
   //discard data if it starts writing on stdout
   curl_easy_setopt(_curl_easy_handle, CURLOPT_OPENSOCKETFUNCTION, get_conn_socket);
@@ -293,23 +440,6 @@ http_apache_steg_t::http_apache_steg_t(http_apache_steg_config_t *cf, conn_t *cn
   curl_easy_setopt(_curl_easy_handle, CURLOPT_CLOSESOCKETDATA, this);
 
   curl_easy_setopt(_curl_easy_handle, CURLOPT_FORBID_REUSE,1); // forbid reuse 
-  /** setup the buffer we communicate with chop */
-  //Every connection checks if the dict is valid
-  if (_apache_config->is_clientside && !_apache_config->uri_dict_up2date
-      && _apache_config->_cur_operation == op_STEG_NO_OP) { //Request for uri dict validation
-    _apache_config->_cur_operation = op_STEG_DICT_WAIT_PEER;
-    char status_to_send = op_STEG_DICT_MAC;
-    evbuffer_add(_apache_config->protocol_data_out, &status_to_send, 1);
-    evbuffer_add(_apache_config->protocol_data_out, ((ApachePayloadServer*)_apache_config->payload_server)->uri_dict_mac(), SHA256_DIGEST_LENGTH);
-
-  }
-
-  if (_apache_config->is_clientside) {
-    //We also need to prepare the evbuffer that is going to used to store the response, this only is happening on the client side
-    curl_inbound = evbuffer_new();
-  }
-
-
 }
 
 int
@@ -333,6 +463,7 @@ http_apache_steg_t::http_client_uri_transmit (struct evbuffer *source, conn_t *c
   data = (char*) evbuffer_pullup(source, sbuflen);
   if (!data) {
     log_debug("evbuffer_pullup failed");
+    free(data2);
     return -1;
   }
 
@@ -345,8 +476,9 @@ http_apache_steg_t::http_client_uri_transmit (struct evbuffer *source, conn_t *c
   //If the uri dict has no element we always can request / uri 
   //also before we make sure that our uri dict is in sync with 
   //server, we shouldn't use it because it will corrupt the 
-  //coding
-  if (!(((ApachePayloadServer*)_apache_config->payload_server)->uri_dict.size() && _apache_config->uri_dict_up2date)) {
+  //coding. Nor while the server codes nothing in the url: it
+  //may start to once it has urls.
+  if (!(((ApachePayloadServer*)_apache_config->payload_server)->uri_dict.size() && _apache_config->uri_dict_up2date && _apache_config->uri_byte_cut)) {
     log_debug("Synced uri dict is not available yet");
     chosen_url = "";
   }
@@ -367,8 +499,10 @@ http_apache_steg_t::http_client_uri_transmit (struct evbuffer *source, conn_t *c
   
   assert(type != 0 || type != -1);
 
+  size_t payload_len = evbuffer_get_length(source);
   string uri_to_send("http://");
   uri_to_send += conn->peername;
+  size_t path_start = uri_to_send.size();
   if (sbuflen > _apache_config->uri_byte_cut)
     {
       sbuflen -= _apache_config->uri_byte_cut;
@@ -386,7 +520,8 @@ http_apache_steg_t::http_client_uri_transmit (struct evbuffer *source, conn_t *c
       if (uri_to_send.size() > c_max_uri_length)
         {
           log_debug("%lu too big to be send in uri", uri_to_send.size());
-            return -1;       
+          free(data2);
+          return -1;       
         }
     }
   else
@@ -397,11 +532,17 @@ http_apache_steg_t::http_client_uri_transmit (struct evbuffer *source, conn_t *c
       uri_to_send += "/" + chosen_url + "?p=" + data2;
 
     }
-  
+  free(data2);
+
+  if (!_apache_config->use_curl)
+    return http_client_native_transmit(source, payload_len,
+                                       uri_to_send.substr(path_start));
+
   //now we are using curl to send the request
   //however, it seems that there is no way to stop curl from also receving 
   //the data and giving control to libevent. Hence we are deligating the 
   //receive process over curl as well
+  prepare_curl_request();
   curl_easy_setopt(_curl_easy_handle, CURLOPT_URL, uri_to_send.c_str());
   curl_easy_setopt(_curl_easy_handle, CURLOPT_WRITEFUNCTION, curl_downstream_read_cb );
   curl_easy_setopt(_curl_easy_handle, CURLOPT_WRITEDATA, this);
@@ -433,6 +574,37 @@ http_apache_steg_t::http_client_uri_transmit (struct evbuffer *source, conn_t *c
    return uri_to_send.length()+46; //GET request always adds 46 chars
 }
 
+/**
+   Writes the GET request for PATH on the connection's own bufferevent,
+   with the headers curl would have sent. The response is then read
+   from conn->inbound() by the usual incremental parser.
+*/
+int
+http_apache_steg_t::http_client_native_transmit(struct evbuffer *source,
+                                                size_t payload_len,
+                                                const string& path)
+{
+  struct evbuffer *dest = conn->outbound();
+  size_t before = evbuffer_get_length(dest);
+
+  if (evbuffer_add(dest, "GET ", 4) ||
+      evbuffer_add(dest, path.data(), path.size()) ||
+      evbuffer_add(dest, " HTTP/1.1\r\nHost: ", 17) ||
+      evbuffer_add(dest, conn->peername, strlen(conn->peername)) ||
+      evbuffer_add(dest, "\r\nAccept: */*\r\n\r\n", 17)) {
+    log_warn(conn, "failed to write the request");
+    return -1;
+  }
+
+  log_debug(conn, "requesting %s", path.c_str());
+  log_debug("CLIENT TRANSMITTED payload %d\n", (int) payload_len);
+
+  evbuffer_drain(source, payload_len);
+  conn->cease_transmission();
+  have_transmitted = true;
+  return evbuffer_get_length(dest) - before;
+}
+
 int
 http_apache_steg_t::http_server_receive(conn_t *conn, struct evbuffer *dest, struct evbuffer* source) {
 
@@ -646,9 +818,9 @@ http_apache_steg_t::~http_apache_steg_t()
     //curl_multi_remove_handle(_apache_config->_curl_multi_handle, _curl_easy_handle);
     log_debug(conn,"at steg destructor, releasing curl");
   }
-  
-  curl_easy_cleanup(_curl_easy_handle);
 
+  if (_curl_easy_handle)
+    _apache_config->release_curl_handle(_curl_easy_handle);
 }
 
 /** 
@@ -664,8 +836,7 @@ inline bool http_apache_steg_config_t::init_uri_dict()
   if (!((ApachePayloadServer*)payload_server)->init_uri_dict())
     return false;
 
-  size_t no_of_uris = ((ApachePayloadServer*)payload_server)->uri_dict.size();
-  for(uri_byte_cut = 0; (no_of_uris /=256) > 0; uri_byte_cut++);
+  uri_byte_cut = compute_uri_byte_cut(((ApachePayloadServer*)payload_server)->uri_dict.size());
 
   return true;
 }
@@ -750,9 +921,15 @@ http_apache_steg_t::receive(struct evbuffer *dest)
 
   //if we are on the client side, curl has received the data and hence
   //we need to retrieve the data from this->curl_received_data_evbuf
+  //unless the request went out natively.
   //If we are on the server side it is business
   if (config->is_clientside) {
+    if (!_apache_config->use_curl)
+      return http_client_receive(conn->inbound(), dest);
+
     source = curl_inbound;
+    if (!source) //nothing has been requested yet
+      return RECV_INCOMPLETE;
     return http_client_receive(source, dest);
 
   } 
@@ -766,10 +943,29 @@ http_apache_steg_t::receive(struct evbuffer *dest)
 size_t
 http_apache_steg_config_t::process_protocol_data()
 {
+  size_t written = 0;
+  size_t avail;
+
+  //the server sends UP2DATE and the next dict chunk in one go, so we
+  //keep going till we are waiting for more bytes
+  while ((avail = evbuffer_get_length(protocol_data_in))) {
+    written += process_protocol_operation();
+    if (evbuffer_get_length(protocol_data_in) == avail)
+      break;
+  }
+
+  return written;
+
+}
+
+size_t
+http_apache_steg_config_t::process_protocol_operation()
+{
+  ApachePayloadServer* apache_payload_server = (ApachePayloadServer*)payload_server;
   char status_to_send;
+  uint32_t dict_size;
   size_t avail = evbuffer_get_length(protocol_data_in);
   log_debug("There are %lu bytes of protocol data is available to process", avail);
-  evbuffer_ptr fin_location;
   log_assert(avail); //do not call process protocol if there's no data
 
   //because data comes in batches we need to keep track
@@ -777,69 +973,120 @@ http_apache_steg_config_t::process_protocol_data()
   if ((_cur_operation == op_STEG_NO_OP) || (_cur_operation == op_STEG_DICT_WAIT_PEER))
     evbuffer_remove(protocol_data_in, &_cur_operation, 1);
 
+  avail = evbuffer_get_length(protocol_data_in);
   switch (_cur_operation) {
   case op_STEG_DICT_MAC:
     //server side
-    avail = evbuffer_get_length(protocol_data_in);
-    if (avail >= SHA256_DIGEST_LENGTH) {
+    if (avail >= sizeof(dict_size) + SHA256_DIGEST_LENGTH) {
       _cur_operation = op_STEG_NO_OP;
-      char peer_dict_mac[SHA256_DIGEST_LENGTH];
+      uint8_t peer_dict_mac[SHA256_DIGEST_LENGTH];
+      uint8_t our_prefix_mac[SHA256_DIGEST_LENGTH];
+      evbuffer_remove(protocol_data_in, &dict_size, sizeof(dict_size));
       evbuffer_remove(protocol_data_in, &peer_dict_mac, SHA256_DIGEST_LENGTH);
-      
-      if (!memcmp(peer_dict_mac, ((ApachePayloadServer*)payload_server)->uri_dict_mac(), SHA256_DIGEST_LENGTH)) { //Macs matches just acknowledge that.
-        status_to_send = op_STEG_DICT_UP2DATE;
-        evbuffer_add(protocol_data_out, &status_to_send, 1);
-        _cur_operation = op_STEG_NO_OP;
-        log_debug("Peer's uri dict is synced with ours");
-        return 1;
+      dict_size = ntohl(dict_size);
+
+      //every client syncs through here, so nothing of a single
+      //client's is kept: the answer only depends on its mac
+      if (!(apache_payload_server->uri_dict_prefix_mac(dict_size, our_prefix_mac) &&
+            !memcmp(peer_dict_mac, our_prefix_mac, SHA256_DIGEST_LENGTH))) {
+        //client's dict is not a prefix of ours, send it from scratch
+        log_debug("Peer's uri dict of size %u is not valid", dict_size);
+        return send_dict_to_peer(0);
       }
-      else //send the entire dict to the client.
-        return send_dict_to_peer();
+
+      if (dict_size < apache_payload_server->uri_dict.size())
+        return send_dict_to_peer(dict_size);
+
+      //The client has the whole dict, it can code with our byte cut
+      uint32_t byte_cut = htonl(uri_byte_cut);
+      status_to_send = op_STEG_DICT_UP2DATE;
+      evbuffer_add(protocol_data_out, &status_to_send, 1);
+      evbuffer_add(protocol_data_out, &byte_cut, sizeof(byte_cut));
+      log_debug("Peer's uri dict is synced with our %u urls", dict_size);
+
+      return 1 + sizeof(byte_cut);
     }
     return 0; //not enough bytes
-  case op_STEG_DICT_UP2DATE:
-    {
-      //client side
-      uri_dict_up2date = true;
-
-      size_t no_of_uris = ((ApachePayloadServer*)payload_server)->uri_dict.size();
-      for(uri_byte_cut = 0; (no_of_uris /=256) > 0; uri_byte_cut++);
 
+  case op_STEG_DICT_UP2DATE:
+    //client side
+    if (avail >= sizeof(uint32_t)) {
       _cur_operation = op_STEG_NO_OP;
-      log_debug("peer's uri dict is synced with ours");
-      return 0;
+      uint32_t byte_cut;
+      evbuffer_remove(protocol_data_in, &byte_cut, sizeof(byte_cut));
+      byte_cut = ntohl(byte_cut);
+
+      //the server has confirmed our whole dict: it is worth keeping
+      size_t our_dict_size = apache_payload_server->uri_dict.size();
+      if (our_dict_size != _stored_dict_size) {
+        stringstream whole_dict;
+        apache_payload_server->export_dict(whole_dict);
+        string whole_dict_str = whole_dict.str();
+        if (apache_payload_server->store_dict((char*)whole_dict_str.c_str(), whole_dict_str.size()))
+          _stored_dict_size = our_dict_size;
+      }
+
+      //the server's byte cut is fixed, so any url index it can
+      //decode is in our dict too
+      uri_dict_up2date = true;
+      uri_byte_cut = byte_cut <= compute_uri_byte_cut(our_dict_size) ? byte_cut : 0;
+      log_debug("peer has confirmed our uri dict of %lu urls, byte cut %lu", (unsigned long)our_dict_size, uri_byte_cut);
     }
+    return 0;
         
   case op_STEG_DICT_UPDATE:
     //client side
-    {
-      size_t fin_len = strlen(http_apache_steg_config_t::c_end_of_dict);
-      fin_location = evbuffer_search(protocol_data_in, http_apache_steg_config_t::c_end_of_dict, fin_len, NULL);
-
-      if (fin_location.pos != -1)
-        { size_t dict_buf_size = evbuffer_get_length(protocol_data_in);
-          log_debug("uri dict of size %lu completely received", dict_buf_size+sizeof(_cur_operation)); 
-          char* dict_buf = new char[dict_buf_size];
-          evbuffer_remove(protocol_data_in, dict_buf, dict_buf_size);
-          
-          stringstream dict_str_stream;
-          dict_str_stream.write(dict_buf, dict_buf_size-fin_len);
-          
-          ((ApachePayloadServer*)payload_server)->init_uri_dict((iostream&)dict_str_stream);
-          ((ApachePayloadServer*)payload_server)->store_dict(dict_buf, dict_buf_size-fin_len);
-          
-          //We need a way to inform server that we got updated.
-          uri_dict_up2date = true;
+    if (avail >= c_DICT_CHUNK_HEADER_SIZE) {
+      uint32_t chunk_header[4]; //first, count, raw length, compressed length
+      evbuffer_copyout(protocol_data_in, chunk_header, c_DICT_CHUNK_HEADER_SIZE);
+      size_t first = ntohl(chunk_header[0]);
+      size_t raw_len = ntohl(chunk_header[2]);
+      size_t compressed_len = ntohl(chunk_header[3]);
+
+      //the peer is not to make us allocate or wait for more than a
+      //chunk can be: what else it has sent can't be parsed either,
+      //so we drop it and ask for the dict again
+      if (raw_len > c_MAX_DICT_CHUNK_LEN ||
+          compressed_len > c_MAX_DICT_CHUNK_LEN + c_MAX_DICT_CHUNK_LEN / 1000 + 64) {
+        log_warn("uri dict chunk of %lu bytes, %lu compressed, is too big", (unsigned long)raw_len, (unsigned long)compressed_len);
+        evbuffer_drain(protocol_data_in, avail);
+        return send_dict_mac();
+      }
 
-          size_t no_of_uris = ((ApachePayloadServer*)payload_server)->uri_dict.size();
-          for(uri_byte_cut = 0; (no_of_uris /=256) > 0; uri_byte_cut++);
+      if (avail < c_DICT_CHUNK_HEADER_SIZE + compressed_len)
+        return 0; //wait for the rest of the chunk
 
-          log_debug("uri dict updated"); 
-          _cur_operation = op_STEG_NO_OP;
-          
-          delete[] dict_buf;
-          
+      _cur_operation = op_STEG_NO_OP;
+      evbuffer_drain(protocol_data_in, c_DICT_CHUNK_HEADER_SIZE);
+      uint8_t* compressed_chunk = evbuffer_pullup(protocol_data_in, compressed_len);
+      char* dict_buf = new char[raw_len + 1];
+      ssize_t dict_buf_size = raw_len ? decompress(compressed_chunk, compressed_len, (uint8_t*)dict_buf, raw_len) : 0;
+      evbuffer_drain(protocol_data_in, compressed_len);
+
+      if (dict_buf_size != (ssize_t)raw_len) {
+        log_warn("corrupted uri dict chunk received");
+      }
+      else {
+        size_t prev_size = apache_payload_server->uri_dict.size();
+        stringstream dict_str_stream;
+        dict_str_stream.write(dict_buf, dict_buf_size);
+
+        if (apache_payload_server->append_uri_dict(dict_str_stream, first)) {
+          log_debug("uri dict chunk of %u urls starting at %lu received", ntohl(chunk_header[1]), (unsigned long)first);
+
+          //urls appended to a dict the server has confirmed keep its
+          //indices, but a dict sent from scratch replaces ours. It is
+          //stored once the server confirms it.
+          if (first == 0 && prev_size) {
+            uri_dict_up2date = false;
+            uri_byte_cut = 0;
+          }
         }
+      }
+      delete[] dict_buf;
+
+      //acknowledging what we have asks for the next chunk
+      return send_dict_mac();
     }
     return 0;
         
@@ -852,26 +1099,91 @@ http_apache_steg_config_t::process_protocol_data()
 }
 
 size_t
-http_apache_steg_config_t::send_dict_to_peer()
+http_apache_steg_config_t::send_dict_mac()
 {
-  //we send the dictionary as a multiline buffer 
-  char status_to_send = op_STEG_DICT_UPDATE;
+  ApachePayloadServer* apache_payload_server = (ApachePayloadServer*)payload_server;
+
+  char status_to_send = op_STEG_DICT_MAC;
+  uint32_t dict_size = htonl(apache_payload_server->uri_dict.size());
   evbuffer_add(protocol_data_out, &status_to_send, 1);
+  evbuffer_add(protocol_data_out, &dict_size, sizeof(dict_size));
+  evbuffer_add(protocol_data_out, apache_payload_server->uri_dict_mac(), SHA256_DIGEST_LENGTH);
+  _cur_operation = op_STEG_DICT_WAIT_PEER;
+
+  return 1 + sizeof(dict_size) + SHA256_DIGEST_LENGTH;
+
+}
+
+void
+http_apache_steg_config_t::reload()
+{
+  if (is_clientside)
+    return; //client receives its dict from the server
+
+  ((ApachePayloadServer*)payload_server)->reload(cfg->base, uri_dict_reloaded_cb, this);
+
+}
+
+void
+http_apache_steg_config_t::uri_dict_reloaded_cb(void* arg)
+{
+  http_apache_steg_config_t* apache_config = (http_apache_steg_config_t*) arg;
+
+  //We keep decoding with the old uri_byte_cut: the new dict is a
+  //superset of the old one so the old codes are still valid, and the
+  //clients coding with it keep doing so. Only a server which had no
+  //urls to code with takes the byte cut of its new dict.
+  size_t new_size = ((ApachePayloadServer*)apache_config->payload_server)->uri_dict.size();
+  if (!apache_config->uri_byte_cut)
+    apache_config->uri_byte_cut = compute_uri_byte_cut(new_size);
+
+  //A client which had the whole old dict appends the new urls, any
+  //other one answers with its mac and we resume from there. If we are
+  //in the middle of receiving a mac, our reply to it is going to carry
+  //the new urls.
+  size_t first = apache_config->_pushed_dict_size;
+  apache_config->_pushed_dict_size = new_size;
+  if (first < new_size && apache_config->_cur_operation == op_STEG_NO_OP) {
+    log_debug("uri dict has changed, pushing the new urls to the peer");
+    apache_config->send_dict_to_peer(first);
+  }
+
+}
+
+size_t
+http_apache_steg_config_t::send_dict_to_peer(size_t first)
+{
+  ApachePayloadServer* apache_payload_server = (ApachePayloadServer*)payload_server;
+  size_t count = 0;
+  if (first < apache_payload_server->uri_dict.size())
+    count = min(c_DICT_CHUNK_SIZE, apache_payload_server->uri_dict.size() - first);
 
   stringstream dict_stream;
- 
-  ((ApachePayloadServer*)payload_server)->export_dict(dict_stream);
+  apache_payload_server->export_dict(dict_stream, first, count);
   string dict_string = dict_stream.str();
-  evbuffer_add(protocol_data_out, dict_string.c_str(), dict_string.size());
 
-  //We mark the end of the data by \r\n
-  evbuffer_add(protocol_data_out, &http_apache_steg_config_t::c_end_of_dict, strlen(http_apache_steg_config_t::c_end_of_dict));
+  //zlib's worst case is a few bytes per 16K block plus the header
+  size_t compressed_capacity = dict_string.size() + dict_string.size() / 1000 + 64;
+  uint8_t* compressed_chunk = new uint8_t[compressed_capacity];
+  ssize_t compressed_len = compress((const uint8_t*)dict_string.c_str(), dict_string.size(), compressed_chunk, compressed_capacity, c_format_zlib);
+  if (compressed_len < 0) {
+    log_warn("failed to compress the uri dict chunk");
+    delete[] compressed_chunk;
+    return 0;
+  }
+
+  char status_to_send = op_STEG_DICT_UPDATE;
+  uint32_t chunk_header[4] = {htonl(first), htonl(count), htonl(dict_string.size()), htonl(compressed_len)};
+  evbuffer_add(protocol_data_out, &status_to_send, 1);
+  evbuffer_add(protocol_data_out, chunk_header, c_DICT_CHUNK_HEADER_SIZE);
+  evbuffer_add(protocol_data_out, compressed_chunk, compressed_len);
+  delete[] compressed_chunk;
+
   _cur_operation = op_STEG_NO_OP;
-  size_t dict_buf_size =  evbuffer_get_length(protocol_data_out);
 
-  log_debug("updating peer's uri dict. need to transmit %lu bytes", dict_buf_size);
+  log_debug("updating peer's uri dict from %lu with %lu urls, %lu bytes compressed to %ld", (unsigned long)first, (unsigned long)count, (unsigned long)dict_string.size(), (long)compressed_len);
 
-  return dict_buf_size;
+  return 1 + c_DICT_CHUNK_HEADER_SIZE + compressed_len;
 
 }
 
@@ -993,7 +1305,7 @@ size_t http_apache_steg_t::curl_downstream_read_cb(void *buffer, size_t size, si
   log_debug(down, "%lu bytes available (received by curl)", no_bytes_2_read);
 
   //move everything to the steg evbuffer
-  if (evbuffer_add(steg_mod->curl_inbound, buffer, size * no_bytes_2_read)) {
+  if (evbuffer_add(steg_mod->curl_inbound, buffer, no_bytes_2_read)) {
     log_debug("Error reading data from curl buffer");
     return 0;
   }
@@ -36,9 +36,9 @@ using namespace std;
          to this module.
 */
 FileStegMod::FileStegMod(PayloadServer* payload_provider, double noise2signal_from_cfg, int child_type = -1)
-  :_payload_server(payload_provider), noise2signal(noise2signal_from_cfg), c_content_type(child_type), outbuf(new uint8_t[c_HTTP_PAYLOAD_BUF_SIZE])
+  :_payload_server(payload_provider), noise2signal(noise2signal_from_cfg), c_content_type(child_type), outbuf(NULL),
+   chunked_responses(false)
 {
-  assert(outbuf);
   log_debug("max storage size: %lu >= maxs preceived storage: %lu >= max no of bits needed for storge %f", sizeof(message_size_t),
             c_NO_BYTES_TO_STORE_MSG_SIZE, log2(c_MAX_MSG_BUF_SIZE)/8.0);
             
@@ -118,28 +118,31 @@ FileStegMod::extract_appropriate_respones_body(evbuffer* payload_buf)
 ssize_t FileStegMod::pick_appropriate_cover_payload(size_t data_len, char** payload_buf, string& cover_id_hash)
 {
   size_t max_capacity = _payload_server->_payload_database.typed_maximum_capacity(c_content_type);
+  size_t needed_capacity = cover_capacity_needed(data_len);
 
   if (max_capacity <= 0) {
     log_abort("SERVER ERROR: No payload of appropriate type=%d was found\n", (int) c_content_type);
     return -1;
   }
 
-  if (data_len > (size_t) max_capacity) {
-    log_abort("SERVER ERROR: type %d cannot accommodate data %d",
+  //covers measured short of their recorded capacity lower the
+  //maximum, so this can happen to a block sized against the old one
+  if (needed_capacity > (size_t) max_capacity) {
+    log_warn("SERVER ERROR: type %d cannot accommodate data %d",
              (int) c_content_type, (int) data_len);
     return -1;
   }
 
   ssize_t payload_size = 0;
   do {
-    if (_payload_server->get_payload(c_content_type, data_len, payload_buf,
+    if (_payload_server->get_payload(c_content_type, needed_capacity, payload_buf,
                                      (int*)&payload_size, noise2signal, &cover_id_hash) == 1) {
       log_debug("SERVER found the next HTTP response template with size %d",
                 (int)payload_size);
     } else { //we can't do much here anymore, we need to add payload to payload
       //database unless if the payload_server is serving randomly which means
       //next time probably won't serve a corrupted payload
-      log_warn("SERVER couldn't find the next HTTP response template, enrich payload database and restart Stegotorus");
+      log_warn("SERVER couldn't find the next HTTP response template, enrich payload database and send SIGHUP to Stegotorus to reload it");
       return -1;
     }
   } while(payload_size == 0); //if the payload size is zero it means that we have failed
@@ -150,16 +153,17 @@ ssize_t FileStegMod::pick_appropriate_cover_payload(size_t data_len, char** payl
 }
 
 /**
-   Find appropriate payload calls virtual embed to embed it appropriate
-   to its type
+   Picks a cover of our type, embeds source in its body and makes its
+   header agree with the body. Drains source on success.
 
-   @param source the data to be transmitted
-   @param conn the connection over which the data is going to be transmitted
+   @param newHdr: receives the response header
+   @param new_header_len: its length
+   @param body: set to the body, which stays valid till the next call
 
-   @return the number of bytes transmitted
+   @return the length of the body or < 0 in case of error
 */
-int
-FileStegMod::http_server_transmit(evbuffer *source, conn_t *conn)
+ssize_t
+FileStegMod::embed_in_cover(evbuffer *source, uint8_t newHdr[], size_t* new_header_len, const uint8_t** body)
 {
 
   uint8_t* data1;
@@ -167,13 +171,12 @@ FileStegMod::http_server_transmit(evbuffer *source, conn_t *conn)
 
   ssize_t outbuflen = 0;
   ssize_t body_offset = 0;
-  uint8_t newHdr[MAX_RESP_HDR_SIZE];
   ssize_t newHdrLen = 0;
   ssize_t cnt = 0;
   size_t body_len = 0;
   size_t hLen = 0;
 
-  evbuffer *dest;
+  ensure_outbuf();
 
   //call this from util to extract the buffer into memory block
   //data1 is allocated in evbuffer_to_memory_block we need to free
@@ -216,6 +219,16 @@ FileStegMod::http_server_transmit(evbuffer *source, conn_t *conn)
     }
     memcpy(outbuf, (const void*)(cover_payload + body_offset), (body_len)*sizeof(char));
 
+    //the cover is fine for less data: record what it really holds so
+    //that it is not picked for this much again, and pick another
+    ssize_t room = cover_room(outbuf, body_len);
+    if (room >= 0 && room < sbuflen) {
+      log_debug("cover has room for %ld bytes only, not %d", (long)room, sbuflen);
+      _payload_server->restrict_capacity(payload_id_hash, cover_capacity_needed(room + 1) - 1);
+      outbuflen = -1;
+      continue;
+    }
+
     //int hLen = body_offset - (size_t)cover_payload - 4 + 1;
     //extrancting the body part of the payload
     log_debug("SERVER embeding data1 with length %d into type %d", sbuflen, c_content_type);
@@ -293,38 +306,84 @@ FileStegMod::http_server_transmit(evbuffer *source, conn_t *conn)
     }
   }
 
-  dest = conn->outbound();
+  *new_header_len = newHdrLen;
+  *body = outbuf;
+  evbuffer_drain(source, sbuflen);
+  delete [] data1;
+
+  return outbuflen;
+
+ error:
+  delete [] data1;
+  return -1;
+
+}
+
+/**
+   Find appropriate payload calls virtual embed to embed it appropriate
+   to its type
+
+   @param source the data to be transmitted
+   @param conn the connection over which the data is going to be transmitted
+
+   @return the number of bytes transmitted
+*/
+int
+FileStegMod::http_server_transmit(evbuffer *source, conn_t *conn)
+{
+  uint8_t newHdr[MAX_RESP_HDR_SIZE];
+  size_t newHdrLen = 0;
+  const uint8_t* body;
+
+  ssize_t outbuflen = embed_in_cover(source, newHdr, &newHdrLen, &body);
+  if (outbuflen < 0)
+    return -1;
+
+  evbuffer *dest = conn->outbound();
+  if (chunked_responses) {
+    //the chunk carrying the data goes first, so the client need not
+    //wait for the rest of the cover to decode it
+    uint8_t chunkedHdr[MAX_RESP_HDR_SIZE];
+    size_t chunkedHdrLen = chunk_response_header(newHdr, newHdrLen, chunkedHdr);
+    if (chunkedHdrLen) {
+      if (evbuffer_add(dest, chunkedHdr, chunkedHdrLen) ||
+          add_chunked_body(dest, body, outbuflen, decodable_prefix(body, outbuflen))) {
+        log_warn("SERVER ERROR: evbuffer_add() fails for chunked response");
+        return -1;
+      }
+      return outbuflen;
+    }
+    log_debug("SERVER cover header has no Content-Length to replace, sending it whole");
+  }
+
   if (evbuffer_add(dest, newHdr, newHdrLen)) {
     log_warn("SERVER ERROR: evbuffer_add() fails for newHdr");
-    goto error;
+    return -1;
     }
 
-  if (evbuffer_add(dest, outbuf, outbuflen)) {
+  if (evbuffer_add(dest, body, outbuflen)) {
     log_warn("SERVER ERROR: evbuffer_add() fails for outbuf");
-    goto error;
     return -1;
   }
 
-  evbuffer_drain(source, sbuflen);
-  delete [] data1;
-  
   return outbuflen;
 
- error:
-  delete [] data1;
-  return -1;
-
 }
 
 int
 FileStegMod::http_client_receive(conn_t *conn, struct evbuffer *dest,
-                               struct evbuffer* source)
+                               struct evbuffer* source, ChunkedBody** chunked,
+                               bool* cover_continues)
 {
   unsigned int response_len = 0;
   int content_len = 0, outbuflen;
   uint8_t *httpHdr, *httpBody;
 
   log_debug("Entering CLIENT receive");
+  ensure_outbuf();
+
+  if (*chunked)
+    return http_client_receive_chunked(conn, dest, source, chunked, cover_continues);
 
   ssize_t body_offset = extract_appropriate_respones_body(source);
   if (body_offset == RESPONSE_INCOMPLETE) {
@@ -345,6 +404,12 @@ FileStegMod::http_client_receive(conn_t *conn, struct evbuffer *dest,
     return RECV_BAD;
   }
 
+  if (is_chunked_response((const char*)httpHdr, hdrLen)) {
+    evbuffer_drain(source, hdrLen);
+    *chunked = new ChunkedBody;
+    return http_client_receive_chunked(conn, dest, source, chunked, cover_continues);
+  }
+
   content_len = find_content_length((char*)httpHdr, hdrLen);
   if (content_len < 0) {
     log_warn("CLIENT unable to find content length");
@@ -392,6 +457,31 @@ FileStegMod::http_client_receive(conn_t *conn, struct evbuffer *dest,
 
 }
 
+/**
+   Decodes the data out of a whole cover body and appends it to dest.
+
+   @return the length of the data or < 0 in case of error
+*/
+ssize_t
+FileStegMod::extract_from_cover(const uint8_t* body, size_t body_len, evbuffer *dest)
+{
+  ensure_outbuf();
+
+  log_debug("CLIENT unwrapping data out of type %d payload", c_content_type);
+  ssize_t outbuflen = decode(body, body_len, outbuf);
+  if (outbuflen < 0) {
+    log_warn("CLIENT ERROR: FileSteg fails\n");
+    return -1;
+  }
+
+  if (evbuffer_add(dest, outbuf, outbuflen)) {
+    log_warn("CLIENT ERROR: evbuffer_add to dest fails\n");
+    return -1;
+  }
+
+  return outbuflen;
+}
+
 size_t FileStegMod::alter_length_in_response_header(uint8_t* original_header, size_t original_header_length, ssize_t new_content_length, uint8_t new_header[])
 {
   char * length_field_start = strstr(reinterpret_cast<char *>(original_header), "Content-Length:");
@@ -414,3 +504,164 @@ size_t FileStegMod::alter_length_in_response_header(uint8_t* original_header, si
   return original_header_length -  (length_field_end - length_field_start) + length_of_content_length; 
 
 }
+
+size_t FileStegMod::chunk_response_header(const uint8_t* original_header, size_t original_header_length, uint8_t new_header[])
+{
+  string header(reinterpret_cast<const char*>(original_header), original_header_length);
+  size_t length_field_start = header.find("\r\nContent-Length:");
+  if (length_field_start == string::npos || header.find("\r\nTransfer-Encoding:") != string::npos)
+    return 0;
+
+  size_t length_field_end = header.find("\r\n", length_field_start + 2);
+  header.erase(length_field_start, length_field_end - length_field_start);
+  //before the empty line ending the header
+  header.insert(header.size() - 2, "Transfer-Encoding: chunked\r\n");
+  if (header.size() > MAX_RESP_HDR_SIZE)
+    return 0;
+
+  memcpy(new_header, header.data(), header.size());
+  return header.size();
+
+}
+
+int FileStegMod::add_chunked_body(evbuffer* dest, const uint8_t* body, size_t body_len, size_t first)
+{
+  for (size_t at = 0; at < body_len; first = 0) {
+    size_t n = min(body_len - at, first ? first : c_RESPONSE_CHUNK_SIZE);
+    if (evbuffer_add_printf(dest, "%lx\r\n", (unsigned long)n) < 0 ||
+        evbuffer_add(dest, body + at, n) || evbuffer_add(dest, "\r\n", 2))
+      return -1;
+    at += n;
+  }
+
+  return evbuffer_add(dest, "0\r\n\r\n", 5);
+
+}
+
+ssize_t FileStegMod::parse_chunks(const uint8_t* chunks, size_t len, uint8_t* body, size_t body_room, size_t* body_len, bool* complete)
+{
+  size_t at = 0;
+  *complete = false;
+  for (;;) {
+    const uint8_t* eol = (const uint8_t*)memmem(chunks + at, len - at, "\r\n", 2);
+    if (!eol)
+      return at;
+
+    if (!isxdigit(chunks[at]))
+      return -1;
+    char* size_end;
+    unsigned long chunk_len = strtoul((const char*)chunks + at, &size_end, 16);
+    if (*size_end != '\r' && *size_end != ';')
+      return -1;
+
+    if (!chunk_len) {
+      //the trailer, if any, ends with an empty line
+      const uint8_t* end = (const uint8_t*)memmem(eol, len - (eol - chunks), "\r\n\r\n", 4);
+      if (!end)
+        return at;
+      *complete = true;
+      return end + 4 - chunks;
+    }
+
+    size_t data_at = eol + 2 - chunks;
+    if (chunk_len > c_HTTP_PAYLOAD_BUF_SIZE || (body && *body_len + chunk_len > body_room))
+      return -1;
+    if (data_at + chunk_len + 2 > len)
+      return at;
+    if (memcmp(chunks + data_at + chunk_len, "\r\n", 2))
+      return -1;
+
+    if (body)
+      memcpy(body + *body_len, chunks + data_at, chunk_len);
+    *body_len += chunk_len;
+    at = data_at + chunk_len + 2;
+  }
+
+}
+
+/**
+   The chunked counterpart of http_client_receive: the data is decoded
+   once the last chunk is in, or before that once the steg mod says
+   it has what it needs.
+*/
+int
+FileStegMod::http_client_receive_chunked(conn_t *conn, evbuffer *dest, evbuffer *source, ChunkedBody** chunked, bool* cover_continues)
+{
+  ChunkedBody* body = *chunked;
+  size_t avail = evbuffer_get_length(source);
+  if (!avail)
+    return RECV_INCOMPLETE;
+
+  const uint8_t* chunks = evbuffer_pullup(source, avail);
+  if (chunks == NULL) {
+    log_warn("CLIENT unable to pullup the chunked response");
+    return RECV_BAD;
+  }
+
+  if (!body->data)
+    body->data = new uint8_t[c_HTTP_PAYLOAD_BUF_SIZE];
+
+  bool complete;
+  int rval = RECV_BAD;
+  ssize_t outbuflen;
+  ssize_t chunks_len = parse_chunks(chunks, avail, body->data, c_HTTP_PAYLOAD_BUF_SIZE,
+                                    &body->len, &complete);
+  if (chunks_len < 0) {
+    log_warn("CLIENT received malformed chunks");
+    goto done;
+  }
+  //what has been taken is not parsed again
+  evbuffer_drain(source, chunks_len);
+
+  if (!complete) {
+    size_t needed = decodable_prefix(body->data, body->len);
+    if (!needed || needed > body->len) {
+      log_debug("Incomplete chunked response, waiting for more data.");
+      return RECV_INCOMPLETE;
+    }
+    log_debug("CLIENT decoding after %lu bytes of the chunked body", (unsigned long)body->len);
+  }
+
+  outbuflen = decode(body->data, body->len, outbuf);
+  if (outbuflen < 0) {
+    log_warn("CLIENT ERROR: FileSteg fails\n");
+    goto done;
+  }
+
+  if (evbuffer_add(dest, outbuf, outbuflen)) {
+    log_warn("CLIENT ERROR: evbuffer_add to dest fails\n");
+    goto done;
+  }
+
+  //the rest of an unfinished cover is drained as it comes
+  if (complete)
+    conn->expect_close();
+  else
+    *cover_continues = true;
+  rval = RECV_GOOD;
+
+ done:
+  delete body;
+  *chunked = NULL;
+  return rval;
+
+}
+
+int FileStegMod::skip_cover_rest(evbuffer *source, bool* done)
+{
+  size_t len = evbuffer_get_length(source);
+  *done = false;
+  if (!len)
+    return RECV_INCOMPLETE;
+
+  size_t ignored = 0;
+  ssize_t chunks_len = parse_chunks(evbuffer_pullup(source, len), len, NULL, 0, &ignored, done);
+  if (chunks_len < 0) {
+    log_warn("CLIENT received malformed chunks");
+    return RECV_BAD;
+  }
+
+  evbuffer_drain(source, chunks_len);
+  return RECV_INCOMPLETE;
+
+}
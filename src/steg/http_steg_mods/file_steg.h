@@ -18,6 +18,20 @@ extern const unsigned int c_no_of_steg_protocol;
 */
 class FileStegMod
 {
+public:
+  /**
+     What a connection keeps of a chunked response between reads: the
+     header and the whole chunks are drained from its inbound buffer as
+     they are taken, so each read only parses what has come since.
+  */
+  struct ChunkedBody
+  {
+    uint8_t* data; //c_HTTP_PAYLOAD_BUF_SIZE, allocated with the first chunk
+    size_t len;
+    ChunkedBody() : data(NULL), len(0) {}
+    ~ChunkedBody() { delete[] data; }
+  };
+
 protected:
   /**
      Constants
@@ -34,6 +48,17 @@ protected:
 
   uint8_t* outbuf; //this is where the payload sit after being injected by the
   //the message. it is define as class member to avoid allocation and delocation
+  //but only allocated on first use (see ensure_outbuf): there is a
+  //module of each type, and most of them never carry anything
+
+  /**
+     Allocates outbuf if it has not been yet. Call before touching it.
+  */
+  void ensure_outbuf()
+  {
+    if (!outbuf)
+      outbuf = new uint8_t[c_HTTP_PAYLOAD_BUF_SIZE];
+  }
 
   //const int pgenflag; //tells us whether we are dealing with a payload taken from the database (0) or a generated on the fly one (1, for SWF only atm) 
   //not clear if we need this at all
@@ -76,9 +101,47 @@ protected:
    */
   size_t alter_length_in_response_header(uint8_t* original_header, size_t original_header_length, ssize_t new_content_length, uint8_t new_header[]);
 
+  /**
+     replaces the Content-Length in HTTP response header with
+     Transfer-Encoding: chunked
+
+     @return the length of new_header or 0 if the header has no
+             Content-Length to replace
+   */
+  static size_t chunk_response_header(const uint8_t* original_header, size_t original_header_length, uint8_t new_header[]);
+
+  /**
+     writes body to dest as chunks, the first one of first bytes if it
+     is not 0, then the last chunk
+   */
+  static int add_chunked_body(evbuffer* dest, const uint8_t* body, size_t body_len, size_t first);
+
+  /**
+     parses the whole chunks of a chunked body and appends their data
+     to body (unless it is NULL)
+
+     @param complete: set if the last chunk and the trailer were there
+
+     @return the length of the chunks parsed or -1 if the
+             chunks are malformed or do not fit in body_room
+   */
+  static ssize_t parse_chunks(const uint8_t* chunks, size_t len, uint8_t* body, size_t body_room, size_t* body_len, bool* complete);
+
+  /**
+     takes the chunks of a chunked response which have become whole
+     since the last call, and decodes the data once it is all there
+
+     @param chunked: the body so far, deleted and set to NULL when the
+            response is done with
+   */
+  int http_client_receive_chunked(conn_t *conn, evbuffer *dest, evbuffer *source, ChunkedBody** chunked, bool* cover_continues);
+
  public:
   static const size_t c_HTTP_PAYLOAD_BUF_SIZE = HTTP_PAYLOAD_BUF_SIZE; //TODO: one constant //maximum
   //size of buffer which stores the whole http response
+  static const size_t c_RESPONSE_CHUNK_SIZE = 16384; //chunks after the one carrying the data
+
+  bool chunked_responses; //send the covers with Transfer-Encoding: chunked
   static const  size_t c_MAX_MSG_BUF_SIZE = 131103; //max size of the message to be embeded
   //static const  size_t c_NO_BYTES_TO_STORE_MSG_SIZE = (static_cast<int>((log2(c_MAX_MSG_BUF_SIZE) + 31) / 32)) * 4; //no of bytes needed to store the message size rounded up to 4 bytes chunks
                                                        // no of bits in multiple of 32: n = [log2(c_MAX_MSG_BUF_SIZE) + 31) / 32]*32 =>
@@ -119,6 +182,40 @@ protected:
   virtual ssize_t capacity(const uint8_t* buffer, size_t len) = 0;
   virtual ssize_t headless_capacity(char *cover_body, int body_length) = 0;
 
+  /**
+     The payload database records each cover's capacity as
+     static_capacity measured it when the database was built. A steg
+     mod configured to pack data more densely than that maps between
+     the two here.
+
+     @return the recorded capacity a cover needs to carry data_len bytes
+  */
+  virtual size_t cover_capacity_needed(size_t data_len) { return data_len; }
+
+  /** @return how much data a cover of recorded capacity can carry */
+  virtual size_t room_in_capacity(size_t capacity) { return capacity; }
+
+  /**
+     When the mapping above can promise more than a particular cover
+     holds, returns how much data that cover body can really carry;
+     otherwise -1, the recorded capacity holds.
+  */
+  virtual ssize_t cover_room(const uint8_t* body, size_t body_len) { (void)body; (void)body_len; return -1; }
+
+  /**
+     A steg mod which embeds the data at the front of the cover can
+     say how much of it decode needs, so that the client decodes a
+     chunked response as soon as that much has come rather than at
+     its end, and the server sends that much as the first chunk.
+
+     @param cover_payload: the body received so far
+     @param len: its length
+
+     @return the length of the body decode needs, or 0 if it cannot
+             tell yet or needs the whole cover
+  */
+  virtual size_t decodable_prefix(const uint8_t* cover_payload, size_t len) { (void)cover_payload; (void)len; return 0; }
+
   /**
      Find appropriate payload calls virtual embed to embed it appropriate
      to its typex
@@ -129,6 +226,29 @@ protected:
   */
   virtual int http_server_transmit(evbuffer *source, conn_t *conn);
 
+  /**
+     Does the embedding part of http_server_transmit for a transport
+     which frames the response itself (e.g. h2c). Drains source on
+     success.
+
+     @param new_header: receives the HTTP/1 response header of the
+            cover, fixed to the length of the body (MAX_RESP_HDR_SIZE)
+     @param new_header_len: its length
+     @param body: set to the body carrying the data, valid until the
+            next call
+
+     @return the length of the body or < 0 in case of error
+  */
+  ssize_t embed_in_cover(evbuffer *source, uint8_t new_header[], size_t* new_header_len, const uint8_t** body);
+
+  /**
+     Recovers the data out of a whole cover body received by such a
+     transport and appends it to dest.
+
+     @return the length of the data or < 0 in case of error
+  */
+  ssize_t extract_from_cover(const uint8_t* body, size_t body_len, evbuffer *dest);
+
   /**
      Tries to extract the embeded data in source buffer and put them
      in dest. It returns INCOMPLETE or BAD if it fails
@@ -137,12 +257,28 @@ protected:
      @param dest will contain the extracted data from
             http cover
 
+     @param chunked the connection's chunked response in progress:
+            while it is set, source holds the rest of its chunks and
+            no header
+
+     @param cover_continues set if the data came before the end of a
+            chunked response, whose rest skip_cover_rest then takes
+
      @return RECV_GOOD if the extraction is successful, RECV_INCOMPLETE
              In case it can't find all the data in the cover (body etc)
              or bad.
   */
   virtual int http_client_receive(conn_t *conn, evbuffer *dest, 
-                                  evbuffer *source);
+                                  evbuffer *source, ChunkedBody** chunked,
+                                  bool* cover_continues);
+
+  /**
+     Drops the chunks of a response whose data has already been
+     decoded, as they arrive.
+
+     @return RECV_BAD if the chunks are malformed
+  */
+  static int skip_cover_rest(evbuffer *source, bool* done);
   /**
      constructor, sets the playoad server
 
@@ -110,6 +110,28 @@ ssize_t GIFSteg::decode(const uint8_t* cover_payload, size_t cover_len, uint8_t*
 
 }
 
+/**
+   The data follows the first image block sentinel, with its length
+   in front of it.
+*/
+size_t GIFSteg::decodable_prefix(const uint8_t* cover_payload, size_t len)
+{
+  //starting_point complains if there is no sentinel yet
+  if (!memchr(cover_payload, c_image_block_sentinel, len))
+    return 0;
+
+  ssize_t from = starting_point(cover_payload, len);
+  if (from <= 0 || (size_t)from + sizeof(size_t) > len)
+    return 0;
+
+  size_t s;
+  memcpy(&s, cover_payload+from, sizeof(size_t));
+  if (s >= c_MAX_MSG_BUF_SIZE)
+    return 0;
+
+  return from + sizeof(size_t) + s;
+}
+
 /**
    constructor just to call parent constructor
 */
@@ -59,6 +59,7 @@ public:
     virtual int encode(uint8_t* data, size_t data_len, uint8_t* cover_payload, size_t cover_len);
     
 	virtual ssize_t decode(const uint8_t* cover_payload, size_t cover_len, uint8_t* data);
+	virtual size_t decodable_prefix(const uint8_t* cover_payload, size_t len);
 
 };
 
@@ -20,7 +20,7 @@ void buf_dump(unsigned char* buf, int len, FILE *out);
 
 ssize_t HTMLSteg::headless_capacity(char *cover_body, int body_length)
 {
-  return static_headless_capacity(cover_body,(size_t) body_length);
+  return static_headless_capacity(cover_body,(size_t) body_length, encoding);
 }
 
 
@@ -39,7 +39,7 @@ unsigned int HTMLSteg::static_capacity(char *cover_payload, int body_length)
 }
 
 unsigned int
-HTMLSteg::static_headless_capacity (char* buf, size_t len) {
+HTMLSteg::static_headless_capacity (char* buf, size_t len, js_encoding_t encoding) {
 
   log_debug("at html static headless capacity");
   char *bp, *jsStart, *jsEnd;
@@ -57,12 +57,15 @@ HTMLSteg::static_headless_capacity (char* buf, size_t len) {
     // count the number of usable hex char between jsStart+31 and jsEnd
 
     size_t chunk_len = jsEnd-bp;
-    cnt += js_code_block_preliminary_capacity(bp, chunk_len);
+    if (encoding == JS_ENCODING_ALNUM)
+      cnt += js_alnum_positions(bp, chunk_len, NULL);
+    else
+      cnt += js_code_block_preliminary_capacity(bp, chunk_len);
 
     bp += 9;
   } // while (bp < (buf+len))
 
-  int actual_capacity = max(0, (cnt -JS_DELIMITER_SIZE)/2);  
+  int actual_capacity = capacity_of_positions(cnt, encoding);
   log_debug("payload has capacity %d", actual_capacity);
   return actual_capacity;
 
@@ -122,7 +125,8 @@ int HTMLSteg::encode_http_body(const char *data, char *jTemplate, char *jData,
     // the JS for encoding data is between jsStart and jsEnd
     scriptLen = jsEnd - jtp;
     // n = encode2(dp, jtp, jdp, dlen, jtlen, jdlen, &fin);
-    n = encode_in_single_js_block((char*)dp, jtp, jdp, dlen, scriptLen, jdlen, &fin);
+    n = encode_in_single_js_block((char*)dp, jtp, jdp, dlen, scriptLen, jdlen, &fin,
+                                  encoding);
     // update encCnt, dp, and dlen based on n
     if (n > 0) {
       encCnt = encCnt+n; dp = dp+n; dlen = dlen-n;
@@ -142,7 +146,7 @@ int HTMLSteg::encode_http_body(const char *data, char *jTemplate, char *jData,
 
   // handling the boundary case in which JS_DELIMITER hasn't been
   // added by encode()
-  if (fin == 0 && dlen == 0) {
+  if (fin == 0 && dlen == 0 && encoding != JS_ENCODING_ALNUM) {
     if (skip > 0) {
       *jtp = JS_DELIMITER;
       jtp = jtp+1; jdp = jdp+1;
@@ -189,10 +193,17 @@ HTMLSteg::decode_http_body(const char *jData, const char *dataBuf, unsigned int
 
     // the JS for decoding data is between jsStart and jsEnd
     scriptLen = jsEnd - jdp;
-    n = decode_single_js_block(jdp, dp, scriptLen, dlen, fin);
+    n = decode_single_js_block(jdp, dp, scriptLen, dlen, fin, encoding);
     if (n > 0) {
       decCnt = decCnt+n; dlen=dlen-n; dp=dp+n;
     }
+
+    // the length prefix says when we have it all
+    if (encoding == JS_ENCODING_ALNUM) {
+      ssize_t need = js_alnum_message_len(dataBuf, decCnt);
+      if (need >= 0 && need <= decCnt)
+        *fin = 1;
+    }
     jdp = jsEnd+strlen(endScriptTypeJS);
   } // while (*fin==0)
 
@@ -28,7 +28,8 @@ public:
        @param body_length the total length of message body
     */
     virtual ssize_t headless_capacity(char *cover_body, int body_length);
-    static unsigned int static_headless_capacity(char *buf, size_t len);
+    static unsigned int static_headless_capacity(char *buf, size_t len,
+                                                 js_encoding_t encoding = JS_ENCODING_HEX);
 
     virtual ssize_t capacity(const uint8_t *cover_payload, size_t len);
     static unsigned int static_capacity(char *cover_payload, int body_length);
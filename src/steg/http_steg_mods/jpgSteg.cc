@@ -69,6 +69,11 @@ int JPGSteg::starting_point(const uint8_t *raw_data, int len)
       log_warn("couldn't find the last marker in jpg payload, corrupted payload probably");
       return -1;
     }
+
+    if (lm + 4 > len) {
+      log_warn("jpg payload ends in the scan header, corrupted payload probably");
+      return -1;
+    }
  
 	const unsigned short *flen = (const unsigned short *)(raw_data+lm+2); // Frame length
 	unsigned short swapped = SWAP(*flen);
@@ -181,6 +186,34 @@ ssize_t JPGSteg::decode(const uint8_t* cover_payload, size_t cover_len, uint8_t*
 
 }
 
+/**
+   The data follows the header of the first scan, with its length
+   in front of it.
+*/
+size_t JPGSteg::decodable_prefix(const uint8_t* cover_payload, size_t len)
+{
+  //starting_point complains if there is no scan yet
+  size_t i = 0;
+  while (i + 1 < len && !(cover_payload[i] == FRAME && cover_payload[i+1] == FRAME_SCAN))
+    i++;
+  //nor if the scan header's length hasn't come
+  if (i + 4 > len)
+    return 0;
+
+  ssize_t from = starting_point(cover_payload, len);
+  if (from < 0 || (size_t)from + c_NO_BYTES_TO_STORE_MSG_SIZE > len)
+    return 0;
+
+  message_size_t s;
+  memcpy(&s, cover_payload+from, c_NO_BYTES_TO_STORE_MSG_SIZE);
+  s %= c_HIGH_BYTES_DISCARDER;
+  if (s > c_MAX_MSG_BUF_SIZE)
+    return 0; //decode has to see the whole thing to fail
+
+  //starting_point wants two bytes after the length, even for no data
+  return from + c_NO_BYTES_TO_STORE_MSG_SIZE + max((size_t)s, (size_t)2);
+}
+
 /**
    constructor just to call parent constructor
 */
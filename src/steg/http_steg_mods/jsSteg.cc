@@ -25,7 +25,7 @@ void buf_dump(unsigned char* buf, int len, FILE *out);
 
 ssize_t JSSteg::headless_capacity(char *cover_body, int body_length)
 {
-  return static_headless_capacity(cover_body,(size_t) body_length);
+  return static_headless_capacity(cover_body,(size_t) body_length, encoding);
 }
 
 
@@ -46,9 +46,54 @@ unsigned int JSSteg::static_capacity(char *cover_payload, int body_length)
 }
 
 unsigned int
-JSSteg::static_headless_capacity (char* buf, size_t len) {
+JSSteg::static_headless_capacity (char* buf, size_t len, js_encoding_t encoding) {
 
-  return max(0, (static_cast<int>(js_code_block_preliminary_capacity(buf,len)) - JS_DELIMITER_SIZE)/2);
+  if (encoding == JS_ENCODING_ALNUM)
+    return capacity_of_positions(js_alnum_positions(buf, len, NULL), encoding);
+
+  return capacity_of_positions(js_code_block_preliminary_capacity(buf,len), encoding);
+}
+
+unsigned int
+JSSteg::capacity_of_positions(size_t positions, js_encoding_t encoding)
+{
+  if (encoding == JS_ENCODING_ALNUM)
+    return positions < JS_ALNUM_LEN_CHARS ? 0 :
+      alnum_decoded_len(positions - JS_ALNUM_LEN_CHARS);
+
+  return max(0, (static_cast<int>(positions) - JS_DELIMITER_SIZE)/2);
+}
+
+size_t
+JSSteg::cover_capacity_needed(size_t data_len)
+{
+  if (encoding != JS_ENCODING_ALNUM)
+    return data_len;
+
+  // a hex capacity of c means at least 2c + JS_DELIMITER_SIZE usable
+  // hex characters, all of them usable by the alnum encoding but for
+  // those in keyword-shaped words; cover_room catches the covers
+  // where that matters
+  size_t chars = JS_ALNUM_LEN_CHARS + alnum_encoded_len(data_len);
+  return chars / 2;
+}
+
+size_t
+JSSteg::room_in_capacity(size_t capacity)
+{
+  if (encoding != JS_ENCODING_ALNUM)
+    return capacity;
+
+  return capacity_of_positions(2*capacity + JS_DELIMITER_SIZE, encoding);
+}
+
+ssize_t
+JSSteg::cover_room(const uint8_t* body, size_t body_len)
+{
+  if (encoding != JS_ENCODING_ALNUM)
+    return -1;
+
+  return headless_capacity((char*)body, body_len);
 }
 
 unsigned int
@@ -106,6 +151,76 @@ int isxString(char *str) {
   return 1;
 }
 
+/*
+ * js_alnum_positions finds, in order, the characters of a JS code
+ * block that the alnum encoding replaces, and returns how many there
+ * are; their offsets go in positions, unless it is NULL.
+ *
+ * As with offset2Hex, the first character of every word and the
+ * keywords skipJSPattern knows are left alone, and so is any word
+ * shaped like one (see jsKeywordShaped), which new letters could turn
+ * into a keyword. Of any other word, every letter and digit after the
+ * first is used. Substituting letters and digits for letters and
+ * digits changes neither word boundaries nor shapes, so the decoder
+ * finds the same positions in the encoded block as the encoder did in
+ * the cover.
+ */
+size_t
+js_alnum_positions(const char *buf, size_t len,
+                   std::vector<unsigned int> *positions)
+{
+  size_t cnt = 0;
+  size_t i = 0;
+
+  while (i < len) {
+    if (!isalnum_(buf[i])) {
+      i++;
+      continue;
+    }
+
+    // buf[i] starts a word
+    int skip = skipJSPattern((char*)buf+i, len-i);
+    if (skip > 0) {
+      i += skip;
+      continue;
+    }
+
+    bool usable = !jsKeywordShaped((char*)buf+i, len-i);
+    for (i++; i < len && isalnum_(buf[i]); i++) {
+      if (usable && isalnum(buf[i])) {
+        if (positions)
+          positions->push_back(i);
+        cnt++;
+      }
+    }
+  }
+
+  return cnt;
+}
+
+/*
+ * js_alnum_message_len returns the number of characters the alnum
+ * encoded message starting at chars takes, length prefix included,
+ * or -1 if the first cnt characters do not tell yet or the prefix is
+ * invalid.
+ */
+ssize_t
+js_alnum_message_len(const char *chars, size_t cnt)
+{
+  if (cnt < JS_ALNUM_LEN_CHARS)
+    return -1;
+
+  uint8_t len_bytes[JS_ALNUM_LEN_BYTES];
+  if (decode_alnum_to_data((const uint8_t*)chars, JS_ALNUM_LEN_CHARS,
+                           len_bytes) != JS_ALNUM_LEN_BYTES)
+    return -1;
+
+  size_t data_len = len_bytes[0] << 16 | len_bytes[1] << 8 | len_bytes[2];
+  if (data_len > FileStegMod::c_MAX_MSG_BUF_SIZE)
+    return -1;
+  return JS_ALNUM_LEN_CHARS + alnum_encoded_len(data_len);
+}
+
 int JSSteg::isxString(char *str) {
   unsigned int i;
   char *dp = str;
@@ -391,6 +506,25 @@ ssize_t JSSteg::decode(const uint8_t* cover_payload, size_t cover_len, uint8_t*
 
   }
 
+  if (encoding == JS_ENCODING_ALNUM) {
+    std::vector<char> chars(JS_ALNUM_LEN_CHARS +
+                            alnum_encoded_len(c_MAX_MSG_BUF_SIZE));
+    decCnt = decode_http_body((const char*)cover_payload, chars.data(), cover_len,
+                              chars.size(), &fin);
+
+    ssize_t need = js_alnum_message_len(chars.data(), decCnt);
+    if (need < 0 || need > decCnt) {
+      log_debug("CLIENT ERROR: alnum data received is truncated or invalid");
+      return -1;
+    }
+
+    ssize_t r = decode_alnum_to_data((uint8_t*)chars.data() + JS_ALNUM_LEN_CHARS,
+                                     need - JS_ALNUM_LEN_CHARS, data);
+    if (r < 0)
+      log_debug("CLIENT ERROR: Data received not alnum");
+    return r;
+  }
+
   decCnt = decode_http_body((const char*)cover_payload, (char*)data, cover_len, HTTP_PAYLOAD_BUF_SIZE,
                                   &fin);
 
@@ -466,15 +600,30 @@ int  JSSteg::encode(uint8_t* data, size_t data_len, uint8_t* cover_payload, size
     return -1; //not enough capacity is an error because you should have check     //before requesting
   }
 
-  size_t hexed_datalen = 2*data_len;
-  std::vector<uint8_t> hexed_data(hexed_datalen);
-
-  encode_data_to_hex(data, data_len, hexed_data.data());
+  size_t hexed_datalen;
+  std::vector<uint8_t> hexed_data;
+
+  if (encoding == JS_ENCODING_ALNUM) {
+    // length prefix, then the data
+    uint8_t len_bytes[JS_ALNUM_LEN_BYTES] = {
+      (uint8_t)(data_len >> 16), (uint8_t)(data_len >> 8), (uint8_t)data_len
+    };
+    hexed_datalen = JS_ALNUM_LEN_CHARS + alnum_encoded_len(data_len);
+    hexed_data.resize(hexed_datalen);
+    encode_data_to_alnum(len_bytes, JS_ALNUM_LEN_BYTES, hexed_data.data());
+    encode_data_to_alnum(data, data_len,
+                         hexed_data.data() + JS_ALNUM_LEN_CHARS);
+  } else {
+    hexed_datalen = 2*data_len;
+    hexed_data.resize(hexed_datalen);
+    encode_data_to_hex(data, data_len, hexed_data.data());
+  }
 
   // log_debug("MJS %d %d", datalen, mjs);
   //this should not happen
   log_assert(cover_payload != NULL);
 
+  ensure_outbuf();
   ssize_t r = encode_http_body((const char*)hexed_data.data(), (char*)cover_payload, (char*)outbuf, hexed_datalen, cover_len, cover_len);
 
   if (r < 0 || ((unsigned int) r < hexed_datalen)) {
@@ -520,7 +669,8 @@ int JSSteg::encode_http_body(const char *data, char *jTemplate, char *jData,
                              unsigned int jdlen)
 {
   int fin;
-  ssize_t r = encode_in_single_js_block((char*)data, (char*)jTemplate, (char*)jData, dlen, jtlen, jdlen, &fin);
+  ssize_t r = encode_in_single_js_block((char*)data, (char*)jTemplate, (char*)jData, dlen, jtlen, jdlen, &fin,
+                                        encoding);
 
   if (r < 0 || ((unsigned int) r < dlen) || fin == 0) {
     log_warn("SERVER ERROR: Incomplete data encoding");
@@ -542,13 +692,13 @@ JSSteg::decode_http_body(const char *jData, const char *dataBuf, unsigned int jd
 {
   log_assert(dataBufSize >= c_MAX_MSG_BUF_SIZE);
   
-  return decode_single_js_block((const char*)jData, (char*)dataBuf, jdlen, HTTP_PAYLOAD_BUF_SIZE,
-                                  fin);
+  return decode_single_js_block((const char*)jData, (char*)dataBuf, jdlen, dataBufSize,
+                                  fin, encoding);
 }
 
 int  encode_in_single_js_block(char *data, char *jTemplate, char *jData,
              unsigned int dlen, unsigned int jtlen,
-             unsigned int jdlen, int *fin)
+             unsigned int jdlen, int *fin, js_encoding_t encoding)
 {
   unsigned int encCnt = 0;  /* num of data encoded in jData */
   char *dp, *jtp, *jdp; /* current pointers for data, jTemplate, and jData */
@@ -559,6 +709,20 @@ int  encode_in_single_js_block(char *data, char *jTemplate, char *jData,
    */
   if (jdlen < jtlen) { return INVALID_BUF_SIZE; }
 
+  if (encoding == JS_ENCODING_ALNUM) {
+    // the template goes through as it is, but for the characters
+    // at the usable positions; there is no delimiter to add
+    std::vector<unsigned int> positions;
+    js_alnum_positions(jTemplate, jtlen, &positions);
+
+    memcpy(jData, jTemplate, jtlen);
+    for (; encCnt < dlen && encCnt < positions.size(); encCnt++)
+      jData[positions[encCnt]] = data[encCnt];
+
+    *fin = (encCnt == dlen);
+    return encCnt;
+  }
+
   dp = data; jtp = jTemplate; jdp = jData;
 
   if (! isxString(dp) ) { return INVALID_DATA_CHAR; }
@@ -803,7 +967,7 @@ int encodeHTTPBody(char *data, char *jTemplate, char *jData,
  * stops when JS_DELIMITER is encountered.
  */
 int decode_single_js_block(const char *jData, const char *dataBuf, unsigned int jdlen,
-             unsigned int dataBufSize, int *fin )
+             unsigned int dataBufSize, int *fin, js_encoding_t encoding)
 {
   unsigned int decCnt = 0;  /* num of data decoded */
   char *dp, *jdp; /* current pointers for dataBuf and jData */
@@ -811,6 +975,18 @@ int decode_single_js_block(const char *jData, const char *dataBuf, unsigned int
   int cjdlen = jdlen;
 
   *fin = 0;
+
+  if (encoding == JS_ENCODING_ALNUM) {
+    // where the data ends is up to the length prefix, which the
+    // caller reads
+    std::vector<unsigned int> positions;
+    js_alnum_positions(jData, jdlen, &positions);
+
+    for (; decCnt < dataBufSize && decCnt < positions.size(); decCnt++)
+      ((char*)dataBuf)[decCnt] = jData[positions[decCnt]];
+
+    return decCnt;
+  }
   dp = (char*)dataBuf; jdp = (char*)jData;
 
   i = offset2Hex(jdp, cjdlen, 0);
@@ -1393,7 +1569,7 @@ http_handle_client_JS_receive(steg_t *, conn_t *conn, struct evbuffer *dest, str
 }
 
 JSSteg::JSSteg(PayloadServer* payload_provider, double noise2signal, int content_type)
- :FileStegMod(payload_provider, noise2signal, content_type)
+ :FileStegMod(payload_provider, noise2signal, content_type), encoding(JS_ENCODING_HEX)
 {
 
 }
@@ -5,6 +5,28 @@
 #ifndef _JSSTEG_H
 #define _JSSTEG_H
 
+#include <vector>
+
+/**
+   How data is written into the usable characters of a JS cover.
+
+   JS_ENCODING_HEX substitutes hex digits for hex digits, two per data
+   byte, and marks the end of the data with JS_DELIMITER.
+
+   JS_ENCODING_ALNUM substitutes letters and digits for letters and
+   digits (see js_alnum_positions), packing the data in base 62 behind
+   a JS_ALNUM_LEN_CHARS length prefix; the rest of the cover is left
+   as it was.
+
+   Nothing in a cover says which was used: both ends have to be
+   configured alike for each cover type.
+*/
+enum js_encoding_t { JS_ENCODING_HEX, JS_ENCODING_ALNUM };
+
+// the data length, as 3 bytes, goes ahead of alnum-encoded data
+#define JS_ALNUM_LEN_BYTES 3
+#define JS_ALNUM_LEN_CHARS 5 // alnum_encoded_len(JS_ALNUM_LEN_BYTES)
+
  class JSSteg : public FileStegMod
 {
 
@@ -43,6 +65,23 @@
   static unsigned int js_code_block_preliminary_capacity(char* buf, size_t len);
 
 public:
+  js_encoding_t encoding;
+
+  /**
+     the capacity in the database is measured for the hex encoding,
+     which (keyword-shaped words aside) takes no more characters of
+     any cover than the alnum one does; so with the alnum encoding a
+     cover of fewer hex bytes will do, and carries more.
+  */
+  virtual size_t cover_capacity_needed(size_t data_len);
+  virtual size_t room_in_capacity(size_t capacity);
+  /** keyword-shaped words can leave a cover less alnum room than its
+      recorded capacity promises, so alnum covers are measured */
+  virtual ssize_t cover_room(const uint8_t* body, size_t body_len);
+
+  /** data capacity of POSITIONS usable characters under ENCODING */
+  static unsigned int capacity_of_positions(size_t positions, js_encoding_t encoding);
+
   int isxString(char *str);
 
   int isGzipContent (char *msg);
@@ -67,7 +106,8 @@ beginig of the body in the response
 @param body_length the total length of message body
 */
     virtual ssize_t headless_capacity(char *cover_body, int body_length);
-    static unsigned int static_headless_capacity(char *buf, size_t len);
+    static unsigned int static_headless_capacity(char *buf, size_t len,
+                                                 js_encoding_t encoding = JS_ENCODING_HEX);
 
     virtual ssize_t capacity(const uint8_t *cover_payload, size_t len);
     static unsigned int static_capacity(char *cover_payload, int body_length);
@@ -116,9 +156,16 @@ int testDecode2(char *inBuf, char *outBuf,
                 int mode, int testNum);**/
 int encode_in_single_js_block(char *data, char *jTemplate, char *jData,
              unsigned int dlen, unsigned int jtlen,
-             unsigned int jdlen, int *fin);
+             unsigned int jdlen, int *fin,
+             js_encoding_t encoding = JS_ENCODING_HEX);
 int decode_single_js_block(const char *jData, const char *dataBuf, unsigned int jdlen,
-             unsigned int dataBufSize, int *fin );
+             unsigned int dataBufSize, int *fin,
+             js_encoding_t encoding = JS_ENCODING_HEX);
+
+size_t js_alnum_positions(const char *buf, size_t len,
+                          std::vector<unsigned int> *positions);
+
+ssize_t js_alnum_message_len(const char *chars, size_t cnt);
 
 int
 http_server_JS_transmit (PayloadServer* pl, struct evbuffer *source,
@@ -462,6 +462,28 @@ PDFSteg::decode(const uint8_t* cover_payload, size_t cover_len, uint8_t* data) /
 }
 
 
+/**
+   The data is all in the first stream, decode needs nothing after it.
+*/
+size_t
+PDFSteg::decodable_prefix(const uint8_t* cover_payload, size_t len)
+{
+  const char* dp = (const char*) cover_payload;
+  char* streamStart = strInBinary(STREAM_BEGIN, STREAM_BEGIN_SIZE, dp, len);
+  if (streamStart == NULL)
+    return 0;
+
+  //past the end of line which decode looks at
+  size_t from = streamStart + STREAM_BEGIN_SIZE + 2 - dp;
+  if (from >= len)
+    return 0;
+
+  char* streamEnd = strInBinary(STREAM_END, STREAM_END_SIZE, dp + from, len - from);
+  if (streamEnd == NULL)
+    return 0;
+
+  return streamEnd + STREAM_END_SIZE - dp;
+}
 
 PDFSteg::PDFSteg(PayloadServer* payload_provider, double noise2signal)
  :FileStegMod(payload_provider, noise2signal, HTTP_CONTENT_PDF)
@@ -172,6 +172,47 @@ ssize_t PNGSteg::decode(const uint8_t* cover_payload, size_t cover_len, uint8_t*
 
 // }
 
+/**
+   The data fills the IDAT chunks from the first one, with its length
+   in front of it: decode needs the chunks up to the one holding its
+   last byte.
+*/
+size_t PNGSteg::decodable_prefix(const uint8_t* cover_payload, size_t len)
+{
+  if (len <= c_magic_header_length)
+    return 0;
+
+  //chunks running past len are not found, as if the cover ended there
+  PNGChunkData next_data_chunk((uint8_t*)cover_payload + c_magic_header_length, (uint8_t*)cover_payload + len), cur_data_chunk;
+  if (not next_data_chunk.chunk_offset)
+    return 0;
+
+  uint8_t length_bytes[sizeof(uint32_t)];
+  size_t embedded = 0; //room in the chunks so far, data length included
+  size_t needed = 0;
+  do {
+    cur_data_chunk = next_data_chunk;
+    const uint8_t* chunk_data = cur_data_chunk.chunk_offset + PNGChunkData::c_chunk_header_length;
+    for (size_t i = 0; i < cur_data_chunk.length && embedded + i < sizeof(uint32_t); i++)
+      length_bytes[embedded + i] = chunk_data[i];
+    embedded += cur_data_chunk.length;
+
+    if (!needed && embedded >= sizeof(uint32_t)) {
+      uint32_t data_length;
+      memcpy(&data_length, length_bytes, sizeof(uint32_t));
+      if (data_length > c_MAX_MSG_BUF_SIZE)
+        return 0;
+      needed = data_length + sizeof(uint32_t);
+    }
+
+    if (needed && embedded >= needed)
+      return cur_data_chunk.chunk_offset + cur_data_chunk.length + PNGChunkData::chunk_header_footer_length - cover_payload;
+
+  } while(cur_data_chunk.get_next_IDAT_chunk(&next_data_chunk));
+
+  return 0;
+}
+
 /**
    constructor just to call parent constructor
 */
@@ -51,31 +51,24 @@ class PNGChunkData
     }
 
     next_chunk->chunk_offset = chunk_offset + length + chunk_header_footer_length;
-    next_chunk->compute_length();
 
-    //If the length is invalid then the file is either corrupted or invalid format
-    if (next_chunk->chunk_offset + next_chunk->length + chunk_header_footer_length > payload_end) {
-      next_chunk->chunk_offset = 0;
-      next_chunk->length = 0;
-      return 0;
-    }
+    //the length and type are only read from a chunk which fits in the payload
+    while(next_chunk->chunk_offset + chunk_header_footer_length <= payload_end) {
+      next_chunk->compute_length();
+
+      //If the length is invalid then the file is either corrupted or invalid format
+      if (next_chunk->chunk_offset + next_chunk->length + chunk_header_footer_length > payload_end)
+        break;
 
-    while(next_chunk->chunk_offset < payload_end) {
       if  (!memcmp(type, next_chunk->chunk_offset + 4, 4 * sizeof(uint8_t)))
         return next_chunk->chunk_offset;
 
-      if (next_chunk->chunk_offset + next_chunk->length + chunk_header_footer_length > payload_end) {
-        next_chunk->chunk_offset = 0;
-        next_chunk->length = 0;
-        return 0; //corrupted: something is wrong!
-      }
-
       next_chunk->chunk_offset += next_chunk->length + chunk_header_footer_length;
-      next_chunk->compute_length();
-           
     }
 
-    //reached the end of payload
+    //reached the end of payload without an IDAT chunk
+    next_chunk->chunk_offset = 0;
+    next_chunk->length = 0;
     return 0;
 
   }
@@ -102,6 +95,8 @@ class PNGChunkData
       PNGChunkData aux_chunk;
       aux_chunk.chunk_offset = cur_chunk_offset;
       aux_chunk.payload_end = payload_end;
+      if (cur_chunk_offset + chunk_header_footer_length > payload_end)
+        return; //not even room for one chunk
       aux_chunk.compute_length();
       /*if (aux_chunk.chunk_offset + aux_chunk.length + chunk_header_footer_length > payload_end) {// || not aux_chunk.get_next_IDAT_chunk(this)) { //not a valid chunk
         chunk_offset = 0;
@@ -152,6 +147,7 @@ public:
    virtual int encode(uint8_t* data, size_t data_len, uint8_t* cover_payload, size_t cover_len);
     
    virtual ssize_t decode(const uint8_t* cover_payload, size_t cover_len, uint8_t* data);
+   virtual size_t decodable_prefix(const uint8_t* cover_payload, size_t len);
 
 };
 
@@ -25,72 +25,100 @@ static const char http_response_1[] =
 int SWFSteg::encode(uint8_t* data, size_t data_len, uint8_t* cover_payload, size_t cover_len) {
   char* tmp_buf;
   int out_swf_len;
-  //int in_swf_len;
-
-  //char* rend;
-  //char hdr[512];
-  //unsigned int hdr_len;
-
-  //char* tmp_buf2;
-  //char* resp;
-  //int resp_len;
 
   if (headless_capacity((char*)cover_payload, cover_len) <  (int) data_len) {
     log_warn("not enough cover capacity to embed data");
     return -1; //not enough capacity is an error because you should have check     //before requesting
   }
 
-  tmp_buf = (char *)xmalloc(data_len + SWF_SAVE_HEADER_LEN + SWF_SAVE_FOOTER_LEN);
-  //tmp_buf2 = (char *)xmalloc(data_len);
-  
+  size_t out_capacity = data_len + SWF_SAVE_HEADER_LEN + SWF_SAVE_FOOTER_LEN + 512-8;
+
   //we skip the first 8 bytes, because we don't want to compress them
   //4 bytes magic and 4 bytes are the the length of the compressed blob
-  memcpy(tmp_buf, cover_payload+8, SWF_SAVE_HEADER_LEN); //look at get_payload in trace_payload_server. 
-  memcpy(tmp_buf+SWF_SAVE_HEADER_LEN, data, data_len);
-  memcpy(tmp_buf+SWF_SAVE_HEADER_LEN+data_len, cover_payload + cover_len - SWF_SAVE_FOOTER_LEN, SWF_SAVE_FOOTER_LEN);
-  out_swf_len =
-    compress((const uint8_t *)tmp_buf,
-             SWF_SAVE_HEADER_LEN + data_len + SWF_SAVE_FOOTER_LEN,
-             (uint8_t *)cover_payload+8,
-             data_len + SWF_SAVE_HEADER_LEN + SWF_SAVE_FOOTER_LEN + 512-8,
-             c_format_zlib);
+  if (precompress_cover) {
+    const PrecompressedCover* header_footer = precompressed_cover(cover_payload, cover_len);
+    if (!header_footer)
+      return -1;
+
+    out_swf_len =
+      deflate_context::for_thread(c_format_zlib).compress(header_footer->first,
+                                                          data, data_len,
+                                                          header_footer->second,
+                                                          cover_payload+8, out_capacity);
+  }
+  else {
+    tmp_buf = (char *)xmalloc(data_len + SWF_SAVE_HEADER_LEN + SWF_SAVE_FOOTER_LEN);
+
+    memcpy(tmp_buf, cover_payload+8, SWF_SAVE_HEADER_LEN); //look at get_payload in trace_payload_server. 
+    memcpy(tmp_buf+SWF_SAVE_HEADER_LEN, data, data_len);
+    memcpy(tmp_buf+SWF_SAVE_HEADER_LEN+data_len, cover_payload + cover_len - SWF_SAVE_FOOTER_LEN, SWF_SAVE_FOOTER_LEN);
+    out_swf_len =
+      compress((const uint8_t *)tmp_buf,
+               SWF_SAVE_HEADER_LEN + data_len + SWF_SAVE_FOOTER_LEN,
+               (uint8_t *)cover_payload+8,
+               out_capacity,
+               c_format_zlib);
+  
+    free(tmp_buf);
+  }
+
+  if (out_swf_len < 0) {
+    log_warn("failed to compress the swf cover");
+    return -1;
+  }
 
   ((int*) (cover_payload))[1] = out_swf_len; //this is not a good practice, implementation becomes machine dependent little/big indian wise.
   
-  free(tmp_buf);
-
   return out_swf_len + 8;
 
 }
 
-ssize_t SWFSteg::decode(const uint8_t *cover_payload, size_t cover_len, uint8_t* data)
+const SWFSteg::PrecompressedCover*
+SWFSteg::precompressed_cover(const uint8_t* cover_payload, size_t cover_len)
 {
-  int inf_len;
-  size_t tmp_len = cover_len * 32; //asset later?
-  char* tmp_buf = (char *)xmalloc(tmp_len);
-
-  for (;;) {
-    inf_len = decompress(cover_payload + 8, cover_len - 8,
-                         (uint8_t *)tmp_buf, tmp_len);
-    if (inf_len != -2)
-      break;
-    tmp_len *= 2;
-    tmp_buf = (char *)xrealloc(tmp_buf, tmp_len);
+  string header_footer((const char*)cover_payload+8, SWF_SAVE_HEADER_LEN);
+  header_footer.append((const char*)cover_payload + cover_len - SWF_SAVE_FOOTER_LEN, SWF_SAVE_FOOTER_LEN);
+
+  auto cached = _precompressed_covers.find(header_footer);
+  if (cached != _precompressed_covers.end())
+    return &cached->second;
+
+  if (_precompressed_covers.size() >= c_PRECOMPRESSED_COVER_CACHE_SIZE)
+    _precompressed_covers.clear();
+
+  PrecompressedCover& segments = _precompressed_covers[header_footer];
+  deflate_context& compressor = deflate_context::for_thread(c_format_zlib);
+  if (!(compressor.precompress((const uint8_t*)header_footer.data(), SWF_SAVE_HEADER_LEN, segments.first, false) &&
+        compressor.precompress((const uint8_t*)header_footer.data() + SWF_SAVE_HEADER_LEN, SWF_SAVE_FOOTER_LEN, segments.second, true))) {
+    _precompressed_covers.erase(header_footer);
+    return NULL;
   }
 
-  if (inf_len < 0 /*|| //no need for this check it always comes this big
-      sizeof(data) < c_HTTP_PAYLOAD_BUF_SIZE */) {
-    fprintf(stderr, "inf_len = %d\n", inf_len);
-    free(tmp_buf);
+  return &segments;
+
+}
+
+ssize_t SWFSteg::decode(const uint8_t *cover_payload, size_t cover_len, uint8_t* data)
+{
+  ssize_t inf_len;
+  evbuffer* inflated = evbuffer_new();
+
+  //inflate as much as it takes in one go instead of guessing a size
+  inf_len = inflate_context::for_thread().decompress(cover_payload + 8, cover_len - 8, inflated);
+
+  if (inf_len < SWF_SAVE_HEADER_LEN + SWF_SAVE_FOOTER_LEN ||
+      (size_t)(inf_len - SWF_SAVE_HEADER_LEN - SWF_SAVE_FOOTER_LEN) > c_MAX_MSG_BUF_SIZE) {
+    log_warn("inf_len = %ld", (long)inf_len);
+    evbuffer_free(inflated);
     return -1;
   }
 
-  memcpy(data, tmp_buf + SWF_SAVE_HEADER_LEN,
-         inf_len - SWF_SAVE_HEADER_LEN - SWF_SAVE_FOOTER_LEN);
-  
-tmp_len= inf_len - SWF_SAVE_HEADER_LEN - SWF_SAVE_FOOTER_LEN; //reassigned to existing variable
+  size_t data_len = inf_len - SWF_SAVE_HEADER_LEN - SWF_SAVE_FOOTER_LEN;
+  evbuffer_drain(inflated, SWF_SAVE_HEADER_LEN);
+  evbuffer_remove(inflated, data, data_len);
+  evbuffer_free(inflated);
 
-return (ssize_t)tmp_len; //added for new return type
+  return (ssize_t)data_len;
 }
 
 ssize_t SWFSteg::headless_capacity(char *cover_body, int body_length)
@@ -139,8 +167,8 @@ unsigned int SWFSteg::static_capacity(char *cover_payload, int len)
 }
 
 SWFSteg::SWFSteg(PayloadServer* payload_provider, double noise2signal)
- :FileStegMod(payload_provider, noise2signal, HTTP_CONTENT_SWF)
-
+ :FileStegMod(payload_provider, noise2signal, HTTP_CONTENT_SWF),
+  precompress_cover(false)
 {
 
 }
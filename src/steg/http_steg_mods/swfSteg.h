@@ -5,6 +5,10 @@
 #ifndef _SWFSTEG_H
 #define _SWFSTEG_H
 
+#include <map>
+
+#include "compression.h"
+
 //struct payloads;
 
 #define SWF_SAVE_HEADER_LEN 1500
@@ -12,8 +16,24 @@
 
 class SWFSteg : public FileStegMod
 {
+protected:
+    /* The saved header and footer of a cover are compressed along with
+       the data in every response. With precompress_cover, they are
+       compressed once per cover and only the data is compressed per
+       response. The cache is keyed by the header and footer themselves
+       because the same cover can live at different addresses. */
+    static const size_t c_PRECOMPRESSED_COVER_CACHE_SIZE = 64;
+    typedef std::pair<deflate_segment, deflate_segment> PrecompressedCover;
+    std::map<std::string, PrecompressedCover> _precompressed_covers;
+
+    /**
+       returns the precompressed header and footer of the cover,
+       compressing them if they are not cached, NULL on error
+    */
+    const PrecompressedCover* precompressed_cover(const uint8_t* cover_payload, size_t cover_len);
 
 public:
+    bool precompress_cover;
 
 
  /**
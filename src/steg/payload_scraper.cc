@@ -25,12 +25,49 @@ using namespace boost::filesystem;
 #include "http_steg_mods/htmlSteg.h"
 
 #include "payload_scraper.h"
+#include "cover_source.h"
 #include "base64.h"
 
 #include "protocol/chop_blk.h" //We need this to no what's the minimum 
                                //acceptable capacity
 
 #define TEMP_MOUNT_DIR "/tmp/remote_www"
+
+/**
+   Finds the value of a field in a raw HTTP response header
+
+   @param header the raw header as received by curl
+   @param field_name name of the header field without colon
+
+   @return the value stripped of the surronding white spaces or empty
+           string if the field is not present
+*/
+static string
+find_header_value(const string& header, const string& field_name)
+{
+  string lower_header(header);
+  string lower_field("\n" + field_name + ":");
+  transform(lower_header.begin(), lower_header.end(), lower_header.begin(), ::tolower);
+  transform(lower_field.begin(), lower_field.end(), lower_field.begin(), ::tolower);
+
+  size_t field_start = lower_header.find(lower_field);
+  if (field_start == string::npos)
+    return "";
+
+  field_start += lower_field.length();
+  size_t field_end = header.find("\r\n", field_start);
+  if (field_end == string::npos)
+    field_end = header.length();
+
+  string value = header.substr(field_start, field_end - field_start);
+  value.erase(0, value.find_first_not_of(" \t"));
+  value.erase(value.find_last_not_of(" \t") + 1);
+  //we store the validator in a space separated file
+  replace(value.begin(), value.end(), ' ', '_');
+
+  return value;
+
+}
 /** We read the /etc/httpd/conf/httpd.conf (this need to be more dynamic)
     but I'm testing it on my system which is running arch) find
     the DocumentRoot. Then it will check the directory recursively and
@@ -49,6 +86,12 @@ using namespace boost::filesystem;
 */
 const string
 PayloadScraper::scrape_url(const string& cur_url, steg_type* cur_steg, bool absolute_url)
+{
+  return scrape_url(capacity_handle, cur_url, cur_steg, absolute_url);
+}
+
+const string
+PayloadScraper::scrape_url(CURL* curl_handle, const string& cur_url, steg_type* cur_steg, bool absolute_url)
 {
   char url_hash[20];
   char url_hash64[40];
@@ -59,7 +102,7 @@ PayloadScraper::scrape_url(const string& cur_url, steg_type* cur_steg, bool abso
   base64::encoder url_hash_encoder;
   url_hash_encoder.encode(url_hash, 20, url_hash64);
                         
-  pair<unsigned long, unsigned long> fileinfo = compute_capacity(cur_url, cur_steg, absolute_url);
+  pair<unsigned long, unsigned long> fileinfo = compute_capacity(curl_handle, cur_url, cur_steg, absolute_url);
   unsigned long cur_filelength = fileinfo.first;
   unsigned long capacity = fileinfo.second;
 
@@ -110,12 +153,22 @@ PayloadScraper::scrape_dir(const path dir_path)
         if (cur_steg->extension == itr->path().extension().string())
           {
             string cur_filename(itr->path().generic_string());
-            log_debug("checking %s for capacity...", cur_filename.c_str());
+            log_debug("queuing %s for capacity check...", cur_filename.c_str());
             string cur_url(cur_filename.substr(_apache_doc_root.length(), cur_filename.length() -  _apache_doc_root.length()));
 
-            string scrape_result = scrape_url(cur_url, cur_steg);
-            if (!scrape_result.empty())
-              _payload_db << total_file_count << " " << cur_steg->type << " " << scrape_result  << " " << cur_url << " " << 0 << " " << cur_url << "\n"; //absolute_url false
+            ScrapedCover cur_cover;
+            cur_cover.file_id = total_file_count;
+            cur_cover.type = cur_steg->type;
+            cur_cover.steg = cur_steg;
+            cur_cover.url = cur_url;
+            cur_cover.absolute_url = false;
+            cur_cover.fetch_url = cur_url;
+
+            boost::system::error_code ec;
+            cur_cover.validator.mtime = (long)last_write_time(itr->path(), ec);
+            cur_cover.validator.size = file_size(itr->path(), ec);
+
+            queue_cover(cur_cover);
           }
     }
 
@@ -172,16 +225,21 @@ PayloadScraper::scrape_url_list(const string list_filename)
 
     for(steg_type* cur_steg = _available_stegs; cur_steg->type!= 0; cur_steg++) {
       if (cur_steg->extension == cur_url_ext) {
-        string scrape_result = scrape_url(file_url, cur_steg, true);
-        if (!scrape_result.empty()) {
-            _payload_db << total_file_count << " " << cur_steg->type << " " << scrape_result  << " " << relativize_url(file_url) << " " << 1 << " " << file_url << "\n"; //absolute_url = true
-        }
-        
+        ScrapedCover cur_cover;
+        cur_cover.file_id = total_file_count;
+        cur_cover.type = cur_steg->type;
+        cur_cover.steg = cur_steg;
+        cur_cover.url = relativize_url(file_url);
+        cur_cover.absolute_url = true;
+        cur_cover.fetch_url = file_url;
+
+        //the validator of remote covers is retrieved by the workers
+        queue_cover(cur_cover);
       }
     }
 
     scraped_tracker[file_url] = true;
-    log_debug("processed: %ld, scraped: %ld", total_processed_items, total_file_count);
+    log_debug("processed: %ld, queued: %ld", total_processed_items, total_file_count);
 
   }
 
@@ -189,6 +247,252 @@ PayloadScraper::scrape_url_list(const string list_filename)
 
 }
 
+CURL*
+PayloadScraper::new_capacity_handle()
+{
+  CURL* new_handle = curl_easy_init();
+  log_assert(new_handle);
+
+  curl_easy_setopt(new_handle, CURLOPT_HEADER, 1L);
+  curl_easy_setopt(new_handle, CURLOPT_HTTP_CONTENT_DECODING, 0L);
+  curl_easy_setopt(new_handle, CURLOPT_HTTP_TRANSFER_DECODING, 0L);
+  curl_easy_setopt(new_handle, CURLOPT_WRITEFUNCTION, curl_read_data_cb);
+  //signals and threads don't mix
+  curl_easy_setopt(new_handle, CURLOPT_NOSIGNAL, 1L);
+
+  return new_handle;
+
+}
+
+void
+PayloadScraper::set_no_of_workers(unsigned int no_of_workers)
+{
+  _no_of_workers = no_of_workers ? no_of_workers : std::thread::hardware_concurrency();
+  if (!_no_of_workers) //hardware_concurrency is allowed to not know
+    _no_of_workers = 1;
+
+}
+
+void
+PayloadScraper::queue_cover(ScrapedCover& cover)
+{
+  //local covers can be checked for change without fetching
+  if (!cover.absolute_url) {
+    auto previous = _previous_scrape.find(cover.fetch_url);
+    if (previous != _previous_scrape.end() &&
+        previous->second.validator == cover.validator) {
+      log_debug("%s has not changed since last scrape", cover.fetch_url.c_str());
+      cover.scrape_result = previous->second.scrape_result;
+
+      std::lock_guard<std::mutex> result_guard(_scraped_covers_lock);
+      _scraped_covers.push_back(cover);
+      _no_of_reused_covers++;
+      return;
+    }
+  }
+
+  std::unique_lock<std::mutex> queue_guard(_fetch_queue_lock);
+  _fetch_queue_not_full.wait(queue_guard, [this] { return _fetch_queue.size() < c_MAX_FETCH_QUEUE_LENGTH; });
+
+  _fetch_queue.push_back(cover);
+  _fetch_queue_not_empty.notify_one();
+
+}
+
+void
+PayloadScraper::scrape_worker()
+{
+  CURL* worker_handle = new_capacity_handle();
+
+  for(;;) {
+    ScrapedCover cur_cover;
+    {
+      std::unique_lock<std::mutex> queue_guard(_fetch_queue_lock);
+      _fetch_queue_not_empty.wait(queue_guard, [this] { return !_fetch_queue.empty() || _no_more_covers; });
+
+      if (_fetch_queue.empty()) //and no more covers are coming
+        break;
+
+      cur_cover = _fetch_queue.front();
+      _fetch_queue.pop_front();
+      _fetch_queue_not_full.notify_one();
+    }
+
+    bool reused = false;
+    //remote covers are validated with a HEAD request, which is a lot
+    //cheaper than fetching them
+    if (cur_cover.absolute_url &&
+        fetch_remote_validator(worker_handle, cur_cover.fetch_url, cur_cover.validator)) {
+      auto previous = _previous_scrape.find(cur_cover.fetch_url);
+      if (previous != _previous_scrape.end() &&
+          previous->second.validator == cur_cover.validator) {
+        log_debug("%s has not changed since last scrape", cur_cover.fetch_url.c_str());
+        cur_cover.scrape_result = previous->second.scrape_result;
+        reused = true;
+      }
+    }
+
+    if (!reused) {
+      log_debug("checking %s for capacity...", cur_cover.fetch_url.c_str());
+      cur_cover.scrape_result = scrape_url(worker_handle, cur_cover.fetch_url, cur_cover.steg, cur_cover.absolute_url);
+    }
+
+    std::lock_guard<std::mutex> result_guard(_scraped_covers_lock);
+    _scraped_covers.push_back(cur_cover);
+    if (reused)
+      _no_of_reused_covers++;
+  }
+
+  curl_easy_cleanup(worker_handle);
+
+}
+
+void
+PayloadScraper::start_workers()
+{
+  _no_more_covers = false;
+  _fetch_queue.clear();
+  _scraped_covers.clear();
+  _no_of_reused_covers = 0;
+
+  log_debug("starting %u scraper workers", _no_of_workers);
+  for(unsigned int i = 0; i < _no_of_workers; i++)
+    _workers.push_back(std::thread(&PayloadScraper::scrape_worker, this));
+
+}
+
+void
+PayloadScraper::join_workers()
+{
+  {
+    std::lock_guard<std::mutex> queue_guard(_fetch_queue_lock);
+    _no_more_covers = true;
+  }
+  _fetch_queue_not_empty.notify_all();
+
+  for(auto& cur_worker : _workers)
+    cur_worker.join();
+
+  _workers.clear();
+
+}
+
+bool
+PayloadScraper::fetch_remote_validator(CURL* curl_handle, const string& cover_url, CoverValidator& validator)
+{
+  stringstream header_buf;
+  string url_to_retrieve(cover_url);
+
+  curl_easy_setopt(curl_handle, CURLOPT_NOBODY, 1L);
+  unsigned long header_size = fetch_url_raw(curl_handle, url_to_retrieve, header_buf);
+  curl_easy_setopt(curl_handle, CURLOPT_HTTPGET, 1L);
+
+  if (header_size == 0)
+    return false;
+
+  string header = header_buf.str();
+  string etag = find_header_value(header, "ETag");
+  string content_length = find_header_value(header, "Content-Length");
+
+  //with neither, an unchanged answer says nothing about the cover
+  if (etag.empty() && content_length.empty())
+    return false;
+
+  validator.etag = etag.empty() ? "-" : etag;
+  validator.size = strtoul(content_length.c_str(), NULL, 10);
+
+  return true;
+
+}
+
+size_t
+PayloadScraper::load_previous_scrape()
+{
+  _previous_scrape.clear();
+
+  std::ifstream state_stream(state_filename());
+  if (!state_stream.is_open())
+    return 0;
+
+  string cur_line;
+  while (std::getline(state_stream, cur_line)) {
+    stringstream line_stream(cur_line);
+    ScrapedCover cur_cover;
+    string hash;
+    line_stream >> cur_cover.fetch_url >> cur_cover.validator.mtime >> cur_cover.validator.size >> cur_cover.validator.etag >> hash;
+    if (line_stream.fail()) {
+      log_warn("ignoring corrupted scrape state entry: %s", cur_line.c_str());
+      continue;
+    }
+
+    if (hash != "-") { //covers which weren't useful have no scrape result
+      unsigned long capacity, length;
+      line_stream >> capacity >> length;
+      if (line_stream.fail()) {
+        log_warn("ignoring corrupted scrape state entry: %s", cur_line.c_str());
+        continue;
+      }
+
+      stringstream scraped_entry;
+      scraped_entry << hash << " " << capacity << " " << length;
+      cur_cover.scrape_result = scraped_entry.str();
+    }
+
+    _previous_scrape[cur_cover.fetch_url] = cur_cover;
+  }
+
+  log_debug("remembered %lu covers from previous scrape", _previous_scrape.size());
+  return _previous_scrape.size();
+
+}
+
+bool
+PayloadScraper::commit_database()
+{
+  //keep the order of the database independent of the worker scheduling
+  std::sort(_scraped_covers.begin(), _scraped_covers.end(),
+            [](const ScrapedCover& a, const ScrapedCover& b) {
+              return a.file_id < b.file_id || (a.file_id == b.file_id && a.type < b.type);
+            });
+
+  string temp_database_filename = _database_filename + ".tmp";
+  string temp_state_filename = state_filename() + ".tmp";
+
+  _payload_db.open(temp_database_filename.c_str());
+  std::ofstream state_stream(temp_state_filename.c_str());
+  if (!_payload_db.is_open() || !state_stream.is_open()) {
+    log_warn("error opening the payload database file: %s",strerror(errno));
+    _payload_db.close();
+    return false;
+  }
+
+  for(auto& cur_cover : _scraped_covers) {
+    if (!cur_cover.scrape_result.empty())
+      _payload_db << cur_cover.file_id << " " << cur_cover.type << " " << cur_cover.scrape_result << " " << cur_cover.url << " " << cur_cover.absolute_url << " " << cur_cover.fetch_url << "\n";
+
+    state_stream << cur_cover.fetch_url << " " << cur_cover.validator.mtime << " " << cur_cover.validator.size << " " << cur_cover.validator.etag << " " << (cur_cover.scrape_result.empty() ? "-" : cur_cover.scrape_result) << "\n";
+  }
+
+  _payload_db.close();
+  state_stream.close();
+  if (_payload_db.fail() || state_stream.fail()) {
+    log_warn("error writing the payload database: %s",strerror(errno));
+    return false;
+  }
+
+  //the state is only useful along with its database, so we move it
+  //first: a crash in between at worst causes a full re-scrape
+  if (rename(temp_state_filename.c_str(), state_filename().c_str()) ||
+      rename(temp_database_filename.c_str(), _database_filename.c_str())) {
+    log_warn("error replacing the payload database: %s",strerror(errno));
+    return false;
+  }
+
+  log_debug("payload database %s updated with %lu covers, %lu of them were unchanged", _database_filename.c_str(), _scraped_covers.size(), _no_of_reused_covers);
+  return true;
+
+}
+
 /** 
     The constructor, calls the scraper by default
     
@@ -198,14 +502,14 @@ PayloadScraper::PayloadScraper(string  database_filename, string cover_server,co
   : _available_stegs(),
     _available_file_stegs(), 
    _cover_list(cover_list),
-   capacity_handle(curl_easy_init())
+   _no_more_covers(false),
+   _no_of_reused_covers(0)
 {
-  /* curl initiation */
-  log_assert(capacity_handle);
-  curl_easy_setopt(capacity_handle, CURLOPT_HEADER, 1L);
-  curl_easy_setopt(capacity_handle, CURLOPT_HTTP_CONTENT_DECODING, 0L);
-  curl_easy_setopt(capacity_handle, CURLOPT_HTTP_TRANSFER_DECODING, 0L);
-  curl_easy_setopt(capacity_handle, CURLOPT_WRITEFUNCTION, curl_read_data_cb);
+  /* curl initiation, has to happen before any worker thread exists
+     because curl_global_init is not thread safe */
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+  capacity_handle = new_capacity_handle();
+  set_no_of_workers(0);
   
   _database_filename = database_filename;
   _cover_server = cover_server;
@@ -247,18 +551,18 @@ PayloadScraper::PayloadScraper(string  database_filename, string cover_server,co
 /** 
     reads all the files in the Doc root and classifies them. return the number of payload file founds. -1 if it fails
 */
-int PayloadScraper::scrape()
+int PayloadScraper::scrape(bool incremental)
 {
   bool scrape_succeed = false;
-  /* open the database file for write this will delete the
-     current content */
-  _payload_db.open(_database_filename.c_str());
 
-  if (!_payload_db.is_open())
-    {
-      log_warn("error opening the payload database file: %s",strerror(errno));
-      return -1;
-    }
+  if (incremental)
+    load_previous_scrape();
+  else
+    _previous_scrape.clear();
+
+  /* we write into a new database and only replace the current one
+     when all covers are scraped */
+  start_workers();
 
   if (!_cover_list.empty()) {//If user gave us a cover list then we should
     //use it for scraping
@@ -295,7 +599,7 @@ int PayloadScraper::scrape()
       if (!(boost::filesystem::exists(mount_dir) ||
             boost::filesystem::create_directory(mount_dir))) {
         log_warn("Failed to create a temp dir to mount remote filesystem");
-        _payload_db.close();
+        join_workers();
         return -1;
       }
       
@@ -311,7 +615,7 @@ int PayloadScraper::scrape()
       int mount_result = system(ftp_mount_command_string.c_str());
       if (mount_result) {
         log_abort("Failed to mount the remote filesystem");
-        _payload_db.close();
+        join_workers();
         return -1;
       }
       
@@ -325,12 +629,15 @@ int PayloadScraper::scrape()
     if (scrape_dir(dir_path) < 0)
       {
         log_warn("error in retrieving payload dir: %s",strerror(errno));
-        _payload_db.close();
+        join_workers();
         return -1;
       }
     else
       scrape_succeed = true;
     
+    //the workers need the mounted doc root till they are done
+    join_workers();
+
     if (remote_mount) {
       int res = system(ftp_unmount_command_string.c_str());
       if (res)
@@ -338,7 +645,11 @@ int PayloadScraper::scrape()
     }
   }
 
-  _payload_db.close();
+  join_workers(); //no-op if already joined
+
+  if (!commit_database())
+    return -1;
+
   return 0;
   
 }
@@ -350,46 +661,24 @@ int PayloadScraper::scrape()
 */
 int PayloadScraper::apache_conf_parser()
 {
-  /* open the apache config file to find the doc root dir*/
-  FILE* apache_conf;
-
-  apache_conf = fopen(_apache_conf_filename.c_str(), "rb");
-  if (apache_conf == NULL)
-    {
-      log_warn("error in opening apache config file: %s",strerror(errno));
-      return 0;
-    }
-
-  char* cur_line = NULL;
-  size_t line_length;
-  while(~feof(apache_conf))
-    {
-      xgetline(&cur_line, &line_length, apache_conf);
-      /*pass the comment*/
-      if ((line_length > 0) && ( cur_line[0] == '#')) continue;
-
-      if (!strncmp(cur_line,"DocumentRoot", strlen("DocumentRoot")))
-        {
-           _apache_doc_root =  cur_line + strlen("DocumentRoot ");
-          _apache_doc_root.erase(remove( _apache_doc_root.begin(), _apache_doc_root.end(), '\"' ), _apache_doc_root.end());
-          _apache_doc_root.erase(std::remove( _apache_doc_root.begin(), _apache_doc_root.end(), '\n' ), _apache_doc_root.end());
-          if (_apache_doc_root[_apache_doc_root.length()-1] != '/')
-            _apache_doc_root.push_back('/');
-
-          return 0;
-        }
-    }
+  /* the payload server reads the doc root the same way to serve
+     covers off the disk */
+  _apache_doc_root = CoverSource::apache_doc_root(_apache_conf_filename);
+  if (_apache_doc_root.empty()) {
+    log_warn("DocumentRoot isn't specified in apache config file");
+    return -1;
+  }
 
-  /* no suitable tag in apache config file
-     I should probably return a defult dir in this case
-     but we return error for now
-  */
-  log_warn("DocumentRoot isn't specified in apache config file");
-  return -1;
+  return 0;
 
 }
 
 pair<unsigned long, unsigned long> PayloadScraper::compute_capacity(string payload_url, steg_type* cur_steg, bool absolute_url)
+{
+  return compute_capacity(capacity_handle, payload_url, cur_steg, absolute_url);
+}
+
+pair<unsigned long, unsigned long> PayloadScraper::compute_capacity(CURL* curl_handle, const string& payload_url, steg_type* cur_steg, bool absolute_url)
 {
   /*cur_file.open(payload_filename.c_str()); //, ios::binary | ios::in);
             
@@ -410,7 +699,7 @@ pair<unsigned long, unsigned long> PayloadScraper::compute_capacity(string paylo
 
   string url_to_retreive = absolute_url ? payload_url : "http://" + _cover_server +"/" + payload_url;
 
-  unsigned long apache_size = fetch_url_raw(capacity_handle, url_to_retreive, payload_buf);
+  unsigned long apache_size = fetch_url_raw(curl_handle, url_to_retreive, payload_buf);
   
   if (apache_size <= 0) //just invalidate the url
     return pair<unsigned long, unsigned long>(0, 0);
@@ -4,6 +4,11 @@
 #ifndef PAYLOADSCRAPER_H
 #define PAYLOADSCRAPER_H
 
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
 //TODO: This structure should be depricated as the FileSteg as
 //parent type should replace it
 struct steg_type
@@ -14,6 +19,45 @@ struct steg_type
 
 };
 
+/**
+   What we remember about a cover from the previous scrape so we can
+   decide if it needs to be fetched again. Local files are compared by
+   modification time and size, remote ones by their ETag (or the
+   Content-Length when the server doesn't issue ETags).
+*/
+struct CoverValidator
+{
+  long mtime;
+  unsigned long size;
+  std::string etag;
+
+  CoverValidator()
+    : mtime(0), size(0), etag("-")
+    {}
+
+  bool operator==(const CoverValidator& rhs) const {
+    return mtime == rhs.mtime && size == rhs.size && etag == rhs.etag;
+  }
+};
+
+/**
+   One scraped cover, that is a line of the payload database plus the
+   validator it was scraped under. An empty scrape_result means the
+   cover was examined and found useless, we keep it in the state file
+   so we don't fetch it again unless it changes.
+*/
+struct ScrapedCover
+{
+  unsigned long file_id;
+  int type;
+  steg_type* steg;
+  std::string url;
+  bool absolute_url;
+  std::string fetch_url;
+  std::string scrape_result; //hash capacity length
+  CoverValidator validator;
+};
+
 class PayloadScraperTest;
 /**
     We read the /etc/httpd/conf/httpd.conf (this need to be more dynamic)
@@ -47,6 +91,94 @@ protected:
                                in task of computing the capacity of the 
                                payloads */
 
+    /* Parallel scraping: the directory walker or the url list reader
+       fills up a bounded queue and a pool of workers, each with its
+       own curl handle, fetch the covers and compute their capacity */
+    static const size_t c_MAX_FETCH_QUEUE_LENGTH = 64;
+    unsigned int _no_of_workers;
+
+    std::deque<ScrapedCover> _fetch_queue;
+    bool _no_more_covers;
+    std::mutex _fetch_queue_lock;
+    std::condition_variable _fetch_queue_not_empty;
+    std::condition_variable _fetch_queue_not_full;
+    std::vector<std::thread> _workers;
+
+    std::mutex _scraped_covers_lock;
+    std::vector<ScrapedCover> _scraped_covers;
+
+    /* state of the previous scrape indexed by the fetch url, used
+       to skip unchanged covers */
+    std::map<std::string, ScrapedCover> _previous_scrape;
+    unsigned long _no_of_reused_covers;
+
+    /**
+       Create a curl handle set up to fetch covers the way the
+       payload server does.
+    */
+    static CURL* new_capacity_handle();
+
+    /**
+       Same as the public compute_capacity but uses the given curl handle
+       so it can be called from the worker threads.
+    */
+    pair<unsigned long, unsigned long> compute_capacity(CURL* curl_handle, const std::string& payload_url, steg_type* cur_steg, bool absolute_url);
+
+    /**
+       Same as the single-threaded scrape_url but with explicit curl handle
+    */
+    const std::string scrape_url(CURL* curl_handle, const std::string& cur_url, steg_type* cur_steg, bool absolute_url);
+
+    /**
+       Ask the cover server for the ETag (or failing that the length) of
+       a remote cover without fetching its body
+
+       @return false if the server did not answer or gave neither, in
+       which case the cover has to be scraped again
+    */
+    bool fetch_remote_validator(CURL* curl_handle, const std::string& cover_url, CoverValidator& validator);
+
+    /**
+       Queues a cover to be scraped by the workers. Blocks while the
+       queue is full. If the cover hasn't changed since the previous
+       scrape its previous result is reused without queuing.
+    */
+    void queue_cover(ScrapedCover& cover);
+
+    /**
+       The main loop of each worker thread
+    */
+    void scrape_worker();
+
+    void start_workers();
+    void join_workers();
+
+    /**
+       Reads the state file of the previous scrape, if any, into
+       _previous_scrape
+
+       @return number of covers remembered
+    */
+    size_t load_previous_scrape();
+
+    /**
+       Writes the database and the state file into temporary files and
+       renames them over the old ones, so a payload server never sees
+       a half written database.
+
+       @return true on success
+    */
+    bool commit_database();
+
+    /**
+       @return the name of the file we store the scrape state next to
+               the database
+    */
+    std::string state_filename() const
+    {
+      return _database_filename + ".state";
+    }
+
     /**
        Computes the capacity and length of a filename indicated by a url as well as the  hash of the url.
 
@@ -108,8 +240,17 @@ public:
 
    /**
       reads all the files in the Doc root and classifies them. return the number of payload file founds. -1 if it fails
+
+      @param incremental if true, covers which has not changed since the
+             last scrape are not fetched again
+   */
+   int scrape(bool incremental = true);
+
+   /**
+      set the number of threads fetching covers and computing their
+      capacity. 0 means one per core.
    */
-   int scrape();
+   void set_no_of_workers(unsigned int no_of_workers);
 
    virtual ~PayloadScraper()
      {
@@ -117,6 +258,7 @@ public:
          delete _available_file_stegs[i];
        
        delete[] _available_stegs;
+       curl_easy_cleanup(capacity_handle);
      }
      
 
@@ -585,21 +585,21 @@ parse_client_headers(char* inbuf, char* outbuf, int len) {
 
 
 
-int
-skipJSPattern(char *cp, int len) {
-  int i,j;
-
-
-  char keywords [21][10]= {"function", "return", "var", "int", "random", "Math", "while",
+static const char js_keywords [21][10]= {"function", "return", "var", "int", "random", "Math", "while",
 			   "else", "for", "document", "write", "writeln", "true",
 			   "false", "True", "False", "window", "indexOf", "navigator", "case", "if"};
 
+// change the limit to 21 to enable if as a keyword
+#define JS_KEYWORD_COUNT 20
+
+int
+skipJSPattern(char *cp, int len) {
+  int i,j;
 
   if (len < 1) return 0;
 
-  // change the limit to 21 to enable if as a keyword
-  for (i=0; i < 20; i++) {
-    char* word = keywords[i];
+  for (i=0; i < JS_KEYWORD_COUNT; i++) {
+    const char* word = js_keywords[i];
     
     if (len <= (int) strlen(word))
       continue;
@@ -628,6 +628,33 @@ skipJSPattern(char *cp, int len) {
   return 0;
 }
 
+/*
+ * jsKeywordShaped returns 1 if the word at cp has the first character
+ * and the length of one of the keywords skipJSPattern looks for, i.e.
+ * if changing letters and digits after its first character could turn
+ * it into one (or out of being one); otherwise 0.
+ */
+int
+jsKeywordShaped(char *cp, int len) {
+  int i,j,n;
+
+  for (i=0; i < JS_KEYWORD_COUNT; i++) {
+    const char* word = js_keywords[i];
+    n = strlen(word);
+
+    if (len <= n || word[0] != cp[0])
+      continue;
+
+    for (j=1; j < n && isalnum(cp[j]); j++)
+      ;
+    if (j == n && !isalnum(cp[n]) &&
+        cp[n] != JS_DELIMITER && cp[n] != JS_DELIMITER_REPLACEMENT)
+      return 1;
+  }
+
+  return 0;
+}
+
 
 
 
@@ -945,3 +972,18 @@ find_content_length (char *hdr, int /*hlen*/) {
   contentLen = atoi(buf);
   return contentLen;
 }
+
+/** true if the response header says its body comes in chunks */
+bool
+is_chunked_response (const char *hdr, int hlen) {
+  std::string header(hdr, hlen);
+  for (size_t i = 0; i < header.size(); i++)
+    header[i] = tolower(header[i]);
+
+  size_t field = header.find("\r\ntransfer-encoding:");
+  if (field == std::string::npos)
+    return false;
+
+  size_t field_end = header.find("\r\n", field + 2);
+  return header.find("chunked", field) < field_end;
+}
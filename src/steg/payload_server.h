@@ -216,19 +216,40 @@ class PayloadDatabase{
     if (payloads[payload_id_hash].corrupted &&
         payloads[payload_id_hash].capacity >= typed_maximum_capacity(payloads[payload_id_hash].type)) {
       //then we need to probably decrease the maximum capacity
-      const unsigned int affected_type = payloads[payload_id_hash].type;
-      //searching for new max capacity among all eligible covers
-      type_detail[affected_type].max_capacity = 0;
-      for(auto cur_payload = payloads.begin(); cur_payload != payloads.end(); cur_payload++)
-        {
-          if ((cur_payload->second.type == affected_type) &&
-              (!cur_payload->second.corrupted) &&
-              (cur_payload->second.capacity > type_detail[affected_type].max_capacity)) {
-            type_detail[affected_type].max_capacity = cur_payload->second.capacity;
-          }
-        }
+      recompute_type_max_capacity(payloads[payload_id_hash].type);
     }
   }
+
+  /**
+   lower the recorded capacity of a cover which turned out to carry
+   less than it promised, and the maximum capacity of its type with it
+
+   @param payload_id_hash id_hash of the payload
+   @param capacity the capacity to record from now on
+  */
+  void restrict_capacity(const std::string& payload_id_hash, unsigned int capacity) {
+    PayloadInfo& payload = payloads[payload_id_hash];
+    if (capacity >= payload.capacity)
+      return;
+
+    bool was_max = payload.capacity >= typed_maximum_capacity(payload.type);
+    payload.capacity = capacity;
+    if (was_max)
+      recompute_type_max_capacity(payload.type);
+  }
+
+  /** searching for new max capacity among all eligible covers */
+  void recompute_type_max_capacity(unsigned int affected_type) {
+    type_detail[affected_type].max_capacity = 0;
+    for(auto cur_payload = payloads.begin(); cur_payload != payloads.end(); cur_payload++)
+      {
+        if ((cur_payload->second.type == affected_type) &&
+            (!cur_payload->second.corrupted) &&
+            (cur_payload->second.capacity > type_detail[affected_type].max_capacity)) {
+          type_detail[affected_type].max_capacity = cur_payload->second.capacity;
+        }
+      }
+  }
   
 };
 
@@ -289,6 +310,16 @@ class PayloadServer
     return;
   }
 
+  /**
+     record a lower capacity for the payload identified by
+     payload_id_hash, which a steg mod found it cannot live up to.
+     Like disqualification, by default it is not supported.
+   */
+  virtual void restrict_capacity(const std::string& payload_id_hash, unsigned int capacity) {
+    (void) payload_id_hash; (void) capacity; //nop
+    return;
+  }
+
   virtual int find_uri_type(const char* buf, int size);
 
   /** return the side for which, the payload_server is initialized */
@@ -362,6 +393,7 @@ class PayloadServer
   char * strInBinary (const char *pattern, unsigned int patternLen,
                       const char *blob, unsigned int blobLen);
   int find_content_length (char *hdr, int hlen);
+  bool is_chunked_response (const char *hdr, int hlen);
 
   int has_eligible_HTTP_content (char* buf, int len, int type);
   int fixContentLen (char* payload, int payloadLen, char *buf, int bufLen);
@@ -369,6 +401,7 @@ class PayloadServer
   void gen_rfc_1123_expiry_date(char* buf, int buf_size);
   int parse_client_headers(char* inbuf, char* outbuf, int len);
   int skipJSPattern (char *cp, int len);
+  int jsKeywordShaped (char *cp, int len);
   int isalnum_ (char c);
   int offset2Alnum_ (char *p, int range);
   int offset2Hex (char *p, int range, int isLastCharHex);
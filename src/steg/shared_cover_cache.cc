@@ -0,0 +1,382 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "shared_cover_cache.h"
+
+using std::string;
+
+namespace {
+const uint32_t SEGMENT_MAGIC = 0x53544343; // "STCC"
+const uint32_t SEGMENT_VERSION = 1;
+
+enum { SEGMENT_NEW = 0, SEGMENT_READY = 1 };
+
+const size_t MIN_BUDGET = 1 << 20;
+const size_t MIN_SLOTS = 256;
+const size_t ARENA_BYTES_PER_SLOT = 16384; //covers are rarely smaller
+const unsigned int READY_WAIT_MS = 2000;
+
+/** FNV-1a, never 0 as that marks an empty slot */
+uint64_t
+key_hash(const string& key)
+{
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < key.size(); i++) {
+    h ^= (uint8_t)key[i];
+    h *= 1099511628211ULL;
+  }
+  return h ? h : 1;
+}
+
+size_t
+round_up(size_t n, size_t to)
+{
+  return (n + to - 1) / to * to;
+}
+}
+
+struct SharedCoverCacheHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t state;
+  uint32_t n_slots; //a power of 2
+  uint64_t arena_size;
+  uint64_t head; //where the next cover goes in the arena
+  uint64_t inserted; //covers ever inserted, gives the age of a slot
+  pthread_mutex_t lock; //writers only
+};
+
+/* A cover is stored in the arena as its key followed by its data. */
+struct SharedCoverSlot
+{
+  uint32_t seq; //odd while a writer is at it
+  uint32_t key_len;
+  uint64_t hash; //0 if the slot is empty
+  uint64_t offset;
+  uint64_t data_len;
+  uint64_t born;
+};
+
+static size_t
+segment_layout(size_t n_slots, size_t arena_size, size_t* slots_at, size_t* arena_at)
+{
+  *slots_at = round_up(sizeof(SharedCoverCacheHeader), 64);
+  *arena_at = *slots_at + round_up(n_slots * sizeof(SharedCoverSlot), 64);
+  return *arena_at + arena_size;
+}
+
+string
+SharedCoverCache::segment_name(const string& cover_origin)
+{
+  char name[64];
+  snprintf(name, sizeof name, "/stegotorus-covers-%016llx",
+           (unsigned long long)key_hash(cover_origin));
+  return name;
+}
+
+SharedCoverCache*
+SharedCoverCache::attach(const string& name, size_t budget)
+{
+  if (budget < MIN_BUDGET)
+    budget = MIN_BUDGET;
+
+  size_t n_slots = MIN_SLOTS;
+  while (n_slots * ARENA_BYTES_PER_SLOT < budget)
+    n_slots <<= 1;
+
+  size_t slots_at, arena_at;
+  size_t size = segment_layout(n_slots, budget, &slots_at, &arena_at);
+
+  bool created = true;
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0 && errno == EEXIST) {
+    created = false;
+    fd = shm_open(name.c_str(), O_RDWR, 0600);
+  }
+  if (fd < 0) {
+    log_warn("cannot open shared cover cache %s: %s", name.c_str(), strerror(errno));
+    return NULL;
+  }
+
+  if (created) {
+    //the new pages read as zero, so every slot starts empty
+    if (ftruncate(fd, size)) {
+      log_warn("cannot size shared cover cache %s: %s", name.c_str(), strerror(errno));
+      close(fd);
+      shm_unlink(name.c_str());
+      return NULL;
+    }
+  } else {
+    //the process creating it might not have sized it yet
+    struct stat st;
+    for (unsigned int waited = 0; ; waited += 10) {
+      if (fstat(fd, &st)) {
+        log_warn("cannot stat shared cover cache %s: %s", name.c_str(), strerror(errno));
+        close(fd);
+        return NULL;
+      }
+      if (st.st_size > 0)
+        break;
+      if (waited >= READY_WAIT_MS) {
+        log_warn("shared cover cache %s was never set up", name.c_str());
+        close(fd);
+        return NULL;
+      }
+      usleep(10000);
+    }
+    size = st.st_size;
+  }
+
+  void* segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (segment == MAP_FAILED) {
+    log_warn("cannot map shared cover cache %s: %s", name.c_str(), strerror(errno));
+    return NULL;
+  }
+
+  SharedCoverCacheHeader* header = (SharedCoverCacheHeader*)segment;
+  if (created) {
+    header->magic = SEGMENT_MAGIC;
+    header->version = SEGMENT_VERSION;
+    header->n_slots = n_slots;
+    header->arena_size = budget;
+    header->head = 0;
+    header->inserted = 0;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&header->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    __atomic_store_n(&header->state, (uint32_t)SEGMENT_READY, __ATOMIC_RELEASE);
+    log_info("created shared cover cache %s of %lu bytes", name.c_str(),
+             (unsigned long)budget);
+  } else {
+    for (unsigned int waited = 0;
+         __atomic_load_n(&header->state, __ATOMIC_ACQUIRE) != SEGMENT_READY;
+         waited += 10) {
+      if (waited >= READY_WAIT_MS)
+        break;
+      usleep(10000);
+    }
+
+    if (__atomic_load_n(&header->state, __ATOMIC_ACQUIRE) != SEGMENT_READY ||
+        header->magic != SEGMENT_MAGIC || header->version != SEGMENT_VERSION ||
+        !header->n_slots || (header->n_slots & (header->n_slots - 1)) ||
+        segment_layout(header->n_slots, header->arena_size,
+                       &slots_at, &arena_at) > size) {
+      log_warn("%s is not a shared cover cache we can use, remove it "
+               "from /dev/shm", name.c_str());
+      munmap(segment, size);
+      return NULL;
+    }
+
+    if (header->arena_size != budget)
+      log_info("shared cover cache %s already exists with %lu bytes",
+               name.c_str(), (unsigned long)header->arena_size);
+  }
+
+  return new SharedCoverCache(segment, size);
+}
+
+SharedCoverCache::SharedCoverCache(void* segment, size_t segment_size)
+  : _segment(segment), _segment_size(segment_size),
+    _header((SharedCoverCacheHeader*)segment)
+{
+  size_t slots_at, arena_at;
+  segment_layout(_header->n_slots, _header->arena_size, &slots_at, &arena_at);
+  _slots = (SharedCoverSlot*)((char*)segment + slots_at);
+  _arena = (char*)segment + arena_at;
+}
+
+/** The segment stays for the other servers, and for our next run. */
+SharedCoverCache::~SharedCoverCache()
+{
+  munmap(_segment, _segment_size);
+}
+
+size_t
+SharedCoverCache::budget() const
+{
+  return _header->arena_size;
+}
+
+size_t
+SharedCoverCache::slots() const
+{
+  return _header->n_slots;
+}
+
+void
+SharedCoverCache::lock()
+{
+  int rc = pthread_mutex_lock(&_header->lock);
+  if (rc == EOWNERDEAD) {
+    //whatever it was writing is behind an odd sequence number, and
+    //is cleaned up when the slot or its bytes are reused
+    log_warn("a server died while writing to the shared cover cache");
+    pthread_mutex_consistent(&_header->lock);
+  } else if (rc)
+    log_abort("failed to lock the shared cover cache: %s", strerror(rc));
+}
+
+void
+SharedCoverCache::unlock()
+{
+  pthread_mutex_unlock(&_header->lock);
+}
+
+bool
+SharedCoverCache::lookup(const string& key, string& data)
+{
+  uint64_t hash = key_hash(key);
+  uint64_t arena_size = _header->arena_size;
+  uint32_t mask = _header->n_slots - 1;
+
+  for (unsigned int i = 0; i < c_NEIGHBOURHOOD; i++) {
+    SharedCoverSlot* slot = &_slots[(hash + i) & mask];
+    for (unsigned int tries = 0; tries < c_READ_TRIES; tries++) {
+      uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+      if (seq & 1)
+        continue;
+      if (slot->hash != hash || slot->key_len != key.size())
+        break;
+
+      //nothing read here is trusted till the sequence is checked, but
+      //it must not take us out of the arena
+      uint64_t offset = slot->offset, len = slot->data_len;
+      if (offset > arena_size || len > arena_size ||
+          offset + key.size() + len > arena_size)
+        continue;
+
+      bool same_key = !memcmp(_arena + offset, key.data(), key.size());
+      if (same_key)
+        data.assign(_arena + offset + key.size(), len);
+
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+        continue;
+      if (!same_key)
+        break;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+SharedCoverSlot*
+SharedCoverCache::find_locked(uint64_t hash, const string& key)
+{
+  uint32_t mask = _header->n_slots - 1;
+  for (unsigned int i = 0; i < c_NEIGHBOURHOOD; i++) {
+    SharedCoverSlot* slot = &_slots[(hash + i) & mask];
+    if (!(slot->seq & 1) && slot->hash == hash && slot->key_len == key.size() &&
+        !memcmp(_arena + slot->offset, key.data(), key.size()))
+      return slot;
+  }
+  return NULL;
+}
+
+void
+SharedCoverCache::invalidate(SharedCoverSlot* slot)
+{
+  uint32_t seq = slot->seq | 1;
+  __atomic_store_n(&slot->seq, seq, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  slot->hash = 0;
+  slot->key_len = 0;
+  slot->data_len = 0;
+  __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/** Empties the slots of every cover stored in [offset, offset + len). */
+void
+SharedCoverCache::evict_range(uint64_t offset, uint64_t len)
+{
+  for (uint32_t i = 0; i < _header->n_slots; i++) {
+    SharedCoverSlot* slot = &_slots[i];
+    if (!slot->hash)
+      continue;
+    uint64_t end = slot->offset + slot->key_len + slot->data_len;
+    if (slot->offset < offset + len && offset < end)
+      invalidate(slot);
+  }
+}
+
+bool
+SharedCoverCache::insert(const string& key, const string& data)
+{
+  uint64_t need = key.size() + data.size();
+  if (data.empty() || need > _header->arena_size / 4)
+    return false;
+
+  uint64_t hash = key_hash(key);
+  uint32_t mask = _header->n_slots - 1;
+
+  lock();
+  if (find_locked(hash, key)) { //another server got there first
+    unlock();
+    return true;
+  }
+
+  uint64_t offset = _header->head;
+  if (offset + need > _header->arena_size)
+    offset = 0;
+  evict_range(offset, need);
+
+  //an empty slot in the neighbourhood, otherwise the oldest one
+  SharedCoverSlot* victim = NULL;
+  for (unsigned int i = 0; i < c_NEIGHBOURHOOD; i++) {
+    SharedCoverSlot* slot = &_slots[(hash + i) & mask];
+    if (!slot->hash) {
+      victim = slot;
+      break;
+    }
+    if (!victim || slot->born < victim->born)
+      victim = slot;
+  }
+  if (victim->hash)
+    invalidate(victim);
+
+  uint32_t seq = victim->seq | 1;
+  __atomic_store_n(&victim->seq, seq, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  memcpy(_arena + offset, key.data(), key.size());
+  memcpy(_arena + offset + key.size(), data.data(), data.size());
+  victim->hash = hash;
+  victim->key_len = key.size();
+  victim->offset = offset;
+  victim->data_len = data.size();
+  victim->born = ++_header->inserted;
+
+  __atomic_store_n(&victim->seq, seq + 1, __ATOMIC_RELEASE);
+  _header->head = offset + need;
+  unlock();
+
+  return true;
+}
+
+void
+SharedCoverCache::clear()
+{
+  lock();
+  for (uint32_t i = 0; i < _header->n_slots; i++)
+    if (_slots[i].hash || (_slots[i].seq & 1))
+      invalidate(&_slots[i]);
+  _header->head = 0;
+  unlock();
+}
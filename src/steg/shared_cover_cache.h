@@ -0,0 +1,92 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+#ifndef _SHARED_COVER_CACHE_H
+#define _SHARED_COVER_CACHE_H
+
+#include <string>
+#include <stdint.h>
+
+struct SharedCoverCacheHeader;
+struct SharedCoverSlot;
+
+/**
+   A cover cache in a POSIX shared memory segment, so that the
+   stegotorus servers of a host hold each cover once between them
+   instead of once per process.
+
+   The segment has a small header, an index of slots and an arena
+   the covers are stored in. The arena is written as a ring: a new
+   cover goes at the head and evicts whatever it overwrites, so the
+   arena size is the byte budget and eviction is oldest first.
+
+   Readers take no lock. Each slot carries a sequence number which
+   writers make odd while they change the slot, or the arena bytes it
+   points at; a reader copies the cover out and retries, or gives up,
+   if the sequence changed under it. Writers are serialized by a
+   robust process-shared mutex, so a server dying while inserting
+   does not wedge the others.
+*/
+class SharedCoverCache
+{
+ public:
+  /**
+     Opens the segment of the given name, creating it with a budget of
+     budget bytes if no other process has yet. A process which finds
+     the segment already there uses it at the size it was created.
+
+     @return NULL if shared memory is not available
+  */
+  static SharedCoverCache* attach(const std::string& name, size_t budget);
+
+  /**
+     A segment name for the servers which fetch their covers from the
+     same place, given as a string identifying that place.
+  */
+  static std::string segment_name(const std::string& cover_origin);
+
+  ~SharedCoverCache();
+
+  /**
+     Copies the cover stored under key into data.
+
+     @return false if it is not in the cache
+  */
+  bool lookup(const std::string& key, std::string& data);
+
+  /**
+     Stores a cover, evicting the oldest ones to make room. Covers
+     larger than a quarter of the budget are not cached.
+
+     @return false if the cover was not stored
+  */
+  bool insert(const std::string& key, const std::string& data);
+
+  /** Drops every cover, for all the processes sharing the segment. */
+  void clear();
+
+  size_t budget() const;
+  size_t slots() const;
+
+ private:
+  SharedCoverCache(void* segment, size_t segment_size);
+  SharedCoverCache(const SharedCoverCache&);
+  SharedCoverCache& operator=(const SharedCoverCache&);
+
+  static const unsigned int c_NEIGHBOURHOOD = 8; //slots a key may live in
+  static const unsigned int c_READ_TRIES = 4;
+
+  void* _segment;
+  size_t _segment_size;
+  SharedCoverCacheHeader* _header;
+  SharedCoverSlot* _slots;
+  char* _arena;
+
+  void lock();
+  void unlock();
+  SharedCoverSlot* find_locked(uint64_t hash, const std::string& key);
+  void invalidate(SharedCoverSlot* slot);
+  void evict_range(uint64_t offset, uint64_t len);
+};
+
+#endif
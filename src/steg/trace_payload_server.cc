@@ -1,4 +1,5 @@
 #include "util.h"
+#include "rng.h"
 
 #include "trace_payload_server.h"
 #include "file_steg.h"
@@ -359,7 +360,7 @@ int TracePayloadServer::get_payload (int contentType, int cap, char** buf, int*
     return 0;
 
   cnt = pl.typePayloadCount[contentType];
-  r = rand() % cnt;
+  r = rng_int(cnt);
   best = r;
   first = r;
 
@@ -413,7 +414,6 @@ void TracePayloadServer::load_payloads(const char* fname)
   int pentryLen;
   int r;
 
-  srand(time(NULL));
   f = fopen(fname, "r");
   if (f == NULL) {
     fprintf(stderr, "Cannot open trace file %s. Exiting\n", fname);
@@ -485,7 +485,7 @@ void TracePayloadServer::load_payloads(const char* fname)
 
 
 unsigned int TracePayloadServer::find_client_payload(char* buf, int len, int type) {
-  int r = rand() % pl.payload_count;
+  int r = rng_int(pl.payload_count);
   int cnt = 0;
   char* inbuf;
 
@@ -0,0 +1,395 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+/**
+   A WebSocket cover: the client opens with an HTTP Upgrade request
+   built from the request templates of the http steg, the server
+   switches protocols, and from then on both sides send the blocks as
+   binary messages, in either direction at any time. A message costs
+   2 to 14 bytes of header instead of an HTTP header and a cover.
+
+   The blocks are cut into messages whose sizes are drawn as those of
+   websocket applications (chat, notifications, game state, market
+   feeds) tend to be: mostly a few dozen to a few hundred bytes, with
+   a tail of larger ones.
+ */
+
+#include <event2/buffer.h>
+#include <vector>
+
+using namespace std;
+
+#include "util.h"
+#include "connections.h"
+#include "protocol.h"
+#include "steg.h"
+#include "rng.h"
+#include "strncasestr.h"
+
+#include "payload_server.h"
+#include "base64.h"
+#include "http_steg_mods/file_steg.h"
+
+#include "http.h"
+#include "websocket_frame.h"
+
+namespace {
+  struct websocket_steg_config_t : http_steg_config_t
+  {
+    STEG_CONFIG_DECLARE_METHODS(websocket);
+  };
+
+  struct websocket_steg_t : http_steg_t
+  {
+    static const size_t c_MAX_HANDSHAKE_LEN = MAX_RESP_HDR_SIZE;
+    //message sizes: an octave drawn geometrically from 2^5 up,
+    //then a size uniformly within it
+    static const unsigned int c_MIN_OCTAVE = 5;
+    static const unsigned int c_OCTAVES = 8;
+    static const unsigned int c_MEAN_OCTAVE = 2;
+
+    websocket_steg_config_t *ws_config;
+
+    bool sent_upgrade : 1; //client
+    bool upgraded : 1; //the handshake is through
+    bool sent_close : 1;
+    string key; //client: our Sec-WebSocket-Key
+    evbuffer *held; //client: messages waiting for the switch
+
+    websocket_steg_t(websocket_steg_config_t *cf, conn_t *cn);
+    STEG_DECLARE_METHODS(websocket);
+
+    int send_upgrade_request(evbuffer *dest);
+    int accept_upgrade_request(evbuffer *source, evbuffer *dest);
+    int check_upgrade_response(evbuffer *source);
+    int add_messages(evbuffer *source, evbuffer *dest);
+    static size_t message_size();
+  };
+}
+
+STEG_DEFINE_MODULE(websocket);
+
+websocket_steg_config_t::websocket_steg_config_t(config_t *cfg, const std::vector<std::string>& options)
+  : http_steg_config_t(cfg, options, true)
+{
+}
+
+websocket_steg_config_t::websocket_steg_config_t(config_t *cfg, const YAML::Node& options)
+  : http_steg_config_t(cfg, options, true)
+{
+}
+
+websocket_steg_config_t::~websocket_steg_config_t()
+{
+}
+
+steg_t *
+websocket_steg_config_t::steg_create(conn_t *conn)
+{
+  return new websocket_steg_t(this, conn);
+}
+
+websocket_steg_t::websocket_steg_t(websocket_steg_config_t *cf, conn_t *cn)
+  : http_steg_t((http_steg_config_t*)cf, cn), ws_config(cf),
+    sent_upgrade(false), upgraded(false), sent_close(false), held(NULL)
+{
+}
+
+websocket_steg_t::~websocket_steg_t()
+{
+  if (held)
+    evbuffer_free(held);
+}
+
+steg_config_t *
+websocket_steg_t::cfg()
+{
+  return ws_config;
+}
+
+/**
+   The value of the header called name in an HTTP message header, or
+   an empty string.
+*/
+static string
+header_value(const string& hdr, const char *name)
+{
+  size_t name_len = strlen(name);
+  for (size_t at = hdr.find("\r\n"); at != string::npos; at = hdr.find("\r\n", at)) {
+    at += 2;
+    if (hdr.compare(at, 2, "\r\n") == 0)
+      break;
+    if (at + name_len >= hdr.size() ||
+        strncasecmp(hdr.c_str() + at, name, name_len) || hdr[at + name_len] != ':')
+      continue;
+    size_t value = hdr.find_first_not_of(" \t", at + name_len + 1);
+    size_t end = hdr.find("\r\n", at);
+    if (value == string::npos || value >= end)
+      return string();
+    return hdr.substr(value, end - value);
+  }
+  return string();
+}
+
+static bool
+header_has_token(const string& value, const char *token)
+{
+  return strncasestr(value.c_str(), token, value.size()) != NULL;
+}
+
+/* static */ size_t
+websocket_steg_t::message_size()
+{
+  unsigned int octave = c_MIN_OCTAVE + rng_range_geom(c_OCTAVES, c_MEAN_OCTAVE);
+  return rng_range(1 << octave, 1 << (octave + 1));
+}
+
+size_t
+websocket_steg_t::transmit_room(size_t pref, size_t, size_t)
+{
+  //the server speaks once the client asked for the switch, the
+  //client at once: its messages wait for the switch in held
+  if (!config->is_clientside && !upgraded)
+    return 0;
+  if (sent_close)
+    return 0;
+  return pref;
+}
+
+int
+websocket_steg_t::send_upgrade_request(evbuffer *dest)
+{
+  char buf[10000];
+  size_t payload_len = 0;
+  for (int cnt = 0; !payload_len; cnt++) {
+    if (cnt == 10)
+      return -1;
+    payload_len = config->payload_server->find_client_payload(buf, sizeof(buf) - 1,
+                                                              TYPE_HTTP_REQUEST);
+  }
+  buf[payload_len] = 0;
+
+  char *eol = strstr(buf, "\r\n");
+  if (!eol) {
+    log_warn(conn, "websocket: bad request template");
+    return -1;
+  }
+
+  if (peer_dnsname.empty())
+    peer_dnsname = lookup_peer_name_from_ip(conn->peername);
+
+  uint8_t nonce[16];
+  rng_bytes(nonce, sizeof nonce);
+  char encoded[32];
+  base64::encoder E(false);
+  size_t len = E.encode((const char *)nonce, sizeof nonce, encoded);
+  len += E.encode_end(encoded + len);
+  key.assign(encoded, len);
+
+  //the request line and the browser headers of the template, less
+  //those the upgrade replaces
+  evbuffer_add(dest, buf, eol - buf + 2);
+  for (char *line = eol + 2; *line && strncmp(line, "\r\n", 2); ) {
+    char *end = strstr(line, "\r\n");
+    if (!end)
+      break;
+    if (strncasecmp(line, "Host:", 5) && strncasecmp(line, "Connection:", 11) &&
+        strncasecmp(line, "Keep-Alive:", 11) && strncasecmp(line, "Upgrade:", 8) &&
+        strncasecmp(line, "Cookie:", 7) && strncasecmp(line, "Content-Length:", 15))
+      evbuffer_add(dest, line, end - line + 2);
+    line = end + 2;
+  }
+
+  if (evbuffer_add_printf(dest,
+                          "Host: %s\r\n"
+                          "Origin: http://%s\r\n"
+                          "Connection: Upgrade\r\n"
+                          "Upgrade: websocket\r\n"
+                          "Sec-WebSocket-Version: 13\r\n"
+                          "Sec-WebSocket-Key: %s\r\n\r\n",
+                          peer_dnsname.c_str(), peer_dnsname.c_str(),
+                          key.c_str()) < 0) {
+    log_warn(conn, "websocket: failed to write the upgrade request");
+    return -1;
+  }
+
+  sent_upgrade = true;
+  return 0;
+}
+
+int
+websocket_steg_t::accept_upgrade_request(evbuffer *source, evbuffer *dest)
+{
+  evbuffer_ptr end = evbuffer_search(source, "\r\n\r\n", 4, NULL);
+  if (end.pos == -1) {
+    if (evbuffer_get_length(source) > c_MAX_HANDSHAKE_LEN) {
+      log_warn(conn, "websocket: no end to the upgrade request");
+      return RECV_BAD;
+    }
+    return RECV_INCOMPLETE;
+  }
+
+  string request((const char *)evbuffer_pullup(source, end.pos + 4), end.pos + 4);
+  string client_key = header_value(request, "Sec-WebSocket-Key");
+  if (request.compare(0, 4, "GET ") ||
+      !header_has_token(header_value(request, "Upgrade"), "websocket") ||
+      !header_has_token(header_value(request, "Connection"), "upgrade") ||
+      client_key.empty()) {
+    log_warn(conn, "websocket: not an upgrade request");
+    return RECV_BAD;
+  }
+  evbuffer_drain(source, end.pos + 4);
+
+  if (evbuffer_add_printf(dest,
+                          "HTTP/1.1 101 Switching Protocols\r\n"
+                          "Upgrade: websocket\r\n"
+                          "Connection: Upgrade\r\n"
+                          "Sec-WebSocket-Accept: %s\r\n\r\n",
+                          ws_accept_key(client_key).c_str()) < 0) {
+    log_warn(conn, "websocket: failed to write the upgrade response");
+    return RECV_BAD;
+  }
+
+  upgraded = true;
+  return RECV_GOOD;
+}
+
+int
+websocket_steg_t::check_upgrade_response(evbuffer *source)
+{
+  evbuffer_ptr end = evbuffer_search(source, "\r\n\r\n", 4, NULL);
+  if (end.pos == -1) {
+    if (evbuffer_get_length(source) > c_MAX_HANDSHAKE_LEN) {
+      log_warn(conn, "websocket: no end to the upgrade response");
+      return RECV_BAD;
+    }
+    return RECV_INCOMPLETE;
+  }
+
+  string response((const char *)evbuffer_pullup(source, end.pos + 4), end.pos + 4);
+  if (response.compare(0, 13, "HTTP/1.1 101 ") ||
+      header_value(response, "Sec-WebSocket-Accept") != ws_accept_key(key)) {
+    log_warn(conn, "websocket: the server did not switch protocols");
+    return RECV_BAD;
+  }
+  evbuffer_drain(source, end.pos + 4);
+
+  upgraded = true;
+  if (held) {
+    if (evbuffer_add_buffer(conn->outbound(), held)) {
+      log_warn(conn, "websocket: failed to release the held messages");
+      return RECV_BAD;
+    }
+    evbuffer_free(held);
+    held = NULL;
+  }
+  return RECV_GOOD;
+}
+
+/** Cuts source into binary messages of sampled sizes, onto dest. */
+int
+websocket_steg_t::add_messages(evbuffer *source, evbuffer *dest)
+{
+  bool masked = config->is_clientside;
+  while (size_t left = evbuffer_get_length(source)) {
+    size_t n = message_size();
+    if (n > left)
+      n = left;
+    const uint8_t *data = evbuffer_pullup(source, n);
+    if (!data || add_ws_frame(dest, ws_BINARY, true, data, n, masked)) {
+      log_warn(conn, "websocket: failed to add a message");
+      return -1;
+    }
+    evbuffer_drain(source, n);
+  }
+  return 0;
+}
+
+int
+websocket_steg_t::transmit(evbuffer *source)
+{
+  evbuffer *dest = conn->outbound();
+  size_t before = evbuffer_get_length(dest);
+
+  if (config->is_clientside && !sent_upgrade && send_upgrade_request(dest))
+    return -1;
+
+  size_t sent = evbuffer_get_length(source);
+  size_t framed = 0;
+  if (!upgraded) {
+    if (!held && !(held = evbuffer_new()))
+      return -1;
+    // held keeps what earlier calls framed too; count only ours
+    size_t held_before = evbuffer_get_length(held);
+    if (add_messages(source, held))
+      return -1;
+    framed = evbuffer_get_length(held) - held_before;
+  } else if (add_messages(source, dest))
+    return -1;
+
+  log_debug(conn, "%s sent %lu bytes in messages",
+            config->is_clientside ? "CLIENT" : "SERVER", (unsigned long)sent);
+  return evbuffer_get_length(dest) - before + framed;
+}
+
+int
+websocket_steg_t::receive(evbuffer *dest)
+{
+  evbuffer *source = conn->inbound();
+  bool from_client = !config->is_clientside;
+
+  if (!upgraded) {
+    int rval = from_client ? accept_upgrade_request(source, conn->outbound()) :
+      check_upgrade_response(source);
+    if (rval != RECV_GOOD || !upgraded)
+      return rval;
+  }
+
+  for (;;) {
+    ws_frame f;
+    evbuffer *payload = evbuffer_new();
+    int rv = take_ws_frame(source, f, payload, from_client);
+    if (rv <= 0) {
+      evbuffer_free(payload);
+      if (rv < 0)
+        log_warn(conn, "websocket: malformed frame");
+      return rv < 0 ? RECV_BAD : RECV_GOOD;
+    }
+
+    switch (f.opcode) {
+    case ws_BINARY:
+    case ws_CONTINUATION:
+      rv = evbuffer_add_buffer(dest, payload);
+      break;
+
+    case ws_PING: {
+      uint8_t ping[WS_MAX_CONTROL_LEN];
+      size_t n = evbuffer_remove(payload, ping, sizeof ping);
+      rv = add_ws_frame(conn->outbound(), ws_PONG, true, ping, n, !from_client);
+      break;
+    }
+
+    case ws_CLOSE:
+      log_debug(conn, "websocket: peer closed");
+      if (!sent_close) {
+        uint8_t code[2] = { 0x03, 0xe8 }; //1000, normal closure
+        rv = add_ws_frame(conn->outbound(), ws_CLOSE, true, code, sizeof code,
+                          !from_client);
+        sent_close = true;
+      }
+      conn->expect_close();
+      break;
+
+    case ws_PONG:
+      break;
+
+    default: //we never send text
+      log_warn(conn, "websocket: unexpected frame opcode %d", f.opcode);
+      rv = -1;
+    }
+    evbuffer_free(payload);
+    if (rv)
+      return RECV_BAD;
+  }
+}
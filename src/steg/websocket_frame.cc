@@ -0,0 +1,151 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "crypt.h"
+#include "rng.h"
+#include "base64.h"
+#include "websocket_frame.h"
+
+#include <event2/buffer.h>
+
+using std::string;
+
+namespace {
+const char WS_GUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+const size_t SHA1_LEN = 20;
+
+bool
+known_opcode(uint8_t opcode)
+{
+  return opcode <= ws_BINARY || (opcode >= ws_CLOSE && opcode <= ws_PONG);
+}
+
+/** Appends len bytes of src to dest, xored with the masking key. */
+int
+add_masked(evbuffer *dest, const uint8_t *src, size_t len, const uint8_t key[4])
+{
+  if (!len)
+    return 0;
+
+  struct evbuffer_iovec v;
+  if (evbuffer_reserve_space(dest, len, &v, 1) != 1 || v.iov_len < len)
+    return -1;
+  uint8_t *p = (uint8_t *)v.iov_base;
+  for (size_t i = 0; i < len; i++)
+    p[i] = src[i] ^ key[i % 4];
+  v.iov_len = len;
+  return evbuffer_commit_space(dest, &v, 1);
+}
+}
+
+int
+add_ws_frame(evbuffer *dest, uint8_t opcode, bool fin,
+             const uint8_t *payload, size_t len, bool masked)
+{
+  uint8_t h[WS_MAX_HEADER_LEN];
+  size_t at = 2;
+
+  h[0] = (fin ? 0x80 : 0) | opcode;
+  if (len < 126)
+    h[1] = len;
+  else if (len < 65536) {
+    h[1] = 126;
+    h[2] = len >> 8;
+    h[3] = len;
+    at = 4;
+  } else {
+    h[1] = 127;
+    for (int i = 0; i < 8; i++)
+      h[2 + i] = (uint64_t)len >> (56 - 8 * i);
+    at = 10;
+  }
+
+  if (!masked)
+    return evbuffer_add(dest, h, at) || evbuffer_add(dest, payload, len) ? -1 : 0;
+
+  h[1] |= 0x80;
+  const uint8_t *key = h + at;
+  rng_bytes(h + at, 4);
+  at += 4;
+  return evbuffer_add(dest, h, at) || add_masked(dest, payload, len, key) ? -1 : 0;
+}
+
+int
+take_ws_frame(evbuffer *source, ws_frame& f, evbuffer *payload, bool expect_masked)
+{
+  size_t avail = evbuffer_get_length(source);
+  if (avail < 2)
+    return 0;
+
+  uint8_t h[WS_MAX_HEADER_LEN];
+  size_t hlen = avail < sizeof h ? avail : sizeof h;
+  evbuffer_copyout(source, h, hlen);
+
+  f.fin = h[0] & 0x80;
+  f.opcode = h[0] & 0x0f;
+  bool masked = h[1] & 0x80;
+  if ((h[0] & 0x70) || !known_opcode(f.opcode) || masked != expect_masked) {
+    log_debug("malformed websocket frame header %02x %02x", h[0], h[1]);
+    return -1;
+  }
+
+  uint64_t len = h[1] & 0x7f;
+  size_t at = 2;
+  if (len == 126) {
+    if (hlen < 4)
+      return 0;
+    len = (h[2] << 8) | h[3];
+    at = 4;
+  } else if (len == 127) {
+    if (hlen < 10)
+      return 0;
+    len = 0;
+    for (int i = 0; i < 8; i++)
+      len = (len << 8) | h[2 + i];
+    at = 10;
+  }
+
+  if (len > WS_MAX_FRAME_LEN ||
+      ((f.opcode & 0x8) && (!f.fin || len > WS_MAX_CONTROL_LEN))) {
+    log_debug("websocket frame of %lu bytes refused", (unsigned long)len);
+    return -1;
+  }
+
+  uint8_t key[4];
+  if (masked) {
+    if (hlen < at + 4)
+      return 0;
+    memcpy(key, h + at, 4);
+    at += 4;
+  }
+  if (avail < at + len)
+    return 0;
+
+  f.len = len;
+  evbuffer_drain(source, at);
+  if (!masked)
+    return evbuffer_remove_buffer(source, payload, len) == (int)len ? 1 : -1;
+
+  const uint8_t *data = evbuffer_pullup(source, len);
+  if (len && !data)
+    return -1;
+  int rv = add_masked(payload, data, len, key);
+  evbuffer_drain(source, len);
+  return rv ? -1 : 1;
+}
+
+string
+ws_accept_key(const string& key)
+{
+  string keyed = key + WS_GUID;
+  uint8_t digest[SHA1_LEN];
+  sha1((const uint8_t *)keyed.data(), keyed.size(), digest);
+
+  char encoded[2 * SHA1_LEN];
+  base64::encoder E(false);
+  size_t len = E.encode((const char *)digest, SHA1_LEN, encoded);
+  len += E.encode_end(encoded + len);
+  return string(encoded, len);
+}
@@ -0,0 +1,59 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+#ifndef _WEBSOCKET_FRAME_H
+#define _WEBSOCKET_FRAME_H
+
+#include <string>
+#include <stdint.h>
+
+struct evbuffer;
+
+/** WebSocket (RFC 6455) frame opcodes. */
+enum ws_opcode
+{
+  ws_CONTINUATION = 0x0,
+  ws_TEXT = 0x1,
+  ws_BINARY = 0x2,
+  ws_CLOSE = 0x8,
+  ws_PING = 0x9,
+  ws_PONG = 0xA,
+};
+
+/** The header of a frame taken off the wire. */
+struct ws_frame
+{
+  bool fin;
+  uint8_t opcode;
+  size_t len;
+};
+
+const size_t WS_MAX_HEADER_LEN = 14;
+const size_t WS_MAX_CONTROL_LEN = 125;
+const size_t WS_MAX_FRAME_LEN = 1 << 20; //we refuse larger ones
+
+/**
+   Writes a frame carrying LEN bytes of PAYLOAD to DEST. A client
+   masks its frames (MASKED) with a fresh random key, a server does
+   not.
+
+   @return 0 or -1
+*/
+int add_ws_frame(evbuffer *dest, uint8_t opcode, bool fin,
+                 const uint8_t *payload, size_t len, bool masked);
+
+/**
+   Takes the frame at the head of SOURCE, if it has all come, and
+   appends its unmasked payload to PAYLOAD. EXPECT_MASKED says
+   whether the peer is a client, which must mask its frames.
+
+   @return 1 if a frame was taken, 0 if it has not all come yet, -1
+           if it is malformed or larger than WS_MAX_FRAME_LEN
+*/
+int take_ws_frame(evbuffer *source, ws_frame& f, evbuffer *payload,
+                  bool expect_masked);
+
+/** The Sec-WebSocket-Accept answering a Sec-WebSocket-Key. */
+std::string ws_accept_key(const std::string& key);
+
+#endif
@@ -0,0 +1,101 @@
+# Copyright 2012 SRI International
+# See LICENSE for other credits and copying information
+
+# Loopback benchmark of chop's hanging requests: after each idle
+# period the server side sends a line downstream, and we report how
+# long the client side took to see it, with and without the client
+# keeping requests hanging. The client answers every line, so that
+# upstream traffic keeps its own polling going as it would in use.
+# Not run by 'make check'; run it from the build directory:
+#
+#   python src/test/idle_latency.py [idle seconds] [rounds] [steg]
+#
+# The default is 2 seconds of idle time, 10 rounds, over http.
+
+import os
+import socket
+import sys
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import itestlib
+from itestlib import Stegotorus
+
+def rounds_of(idle, rounds):
+    lsn = socket.socket()
+    lsn.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    lsn.bind(("127.0.0.1", 5001))
+    lsn.listen(1)
+    cli = socket.create_connection(("127.0.0.1", 4999))
+    cli.settimeout(itestlib.TIMEOUT_LEN)
+    cli.sendall("hello\n")
+    (srv, _) = lsn.accept()
+    srv.settimeout(itestlib.TIMEOUT_LEN)
+    srv.recv(100)
+    latencies = []
+    try:
+        for i in xrange(rounds):
+            time.sleep(idle)
+            start = time.time()
+            srv.sendall("down %d\n" % i)
+            cli.recv(100)
+            latencies.append((time.time() - start) * 1000)
+            cli.sendall("up %d\n" % i)
+            srv.recv(100)
+        # close both directions through the tunnel, as tltester does,
+        # so that no circuit is left for the shutdown to break
+        cli.shutdown(socket.SHUT_WR)
+        while srv.recv(100):
+            pass
+        srv.shutdown(socket.SHUT_WR)
+        while cli.recv(100):
+            pass
+    finally:
+        cli.close()
+        srv.close()
+        lsn.close()
+    return latencies
+
+def run(steg, idle, rounds, client_opts):
+    st = Stegotorus(("chop", "server", "127.0.0.1:5001",
+                     steg, "127.0.0.1:5010",
+                     "chop", "client") + client_opts + ("127.0.0.1:4999",
+                     steg, "127.0.0.1:5010"))
+    errors = ""
+    latencies = []
+    try:
+        latencies = rounds_of(idle, rounds)
+    except socket.error, e:
+        errors += "%s\n" % e
+    errors += st.check_completion(steg + " proxy", errors != "")
+    return (latencies, errors)
+
+def main(argv):
+    idle = 2.0
+    rounds = 10
+    steg = "http"
+    if len(argv) > 1:
+        idle = float(argv[1])
+    if len(argv) > 2:
+        rounds = int(argv[2])
+    if len(argv) > 3:
+        steg = argv[3]
+
+    # the proxies have to outlive every round
+    itestlib.TIMEOUT_LEN = rounds * (idle + 5) + 15
+
+    for (label, opts) in (("polling", ()),
+                          ("hanging", ("--hanging-requests", "2"))):
+        (latencies, errors) = run(steg, idle, rounds, opts)
+        if errors:
+            sys.stderr.write(errors)
+        if len(latencies) < rounds:
+            print "%-8s failed after %d rounds" % (label, len(latencies))
+            continue
+        latencies.sort()
+        print "%-8s median %7.1f ms   mean %7.1f ms   max %7.1f ms" % (
+            label, latencies[len(latencies) / 2],
+            sum(latencies) / len(latencies), latencies[-1])
+
+if __name__ == '__main__':
+    main(sys.argv)
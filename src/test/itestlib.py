@@ -76,13 +76,14 @@ class Stegotorus(subprocess.Popen):
                                   env=stegotorus_env,
                                   close_fds=True,
                                   **kwargs)
-        # wait for startup completion, which is signaled by
-        # the subprocess closing its stdout
-        self.output = self.stdout.read()
         # read stderr in a separate thread, since we will
-        # have several processes outstanding at the same time
+        # have several processes outstanding at the same time,
+        # and startup alone can log more than a pipe holds
         self.communicator = threading.Thread(target=self.run_communicate)
         self.communicator.start()
+        # wait for startup completion, which is signaled by
+        # the subprocess closing its stdout
+        self.output = self.stdout.read()
         self.timeout = threading.Timer(TIMEOUT_LEN, self.stop)
         self.timeout.start()
 
@@ -0,0 +1,97 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "steg/payload_server.h"
+#include "steg/http_steg_mods/file_steg.h"
+#include "steg/http_steg_mods/jsSteg.h"
+#include "steg/http_steg_mods/htmlSteg.h"
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+/* Compares how much data the hex and the alnum encodings can put in
+   a corpus of JavaScript and HTML covers, e.g. the files the payload
+   scraper finds. Files ending in .js count as JavaScript and files
+   ending in .html or .htm as HTML; each is taken as a response body.
+
+   usage: js_capacity_bench file...  */
+
+struct totals
+{
+  unsigned long files;
+  unsigned long long bytes;
+  unsigned long long hex;
+  unsigned long long alnum;
+};
+
+static bool
+ends_with(const std::string& s, const char *suffix)
+{
+  size_t n = strlen(suffix);
+  return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+static void
+report(const char *label, const totals& t)
+{
+  if (t.files == 0) {
+    printf("%-5s no covers\n", label);
+    return;
+  }
+  printf("%-5s %6lu covers %10llu bytes  hex %9llu  alnum %9llu  (%+.1f%%)\n",
+         label, t.files, t.bytes, t.hex, t.alnum,
+         t.hex ? (double(t.alnum) / t.hex - 1) * 100 : 0.0);
+}
+
+int
+main(int argc, char **argv)
+{
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s file...\n", argv[0]);
+    return 1;
+  }
+
+  log_set_method(LOG_METHOD_STDERR, NULL);
+
+  totals js = totals(), html = totals();
+
+  for (int i = 1; i < argc; i++) {
+    std::string name = argv[i];
+    bool is_js = ends_with(name, ".js");
+    if (!is_js && !ends_with(name, ".html") && !ends_with(name, ".htm"))
+      continue;
+
+    std::ifstream in(name.c_str(), std::ios::binary);
+    if (!in) {
+      log_warn("cannot read %s", name.c_str());
+      continue;
+    }
+    std::stringstream contents;
+    contents << in.rdbuf();
+    std::string body = contents.str();
+
+    // the capacity functions look for terminators with strstr
+    std::vector<char> buf(body.begin(), body.end());
+    buf.push_back('\0');
+
+    totals& t = is_js ? js : html;
+    t.files++;
+    t.bytes += body.size();
+    if (is_js) {
+      t.hex += JSSteg::static_headless_capacity(buf.data(), body.size());
+      t.alnum += JSSteg::static_headless_capacity(buf.data(), body.size(),
+                                                  JS_ENCODING_ALNUM);
+    } else {
+      t.hex += HTMLSteg::static_headless_capacity(buf.data(), body.size());
+      t.alnum += HTMLSteg::static_headless_capacity(buf.data(), body.size(),
+                                                    JS_ENCODING_ALNUM);
+    }
+  }
+
+  report("js", js);
+  report("html", html);
+  return 0;
+}
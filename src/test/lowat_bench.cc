@@ -0,0 +1,338 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+
+#include <event2/bufferevent.h>
+#include <event2/buffer.h>
+#include <event2/event.h>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#ifdef HAVE_LINUX_SOCKIOS_H
+#include <linux/sockios.h>
+#endif
+
+/* Latency of interactive messages mixed with bulk traffic, as chop
+   sends them over several downstream connections, with and without
+   the write shaping conn_t does for it (TCP_NOTSENT_LOWAT on the
+   sockets, and pick_connection counting the kernel's unsent bytes).
+
+   Two loopback connections each carry a steady stream of bulk
+   records to a sink thread that reads them at a fixed rate, so that
+   data backs up on the sending side as it does on a slow path. Every
+   few milliseconds an interactive record goes to whichever
+   connection has the least unsent data, as far as the sender can
+   tell; the sink reports how long each took to arrive.
+
+     plain       the kernel queues all it will; only the outbound
+                 buffers are counted
+     lowat       TCP_NOTSENT_LOWAT; only the outbound buffers are
+                 counted
+     lowat+outq  TCP_NOTSENT_LOWAT; the kernel's unsent bytes are
+                 counted as well
+
+   usage: lowat_bench [seconds] [kilobytes/s]  */
+
+#define N_CONNS 2
+#define UNSENT_LOWAT (16 * 1024)
+#define BULK_RECORD (16 * 1024)
+#define BULK_QUEUE (64 * 1024)
+#define INTERACTIVE_RECORD 200
+#define INTERACTIVE_INTERVAL_MS 10
+
+// record: length (4 bytes, including this header), kind, send time in
+// nanoseconds (8 bytes)
+#define RECORD_HEADER 13
+enum { KIND_BULK = 0, KIND_INTERACTIVE = 1 };
+
+static unsigned long long
+now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+listen_loopback(struct sockaddr_in *sin)
+{
+  socklen_t len = sizeof *sin;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  memset(sin, 0, sizeof *sin);
+  sin->sin_family = AF_INET;
+  sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd < 0 || bind(fd, (struct sockaddr *)sin, sizeof *sin) ||
+      listen(fd, N_CONNS) || getsockname(fd, (struct sockaddr *)sin, &len))
+    log_abort("cannot listen on loopback: %s", strerror(errno));
+  return fd;
+}
+
+static int
+connect_loopback(const struct sockaddr_in *sin)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (const struct sockaddr *)sin, sizeof *sin))
+    log_abort("cannot connect on loopback: %s", strerror(errno));
+  return fd;
+}
+
+static void
+add_record(struct evbuffer *buf, uint8_t kind, size_t len)
+{
+  static char filler[BULK_RECORD];
+  uint8_t hdr[RECORD_HEADER];
+  unsigned long long t = now_ns();
+
+  for (int i = 0; i < 4; i++)
+    hdr[i] = len >> (24 - 8*i);
+  hdr[4] = kind;
+  for (int i = 0; i < 8; i++)
+    hdr[5 + i] = t >> (56 - 8*i);
+  evbuffer_add(buf, hdr, sizeof hdr);
+  evbuffer_add(buf, filler, len - RECORD_HEADER);
+}
+
+/* Reads every connection at RATE bytes per second until all of them
+   end, recording the latency of each interactive record. */
+static void
+sink(int listener, unsigned long rate, std::vector<double> *latencies)
+{
+  struct conn {
+    int fd;
+    std::vector<uint8_t> pending;
+  } conns[N_CONNS];
+  struct pollfd pfd[N_CONNS];
+  static uint8_t chunk[64*1024];
+  int open = N_CONNS;
+
+  for (int i = 0; i < N_CONNS; i++) {
+    // A small receive window keeps the backlog on the sending side.
+    int rcvbuf = 64 * 1024;
+    conns[i].fd = accept(listener, NULL, NULL);
+    setsockopt(conns[i].fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+    pfd[i].fd = conns[i].fd;
+  }
+
+  unsigned long long start = now_ns();
+  double allowed[N_CONNS] = { 0 };
+  unsigned long long last = start;
+
+  while (open > 0) {
+    for (int i = 0; i < N_CONNS; i++)
+      pfd[i].events = allowed[i] >= 1 ? POLLIN : 0;
+    poll(pfd, N_CONNS, 1);
+    unsigned long long t = now_ns();
+    for (int i = 0; i < N_CONNS; i++) {
+      allowed[i] = std::min(allowed[i] + rate * (t - last) / 1e9,
+                            (double)sizeof chunk);
+      if (pfd[i].fd < 0 || !(pfd[i].revents & (POLLIN|POLLHUP)) ||
+          allowed[i] < 1)
+        continue;
+
+      ssize_t n = read(pfd[i].fd, chunk, (size_t)allowed[i]);
+      if (n <= 0) {
+        close(pfd[i].fd);
+        pfd[i].fd = -1;
+        open--;
+        continue;
+      }
+      allowed[i] -= n;
+
+      std::vector<uint8_t> &p = conns[i].pending;
+      p.insert(p.end(), chunk, chunk + n);
+      size_t used = 0;
+      while (p.size() - used >= RECORD_HEADER) {
+        const uint8_t *r = &p[used];
+        size_t len = (r[0] << 24) | (r[1] << 16) | (r[2] << 8) | r[3];
+        if (p.size() - used < len)
+          break;
+        if (r[4] == KIND_INTERACTIVE) {
+          unsigned long long sent = 0;
+          for (int j = 0; j < 8; j++)
+            sent = (sent << 8) | r[5 + j];
+          latencies->push_back((t - sent) / 1e6);
+        }
+        used += len;
+      }
+      p.erase(p.begin(), p.begin() + used);
+    }
+    last = t;
+  }
+}
+
+enum shaping { SHAPE_PLAIN, SHAPE_LOWAT, SHAPE_LOWAT_OUTQ };
+
+struct sender {
+  struct event_base *base;
+  struct bufferevent *bev[N_CONNS];
+  struct event *ticker;
+  shaping mode;
+  unsigned long long end;
+  unsigned long interactive_sent;
+  int finished;
+};
+
+static size_t
+unsent(sender *s, int i)
+{
+  size_t n = evbuffer_get_length(bufferevent_get_output(s->bev[i]));
+#ifdef SIOCOUTQNSD
+  int queued;
+  if (s->mode == SHAPE_LOWAT_OUTQ &&
+      ioctl(bufferevent_getfd(s->bev[i]), SIOCOUTQNSD, &queued) == 0 &&
+      queued > 0)
+    n += queued;
+#endif
+  return n;
+}
+
+/* Keeps the connection's outbound buffer full of bulk records until
+   the end of the run, then shuts it down once everything has been
+   written. */
+static void
+bulk_writecb(struct bufferevent *bev, void *arg)
+{
+  sender *s = (sender *)arg;
+  struct evbuffer *out = bufferevent_get_output(bev);
+
+  if (now_ns() < s->end) {
+    while (evbuffer_get_length(out) < BULK_QUEUE)
+      add_record(out, KIND_BULK, BULK_RECORD);
+    return;
+  }
+
+  bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
+  if (evbuffer_get_length(out) == 0 &&
+      (bufferevent_get_enabled(bev) & EV_WRITE)) {
+    shutdown(bufferevent_getfd(bev), SHUT_WR);
+    bufferevent_disable(bev, EV_WRITE);
+    if (++s->finished == N_CONNS)
+      event_base_loopbreak(s->base);
+  }
+}
+
+static void
+interactive_cb(evutil_socket_t, short, void *arg)
+{
+  sender *s = (sender *)arg;
+
+  if (now_ns() >= s->end) {
+    event_del(s->ticker);
+    for (int i = 0; i < N_CONNS; i++)
+      bulk_writecb(s->bev[i], s);
+    return;
+  }
+
+  int best = 0;
+  size_t least = unsent(s, 0);
+  for (int i = 1; i < N_CONNS; i++) {
+    size_t n = unsent(s, i);
+    if (n < least) {
+      least = n;
+      best = i;
+    }
+  }
+  add_record(bufferevent_get_output(s->bev[best]), KIND_INTERACTIVE,
+             INTERACTIVE_RECORD);
+  s->interactive_sent++;
+}
+
+static void
+run(const char *label, shaping mode, double seconds, unsigned long rate)
+{
+  struct sockaddr_in addr;
+  int listener = listen_loopback(&addr);
+  std::vector<double> latencies;
+  std::thread reader(sink, listener, rate, &latencies);
+
+  sender s;
+  s.base = event_base_new();
+  s.mode = mode;
+  s.interactive_sent = 0;
+  s.finished = 0;
+  s.end = now_ns() + (unsigned long long)(seconds * 1e9);
+
+  for (int i = 0; i < N_CONNS; i++) {
+    int fd = connect_loopback(&addr);
+#ifdef TCP_NOTSENT_LOWAT
+    int lowat = UNSENT_LOWAT;
+    if (mode != SHAPE_PLAIN &&
+        setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof lowat))
+      log_abort("setsockopt(TCP_NOTSENT_LOWAT): %s", strerror(errno));
+#endif
+    evutil_make_socket_nonblocking(fd);
+    s.bev[i] = bufferevent_socket_new(s.base, fd, BEV_OPT_CLOSE_ON_FREE);
+    bufferevent_setwatermark(s.bev[i], EV_WRITE, BULK_QUEUE / 2, 0);
+    bufferevent_setcb(s.bev[i], NULL, bulk_writecb, NULL, &s);
+    bufferevent_enable(s.bev[i], EV_WRITE);
+    bulk_writecb(s.bev[i], &s);
+  }
+
+  struct timeval tick = { 0, INTERACTIVE_INTERVAL_MS * 1000 };
+  s.ticker = event_new(s.base, -1, EV_PERSIST, interactive_cb, &s);
+  event_add(s.ticker, &tick);
+  event_base_dispatch(s.base);
+
+  event_free(s.ticker);
+  for (int i = 0; i < N_CONNS; i++)
+    bufferevent_free(s.bev[i]);
+  reader.join();
+  close(listener);
+  event_base_free(s.base);
+
+  if (latencies.size() != s.interactive_sent)
+    log_abort("%s: %lu of %lu interactive records arrived", label,
+              (unsigned long)latencies.size(), s.interactive_sent);
+  if (latencies.empty()) {
+    printf("%-12s no interactive records\n", label);
+    return;
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+  size_t n = latencies.size();
+  printf("%-12s %5lu msgs   median %8.1f ms   p90 %8.1f ms   p99 %8.1f ms"
+         "   max %8.1f ms\n", label, (unsigned long)n,
+         latencies[n / 2], latencies[n * 9 / 10], latencies[n * 99 / 100],
+         latencies[n - 1]);
+}
+
+int
+main(int argc, char **argv)
+{
+  double seconds = 5;
+  unsigned long kilobytes = 4096;
+  if (argc > 1)
+    seconds = strtod(argv[1], NULL);
+  if (argc > 2)
+    kilobytes = strtoul(argv[2], NULL, 10);
+  if (seconds <= 0 || kilobytes == 0) {
+    fprintf(stderr, "usage: %s [seconds] [kilobytes/s]\n", argv[0]);
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  log_set_method(LOG_METHOD_STDERR, NULL);
+
+  run("plain", SHAPE_PLAIN, seconds, kilobytes * 1024);
+#ifdef TCP_NOTSENT_LOWAT
+  run("lowat", SHAPE_LOWAT, seconds, kilobytes * 1024);
+  run("lowat+outq", SHAPE_LOWAT_OUTQ, seconds, kilobytes * 1024);
+#else
+  printf("TCP_NOTSENT_LOWAT is not available here\n");
+#endif
+  return 0;
+}
@@ -0,0 +1,126 @@
+# Copyright 2012 SRI International
+# See LICENSE for other credits and copying information
+
+# Loopback count of what chop's multiplexing saves: a page load's
+# worth of connections is opened through the client side at once,
+# each sends a request and reads a reply, and we report how many
+# circuits (one handshake each) and cover connections the client
+# used for them, with and without --multiplex. The counts come from
+# the line every chop circuit logs when it closes. Not run by 'make
+# check'; run it from the build directory:
+#
+#   python src/test/multiplex_count.py [connections] [rounds] [steg]
+#
+# The default is 8 connections at once, 3 rounds, over http.
+
+import os
+import re
+import socket
+import sys
+import threading
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import itestlib
+from itestlib import Stegotorus
+
+REPLY_LEN = 16 * 1024
+
+carried_re = re.compile(
+    r"carried (\d+) upstream connections over (\d+) cover connections")
+
+def serve(lsn, count, errors):
+    try:
+        for i in xrange(count):
+            (srv, _) = lsn.accept()
+            srv.settimeout(itestlib.TIMEOUT_LEN)
+            request = srv.recv(100)
+            srv.sendall(request[:1] * REPLY_LEN)
+            srv.shutdown(socket.SHUT_WR)
+            while srv.recv(100):
+                pass
+            srv.close()
+    except socket.error, e:
+        errors.append("server: %s" % e)
+
+def fetch(i, errors):
+    try:
+        cli = socket.create_connection(("127.0.0.1", 4999))
+        cli.settimeout(itestlib.TIMEOUT_LEN)
+        cli.sendall("%c /%d\n" % (chr(ord('a') + i % 26), i))
+        cli.shutdown(socket.SHUT_WR)
+        got = 0
+        while True:
+            data = cli.recv(4096)
+            if not data:
+                break
+            got += len(data)
+        cli.close()
+        if got != REPLY_LEN:
+            errors.append("connection %d: %d bytes of %d" % (i, got, REPLY_LEN))
+    except socket.error, e:
+        errors.append("connection %d: %s" % (i, e))
+
+def page_loads(connections, rounds):
+    lsn = socket.socket()
+    lsn.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    lsn.bind(("127.0.0.1", 5001))
+    lsn.listen(connections)
+    errors = []
+    try:
+        for r in xrange(rounds):
+            server = threading.Thread(target=serve,
+                                      args=(lsn, connections, errors))
+            server.start()
+            clients = [threading.Thread(target=fetch, args=(i, errors))
+                       for i in xrange(connections)]
+            for c in clients:
+                c.start()
+            for c in clients:
+                c.join()
+            server.join()
+    finally:
+        lsn.close()
+    return errors
+
+def run(steg, connections, rounds, client_opts):
+    server = Stegotorus(("chop", "server", "127.0.0.1:5001",
+                         steg, "127.0.0.1:5010"))
+    client = Stegotorus(("chop", "client") + client_opts +
+                        ("127.0.0.1:4999", steg, "127.0.0.1:5010"))
+    errors = page_loads(connections, rounds)
+    report = client.check_completion(steg + " client", False)
+    report += server.check_completion(steg + " server", False)
+    circuits = carried_re.findall(client.errput)
+    return (len(circuits),
+            sum(int(c[0]) for c in circuits),
+            sum(int(c[1]) for c in circuits),
+            errors, report)
+
+def main(argv):
+    connections = 8
+    rounds = 3
+    steg = "http"
+    if len(argv) > 1:
+        connections = int(argv[1])
+    if len(argv) > 2:
+        rounds = int(argv[2])
+    if len(argv) > 3:
+        steg = argv[3]
+
+    itestlib.TIMEOUT_LEN = rounds * 20 + 15
+
+    print "%d connections at once, %d rounds, over %s" % (
+        connections, rounds, steg)
+    for (label, opts) in (("separate", ()),
+                          ("multiplex", ("--multiplex",))):
+        (circuits, carried, covers, errors, report) = \
+            run(steg, connections, rounds, opts)
+        if errors:
+            sys.stderr.write("\n".join(errors) + "\n")
+        print ("%-9s %3d handshakes  %4d cover connections  "
+               "for %d upstream connections%s" % (
+                   label, circuits, covers, carried,
+                   "  (proxy warnings)" if report else ""))
+
+if __name__ == '__main__':
+    main(sys.argv)
@@ -0,0 +1,308 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "splice_relay.h"
+#include "uring_transport.h"
+
+#include <event2/bufferevent.h>
+#include <event2/buffer.h>
+#include <event2/event.h>
+
+#include <algorithm>
+#include <thread>
+
+#include <sys/syscall.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+/* Throughput and CPU comparison of the ways the transparent proxy
+   and the null protocol can relay a connection: through bufferevents
+   (as TransparentProxy::readcb does), through the same bufferevent
+   relay with the sockets on the io_uring transport, or with the
+   splice relay.
+
+   A producer thread pushes the data through the relay over loopback
+   TCP to a sink thread. Only the relay runs on the main thread, so
+   its CPU time is the cost of relaying. Its system calls are the
+   reads and writes the kernel counts for the thread plus, on the
+   ring, its io_uring_enter calls; the kernel does not count splice
+   calls as either. Work it hands to its io_uring worker threads is
+   not counted on either score.
+
+   usage: relay_bench [megabytes]  */
+
+#define MAX_OUTPUT SpliceRelay::MAX_OUTPUT
+
+static double
+now(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Read and write system calls made so far by this thread. */
+static unsigned long long
+thread_syscalls()
+{
+  char path[64];
+  snprintf(path, sizeof path, "/proc/self/task/%ld/io", (long)syscall(SYS_gettid));
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return 0;
+
+  char line[128];
+  unsigned long long n, total = 0;
+  while (fgets(line, sizeof line, f))
+    if (sscanf(line, "syscr: %llu", &n) == 1 || sscanf(line, "syscw: %llu", &n) == 1)
+      total += n;
+  fclose(f);
+  return total;
+}
+
+static int
+listen_loopback(struct sockaddr_in *sin)
+{
+  socklen_t len = sizeof *sin;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  memset(sin, 0, sizeof *sin);
+  sin->sin_family = AF_INET;
+  sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd < 0 || bind(fd, (struct sockaddr *)sin, sizeof *sin) ||
+      listen(fd, 1) || getsockname(fd, (struct sockaddr *)sin, &len))
+    log_abort("cannot listen on loopback: %s", strerror(errno));
+  return fd;
+}
+
+static int
+connect_loopback(const struct sockaddr_in *sin)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (const struct sockaddr *)sin, sizeof *sin))
+    log_abort("cannot connect on loopback: %s", strerror(errno));
+  return fd;
+}
+
+static void
+produce(struct sockaddr_in front, size_t total)
+{
+  static char chunk[64*1024];
+  int fd = connect_loopback(&front);
+
+  while (total > 0) {
+    ssize_t n = write(fd, chunk, std::min(total, sizeof chunk));
+    if (n <= 0)
+      log_abort("producer: %s", strerror(errno));
+    total -= n;
+  }
+  shutdown(fd, SHUT_WR);
+
+  char c;
+  while (read(fd, &c, 1) > 0)
+    ;
+  close(fd);
+}
+
+static void
+consume(int listener, size_t *received, int notify)
+{
+  static char chunk[64*1024];
+  int fd = accept(listener, NULL, NULL);
+  ssize_t n;
+
+  while ((n = read(fd, chunk, sizeof chunk)) > 0)
+    *received += n;
+  close(fd);
+
+  char c = 0;
+  if (write(notify, &c, 1) != 1)
+    log_abort("consumer: %s", strerror(errno));
+}
+
+/* The bufferevent relay, as in TransparentProxy. */
+
+static void relay_readcb(struct bufferevent *bev, void *ctx);
+
+static void
+relay_drained_writecb(struct bufferevent *bev, void *ctx)
+{
+  struct bufferevent *partner = (struct bufferevent *)ctx;
+  bufferevent_setcb(bev, relay_readcb, NULL, NULL, partner);
+  bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
+  bufferevent_enable(partner, EV_READ);
+}
+
+static void
+relay_flushed_writecb(struct bufferevent *bev, void *)
+{
+  if (evbuffer_get_length(bufferevent_get_output(bev)) == 0)
+    UringTransport::shutdown_write(bev);
+}
+
+static void
+relay_readcb(struct bufferevent *bev, void *ctx)
+{
+  struct bufferevent *partner = (struct bufferevent *)ctx;
+  struct evbuffer *dst = bufferevent_get_output(partner);
+
+  evbuffer_add_buffer(dst, bufferevent_get_input(bev));
+  if (evbuffer_get_length(dst) >= MAX_OUTPUT) {
+    bufferevent_setcb(partner, relay_readcb, relay_drained_writecb,
+                      NULL, bev);
+    bufferevent_setwatermark(partner, EV_WRITE, MAX_OUTPUT/2, MAX_OUTPUT);
+    bufferevent_disable(bev, EV_READ);
+  }
+}
+
+static void
+relay_eventcb(struct bufferevent *bev, short what, void *ctx)
+{
+  struct bufferevent *partner = (struct bufferevent *)ctx;
+  if (what & BEV_EVENT_EOF) {
+    relay_readcb(bev, ctx);
+    bufferevent_setcb(partner, NULL, relay_flushed_writecb, NULL, NULL);
+    relay_flushed_writecb(partner, NULL);
+  }
+}
+
+static void
+splice_done(SpliceRelay *, int error, void *)
+{
+  if (error)
+    log_abort("splice relay: %s", strerror(error));
+}
+
+static void
+notify_cb(evutil_socket_t, short, void *arg)
+{
+  event_base_loopbreak((struct event_base *)arg);
+}
+
+enum relay_mode { RELAY_BUFFEREVENT, RELAY_URING, RELAY_SPLICE };
+
+static void
+run(const char *label, relay_mode mode, size_t total)
+{
+  struct event_base *base = event_base_new();
+  if (mode == RELAY_URING && !UringTransport::init(base)) {
+    printf("%-12s not available\n", label);
+    event_base_free(base);
+    return;
+  }
+
+  struct sockaddr_in front, back;
+  int front_lsn = listen_loopback(&front);
+  int back_lsn = listen_loopback(&back);
+  int notify[2];
+  size_t received = 0;
+
+  if (pipe(notify))
+    log_abort("pipe: %s", strerror(errno));
+
+  std::thread producer(produce, front, total);
+  std::thread consumer(consume, back_lsn, &received, notify[1]);
+
+  int fd_in = accept(front_lsn, NULL, NULL);
+  int fd_out = connect_loopback(&back);
+  evutil_make_socket_nonblocking(fd_in);
+  evutil_make_socket_nonblocking(fd_out);
+
+  struct event *done = event_new(base, notify[0], EV_READ, notify_cb, base);
+  event_add(done, NULL);
+
+  struct bufferevent *b_in = NULL, *b_out = NULL;
+  SpliceRelay *relay = NULL;
+
+  UringTransport::stats_t ring_before = UringTransport::stats();
+  unsigned long long syscalls = thread_syscalls();
+  double wall = now(CLOCK_MONOTONIC);
+  double cpu = now(CLOCK_THREAD_CPUTIME_ID);
+
+  if (mode == RELAY_SPLICE) {
+    relay = SpliceRelay::create(base, fd_in, fd_out, NULL, NULL,
+                                splice_done, NULL);
+    if (!relay)
+      log_abort("splice is not available here");
+  } else if (mode == RELAY_URING) {
+    // the transport closes its sockets; the others leave them to us
+    b_in = UringTransport::socket_new(base, dup(fd_in));
+    b_out = UringTransport::socket_new(base, dup(fd_out));
+  } else {
+    b_in = bufferevent_socket_new(base, fd_in, 0);
+    b_out = bufferevent_socket_new(base, fd_out, 0);
+  }
+  if (b_in) {
+    bufferevent_setcb(b_in, relay_readcb, NULL, relay_eventcb, b_out);
+    bufferevent_setcb(b_out, relay_readcb, NULL, relay_eventcb, b_in);
+    bufferevent_enable(b_in, EV_READ|EV_WRITE);
+    bufferevent_enable(b_out, EV_READ|EV_WRITE);
+  }
+
+  event_base_dispatch(base);
+
+  wall = now(CLOCK_MONOTONIC) - wall;
+  cpu = now(CLOCK_THREAD_CPUTIME_ID) - cpu;
+  syscalls = thread_syscalls() - syscalls +
+    (UringTransport::stats().enters - ring_before.enters);
+
+  // Let the producer see its EOF.
+  shutdown(fd_in, SHUT_WR);
+  producer.join();
+  consumer.join();
+
+  if (received != total)
+    log_abort("%s: relayed %lu of %lu bytes", label,
+              (unsigned long)received, (unsigned long)total);
+
+  printf("%-12s %9.1f MB/s %9.3f s CPU/GB %9.0f syscalls/s %9.0f syscalls/GB\n",
+         label, total / wall / 1e6, cpu * 1e9 / total,
+         syscalls / wall, syscalls * 1e9 / total);
+
+  delete relay;
+  if (b_in)
+    UringTransport::free(b_in);
+  if (b_out)
+    UringTransport::free(b_out);
+  UringTransport::free_all();
+  event_free(done);
+  close(fd_in);
+  close(fd_out);
+  close(front_lsn);
+  close(back_lsn);
+  close(notify[0]);
+  close(notify[1]);
+  event_base_free(base);
+}
+
+int
+main(int argc, char **argv)
+{
+  unsigned long megabytes = 1024;
+  if (argc > 1)
+    megabytes = strtoul(argv[1], NULL, 10);
+  if (megabytes == 0) {
+    fprintf(stderr, "usage: %s [megabytes]\n", argv[0]);
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  log_set_method(LOG_METHOD_STDERR, NULL);
+
+  size_t total = megabytes << 20;
+  run("bufferevent", RELAY_BUFFEREVENT, total);
+  run("io_uring", RELAY_URING, total);
+  if (SpliceRelay::available())
+    run("splice", RELAY_SPLICE, total);
+  else
+    printf("splice       not available\n");
+
+  return 0;
+}
@@ -0,0 +1,81 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "rng.h"
+
+#include <time.h>
+#include <openssl/rand.h>
+
+/* Microbenchmark for the random number generator.  Compares the
+   buffered generator behind rng_* with what they used to do, i.e. a
+   RAND_bytes call for every few bytes drawn.
+
+   usage: rng_bench [iterations]  */
+
+/* rng_int as it was, going to OpenSSL for every candidate. */
+static int
+openssl_rng_int(unsigned int max)
+{
+  unsigned int nbits = CHAR_BIT*sizeof(int) - __builtin_clz(max);
+  unsigned int nbytes = (nbits / CHAR_BIT) + 1;
+  unsigned int mask = (1U << nbits) - 1;
+  unsigned char buf[sizeof(int)];
+
+  for (;;) {
+    int rv = RAND_bytes(buf, nbytes);
+    log_assert(rv);
+
+    unsigned int r = 0;
+    for (unsigned int i = 0; i < nbytes; i++)
+      r = (r << CHAR_BIT) | buf[i];
+
+    r &= mask;
+    if (r < max)
+      return r;
+  }
+}
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Prints the time per call of BODY run N times.  The sink keeps the
+   compiler from dropping the calls. */
+#define BENCH(label, n, body)                                   \
+  do {                                                          \
+    double start = now();                                       \
+    for (unsigned long i = 0; i < (n); i++) {                   \
+      body;                                                     \
+    }                                                           \
+    double elapsed = now() - start;                             \
+    printf("%-32s %8.1f ns/call\n", label, elapsed * 1e9 / (n)); \
+  } while (0)
+
+int
+main(int argc, char **argv)
+{
+  unsigned long n = 1000000;
+  if (argc > 1)
+    n = strtoul(argv[1], NULL, 10);
+  if (n == 0) {
+    fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+    return 1;
+  }
+
+  volatile unsigned int sink = 0;
+  uint8_t buf[16];
+
+  BENCH("RAND_bytes(16)", n, RAND_bytes(buf, sizeof buf); sink += buf[0]);
+  BENCH("rng_bytes(16)", n, rng_bytes(buf, sizeof buf); sink += buf[0]);
+  BENCH("openssl rng_int(1000)", n, sink += openssl_rng_int(1000));
+  BENCH("rng_int(1000)", n, sink += rng_int(1000));
+  BENCH("rng_range_geom(1024, 8)", n, sink += rng_range_geom(1024, 8));
+
+  return sink == 0xdeadbeef; // practically never
+}
@@ -0,0 +1,76 @@
+# Copyright 2012 SRI International
+# See LICENSE for other credits and copying information
+
+# Loopback benchmark of the steg modules: a chop client and server
+# carry a generated timeline, interleaved in both directions, and we
+# report how long each steg takes to deliver it. Not run by 'make
+# check'; run it from the build directory:
+#
+#   python src/test/steg_bench.py [kilobytes] [steg ...]
+#
+# The default is 256 kilobytes each way, over http and websocket.
+
+import os
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from itestlib import Stegotorus, Tltester
+
+LINE_LEN = 1000
+
+def write_timeline(kilobytes):
+    (fd, name) = tempfile.mkstemp(prefix="steg_bench_")
+    tl = os.fdopen(fd, "w")
+    tl.write("# %d kilobytes each way\n" % kilobytes)
+    for i in xrange(kilobytes * 1024 / LINE_LEN):
+        c = chr(ord('a') + i % 26)
+        tl.write("> %s\n" % (c * LINE_LEN))
+        tl.write("< %s\n" % (c.upper() * LINE_LEN))
+    tl.write("]\n[\n")
+    tl.close()
+    return name
+
+def run(steg, timeline):
+    st = Stegotorus(("chop", "server", "127.0.0.1:5001",
+                     steg, "127.0.0.1:5010", steg, "127.0.0.1:5011",
+                     "chop", "client", "127.0.0.1:4999",
+                     steg, "127.0.0.1:5010", steg, "127.0.0.1:5011"))
+    start = time.time()
+    tester = Tltester(timeline, ("127.0.0.1:4999", "127.0.0.1:5001"))
+    errors = ""
+    try:
+        tester.check_completion(steg + " tester")
+    except AssertionError, e:
+        errors += e.message
+    elapsed = time.time() - start
+    report = st.check_completion(steg + " proxy", errors != "")
+    return (elapsed, errors, report)
+
+def main(argv):
+    kilobytes = 256
+    stegs = ["http", "websocket"]
+    if len(argv) > 1:
+        kilobytes = int(argv[1])
+    if len(argv) > 2:
+        stegs = argv[2:]
+
+    timeline = write_timeline(kilobytes)
+    try:
+        for steg in stegs:
+            (elapsed, errors, report) = run(steg, timeline)
+            sys.stderr.write(errors + report)
+            if errors:
+                print "%-12s failed" % steg
+            else:
+                # the transfer went through, even if the proxy
+                # complained on the way
+                print "%-12s %7.2fs %8.1f kB/s%s" % (
+                    steg, elapsed, 2 * kilobytes / elapsed,
+                    report and "   (proxy warnings)" or "")
+    finally:
+        os.unlink(timeline)
+
+if __name__ == '__main__':
+    main(sys.argv)
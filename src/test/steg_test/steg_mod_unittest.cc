@@ -29,6 +29,7 @@
 
 #include <iostream>
 #include <fstream>
+#include <vector>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,6 +45,7 @@
 #include "jpgSteg.h"
 #include "gifSteg.h"
 #include "swfSteg.h"
+#include "pdfSteg.h"
 
 #include <gtest/gtest.h>
 
@@ -90,6 +92,34 @@ class StegModTest : public testing::Test {
    //  cout << recovered_phrase << endl;
   }
 
+  /* Embeds the phrase, then hands the steg mod the cover a byte at a
+     time, as a chunked response comes in: once it can tell how much
+     decode needs, that has to stay the same after, be within the
+     cover and be enough to decode. */
+  void decodable_prefix_bytewise(const char* test_phrase, FileStegMod* test_steg_mod) {
+    ssize_t data_len = strlen(test_phrase)+1;
+    uint8_t recovered_phrase[FileStegMod::c_MAX_MSG_BUF_SIZE];
+    size_t prefix = 0;
+
+    ssize_t encoded_len = test_steg_mod->encode((uint8_t*)test_phrase, data_len, cover_payload, cover_len);
+    ASSERT_GT(encoded_len, 0);
+
+    for (size_t n = 1; n <= (size_t)encoded_len; n++) {
+      //a copy of just n bytes, so that reading past them shows
+      vector<uint8_t> received(cover_payload, cover_payload + n);
+      size_t needed = test_steg_mod->decodable_prefix(&received[0], n);
+      if (!prefix)
+        prefix = needed;
+      else
+        ASSERT_EQ(prefix, needed);
+    }
+
+    ASSERT_NE(0u, prefix);
+    ASSERT_LE(prefix, (size_t)encoded_len);
+    EXPECT_EQ(data_len, test_steg_mod->decode(cover_payload, prefix, recovered_phrase));
+    EXPECT_FALSE(memcmp(test_phrase, recovered_phrase, data_len));
+  }
+
   virtual void SetUp()
   {
 
@@ -116,9 +146,9 @@ la chaleur lourde qui épaissit l'air.";
 
   virtual void TearDown()
   {
-    delete short_message;
-    delete long_message;
-    delete cover_payload;
+    delete[] short_message;
+    delete[] long_message;
+    delete[] cover_payload;
   }
 
 };
@@ -143,7 +173,7 @@ TEST_F(StegModTest, swf_gracefully_invalid) {
 
   read_cover("src/test/steg_test/inrozxa.swf");
   EXPECT_FALSE(swf_test_steg.headless_capacity((char*)cover_payload, cover_len));
-  delete cover_payload;
+  delete[] cover_payload;
 }
 
 //PDF - probably needs another capacity test and a chunking test too, depending on whatever SRI will be piping into here
@@ -166,9 +196,24 @@ TEST_F(StegModTest, pdf_gracefully_invalid) {
 
   read_cover("src/test/steg_test/(insert pdf here)");
   EXPECT_FALSE(pdf_test_steg.headless_capacity((char*)cover_payload, cover_len));
-  delete cover_payload;
+  delete[] cover_payload;
 }*/
 
+//there is no pdf cover in the tree, this is the least PDFSteg takes:
+//one stream, which the data replaces
+TEST_F(StegModTest, pdf_decodable_prefix) {
+  PDFSteg pdf_test_steg(NULL, 0);
+  const string pdf = "%PDF-1.4\n1 0 obj <<\n/Length 2000\n>>\nstream\n" +
+    string(2000, 'x') + "\r\nendstream\nendobj\ntrailer\n<< /Root 1 0 R >>\n%%EOF\n";
+
+  //the short message compresses to much less than the stream it
+  //replaces, so the new cover fits where the old one was
+  cover_len = pdf.size();
+  cover_payload = new uint8_t[cover_len];
+  memcpy(cover_payload, pdf.data(), cover_len);
+  decodable_prefix_bytewise(short_message, &pdf_test_steg);
+}
+
 //PNG
 TEST_F(StegModTest, png_encode_decode_small) {
   PNGSteg png_test_steg(NULL, 0);
@@ -188,21 +233,27 @@ TEST_F(StegModTest, png_gracefully_invalid) {
 
   read_cover("src/test/steg_test/test3.png");
   EXPECT_FALSE(png_test_steg.headless_capacity((char*)cover_payload, cover_len));
-  delete cover_payload;
+  delete[] cover_payload;
 
   read_cover("src/test/steg_test/thegif.png");
   EXPECT_FALSE(png_test_steg.headless_capacity((char*)cover_payload, cover_len));
-  delete cover_payload;
+  delete[] cover_payload;
 
   read_cover("src/test/steg_test/trickycorrupt.png");
   EXPECT_FALSE(png_test_steg.headless_capacity((char*)cover_payload, cover_len));
-  delete cover_payload;
+  delete[] cover_payload;
 
   read_cover("src/test/steg_test/corner_case4.png");
   EXPECT_FALSE(png_test_steg.headless_capacity((char*)cover_payload, cover_len));
 
 }
 
+TEST_F(StegModTest, png_decodable_prefix) {
+  PNGSteg png_test_steg(NULL, 0);
+  read_cover("src/test/steg_test/test1.png");
+  decodable_prefix_bytewise(short_message, &png_test_steg);
+}
+
 //JPG
 TEST_F(StegModTest, jpg_encode_decode_small) {
   JPGSteg jpg_test_steg(NULL, 0);
@@ -221,12 +272,18 @@ TEST_F(StegModTest, jpg_gracefully_invalid) {
 
   read_cover("src/test/steg_test/test3.jpg"); //html page actually
   EXPECT_FALSE(jpg_test_steg.headless_capacity((char*)cover_payload, cover_len));
-  delete cover_payload;
+  delete[] cover_payload;
 
   encode_decode("src/test/steg_test/test4.jpg", long_message, &jpg_test_steg);
 
 }
 
+TEST_F(StegModTest, jpg_decodable_prefix) {
+  JPGSteg jpg_test_steg(NULL, 0);
+  read_cover("src/test/steg_test/test1.jpg");
+  decodable_prefix_bytewise(short_message, &jpg_test_steg);
+}
+
 //GIF
 TEST_F(StegModTest, gif_encode_decode_small) {
   GIFSteg gif_test_steg(NULL, 0);
@@ -249,13 +306,18 @@ TEST_F(StegModTest, gif_gracefully_invalid) {
     fail.
   read_cover("src/test/steg_test/test3.gif"); //png file actually
   EXPECT_FALSE(gif_test_steg.headless_capacity((char*)cover_payload, cover_len));
-  delete cover_payload;*/
+  delete[] cover_payload;*/
 
   read_cover("src/test/steg_test/test4.gif"); //html page actually
   EXPECT_FALSE(gif_test_steg.headless_capacity((char*)cover_payload, cover_len));
-  delete cover_payload;
+  delete[] cover_payload;
 
   encode_decode("src/test/steg_test/test5.gif", long_message, &gif_test_steg);
 
 }
 
+TEST_F(StegModTest, gif_decodable_prefix) {
+  GIFSteg gif_test_steg(NULL, 0);
+  read_cover("src/test/steg_test/test1.gif");
+  decodable_prefix_bytewise(short_message, &gif_test_steg);
+}
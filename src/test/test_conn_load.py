@@ -0,0 +1,140 @@
+# Copyright 2012 SRI International
+# See LICENSE for other credits and copying information
+
+# Integration tests for stegotorus - connection limits.
+#
+# These open idle downstream connections to a chop server, which
+# holds them without opening anything upstream until it sees a
+# handshake, and check the global limit, the per-address quota, and
+# that the listener pauses at the limit instead of refusing.
+
+import errno
+import re
+import resource
+import select
+import socket
+import struct
+import threading
+import time
+
+from itestlib import Stegotorus
+from unittest import TestCase
+
+SERVER = ("127.0.0.1", 5001)
+
+# Connections for the load test.  Loopback connections from one
+# source address to one destination run out of ephemeral ports at
+# about 28000, so they are spread over several source addresses.
+LOAD_CONNS = 50000
+CONNS_PER_SOURCE = 20000
+
+def raise_fd_limit(want):
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    if hard != resource.RLIM_INFINITY and hard < want:
+        return False
+    if soft != resource.RLIM_INFINITY and soft < want:
+        resource.setrlimit(resource.RLIMIT_NOFILE, (want, hard))
+    return True
+
+def start_server(*extra):
+    st = Stegotorus(list(extra) +
+                    ["chop", "server", "%s:%d" % SERVER,
+                     "127.0.0.1:5010", "nosteg"])
+    # The default timeout is too short for the load test.
+    st.timeout.cancel()
+    st.timeout = threading.Timer(300, st.stop)
+    st.timeout.start()
+    return st
+
+def open_conns(n, first=0):
+    """Open N non-blocking connections to the server, from source
+       addresses 127.0.0.2 and up, and wait until all of them are
+       established.  Returns the sockets and an epoll object watching
+       them for input."""
+    socks = []
+    ep = select.epoll()
+    for i in xrange(first, first + n):
+        s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        s.setblocking(0)
+        s.bind(("127.0.0.%d" % (2 + i // CONNS_PER_SOURCE), 0))
+        err = s.connect_ex(SERVER)
+        if err not in (0, errno.EINPROGRESS):
+            raise socket.error(err, "connect: " + errno.errorcode[err])
+        ep.register(s.fileno(), select.EPOLLOUT)
+        socks.append(s)
+
+    by_fd = dict((s.fileno(), s) for s in socks)
+    waiting = len(socks)
+    deadline = time.time() + 60
+    while waiting > 0:
+        if time.time() > deadline:
+            raise AssertionError("%d connections not established" % waiting)
+        for fd, ev in ep.poll(1.0):
+            err = by_fd[fd].getsockopt(socket.SOL_SOCKET, socket.SO_ERROR)
+            if err:
+                raise socket.error(err, "connect: " + errno.errorcode[err])
+            ep.modify(fd, select.EPOLLIN | select.EPOLLRDHUP)
+            waiting -= 1
+    return socks, ep
+
+def reset(socks):
+    """Close connections with a RST.  An idle chop connection is only
+       half-closed by a FIN, and would keep its slot."""
+    for s in socks:
+        s.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER,
+                     struct.pack("ii", 1, 0))
+        s.close()
+
+def closed_by_server(ep, settle):
+    """Number of connections the server closed within SETTLE seconds."""
+    closed = set()
+    deadline = time.time() + settle
+    while time.time() < deadline:
+        for fd, ev in ep.poll(0.2):
+            closed.add(fd)
+            ep.unregister(fd)
+    return len(closed)
+
+def accepted(st):
+    return len(re.findall(r"new connection to server from", st.errput))
+
+class ConnLoadTest(TestCase):
+
+    def finish(self, st, socks, label):
+        reset(socks)
+        errors = st.check_completion(label)
+        if errors != "":
+            self.fail("\n" + errors)
+
+    def test_many_connections(self):
+        if not raise_fd_limit(2 * LOAD_CONNS + 1024):
+            self.skipTest("file descriptor limit too low for %d connections"
+                          % LOAD_CONNS)
+
+        st = start_server()
+        socks, ep = open_conns(LOAD_CONNS)
+        self.assertEqual(closed_by_server(ep, 2.0), 0)
+        self.finish(st, socks, "load server")
+        self.assertEqual(accepted(st), LOAD_CONNS)
+
+    def test_quota(self):
+        st = start_server("--max-connections-per-ip=5")
+        socks, ep = open_conns(8)
+        self.assertEqual(closed_by_server(ep, 1.0), 3)
+        self.finish(st, socks, "quota server")
+        self.assertEqual(len(re.findall(r"client has its quota", st.errput)),
+                         3)
+
+    def test_backpressure(self):
+        st = start_server("--max-connections=10")
+        first, ep = open_conns(10)
+        time.sleep(0.5)
+        # These wait in the accept queue, rather than being refused.
+        rest, ep2 = open_conns(5, 10)
+        self.assertEqual(closed_by_server(ep, 1.0), 0)
+        reset(first)
+        self.assertEqual(closed_by_server(ep2, 1.0), 0)
+        self.finish(st, rest, "backpressure server")
+        self.assertEqual(accepted(st), 15)
+        self.assertRegexpMatches(st.errput, r"no longer accepting")
+        self.assertRegexpMatches(st.errput, r"accepting again")
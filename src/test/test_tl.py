@@ -65,6 +65,55 @@ class TimelineTest(object):
             "127.0.0.1:5010","nosteg","127.0.0.1:5011","nosteg",
             ))
 
+    def test_chop_nosteg2_io_uring(self):
+        self.doTest("chop",
+           ("--io-uring",
+            "chop", "server", "127.0.0.1:5001",
+            "127.0.0.1:5010","nosteg","127.0.0.1:5011","nosteg",
+            "chop", "client", "127.0.0.1:4999",
+            "127.0.0.1:5010","nosteg","127.0.0.1:5011","nosteg",
+            ))
+
+    def test_chop_nosteg_compress(self):
+        self.doTest("chop",
+           ("chop", "server", "--compress", "127.0.0.1:5001",
+            "127.0.0.1:5010","nosteg",
+            "chop", "client", "--compress", "127.0.0.1:4999",
+            "127.0.0.1:5010","nosteg",
+            ))
+
+    def test_chop_nosteg2_fec(self):
+        self.doTest("chop",
+           ("chop", "server", "--fec", "127.0.0.1:5001",
+            "127.0.0.1:5010","nosteg","127.0.0.1:5011","nosteg",
+            "chop", "client", "--fec", "127.0.0.1:4999",
+            "127.0.0.1:5010","nosteg","127.0.0.1:5011","nosteg",
+            ))
+
+    def test_chop_nosteg2_fec_server(self):
+        self.doTest("chop",
+           ("chop", "server", "--fec", "127.0.0.1:5001",
+            "127.0.0.1:5010","nosteg","127.0.0.1:5011","nosteg",
+            "chop", "client", "127.0.0.1:4999",
+            "127.0.0.1:5010","nosteg","127.0.0.1:5011","nosteg",
+            ))
+
+    def test_chop_nosteg2_multiplex(self):
+        self.doTest("chop",
+           ("chop", "server", "127.0.0.1:5001",
+            "127.0.0.1:5010","nosteg","127.0.0.1:5011","nosteg",
+            "chop", "client", "--multiplex", "127.0.0.1:4999",
+            "127.0.0.1:5010","nosteg","127.0.0.1:5011","nosteg",
+            ))
+
+    def test_chop_nosteg2_hanging(self):
+        self.doTest("chop",
+           ("chop", "server", "127.0.0.1:5001",
+            "127.0.0.1:5010","nosteg","127.0.0.1:5011","nosteg",
+            "chop", "client", "--hanging-requests", "2", "127.0.0.1:4999",
+            "127.0.0.1:5010","nosteg","127.0.0.1:5011","nosteg",
+            ))
+
     def test_chop_nosteg_rr(self):
         self.doTest("chop",
            ("chop", "server", "127.0.0.1:5001",
@@ -112,6 +161,31 @@ class TimelineTest(object):
             "127.0.0.1:5010","http","127.0.0.1:5011","http",
             ))
 
+    def test_http_chunked(self):
+        self.doTest("chop",
+           ("chop", "server", "127.0.0.1:5001",
+            "http","127.0.0.1:5010","--chunked-responses",
+            "http","127.0.0.1:5011","--chunked-responses",
+            "chop", "client", "127.0.0.1:4999",
+            "http","127.0.0.1:5010","http","127.0.0.1:5011",
+            ))
+
+    def test_h2c(self):
+        self.doTest("chop",
+           ("chop", "server", "127.0.0.1:5001",
+            "127.0.0.1:5010","h2c","127.0.0.1:5011","h2c",
+            "chop", "client", "127.0.0.1:4999",
+            "127.0.0.1:5010","h2c","127.0.0.1:5011","h2c",
+            ))
+
+    def test_websocket(self):
+        self.doTest("chop",
+           ("chop", "server", "127.0.0.1:5001",
+            "127.0.0.1:5010","websocket","127.0.0.1:5011","websocket",
+            "chop", "client", "127.0.0.1:4999",
+            "127.0.0.1:5010","websocket","127.0.0.1:5011","websocket",
+            ))
+
     def test_http_apache(self):
         self.doTest("chop",
            ("chop", "server", "127.0.0.1:5001",
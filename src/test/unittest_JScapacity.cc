@@ -1,3 +1,158 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "steg/payload_server.h"
+#include "steg/http_steg_mods/file_steg.h"
+#include "steg/http_steg_mods/jsSteg.h"
+
+#include <ctype.h>
+
+using std::string;
+
+/* Groups of n bytes take the fewest characters holding 256^n values,
+   and the decoded length undoes the encoded one. */
+static void
+test_js_capacity_alnum_len(void *)
+{
+  const size_t group[9] = { 0, 2, 3, 5, 6, 7, 9, 10, 11 };
+
+  for (size_t n = 0; n <= 8; n++)
+    tt_uint_op(alnum_encoded_len(n), ==, group[n]);
+  tt_uint_op(alnum_encoded_len(16), ==, 22);
+  tt_uint_op(alnum_encoded_len(19), ==, 27);
+
+  for (size_t n = 0; n < 200; n++)
+    tt_uint_op(alnum_decoded_len(alnum_encoded_len(n)), ==, n);
+
+  // characters short of the next group carry nothing more
+  tt_uint_op(alnum_decoded_len(1), ==, 0);
+  tt_uint_op(alnum_decoded_len(4), ==, 2);
+  tt_uint_op(alnum_decoded_len(12), ==, 8);
+  tt_uint_op(alnum_decoded_len(JS_ALNUM_LEN_CHARS), ==, JS_ALNUM_LEN_BYTES);
+
+ end:;
+}
+
+/* Any data comes back from letters and digits only; what no data
+   encodes to is refused. */
+static void
+test_js_capacity_alnum_round_trip(void *)
+{
+  uint8_t data[40], back[40];
+  uint8_t chars[64];
+
+  for (size_t len = 0; len <= sizeof data; len++) {
+    for (size_t i = 0; i < len; i++)
+      data[i] = (uint8_t)(len % 3 == 0 ? 0xFF : i * 37 + len);
+
+    encode_data_to_alnum(data, len, chars);
+    for (size_t i = 0; i < alnum_encoded_len(len); i++)
+      tt_assert(isalnum(chars[i]));
+
+    tt_int_op(decode_alnum_to_data(chars, alnum_encoded_len(len), back),
+              ==, (ssize_t)len);
+    tt_assert(len == 0 || !memcmp(data, back, len));
+  }
+
+  tt_int_op(decode_alnum_to_data((const uint8_t *)"0-", 2, back), ==, -1);
+  // no data encodes to one character
+  tt_int_op(decode_alnum_to_data((const uint8_t *)"0", 1, back), ==, -1);
+  // two characters hold one byte, and 61*62+61 is too much for it
+  tt_int_op(decode_alnum_to_data((const uint8_t *)"zz", 2, back), ==, -1);
+  tt_int_op(decode_alnum_to_data((const uint8_t *)"47", 2, back), ==, 1);
+  tt_int_op(back[0], ==, 255);
+
+ end:;
+}
+
+namespace {
+  struct js_capacity_steg : JSSteg
+  {
+    js_capacity_steg() : JSSteg(NULL) { encoding = JS_ENCODING_ALNUM; }
+    const uint8_t *encoded() { return outbuf; }
+  };
+}
+
+/* Data goes into the letters and digits of a script and comes back;
+   keywords, and words shaped like them, are left as they were. */
+static void
+test_js_capacity_js_alnum(void *)
+{
+  js_capacity_steg steg;
+  string cover;
+  uint8_t data[64], back[FileStegMod::c_MAX_MSG_BUF_SIZE];
+  ssize_t room;
+  int len;
+
+  for (int i = 0; i < 10; i++)
+    cover += "function scaleBox(width, height) { var ratio = width / height;"
+      " if (ratio > 1) return widthFactor; wrote = null; }\n";
+
+  room = steg.cover_room((const uint8_t *)cover.data(), cover.size());
+  tt_int_op(room, ==, steg.headless_capacity((char *)cover.data(), cover.size()));
+  tt_int_op(room, >=, (ssize_t)sizeof data);
+
+  for (size_t i = 0; i < sizeof data; i++)
+    data[i] = (uint8_t)(i * 53 + 7);
+
+  len = steg.encode(data, sizeof data, (uint8_t *)cover.data(), cover.size());
+  tt_int_op(len, ==, (int)cover.size());
+  for (size_t i = 0; i < cover.size(); i++)
+    tt_assert(isalnum(cover[i]) ? isalnum(steg.encoded()[i])
+              : steg.encoded()[i] == (uint8_t)cover[i]);
+  tt_assert(!memcmp(steg.encoded(), "function", 8));
+  tt_assert(!memcmp(steg.encoded() + cover.find("return"), "return", 6));
+  tt_assert(!memcmp(steg.encoded() + cover.find("wrote"), "wrote", 5));
+
+  tt_int_op(steg.decode(steg.encoded(), len, back), ==, (ssize_t)sizeof data);
+  tt_assert(!memcmp(data, back, sizeof data));
+
+  // no more than the cover holds, whatever its recorded capacity says
+  tt_int_op(steg.encode(data, room + 1, (uint8_t *)cover.data(), cover.size()),
+            ==, -1);
+
+  steg.encoding = JS_ENCODING_HEX;
+  tt_int_op(steg.cover_room((const uint8_t *)cover.data(), cover.size()), ==, -1);
+
+ end:;
+}
+
+/* A cover measured short of its recorded capacity takes the type's
+   maximum down with it. */
+static void
+test_js_capacity_restrict(void *)
+{
+  PayloadDatabase db;
+
+  db.payloads["a"].type = HTTP_CONTENT_JAVASCRIPT;
+  db.payloads["a"].capacity = 900;
+  db.payloads["b"].type = HTTP_CONTENT_JAVASCRIPT;
+  db.payloads["b"].capacity = 500;
+  db.type_detail[HTTP_CONTENT_JAVASCRIPT].max_capacity = 900;
+
+  db.restrict_capacity("b", 600);
+  tt_uint_op(db.payloads["b"].capacity, ==, 500);
+  db.restrict_capacity("a", 300);
+  tt_uint_op(db.payloads["a"].capacity, ==, 300);
+  tt_uint_op(db.typed_maximum_capacity(HTTP_CONTENT_JAVASCRIPT), ==, 500);
+
+ end:;
+}
+
+#define T(name) \
+  { #name, test_js_capacity_##name, 0, 0, 0 }
+
+struct testcase_t js_capacity_tests[] = {
+  T(alnum_len),
+  T(alnum_round_trip),
+  T(js_alnum),
+  T(restrict),
+  END_OF_TESTCASES
+};
+
 /*
 void testOffset2Alnum_skipJSPattern () {
   char s1[] = "for (i=0; i<10; i++) { print i; }";
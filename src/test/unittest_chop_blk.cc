@@ -0,0 +1,233 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "crypt.h"
+#include "protocol/chop_blk.h"
+
+#include <event2/buffer.h>
+
+using namespace chop_blk;
+
+/* Three transmissions, of blocks numbered from 0 on:
+   0-1, 2-4 and 5. */
+struct test_block
+{
+  opcode_t op;
+  const char *data;
+};
+
+static const test_block blocks[] = {
+  { op_ACK, "\x00\x00\x00\x00" },
+  { op_DAT, "first transmission" },
+  { op_PAR, "" },
+  { op_DAT, "second, and somewhat longer, transmission" },
+  { op_DAT, "" },
+  { op_FIN, "third" },
+};
+static const uint32_t member_first[] = { 0, 2, 5 };
+static const uint8_t member_count[] = { 2, 3, 1 };
+static const size_t n_members = 3;
+
+static evbuffer *
+block_data(size_t i)
+{
+  evbuffer *data = evbuffer_new();
+  evbuffer_add(data, blocks[i].data, strlen(blocks[i].data));
+  return data;
+}
+
+static evbuffer *
+make_parity()
+{
+  parity_encoder enc;
+  for (size_t m = 0; m < n_members; m++) {
+    enc.begin_member(member_first[m], member_count[m]);
+    for (uint32_t s = member_first[m];
+         s < member_first[m] + member_count[m]; s++) {
+      evbuffer *data = block_data(s);
+      enc.add_block(blocks[s].op, data);
+      evbuffer_free(data);
+    }
+  }
+  enc.close();
+  if (!enc.due())
+    return 0;
+  return enc.take();
+}
+
+/* Receives every block but those of transmission SKIP. */
+static void
+receive_all_but(size_t skip, reassembly_queue &q, parity_decoder &dec)
+{
+  for (size_t m = 0; m < n_members; m++) {
+    if (m == skip)
+      continue;
+    for (uint32_t s = member_first[m];
+         s < member_first[m] + member_count[m]; s++) {
+      evbuffer *data = block_data(s);
+      dec.keep(s, blocks[s].op, data);
+      q.insert(s, blocks[s].op, data, 0);
+    }
+  }
+}
+
+/* Any one missing transmission comes back as it was. */
+static void
+test_chop_blk_parity_rebuild(void *)
+{
+  evbuffer *parity = make_parity();
+  tt_assert(parity);
+
+  for (size_t skip = 0; skip < n_members; skip++) {
+    reassembly_queue q;
+    parity_decoder dec;
+    std::vector<rebuilt_block> got;
+    receive_all_but(skip, q, dec);
+
+    tt_int_op(dec.rebuild(parity, q, got), ==, member_count[skip]);
+    tt_uint_op(got.size(), ==, member_count[skip]);
+    for (size_t i = 0; i < got.size(); i++) {
+      uint32_t s = member_first[skip] + i;
+      size_t len = strlen(blocks[s].data);
+      tt_uint_op(got[i].seqno, ==, s);
+      tt_int_op(got[i].op, ==, blocks[s].op);
+      tt_uint_op(evbuffer_get_length(got[i].data), ==, len);
+      tt_mem_op(evbuffer_pullup(got[i].data, len), ==, blocks[s].data, len);
+      q.insert(got[i].seqno, got[i].op, got[i].data, 0);
+    }
+
+    // nothing more to rebuild, and the copies are gone
+    got.clear();
+    tt_int_op(dec.rebuild(parity, q, got), ==, 0);
+    tt_uint_op(got.size(), ==, 0);
+  }
+
+ end:
+  if (parity)
+    evbuffer_free(parity);
+}
+
+/* Parity makes up for one transmission, not two; an empty PAR block
+   has no members; and a short one is refused. */
+static void
+test_chop_blk_parity_limits(void *)
+{
+  reassembly_queue q;
+  parity_decoder dec;
+  std::vector<rebuilt_block> got;
+  evbuffer *parity = make_parity();
+  evbuffer *empty = evbuffer_new();
+  evbuffer *bad = evbuffer_new();
+  tt_assert(parity);
+
+  for (uint32_t s = member_first[2]; s < member_first[2] + member_count[2];
+       s++) {
+    evbuffer *data = block_data(s);
+    dec.keep(s, blocks[s].op, data);
+    q.insert(s, blocks[s].op, data, 0);
+  }
+  tt_int_op(dec.rebuild(parity, q, got), ==, 0);
+  tt_int_op(dec.rebuild(empty, q, got), ==, 0);
+
+  evbuffer_add(bad, "\x02\x00\x00\x00\x00\x01", 6);
+  tt_int_op(dec.rebuild(bad, q, got), ==, -1);
+  tt_uint_op(got.size(), ==, 0);
+
+ end:
+  if (parity)
+    evbuffer_free(parity);
+  evbuffer_free(empty);
+  evbuffer_free(bad);
+}
+
+/* Stream frames come back out as they went in, however the bytes
+   are split on the way, and an unknown frame type is refused. */
+static void
+test_chop_blk_stream_frames(void *)
+{
+  evbuffer *wire = evbuffer_new();
+  evbuffer *payload = evbuffer_new();
+  evbuffer *in = evbuffer_new();
+  stream_frame f;
+  uint8_t c[4];
+
+  evbuffer_add(payload, "GET / HTTP/1.1\r\n\r\n", 18);
+  tt_int_op(add_stream_frame(wire, 1, sf_DAT, payload, 18), ==, 0);
+  tt_uint_op(evbuffer_get_length(payload), ==, 0);
+  tt_int_op(add_stream_frame(wire, 0x01020304, sf_FIN, NULL, 0), ==, 0);
+  tt_int_op(add_stream_credit(wire, 7, 0x40000), ==, 0);
+  tt_uint_op(evbuffer_get_length(wire), ==, 3 * STREAM_HEADER_LEN + 18 + 4);
+
+  // the first frame, a byte at a time
+  for (size_t i = 0; i < STREAM_HEADER_LEN + 17; i++) {
+    evbuffer_remove_buffer(wire, in, 1);
+    tt_int_op(take_stream_frame(in, f), ==, 0);
+  }
+  evbuffer_remove_buffer(wire, in, 1);
+  tt_int_op(take_stream_frame(in, f), ==, 1);
+  tt_uint_op(f.stream, ==, 1);
+  tt_int_op(f.type, ==, sf_DAT);
+  tt_uint_op(f.len, ==, 18);
+  tt_mem_op(evbuffer_pullup(in, 18), ==, "GET / HTTP/1.1\r\n\r\n", 18);
+  evbuffer_drain(in, 18);
+
+  evbuffer_add_buffer(in, wire);
+  tt_int_op(take_stream_frame(in, f), ==, 1);
+  tt_uint_op(f.stream, ==, 0x01020304);
+  tt_int_op(f.type, ==, sf_FIN);
+  tt_uint_op(f.len, ==, 0);
+
+  tt_int_op(take_stream_frame(in, f), ==, 1);
+  tt_uint_op(f.stream, ==, 7);
+  tt_int_op(f.type, ==, sf_WND);
+  tt_uint_op(f.len, ==, 4);
+  evbuffer_remove(in, c, 4);
+  tt_mem_op(c, ==, "\x00\x04\x00\x00", 4);
+  tt_int_op(take_stream_frame(in, f), ==, 0);
+
+  evbuffer_add(in, "\x00\x00\x00\x01\x09\x00\x00", STREAM_HEADER_LEN);
+  tt_int_op(take_stream_frame(in, f), ==, -1);
+
+ end:
+  evbuffer_free(wire);
+  evbuffer_free(payload);
+  evbuffer_free(in);
+}
+
+static evbuffer *
+ack_through(uint32_t hsn)
+{
+  return ack_payload(hsn).serialize();
+}
+
+/* An ACK overtaken by a later one is ignored; one for blocks never
+   sent is refused. */
+static void
+test_chop_blk_stale_ack(void *)
+{
+  transmit_queue q(true);
+  for (size_t i = 0; i < 4; i++)
+    q.enqueue(op_DAT, block_data(1), 0);
+
+  tt_int_op(q.process_ack(ack_through(2)), ==, 0);
+  tt_int_op(q.process_ack(ack_through(0)), ==, 0);
+  tt_int_op(q.process_ack(ack_through(2)), ==, 0);
+  tt_int_op(q.process_ack(ack_through(3)), ==, 0);
+  tt_int_op(q.process_ack(ack_through(4)), ==, -1);
+
+ end:;
+}
+
+#define T(name) \
+  { #name, test_chop_blk_##name, 0, 0, 0 }
+
+struct testcase_t chop_blk_tests[] = {
+  T(parity_rebuild),
+  T(parity_limits),
+  T(stream_frames),
+  T(stale_ack),
+  END_OF_TESTCASES
+};
@@ -0,0 +1,286 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "payload_server.h"
+#include "file_steg.h"
+
+#include <event2/buffer.h>
+
+using std::string;
+
+/* Reaches the chunked encoding helpers of the file steg mods, which
+   are protected. */
+struct ChunkedCover : public FileStegMod
+{
+  using FileStegMod::chunk_response_header;
+  using FileStegMod::add_chunked_body;
+  using FileStegMod::parse_chunks;
+};
+
+static string
+chunked(const string& body, size_t first)
+{
+  struct evbuffer *buf = evbuffer_new();
+  string chunks;
+  if (ChunkedCover::add_chunked_body(buf, (const uint8_t *)body.data(),
+                                     body.size(), first) == 0) {
+    chunks.resize(evbuffer_get_length(buf));
+    evbuffer_remove(buf, &chunks[0], chunks.size());
+  }
+  evbuffer_free(buf);
+  return chunks;
+}
+
+static ssize_t
+parse(const string& chunks, string *body, bool *complete)
+{
+  uint8_t room[256];
+  size_t body_len = 0;
+  ssize_t parsed = ChunkedCover::parse_chunks((const uint8_t *)chunks.data(),
+                                              chunks.size(), room, sizeof room,
+                                              &body_len, complete);
+  body->assign((const char *)room, body_len);
+  return parsed;
+}
+
+static void
+test_chunked_round_trip(void *)
+{
+  const size_t body_len = 2 * FileStegMod::c_RESPONSE_CHUNK_SIZE + 1000;
+  uint8_t *body = new uint8_t[body_len];
+  uint8_t *parsed = new uint8_t[body_len];
+  struct evbuffer *buf = evbuffer_new();
+  size_t parsed_len = 0;
+  bool complete;
+  size_t len;
+  const uint8_t *chunks;
+
+  for (size_t i = 0; i < body_len; i++)
+    body[i] = i * 7;
+
+  //the first chunk carries the first bytes, the others are of the
+  //usual size
+  tt_int_op(ChunkedCover::add_chunked_body(buf, body, body_len, 100), ==, 0);
+  len = evbuffer_get_length(buf);
+  chunks = evbuffer_pullup(buf, len);
+  tt_mem_op(chunks, ==, "64\r\n", 4);
+  tt_mem_op(chunks + 4 + 100, ==, "\r\n4000\r\n", 8);
+  tt_mem_op(chunks + len - 5, ==, "0\r\n\r\n", 5);
+
+  tt_int_op(ChunkedCover::parse_chunks(chunks, len, parsed, body_len,
+                                       &parsed_len, &complete), ==, len);
+  tt_assert(complete);
+  tt_uint_op(parsed_len, ==, body_len);
+  tt_mem_op(parsed, ==, body, body_len);
+
+  //without a first chunk, and with the data only counted
+  evbuffer_drain(buf, len);
+  tt_int_op(ChunkedCover::add_chunked_body(buf, body, body_len, 0), ==, 0);
+  len = evbuffer_get_length(buf);
+  chunks = evbuffer_pullup(buf, len);
+  tt_mem_op(chunks, ==, "4000\r\n", 6);
+  parsed_len = 0;
+  tt_int_op(ChunkedCover::parse_chunks(chunks, len, NULL, 0,
+                                       &parsed_len, &complete), ==, len);
+  tt_assert(complete);
+  tt_uint_op(parsed_len, ==, body_len);
+
+  //an empty body is the last chunk alone
+  tt_assert(chunked("", 0) == "0\r\n\r\n");
+
+ end:
+  evbuffer_free(buf);
+  delete [] body;
+  delete [] parsed;
+}
+
+static void
+test_chunked_partial(void *)
+{
+  const string chunks = chunked("hello world", 5);
+  string body;
+  bool complete;
+
+  tt_str_op(chunks.c_str(), ==, "5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n");
+
+  //fed byte by byte, only whole chunks are taken
+  for (size_t n = 0; n < chunks.size(); n++) {
+    ssize_t parsed = parse(chunks.substr(0, n), &body, &complete);
+    tt_assert(!complete);
+    if (n < 10) {
+      tt_int_op(parsed, ==, 0);
+      tt_str_op(body.c_str(), ==, "");
+    } else if (n < 21) {
+      tt_int_op(parsed, ==, 10);
+      tt_str_op(body.c_str(), ==, "hello");
+    } else {
+      tt_int_op(parsed, ==, 21);
+      tt_str_op(body.c_str(), ==, "hello world");
+    }
+  }
+
+  tt_int_op(parse(chunks, &body, &complete), ==, chunks.size());
+  tt_assert(complete);
+  tt_str_op(body.c_str(), ==, "hello world");
+
+ end:;
+}
+
+static void
+test_chunked_bad_sizes(void *)
+{
+  const char *const bad[] = {
+    "zz\r\n",
+    "5x\r\nhello\r\n0\r\n\r\n",
+    " 5\r\nhello\r\n0\r\n\r\n",
+    "\r\n",
+    "-5\r\nhello\r\n0\r\n\r\n",
+    "3\r\nhello\r\n0\r\n\r\n",   // data longer than the size
+    "5\r\nhel\r\n0\r\n\r\n",       // and shorter
+    "5\r\nhello\r\nq\r\n",       // a bad size after a good chunk
+  };
+  string body;
+  bool complete;
+
+  for (size_t i = 0; i < ALEN(bad); i++) {
+    tt_int_op(parse(bad[i], &body, &complete), ==, -1);
+    tt_assert(!complete);
+  }
+
+ end:;
+}
+
+static void
+test_chunked_trailer(void *)
+{
+  const string chunks = "3;name=value\r\nabc\r\n0\r\nX-Trailer: y\r\n\r\n";
+  string body;
+  bool complete;
+
+  //the trailer is waited for up to its empty line
+  tt_int_op(parse(chunks.substr(0, chunks.size() - 2), &body, &complete),
+            ==, 19);
+  tt_assert(!complete);
+  tt_str_op(body.c_str(), ==, "abc");
+
+  tt_int_op(parse(chunks + "HTTP/1.1", &body, &complete), ==, chunks.size());
+  tt_assert(complete);
+  tt_str_op(body.c_str(), ==, "abc");
+
+ end:;
+}
+
+static void
+test_chunked_oversize(void *)
+{
+  char size_line[32];
+  string body;
+  bool complete;
+  size_t body_len = 0;
+
+  //larger than any cover, even when only counted
+  snprintf(size_line, sizeof size_line, "%lx\r\n",
+           (unsigned long)FileStegMod::c_HTTP_PAYLOAD_BUF_SIZE + 1);
+  tt_int_op(ChunkedCover::parse_chunks((const uint8_t *)size_line,
+                                       strlen(size_line), NULL, 0,
+                                       &body_len, &complete), ==, -1);
+  tt_int_op(parse("ffffffffffffffffffffffff\r\n", &body, &complete), ==, -1);
+
+  //larger than the room left in the body
+  tt_int_op(parse(chunked(string(300, 'a'), 100), &body, &complete), ==, -1);
+  tt_int_op(parse(chunked(string(256, 'a'), 100), &body, &complete), >, 0);
+  tt_assert(complete);
+
+ end:;
+}
+
+static void
+test_chunked_header(void *)
+{
+  const string with_length =
+    "HTTP/1.1 200 OK\r\nContent-Type: image/png\r\n"
+    "Content-Length: 1234\r\nServer: x\r\n\r\n";
+  const string length_last =
+    "HTTP/1.1 200 OK\r\nContent-Length: 1234\r\n\r\n";
+  const string without_length =
+    "HTTP/1.1 200 OK\r\nContent-Type: image/png\r\n\r\n";
+  const string already_chunked =
+    "HTTP/1.1 200 OK\r\nContent-Length: 1234\r\n"
+    "Transfer-Encoding: chunked\r\n\r\n";
+  uint8_t new_header[MAX_RESP_HDR_SIZE];
+  size_t len;
+  string rewritten;
+
+  len = ChunkedCover::chunk_response_header((const uint8_t *)with_length.data(),
+                                            with_length.size(), new_header);
+  rewritten.assign((char *)new_header, len);
+  tt_str_op(rewritten.c_str(), ==,
+            "HTTP/1.1 200 OK\r\nContent-Type: image/png\r\n"
+            "Server: x\r\nTransfer-Encoding: chunked\r\n\r\n");
+
+  len = ChunkedCover::chunk_response_header((const uint8_t *)length_last.data(),
+                                            length_last.size(), new_header);
+  rewritten.assign((char *)new_header, len);
+  tt_str_op(rewritten.c_str(), ==,
+            "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n");
+
+  tt_uint_op(ChunkedCover::chunk_response_header(
+               (const uint8_t *)without_length.data(), without_length.size(),
+               new_header), ==, 0);
+  tt_uint_op(ChunkedCover::chunk_response_header(
+               (const uint8_t *)already_chunked.data(), already_chunked.size(),
+               new_header), ==, 0);
+
+ end:;
+}
+
+static void
+test_chunked_skip_cover_rest(void *)
+{
+  struct evbuffer *source = evbuffer_new();
+  bool done = true;
+
+  tt_int_op(FileStegMod::skip_cover_rest(source, &done), ==, RECV_INCOMPLETE);
+  tt_assert(!done);
+
+  //a chunk is drained once it is whole
+  evbuffer_add_printf(source, "5\r\nhel");
+  tt_int_op(FileStegMod::skip_cover_rest(source, &done), ==, RECV_INCOMPLETE);
+  tt_assert(!done);
+  tt_uint_op(evbuffer_get_length(source), ==, 6);
+
+  evbuffer_add_printf(source, "lo\r\n3\r");
+  tt_int_op(FileStegMod::skip_cover_rest(source, &done), ==, RECV_INCOMPLETE);
+  tt_assert(!done);
+  tt_uint_op(evbuffer_get_length(source), ==, 2);
+
+  //the next response is left alone
+  evbuffer_add_printf(source, "\nabc\r\n0\r\n\r\nHTTP/1.1");
+  tt_int_op(FileStegMod::skip_cover_rest(source, &done), ==, RECV_INCOMPLETE);
+  tt_assert(done);
+  tt_uint_op(evbuffer_get_length(source), ==, 8);
+
+  evbuffer_drain(source, 8);
+  evbuffer_add_printf(source, "5\r\nhello\r\nq\r\n");
+  tt_int_op(FileStegMod::skip_cover_rest(source, &done), ==, RECV_BAD);
+
+ end:
+  evbuffer_free(source);
+}
+
+#define T(name) \
+  { #name, test_chunked_##name, 0, 0, 0 }
+
+struct testcase_t chunked_tests[] = {
+  T(round_trip),
+  T(partial),
+  T(bad_sizes),
+  T(trailer),
+  T(oversize),
+  T(header),
+  T(skip_cover_rest),
+  END_OF_TESTCASES
+};
@@ -7,6 +7,8 @@
 
 #include "compression.h"
 
+#include <event2/buffer.h>
+
 // Smoke tests for zlib.
 // Compressed strings generated with Python's 'zlib' and 'gzip'
 // modules, which wrap zlib, so they only constitute a round-trip
@@ -425,6 +427,113 @@ test_decompress_gzip(void *)
  end:;
 }
 
+static void
+test_decompressed_size(void *)
+{
+  for (const zlib_testvec *t = testvecs; t->text; t++) {
+    tt_int_op(decompressed_size(t->gzipped, t->glen), ==, t->tlen);
+    tt_int_op(decompressed_size(t->zlibbed, t->zlen), ==, -1);
+  }
+
+ end:;
+}
+
+static void
+test_decompress_evbuffer(void *)
+{
+  struct evbuffer *buf = evbuffer_new();
+  for (const zlib_testvec *t = testvecs; t->text; t++) {
+    ssize_t n = inflate_context::for_thread().decompress(t->gzipped, t->glen,
+                                                         buf);
+    tt_int_op(n, ==, t->tlen);
+    tt_uint_op(evbuffer_get_length(buf), ==, t->tlen);
+    tt_mem_op(evbuffer_pullup(buf, -1), ==, t->text, t->tlen);
+    evbuffer_drain(buf, t->tlen);
+
+    n = deflate_context::for_thread(c_format_zlib).compress(t->text, t->tlen,
+                                                            buf);
+    tt_int_op(n, ==, t->zlen);
+    tt_mem_op(evbuffer_pullup(buf, -1), ==, t->zlibbed, t->zlen);
+    evbuffer_drain(buf, t->zlen);
+  }
+
+ end:
+  evbuffer_free(buf);
+}
+
+/* Every test vector through one stream, each message recoverable as
+   soon as it is sent, even when the compressed bytes arrive split at
+   arbitrary points. */
+static void
+test_stream_roundtrip(void *)
+{
+  stream_deflater def;
+  stream_inflater inf;
+  struct evbuffer *src = evbuffer_new();
+  struct evbuffer *wire = evbuffer_new();
+  struct evbuffer *piece = evbuffer_new();
+  struct evbuffer *out = evbuffer_new();
+
+  for (const zlib_testvec *t = testvecs; t->text; t++) {
+    evbuffer_add(src, t->text, t->tlen);
+    ssize_t n = def.compress(src, t->tlen, wire);
+    tt_int_op(n, >=, 0);
+    tt_uint_op(evbuffer_get_length(src), ==, 0);
+
+    // deliver in pieces of 1, 2, 3, ... bytes
+    for (size_t cut = 1; evbuffer_get_length(wire) > 0; cut++) {
+      evbuffer_remove_buffer(wire, piece, cut);
+      tt_int_op(inf.decompress(piece, out), >=, 0);
+      tt_uint_op(evbuffer_get_length(piece), ==, 0);
+    }
+    tt_uint_op(evbuffer_get_length(out), ==, t->tlen);
+    tt_mem_op(evbuffer_pullup(out, -1), ==, t->text, t->tlen);
+    evbuffer_drain(out, t->tlen);
+  }
+
+ end:
+  evbuffer_free(src);
+  evbuffer_free(wire);
+  evbuffer_free(piece);
+  evbuffer_free(out);
+}
+
+/* A stream spliced from precompressed segments must decompress to
+   prefix + middle + suffix in either format. */
+static void
+test_compress_precompressed(void *)
+{
+  static const compression_format fmts[] = { c_format_zlib, c_format_gzip };
+  const zlib_testvec *prefix = &testvecs[1];
+  uint8_t obuf[4096];
+  uint8_t ibuf[4096];
+  uint8_t expected[4096];
+
+  for (size_t f = 0; f < sizeof fmts / sizeof fmts[0]; f++) {
+    deflate_context &ctx = deflate_context::for_thread(fmts[f]);
+    for (const zlib_testvec *t = testvecs; t->text; t++) {
+      const zlib_testvec *suffix = t;
+      deflate_segment pre, suf;
+      tt_assert(ctx.precompress(prefix->text, prefix->tlen, pre, false));
+      tt_assert(ctx.precompress(suffix->text, suffix->tlen, suf, true));
+
+      ssize_t n = ctx.compress(pre, t->text, t->tlen, suf, obuf, sizeof obuf);
+      tt_int_op(n, >, 0);
+
+      size_t elen = 0;
+      memcpy(expected, prefix->text, prefix->tlen); elen += prefix->tlen;
+      memcpy(expected + elen, t->text, t->tlen); elen += t->tlen;
+      memcpy(expected + elen, suffix->text, suffix->tlen); elen += suffix->tlen;
+
+      ssize_t m = decompress(obuf, n, ibuf, sizeof ibuf);
+      tt_int_op(m, ==, elen);
+      tt_mem_op(ibuf, ==, expected, elen);
+    }
+  }
+
+ end:;
+}
+
 #define T(name) \
   { #name, test_##name, 0, 0, 0 }
 
@@ -433,5 +542,9 @@ struct testcase_t zlib_tests[] = {
   T(decompress_zlib),
   T(compress_gzip),
   T(decompress_gzip),
+  T(decompressed_size),
+  T(decompress_evbuffer),
+  T(compress_precompressed),
+  T(stream_roundtrip),
   END_OF_TESTCASES
 };
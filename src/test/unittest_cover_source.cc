@@ -0,0 +1,140 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "steg/cover_source.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+using std::string;
+
+static string
+write_file(const string& path, const string& contents)
+{
+  FILE *f = fopen(path.c_str(), "wb");
+  if (!f)
+    return string();
+  fwrite(contents.data(), 1, contents.size(), f);
+  fclose(f);
+  return path;
+}
+
+/* Stands in for the cover server behind a local source. */
+class EchoCoverSource : public CoverSource
+{
+ public:
+  virtual string fetch(const string& cover) { return "echo " + cover; }
+};
+
+/* A cover read off the disk looks like what apache would have sent,
+   and names outside the doc root or of missing files get nothing. */
+static void
+test_cover_source_local(void *)
+{
+  char dir[] = "/tmp/st_covers_XXXXXX";
+  string root, js, conf;
+  string response;
+  LocalCoverSource *local = NULL;
+  const string body = "var cover = 1;\n";
+
+  tt_assert(mkdtemp(dir));
+  root = string(dir) + "/";
+  js = write_file(root + "cover.js", body);
+  conf = write_file(root + "httpd.conf",
+                    "# DocumentRoot \"/nowhere\"\n"
+                    "ServerName localhost\n"
+                    "DocumentRoot \"" + string(dir) + "\"\n");
+  tt_assert(!js.empty() && !conf.empty());
+
+  response = CoverSource::apache_doc_root(conf);
+  tt_str_op(response.c_str(), ==, root.c_str());
+
+  local = new LocalCoverSource(root, NULL);
+  response = local->fetch("cover.js");
+  tt_assert(response.compare(0, 17, "HTTP/1.1 200 OK\r\n") == 0);
+  tt_assert(response.find("\r\nContent-Type: application/javascript\r\n")
+            != string::npos);
+  tt_assert(response.find("\r\nContent-Length: 15\r\n") != string::npos);
+  tt_uint_op(response.find("\r\n\r\n") + 4, ==, response.size() - body.size());
+  tt_assert(response.compare(response.size() - body.size(), body.size(),
+                             body) == 0);
+
+  tt_uint_op(local->fetch("missing.js").size(), ==, 0);
+  tt_uint_op(local->fetch("../cover.js").size(), ==, 0);
+  tt_uint_op(local->fetch("http://example.com/cover.js").size(), ==, 0);
+  tt_uint_op(local->fetch("").size(), ==, 0);
+
+  //what is not on the disk is asked of the cover server
+  delete local;
+  local = new LocalCoverSource(root, new EchoCoverSource);
+  response = local->fetch("missing.js");
+  tt_str_op(response.c_str(), ==, "echo missing.js");
+  response = local->fetch("/");
+  tt_str_op(response.c_str(), ==, "echo /");
+  response = local->fetch("http://example.com/cover.js");
+  tt_str_op(response.c_str(), ==, "echo http://example.com/cover.js");
+  tt_uint_op(local->fetch("../cover.js").size(), ==, 0);
+  tt_assert(local->fetch("cover.js").compare(0, 17, "HTTP/1.1 200 OK\r\n") == 0);
+
+ end:
+  delete local;
+  if (!js.empty())
+    unlink(js.c_str());
+  if (!conf.empty())
+    unlink(conf.c_str());
+  rmdir(dir);
+}
+
+static void
+test_cover_source_origin_list(void *)
+{
+  std::vector<CoverOriginPool::OriginSpec> origins;
+
+  tt_assert(CoverOriginPool::parse_origin_list(
+              "10.0.0.1,10.0.0.2:8080*3,cover.example.com*1", origins));
+  tt_uint_op(origins.size(), ==, 3);
+  tt_str_op(origins[0].host.c_str(), ==, "10.0.0.1");
+  tt_uint_op(origins[0].weight, ==, 1);
+  tt_str_op(origins[1].host.c_str(), ==, "10.0.0.2:8080");
+  tt_uint_op(origins[1].weight, ==, 3);
+  tt_str_op(origins[2].host.c_str(), ==, "cover.example.com");
+
+  tt_assert(!CoverOriginPool::parse_origin_list("", origins));
+  tt_assert(!CoverOriginPool::parse_origin_list("10.0.0.1,,10.0.0.2", origins));
+  tt_assert(!CoverOriginPool::parse_origin_list("10.0.0.1*0", origins));
+  tt_assert(!CoverOriginPool::parse_origin_list("10.0.0.1*x", origins));
+  tt_assert(!CoverOriginPool::parse_origin_list("http://10.0.0.1/", origins));
+
+ end:;
+}
+
+/* Only an origin which cannot be reached or answers with a server
+   error is taken for down at once. */
+static void
+test_cover_source_server_failure(void *)
+{
+  tt_assert(!HTTPCoverSource::server_failure(CURLE_OK, 200));
+  tt_assert(!HTTPCoverSource::server_failure(CURLE_OK, 404));
+  tt_assert(HTTPCoverSource::server_failure(CURLE_OK, 503));
+  tt_assert(HTTPCoverSource::server_failure(CURLE_COULDNT_CONNECT, 0));
+  tt_assert(HTTPCoverSource::server_failure(CURLE_COULDNT_RESOLVE_HOST, 0));
+  tt_assert(HTTPCoverSource::server_failure(CURLE_OPERATION_TIMEDOUT, 0));
+  tt_assert(!HTTPCoverSource::server_failure(CURLE_GOT_NOTHING, 0));
+  tt_assert(!HTTPCoverSource::server_failure(CURLE_RECV_ERROR, 0));
+
+ end:;
+}
+
+#define T(name) \
+  { #name, test_cover_source_##name, 0, 0, 0 }
+
+struct testcase_t cover_source_tests[] = {
+  T(local),
+  T(origin_list),
+  T(server_failure),
+  END_OF_TESTCASES
+};
@@ -0,0 +1,227 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "steg/h2_session.h"
+
+#include <event2/buffer.h>
+
+using std::string;
+
+static h2_header_list
+request_headers(const char *path, const char *cookie)
+{
+  h2_header_list h;
+  h.push_back(h2_header(":method", "GET"));
+  h.push_back(h2_header(":scheme", "http"));
+  h.push_back(h2_header(":authority", "www.example.com"));
+  h.push_back(h2_header(":path", path));
+  h.push_back(h2_header("user-agent", "Mozilla/5.0 (X11; Linux x86_64)"));
+  h.push_back(h2_header("cookie", cookie));
+  return h;
+}
+
+static void
+add_frame(evbuffer *buf, uint8_t type, uint8_t flags, uint32_t stream,
+          const void *payload, size_t len)
+{
+  uint8_t h[9] = { (uint8_t)(len >> 16), (uint8_t)(len >> 8), (uint8_t)len,
+                   type, flags, (uint8_t)(stream >> 24), (uint8_t)(stream >> 16),
+                   (uint8_t)(stream >> 8), (uint8_t)stream };
+  evbuffer_add(buf, h, 9);
+  evbuffer_add(buf, payload, len);
+}
+
+/* Whatever is repeated from one header block to the next shrinks to
+   an index, and the decoder keeps up with the encoder. */
+static void
+test_h2_session_hpack(void *)
+{
+  HpackEncoder enc;
+  HpackDecoder dec;
+  h2_header_list first = request_headers("/a.jpg", "x=1");
+  h2_header_list second = request_headers("/b/c.pdf", "y=22");
+  h2_header_list got;
+  string block1, block2;
+
+  enc.encode(first, block1);
+  enc.encode(second, block2);
+  tt_uint_op(block2.size(), <, block1.size());
+  // the unchanged user-agent and authority are a byte each now
+  tt_uint_op(block2.size(), <, 2 + 4 + 2 + 10 + 2 + 6);
+
+  tt_int_op(dec.decode((const uint8_t *)block1.data(), block1.size(), got), ==, 0);
+  tt_assert(got == first);
+  got.clear();
+  tt_int_op(dec.decode((const uint8_t *)block2.data(), block2.size(), got), ==, 0);
+  tt_assert(got == second);
+
+  // cut short, and Huffman coded
+  got.clear();
+  tt_int_op(dec.decode((const uint8_t *)block1.data(), block1.size() - 1, got), ==, -1);
+  tt_int_op(dec.decode((const uint8_t *)"\x40\x81\x00\x01x", 5, got), ==, -1);
+
+ end:;
+}
+
+/* A client and a server session carry several streams at once over
+   one connection, each response body larger than the default
+   windows. */
+static void
+test_h2_session_streams(void *)
+{
+  H2Session client(true), server(false);
+  evbuffer *c2s = evbuffer_new();
+  evbuffer *s2c = evbuffer_new();
+  string body[3];
+  const char *paths[3] = { "/1.jpg", "/2.pdf", "/3.gif" };
+
+  for (int i = 0; i < 3; i++) {
+    tt_uint_op(client.send_request(request_headers(paths[i], "k=v"), c2s), ==,
+               2 * i + 1);
+    body[i].assign(150000 + i, 'a' + i);
+  }
+  tt_uint_op(client.open_streams(), ==, 3);
+
+  tt_int_op(server.receive(c2s, s2c), ==, 0);
+  tt_uint_op(server.received.size(), ==, 3);
+  for (int i = 0; i < 3; i++) {
+    H2Message &m = server.received[i];
+    tt_uint_op(m.stream, ==, 2 * i + 1);
+    tt_assert(m.headers == request_headers(paths[i], "k=v"));
+    tt_uint_op(m.body.size(), ==, 0);
+  }
+
+  for (int i = 0; i < 3; i++) {
+    h2_header_list h;
+    h.push_back(h2_header(":status", "200"));
+    h.push_back(h2_header("content-type", "image/jpeg"));
+    tt_int_op(server.send_response(2 * i + 1, h, (const uint8_t *)body[i].data(),
+                                   body[i].size(), s2c), ==, 0);
+  }
+
+  // back and forth till the windows have let everything through
+  for (int round = 0; round < 10 && client.received.size() < 3; round++) {
+    tt_int_op(client.receive(s2c, c2s), ==, 0);
+    tt_int_op(server.receive(c2s, s2c), ==, 0);
+  }
+
+  tt_uint_op(client.received.size(), ==, 3);
+  for (int i = 0; i < 3; i++) {
+    H2Message &m = client.received[i];
+    tt_uint_op(m.stream, ==, 2 * i + 1);
+    tt_str_op(m.headers[0].second.c_str(), ==, "200");
+    tt_assert(m.body == body[i]);
+  }
+  tt_uint_op(client.open_streams(), ==, 0);
+  tt_uint_op(server.open_streams(), ==, 0);
+  tt_uint_op(server.blocked_bytes(), ==, 0);
+
+ end:
+  evbuffer_free(c2s);
+  evbuffer_free(s2c);
+}
+
+/* A response waits for the peer's window updates, and a connection
+   which does not start with the preface is refused. */
+static void
+test_h2_session_flow_control(void *)
+{
+  H2Session server(false), stranger(false);
+  evbuffer *in = evbuffer_new();
+  evbuffer *out = evbuffer_new();
+  HpackEncoder enc;
+  string block;
+  string body(100000, 'b');
+  h2_header_list status;
+  status.push_back(h2_header(":status", "200"));
+
+  // a client with default windows
+  evbuffer_add(in, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", 24);
+  add_frame(in, 4, 0, 0, "", 0);
+  enc.encode(request_headers("/a.jpg", "k=v"), block);
+  add_frame(in, 1, 0x5, 1, block.data(), block.size());
+  tt_int_op(server.receive(in, out), ==, 0);
+  tt_uint_op(server.received.size(), ==, 1);
+
+  tt_int_op(server.send_response(1, status, (const uint8_t *)body.data(),
+                                 body.size(), out), ==, 0);
+  tt_uint_op(server.blocked_bytes(), ==, body.size() - 65535);
+
+  add_frame(in, 8, 0, 0, "\x00\x00\x20\x00", 4);
+  tt_int_op(server.receive(in, out), ==, 0);
+  tt_uint_op(server.blocked_bytes(), ==, body.size() - 65535); //the stream's is full
+
+  add_frame(in, 8, 0, 1, "\x00\x01\x00\x00", 4);
+  tt_int_op(server.receive(in, out), ==, 0);
+  tt_uint_op(server.blocked_bytes(), ==, body.size() - 65535 - 0x2000);
+
+  add_frame(in, 8, 0, 0, "\x00\x01\x00\x00", 4);
+  tt_int_op(server.receive(in, out), ==, 0);
+  tt_uint_op(server.blocked_bytes(), ==, 0);
+  tt_uint_op(server.open_streams(), ==, 0);
+
+  evbuffer_drain(in, evbuffer_get_length(in));
+  evbuffer_add(in, "GET / HTTP/1.1\r\n", 16);
+  tt_int_op(stranger.receive(in, out), ==, -1);
+  tt_assert(stranger.going_away());
+
+ end:
+  evbuffer_free(in);
+  evbuffer_free(out);
+}
+
+/* A stream's window is never replenished, so that a body cannot grow
+   past the largest cover; a peer sending more is told off with a
+   FLOW_CONTROL_ERROR. */
+static void
+test_h2_session_stream_overrun(void *)
+{
+  H2Session server(false);
+  evbuffer *in = evbuffer_new();
+  evbuffer *out = evbuffer_new();
+  HpackEncoder enc;
+  string block;
+  string chunk(16384, 'c');
+  size_t sent = 0;
+  const uint8_t *goaway;
+
+  evbuffer_add(in, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", 24);
+  add_frame(in, 4, 0, 0, "", 0);
+  enc.encode(request_headers("/upload", "k=v"), block);
+  add_frame(in, 1, 0x4, 1, block.data(), block.size());
+  tt_int_op(server.receive(in, out), ==, 0);
+
+  for (; sent + chunk.size() <= H2Session::c_STREAM_RECV_WINDOW; sent += chunk.size())
+    add_frame(in, 0, 0, 1, chunk.data(), chunk.size());
+  tt_int_op(server.receive(in, out), ==, 0);
+  tt_assert(!server.going_away());
+  evbuffer_drain(out, evbuffer_get_length(out));
+
+  add_frame(in, 0, 0, 1, chunk.data(), chunk.size());
+  tt_int_op(server.receive(in, out), ==, -1);
+  tt_assert(server.going_away());
+  tt_uint_op(server.received.size(), ==, 0);
+
+  tt_uint_op(evbuffer_get_length(out), ==, 9 + 8);
+  goaway = evbuffer_pullup(out, 17);
+  tt_int_op(goaway[3], ==, 7);
+  tt_mem_op(goaway + 9, ==, "\x00\x00\x00\x01\x00\x00\x00\x03", 8);
+
+ end:
+  evbuffer_free(in);
+  evbuffer_free(out);
+}
+
+#define T(name) \
+  { #name, test_h2_session_##name, 0, 0, 0 }
+
+struct testcase_t h2_session_tests[] = {
+  T(hpack),
+  T(streams),
+  T(flow_control),
+  T(stream_overrun),
+  END_OF_TESTCASES
+};
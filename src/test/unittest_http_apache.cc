@@ -0,0 +1,157 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "protocol.h"
+#include "steg.h"
+#include "compression.h"
+
+#include <event2/buffer.h>
+
+#include <limits.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using std::string;
+using std::vector;
+
+/* same values as op_apache_steg_code in http_apache.cc */
+enum { op_DICT_MAC = 1, op_DICT_UP2DATE = 2, op_DICT_UPDATE = 3 };
+
+/* The server confirms the client's empty dict and pushes the first
+   chunk of its new one in the same block: the client has to take both
+   and answer the chunk. */
+static void
+test_http_apache_dict_sync(void *)
+{
+  char dir[] = "/tmp/st_apache_XXXXXX";
+  char cwd[PATH_MAX];
+  const char *const options[] =
+    { "chop", "client", "127.0.0.1:0", "http_apache", "127.0.0.1:5010" };
+  config_t *cfg = NULL;
+  steg_config_t *apache = NULL;
+  const string urls = "/index.html\n/cover.js\n/logo.png\n";
+  uint8_t compressed[256];
+  ssize_t compressed_len;
+  uint32_t byte_cut = htonl(0);
+  uint32_t dict_size;
+  uint32_t chunk_header[4];
+  char op;
+  bool moved = false;
+
+  tt_assert(getcwd(cwd, sizeof cwd));
+  tt_assert(mkdtemp(dir));
+  //the client keeps its dict in the working directory
+  tt_int_op(chdir(dir), ==, 0);
+  moved = true;
+  tt_int_op(mkdir("apache_payload", 0700), ==, 0);
+
+  cfg = config_create(ALEN(options), options);
+  tt_assert(cfg);
+  apache = steg_new("http_apache", cfg, vector<string>());
+  tt_assert(apache);
+
+  compressed_len = compress((const uint8_t *)urls.data(), urls.size(),
+                            compressed, sizeof compressed, c_format_zlib);
+  tt_int_op(compressed_len, >, 0);
+  chunk_header[0] = htonl(0);
+  chunk_header[1] = htonl(3);
+  chunk_header[2] = htonl(urls.size());
+  chunk_header[3] = htonl(compressed_len);
+
+  op = op_DICT_UP2DATE;
+  evbuffer_add(apache->protocol_data_in, &op, 1);
+  evbuffer_add(apache->protocol_data_in, &byte_cut, sizeof byte_cut);
+  op = op_DICT_UPDATE;
+  evbuffer_add(apache->protocol_data_in, &op, 1);
+  evbuffer_add(apache->protocol_data_in, chunk_header, sizeof chunk_header);
+  evbuffer_add(apache->protocol_data_in, compressed, compressed_len);
+
+  //the reply to the chunk is the mac of the 3 urls we now have
+  tt_uint_op(apache->process_protocol_data(), ==, 1 + 4 + 32);
+  tt_uint_op(evbuffer_get_length(apache->protocol_data_in), ==, 0);
+  tt_uint_op(evbuffer_get_length(apache->protocol_data_out), ==, 1 + 4 + 32);
+  evbuffer_remove(apache->protocol_data_out, &op, 1);
+  tt_int_op(op, ==, op_DICT_MAC);
+  evbuffer_remove(apache->protocol_data_out, &dict_size, sizeof dict_size);
+  tt_uint_op(ntohl(dict_size), ==, 3);
+  //the dict is only stored once the server confirms it
+  tt_int_op(access("apache_payload/client_list.txt", F_OK), ==, -1);
+
+  //an operation cut short waits for the rest
+  op = op_DICT_UP2DATE;
+  evbuffer_drain(apache->protocol_data_out, 32);
+  evbuffer_add(apache->protocol_data_in, &op, 1);
+  evbuffer_add(apache->protocol_data_in, &byte_cut, 2);
+  tt_uint_op(apache->process_protocol_data(), ==, 0);
+  tt_uint_op(evbuffer_get_length(apache->protocol_data_in), ==, 2);
+  evbuffer_add(apache->protocol_data_in, (uint8_t *)&byte_cut + 2, 2);
+  tt_uint_op(apache->process_protocol_data(), ==, 0);
+  tt_uint_op(evbuffer_get_length(apache->protocol_data_in), ==, 0);
+  tt_int_op(access("apache_payload/client_list.txt", F_OK), ==, 0);
+
+ end:
+  delete apache;
+  delete cfg;
+  if (moved) {
+    unlink((string(dir) + "/apache_payload/client_list.txt").c_str());
+    rmdir((string(dir) + "/apache_payload").c_str());
+    if (chdir(cwd))
+      log_warn("cannot go back to %s", cwd);
+    rmdir(dir);
+  }
+}
+
+/* A chunk bigger than any the server sends is not waited for: the
+   client drops what it has and asks for the dict again. */
+static void
+test_http_apache_oversize_chunk(void *)
+{
+  const char *const options[] =
+    { "chop", "client", "127.0.0.1:0", "http_apache", "127.0.0.1:5010" };
+  config_t *cfg = NULL;
+  steg_config_t *apache = NULL;
+  uint32_t chunk_header[4];
+  char op = op_DICT_UPDATE;
+
+  cfg = config_create(ALEN(options), options);
+  tt_assert(cfg);
+  apache = steg_new("http_apache", cfg, vector<string>());
+  tt_assert(apache);
+
+  chunk_header[0] = htonl(0);
+  chunk_header[1] = htonl(3);
+  chunk_header[2] = htonl(0xffffffff);
+  chunk_header[3] = htonl(16);
+  evbuffer_add(apache->protocol_data_in, &op, 1);
+  evbuffer_add(apache->protocol_data_in, chunk_header, sizeof chunk_header);
+  tt_uint_op(apache->process_protocol_data(), ==, 1 + 4 + 32);
+  tt_uint_op(evbuffer_get_length(apache->protocol_data_in), ==, 0);
+  evbuffer_remove(apache->protocol_data_out, &op, 1);
+  tt_int_op(op, ==, op_DICT_MAC);
+  evbuffer_drain(apache->protocol_data_out, 4 + 32);
+
+  op = op_DICT_UPDATE;
+  chunk_header[2] = htonl(100);
+  chunk_header[3] = htonl(0x7fffffff);
+  evbuffer_add(apache->protocol_data_in, &op, 1);
+  evbuffer_add(apache->protocol_data_in, chunk_header, sizeof chunk_header);
+  tt_uint_op(apache->process_protocol_data(), ==, 1 + 4 + 32);
+  tt_uint_op(evbuffer_get_length(apache->protocol_data_in), ==, 0);
+
+ end:
+  delete apache;
+  delete cfg;
+}
+
+#define T(name) \
+  { #name, test_http_apache_##name, 0, 0, 0 }
+
+struct testcase_t http_apache_tests[] = {
+  T(dict_sync),
+  T(oversize_chunk),
+  END_OF_TESTCASES
+};
@@ -0,0 +1,103 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "steg/shared_cover_cache.h"
+
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using std::string;
+
+static string
+test_segment_name()
+{
+  char name[64];
+  snprintf(name, sizeof name, "/stegotorus-unittest-%ld", (long)getpid());
+  return name;
+}
+
+/* What one process stores another one finds, and it survives the
+   first one detaching. */
+static void
+test_shared_cover_cache_share(void *)
+{
+  string name = test_segment_name();
+  SharedCoverCache *a = NULL, *b = NULL;
+  const string cover = "HTTP/1.1 200 OK\r\n\r\n%PDF";
+  string data;
+
+  shm_unlink(name.c_str());
+  a = SharedCoverCache::attach(name, 1 << 20);
+  tt_assert(a);
+  b = SharedCoverCache::attach(name, 4 << 20); // takes a's size
+  tt_assert(b);
+  tt_uint_op(b->budget(), ==, 1 << 20);
+
+  tt_assert(!b->lookup("docs/a.pdf", data));
+  tt_assert(a->insert("docs/a.pdf", cover));
+  tt_assert(b->lookup("docs/a.pdf", data));
+  tt_str_op(data.c_str(), ==, cover.c_str());
+  tt_assert(!b->lookup("docs/a.pd", data));
+
+  delete a;
+  a = NULL;
+  tt_assert(b->lookup("docs/a.pdf", data));
+
+  b->clear();
+  tt_assert(!b->lookup("docs/a.pdf", data));
+
+ end:
+  delete a;
+  delete b;
+  shm_unlink(name.c_str());
+}
+
+/* The arena is a byte budget: filling it evicts the oldest covers,
+   and a cover too big for it is refused. */
+static void
+test_shared_cover_cache_eviction(void *)
+{
+  string name = test_segment_name();
+  SharedCoverCache *c = NULL;
+  string data;
+  char key[32];
+  const size_t cover_len = 100000;
+  const int n = 30; // about 3MB through a 1MB cache
+  const char last = 'a' + (n - 1) % 26;
+
+  shm_unlink(name.c_str());
+  c = SharedCoverCache::attach(name, 1 << 20);
+  tt_assert(c);
+
+  for (int i = 0; i < n; i++) {
+    string data_i(cover_len, 'a' + i % 26);
+    snprintf(key, sizeof key, "cover%d.jpg", i);
+    tt_assert(c->insert(key, data_i));
+  }
+
+  tt_assert(!c->lookup("cover0.jpg", data));
+  snprintf(key, sizeof key, "cover%d.jpg", n - 1);
+  tt_assert(c->lookup(key, data));
+  tt_uint_op(data.size(), ==, cover_len);
+  tt_int_op(data[0], ==, last);
+
+  tt_assert(!c->insert("huge.pdf", string(c->budget() / 2, 'x')));
+  tt_assert(!c->lookup("huge.pdf", data));
+
+ end:
+  delete c;
+  shm_unlink(name.c_str());
+}
+
+#define T(name) \
+  { #name, test_shared_cover_cache_##name, 0, 0, 0 }
+
+struct testcase_t shared_cover_cache_tests[] = {
+  T(share),
+  T(eviction),
+  END_OF_TESTCASES
+};
@@ -0,0 +1,120 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "timer_wheel.h"
+
+#include <time.h>
+#include <event2/event.h>
+
+static unsigned long long
+now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+struct probe
+{
+  wheel_timer timer;
+  unsigned long long due;
+  int fired;
+  int early;
+  int rearm;
+  struct event_base *base;
+};
+
+static void
+probe_cb(wheel_timer *, void *arg)
+{
+  probe *p = (probe *)arg;
+  if (now_ms() < p->due)
+    p->early++;
+  p->fired++;
+  if (p->rearm > 0) {
+    p->rearm--;
+    p->due = now_ms() + 3;
+    p->timer.arm(p->base, 3);
+  }
+}
+
+static void
+probe_init(probe *p, struct event_base *base, unsigned long ms)
+{
+  p->fired = p->early = p->rearm = 0;
+  p->base = base;
+  p->due = now_ms() + ms;
+  p->timer.set(probe_cb, p);
+  p->timer.arm(base, ms);
+}
+
+/* Timers on every level fire, in order, and no sooner than asked. */
+static void
+test_timer_wheel_expiry(void *)
+{
+  struct event_base *base = event_base_new();
+  static const unsigned long delays[] = { 0, 1, 7, 255, 256, 300, 1100 };
+  const size_t n = sizeof delays / sizeof delays[0];
+  probe p[n];
+
+  for (size_t i = 0; i < n; i++)
+    probe_init(&p[i], base, delays[i]);
+  tt_assert(p[n-1].timer.pending());
+
+  event_base_dispatch(base);
+
+  for (size_t i = 0; i < n; i++) {
+    tt_int_op(p[i].fired, ==, 1);
+    tt_int_op(p[i].early, ==, 0);
+    tt_assert(!p[i].timer.pending());
+  }
+
+ end:
+  timer_wheel_free(base);
+  event_base_free(base);
+}
+
+/* Disarming, re-arming, and re-arming from a callback. */
+static void
+test_timer_wheel_rearm(void *)
+{
+  struct event_base *base = event_base_new();
+  probe a, b, c;
+
+  probe_init(&a, base, 5);
+  probe_init(&b, base, 5);
+  probe_init(&c, base, 2000);
+
+  b.timer.disarm();
+  tt_assert(!b.timer.pending());
+  b.timer.disarm(); // harmless when not pending
+
+  // pulling a long timer in moves it down the wheel
+  c.due = now_ms() + 10;
+  c.timer.arm(base, 10);
+  a.rearm = 3;
+
+  event_base_dispatch(base);
+
+  tt_int_op(a.fired, ==, 4);
+  tt_int_op(a.early, ==, 0);
+  tt_int_op(b.fired, ==, 0);
+  tt_int_op(c.fired, ==, 1);
+  tt_int_op(c.early, ==, 0);
+
+ end:
+  timer_wheel_free(base);
+  event_base_free(base);
+}
+
+#define T(name) \
+  { #name, test_timer_wheel_##name, 0, 0, 0 }
+
+struct testcase_t timer_wheel_tests[] = {
+  T(expiry),
+  T(rearm),
+  END_OF_TESTCASES
+};
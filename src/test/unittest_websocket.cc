@@ -0,0 +1,138 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "steg/websocket_frame.h"
+
+#include <event2/buffer.h>
+
+using std::string;
+
+/* Frames of every length encoding come back whole, masked or not. */
+static void
+test_websocket_frames(void *)
+{
+  evbuffer *wire = evbuffer_new();
+  evbuffer *payload = evbuffer_new();
+  size_t lens[4] = { 0, 125, 300, 70000 };
+  string data(70000, 0);
+  ws_frame f;
+
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = (char)(i * 7);
+
+  for (int masked = 0; masked < 2; masked++)
+    for (int i = 0; i < 4; i++) {
+      tt_int_op(add_ws_frame(wire, ws_BINARY, true, (const uint8_t *)data.data(),
+                             lens[i], masked), ==, 0);
+      tt_uint_op(evbuffer_get_length(wire), >=, lens[i] + 2 + 4 * masked);
+      if (masked && lens[i])
+        tt_assert(memcmp(evbuffer_pullup(wire, -1) + evbuffer_get_length(wire) - lens[i],
+                         data.data(), lens[i]));
+
+      tt_int_op(take_ws_frame(wire, f, payload, masked), ==, 1);
+      tt_assert(f.fin);
+      tt_int_op(f.opcode, ==, ws_BINARY);
+      tt_uint_op(f.len, ==, lens[i]);
+      tt_uint_op(evbuffer_get_length(wire), ==, 0);
+      tt_uint_op(evbuffer_get_length(payload), ==, lens[i]);
+      tt_assert(!lens[i] || !memcmp(evbuffer_pullup(payload, -1), data.data(), lens[i]));
+      evbuffer_drain(payload, lens[i]);
+    }
+
+ end:
+  evbuffer_free(wire);
+  evbuffer_free(payload);
+}
+
+/* A frame is taken only once it has all come, a byte at a time. */
+static void
+test_websocket_partial(void *)
+{
+  evbuffer *whole = evbuffer_new();
+  evbuffer *wire = evbuffer_new();
+  evbuffer *payload = evbuffer_new();
+  string data(1000, 'x');
+  ws_frame f;
+  size_t len;
+
+  add_ws_frame(whole, ws_BINARY, true, (const uint8_t *)data.data(), data.size(), true);
+  add_ws_frame(whole, ws_PING, true, (const uint8_t *)"hi", 2, true);
+  len = evbuffer_get_length(whole);
+  tt_uint_op(len, ==, 2 + 2 + 4 + 1000 + 2 + 4 + 2);
+
+  for (size_t i = 0; i < 2 + 2 + 4 + 1000 - 1; i++) {
+    evbuffer_remove_buffer(whole, wire, 1);
+    tt_int_op(take_ws_frame(wire, f, payload, true), ==, 0);
+  }
+  evbuffer_remove_buffer(whole, wire, 1);
+  tt_int_op(take_ws_frame(wire, f, payload, true), ==, 1);
+  tt_uint_op(evbuffer_get_length(payload), ==, 1000);
+
+  evbuffer_add_buffer(wire, whole);
+  tt_int_op(take_ws_frame(wire, f, payload, true), ==, 1);
+  tt_int_op(f.opcode, ==, ws_PING);
+  tt_uint_op(evbuffer_get_length(payload), ==, 1002);
+  tt_int_op(take_ws_frame(wire, f, payload, true), ==, 0);
+
+ end:
+  evbuffer_free(whole);
+  evbuffer_free(wire);
+  evbuffer_free(payload);
+}
+
+/* Unmasked frames from a client, reserved bits and opcodes, long or
+   fragmented control frames and oversized frames are refused. */
+static void
+test_websocket_bad_frames(void *)
+{
+  evbuffer *wire = evbuffer_new();
+  evbuffer *payload = evbuffer_new();
+  ws_frame f;
+  const char *bad[] = {
+    "\x82\x01x",                         // a client's, unmasked
+    "\xc2\x81\0\0\0\0x",                 // RSV1
+    "\x83\x81\0\0\0\0x",                 // opcode 3
+    "\x09\x81\0\0\0\0x",                 // fragmented ping
+    "\x89\xfe\0\x7e",                    // 126 byte ping
+    "\x82\xff\0\0\0\0\0\x20\0\0",        // 2MB
+  };
+  size_t bad_len[] = { 3, 7, 7, 7, 4, 10 };
+
+  for (size_t i = 0; i < sizeof bad / sizeof bad[0]; i++) {
+    evbuffer_add(wire, bad[i], bad_len[i]);
+    tt_int_op(take_ws_frame(wire, f, payload, true), ==, -1);
+    evbuffer_drain(wire, evbuffer_get_length(wire));
+  }
+
+  // a server's must not be masked
+  add_ws_frame(wire, ws_BINARY, true, (const uint8_t *)"x", 1, true);
+  tt_int_op(take_ws_frame(wire, f, payload, false), ==, -1);
+  tt_uint_op(evbuffer_get_length(payload), ==, 0);
+
+ end:
+  evbuffer_free(wire);
+  evbuffer_free(payload);
+}
+
+/* The example of RFC 6455, section 1.3. */
+static void
+test_websocket_accept_key(void *)
+{
+  string accept = ws_accept_key("dGhlIHNhbXBsZSBub25jZQ==");
+  tt_str_op(accept.c_str(), ==, "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=");
+ end:;
+}
+
+#define T(name) \
+  { #name, test_websocket_##name, 0, 0, 0 }
+
+struct testcase_t websocket_tests[] = {
+  T(frames),
+  T(partial),
+  T(bad_frames),
+  T(accept_key),
+  END_OF_TESTCASES
+};
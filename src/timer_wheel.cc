@@ -0,0 +1,340 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "timer_wheel.h"
+
+#include <algorithm>
+#include <time.h>
+#include <event2/event.h>
+
+/* Four levels of 256 slots. A timer sits on level 0 if it is due
+   within 256 ticks of the wheel's current time, otherwise on the
+   level whose slot span covers its distance; when the wheel reaches
+   a slot on an upper level, the timers there are cascaded down. */
+
+namespace {
+const unsigned int LEVELS = 4;
+const unsigned int SLOT_BITS = 8;
+const unsigned int SLOTS = 1 << SLOT_BITS;
+const unsigned int SLOT_MASK = SLOTS - 1;
+const unsigned long long MAX_DELTA = (1ULL << (LEVELS * SLOT_BITS)) - 1;
+const unsigned long long NEVER = ~0ULL;
+
+/* Slot value of a timer that is in an expiry batch. */
+const unsigned int EXPIRING = LEVELS * SLOTS;
+}
+
+class TimerWheel
+{
+public:
+  explicit TimerWheel(struct event_base *base);
+  ~TimerWheel();
+
+  static TimerWheel *for_base(struct event_base *base);
+  static TimerWheel *the_wheel;
+
+  static unsigned long long now();
+
+  void add(wheel_timer *t);
+  void remove(wheel_timer *t);
+
+  struct event_base *base;
+
+private:
+  struct event *tick_ev;
+  unsigned long long current;   // every timer due by now has expired
+  unsigned long long scheduled; // when tick_ev will fire, or NEVER
+  size_t count;
+
+  wheel_timer heads[LEVELS * SLOTS];
+  unsigned long long occupied[LEVELS][SLOTS / 64];
+
+  void place(wheel_timer *t);
+  void link(wheel_timer *t, unsigned int slot);
+  unsigned int next_occupied(unsigned int level, unsigned int idx) const;
+  unsigned long long next_due() const;
+  void schedule();
+  void cascade();
+  void expire(unsigned int slot);
+  void advance(unsigned long long to);
+
+  static void tick_cb(evutil_socket_t, short, void *arg);
+
+  TimerWheel(const TimerWheel&);
+  TimerWheel& operator=(const TimerWheel&);
+};
+
+TimerWheel *TimerWheel::the_wheel = 0;
+
+unsigned long long
+TimerWheel::now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+TimerWheel::TimerWheel(struct event_base *base)
+  : base(base), current(now()), scheduled(NEVER), count(0)
+{
+  tick_ev = evtimer_new(base, tick_cb, this);
+  if (!tick_ev)
+    log_abort("failed to create the timer wheel event");
+
+  for (unsigned int i = 0; i < LEVELS * SLOTS; i++)
+    heads[i].next = heads[i].prev = &heads[i];
+  memset(occupied, 0, sizeof occupied);
+}
+
+TimerWheel::~TimerWheel()
+{
+  for (unsigned int i = 0; i < LEVELS * SLOTS; i++)
+    while (heads[i].next != &heads[i])
+      remove(heads[i].next);
+  event_free(tick_ev);
+}
+
+/** There is only one event base in this program, hence one wheel. */
+TimerWheel *
+TimerWheel::for_base(struct event_base *base)
+{
+  if (!the_wheel)
+    the_wheel = new TimerWheel(base);
+  else if (the_wheel->base != base)
+    log_abort("timer wheel used with a second event base");
+  return the_wheel;
+}
+
+void
+TimerWheel::link(wheel_timer *t, unsigned int slot)
+{
+  wheel_timer *head = &heads[slot];
+  t->slot = slot;
+  t->prev = head->prev;
+  t->next = head;
+  head->prev->next = t;
+  head->prev = t;
+  occupied[slot / SLOTS][(slot % SLOTS) / 64] |= 1ULL << (slot % 64);
+}
+
+/** Puts T in the slot for its expiry time, relative to the wheel's.
+    A timer due right now goes in the level 0 slot about to expire. */
+void
+TimerWheel::place(wheel_timer *t)
+{
+  if (t->expires - current > MAX_DELTA)
+    t->expires = current + MAX_DELTA;
+
+  unsigned long long delta = t->expires - current;
+  unsigned int level = 0;
+  while (level < LEVELS - 1 && delta >> (SLOT_BITS * (level + 1)))
+    level++;
+
+  link(t, level * SLOTS +
+       ((t->expires >> (SLOT_BITS * level)) & SLOT_MASK));
+}
+
+void
+TimerWheel::add(wheel_timer *t)
+{
+  // An empty wheel may have been idle for a long while; catch up so
+  // we are not cascading through all of that later.
+  if (count == 0)
+    current = std::max(current, now());
+
+  // The current level 0 slot has already expired.
+  if (t->expires <= current)
+    t->expires = current + 1;
+  place(t);
+  t->wheel = this;
+  count++;
+
+  if (scheduled == NEVER || t->expires < scheduled)
+    schedule();
+}
+
+void
+TimerWheel::remove(wheel_timer *t)
+{
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->next = t->prev = 0;
+  t->wheel = 0;
+  count--;
+
+  unsigned int slot = t->slot;
+  if (slot != EXPIRING && heads[slot].next == &heads[slot])
+    occupied[slot / SLOTS][(slot % SLOTS) / 64] &= ~(1ULL << (slot % 64));
+}
+
+/** Distance, 1 to SLOTS, from IDX to the next occupied slot of LEVEL
+    going round the wheel; 0 if the level is empty. */
+unsigned int
+TimerWheel::next_occupied(unsigned int level, unsigned int idx) const
+{
+  const unsigned long long *bits = occupied[level];
+  for (unsigned int d = 1; d <= SLOTS; ) {
+    unsigned int i = (idx + d) & SLOT_MASK;
+    unsigned long long word = bits[i / 64] >> (i % 64);
+    if (word)
+      return d + __builtin_ctzll(word) <= SLOTS
+        ? d + __builtin_ctzll(word) : 0;
+    d += 64 - i % 64;
+  }
+  return 0;
+}
+
+/** The next time something has to happen: a level 0 slot expiring
+    or an upper level slot cascading. */
+unsigned long long
+TimerWheel::next_due() const
+{
+  if (count == 0)
+    return NEVER;
+
+  unsigned long long due = NEVER;
+  for (unsigned int level = 0; level < LEVELS; level++) {
+    unsigned int shift = SLOT_BITS * level;
+    unsigned int d = next_occupied(level, (current >> shift) & SLOT_MASK);
+    if (d)
+      due = std::min(due, ((current >> shift) + d) << shift);
+  }
+  return due;
+}
+
+void
+TimerWheel::schedule()
+{
+  unsigned long long due = next_due();
+  if (due == scheduled)
+    return;
+
+  if (due == NEVER) {
+    evtimer_del(tick_ev);
+  } else {
+    unsigned long long t = now();
+    unsigned long long wait = due > t ? due - t : 0;
+    struct timeval tv;
+    tv.tv_sec = wait / 1000;
+    tv.tv_usec = (wait % 1000) * 1000;
+    evtimer_add(tick_ev, &tv);
+  }
+  scheduled = due;
+}
+
+/** At a level 0 wrap, moves the timers of each upper level's
+    current slot down, for as long as the levels wrap too. */
+void
+TimerWheel::cascade()
+{
+  for (unsigned int level = 1; level < LEVELS; level++) {
+    unsigned int idx = (current >> (SLOT_BITS * level)) & SLOT_MASK;
+    wheel_timer *head = &heads[level * SLOTS + idx];
+
+    if (head->next != head) {
+      wheel_timer batch;
+      batch.next = head->next;
+      batch.prev = head->prev;
+      batch.next->prev = batch.prev->next = &batch;
+      head->next = head->prev = head;
+      occupied[level][idx / 64] &= ~(1ULL << (idx % 64));
+
+      while (batch.next != &batch) {
+        wheel_timer *t = batch.next;
+        batch.next = t->next;
+        t->next->prev = &batch;
+        place(t);
+      }
+      batch.next = batch.prev = 0;
+    }
+
+    if (idx != 0)
+      break;
+  }
+}
+
+/** Runs the callbacks of everything in level 0 SLOT. They may arm
+    and disarm timers, including ones still in the batch. */
+void
+TimerWheel::expire(unsigned int slot)
+{
+  wheel_timer *head = &heads[slot];
+  if (head->next == head)
+    return;
+
+  wheel_timer batch;
+  batch.next = head->next;
+  batch.prev = head->prev;
+  batch.next->prev = batch.prev->next = &batch;
+  head->next = head->prev = head;
+  occupied[0][slot / 64] &= ~(1ULL << (slot % 64));
+
+  for (wheel_timer *t = batch.next; t != &batch; t = t->next)
+    t->slot = EXPIRING;
+
+  while (batch.next != &batch) {
+    wheel_timer *t = batch.next;
+    remove(t);
+    t->cb(t, t->arg);
+  }
+  batch.next = batch.prev = 0;
+}
+
+void
+TimerWheel::advance(unsigned long long to)
+{
+  for (;;) {
+    unsigned long long due = next_due();
+    if (due > to) {
+      current = std::max(current, to);
+      return;
+    }
+    current = due;
+    if ((current & SLOT_MASK) == 0)
+      cascade();
+    expire(current & SLOT_MASK);
+  }
+}
+
+void
+TimerWheel::tick_cb(evutil_socket_t, short, void *arg)
+{
+  TimerWheel *wheel = (TimerWheel *)arg;
+  wheel->scheduled = NEVER;
+  wheel->advance(now());
+  wheel->schedule();
+}
+
+wheel_timer::wheel_timer()
+  : next(0), prev(0), wheel(0), expires(0), slot(0), cb(0), arg(0)
+{
+}
+
+void
+wheel_timer::arm(struct event_base *base, unsigned long milliseconds)
+{
+  log_assert(cb);
+  TimerWheel *w = wheel ? wheel : TimerWheel::for_base(base);
+  if (wheel)
+    w->remove(this);
+  expires = TimerWheel::now() + milliseconds;
+  w->add(this);
+}
+
+void
+wheel_timer::disarm()
+{
+  if (wheel)
+    wheel->remove(this);
+}
+
+void
+timer_wheel_free(struct event_base *base)
+{
+  if (TimerWheel::the_wheel && TimerWheel::the_wheel->base == base) {
+    delete TimerWheel::the_wheel;
+    TimerWheel::the_wheel = 0;
+  }
+}
@@ -0,0 +1,65 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+/**
+   Hierarchical timer wheel for the per-circuit and per-connection
+   timers (flush, axe, must-send). These are re-armed on nearly every
+   send, and with one libevent timer each, tens of thousands of
+   circuits meant a busy min-heap and an allocation per timer.
+
+   A wheel_timer is embedded in its owner and never allocated. Arming,
+   disarming and re-arming are O(1) list operations. All timers of an
+   event base share one libevent timer, which fires when the earliest
+   of them is due; everything due by then expires in one batch.
+
+   Resolution is one millisecond; timeouts are capped at about 49 days.
+*/
+
+struct event_base;
+struct wheel_timer;
+class TimerWheel;
+
+typedef void (*wheel_timer_cb)(wheel_timer *timer, void *arg);
+
+struct wheel_timer
+{
+  wheel_timer();
+  ~wheel_timer() { disarm(); }
+
+  /** Sets what to call on expiry. Must be done before arm(). */
+  void set(wheel_timer_cb cb, void *arg)
+  { this->cb = cb; this->arg = arg; }
+
+  bool initialized() const { return cb != 0; }
+
+  /** (Re)arms the timer to expire MILLISECONDS from now. */
+  void arm(struct event_base *base, unsigned long milliseconds);
+
+  /** Cancels the timer if it is pending; harmless if it is not. */
+  void disarm();
+
+  bool pending() const { return wheel != 0; }
+
+private:
+  friend class TimerWheel;
+
+  wheel_timer *next, *prev;
+  TimerWheel *wheel;      // the wheel we are on, if pending
+  unsigned long long expires; // in the wheel's ticks
+  unsigned int slot;
+  wheel_timer_cb cb;
+  void *arg;
+
+  wheel_timer(const wheel_timer&);
+  wheel_timer& operator=(const wheel_timer&);
+};
+
+/** Frees the wheel of BASE, if it has one. Any timer still pending
+    is cancelled. Call before freeing the event base. */
+void timer_wheel_free(struct event_base *base);
+
+#endif
@@ -34,6 +34,8 @@ using namespace std;
 
 #include "util.h"
 #include "connections.h"
+#include "splice_relay.h"
+#include "uring_transport.h"
 
 static double drop_rate = 0; //do not drop anything by default
 
@@ -41,7 +43,7 @@ static double drop_rate = 0; //do not drop anything by default
 
 
 std::unordered_map<bufferevent *, conn_t*> TransparentProxy::transparentized_connections;
-#define MAX_OUTPUT (512*1024)
+#define MAX_OUTPUT SpliceRelay::MAX_OUTPUT
 bool TransparentProxy::trace_packet_data = false;
 
 /** 
@@ -156,11 +158,70 @@ TransparentProxy::close_on_finished_writecb(struct bufferevent *bev, void *ctx)
   }
 }
 
+/** The two ends of a connection that is being spliced. */
+struct spliced_pair {
+  struct bufferevent *b_in, *b_out;
+};
+
+void
+TransparentProxy::splice_done_cb(SpliceRelay *relay, int error, void *arg)
+{
+  spliced_pair *pair = (spliced_pair *)arg;
+
+  if (error)
+    log_debug("proxy error: %s", strerror(error));
+
+  delete relay;
+  free_or_close(pair->b_out);
+  free_or_close(pair->b_in);
+  delete pair;
+}
+
+/**
+   Called once the connection to the cover server is up: from then on
+   we only ever copy bytes, so let the kernel do it. Whatever has
+   already been read or queued on either side goes out first. If
+   splice is not available we stay on the bufferevents.
+*/
+void
+TransparentProxy::start_splicing(struct bufferevent *b_out,
+                                 struct bufferevent *b_in)
+{
+  if (!b_in || !SpliceRelay::available() || trace_packet_data ||
+      drop_rate != 0 || UringTransport::on_ring(b_in))
+    return;
+
+  bufferevent_disable(b_in, EV_READ|EV_WRITE);
+  bufferevent_disable(b_out, EV_READ|EV_WRITE);
+
+  struct evbuffer *to_out = bufferevent_get_output(b_out);
+  struct evbuffer *to_in = bufferevent_get_output(b_in);
+  evbuffer_add_buffer(to_out, bufferevent_get_input(b_in));
+  evbuffer_add_buffer(to_in, bufferevent_get_input(b_out));
+
+  spliced_pair *pair = new spliced_pair;
+  pair->b_in = b_in;
+  pair->b_out = b_out;
+
+  if (!SpliceRelay::create(bufferevent_get_base(b_out),
+                           bufferevent_getfd(b_in), bufferevent_getfd(b_out),
+                           to_in, to_out, splice_done_cb, pair)) {
+    delete pair;
+    bufferevent_enable(b_in, EV_READ|EV_WRITE);
+    bufferevent_enable(b_out, EV_READ|EV_WRITE);
+  }
+}
+
 void
 TransparentProxy::eventcb(struct bufferevent *bev, short what, void *ctx)
 {
   struct bufferevent *partner = (bufferevent *)ctx;
 
+  if (what & BEV_EVENT_CONNECTED) {
+    start_splicing(bev, partner);
+    return;
+  }
+
   if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
     if (what & BEV_EVENT_ERROR)
         fprintf(stderr,
@@ -230,7 +291,7 @@ TransparentProxy::accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
   bufferevent_enable(b_out, EV_READ|EV_WRITE);
 }
 
-void TransparentProxy::transparentize_connection(conn_t* conn_in, uint8_t* apriori_data, size_t apriori_data_length)
+void TransparentProxy::transparentize_connection(conn_t* conn_in, evbuffer* apriori_data)
 {
   assert(conn_in->buffer);
   struct bufferevent *b_out, *b_in = conn_in->buffer;
@@ -275,7 +336,7 @@ void TransparentProxy::transparentize_connection(conn_t* conn_in, uint8_t* aprio
   //in the buffer.
   //readcb(b_in, b_out);
   evbuffer* dst = bufferevent_get_output(b_out);
-  evbuffer_add(dst, apriori_data, apriori_data_length);
+  evbuffer_add_buffer(dst, apriori_data);
 
   if (evbuffer_get_length(dst) >= MAX_OUTPUT) {
     /* We're giving the other side data faster than it can
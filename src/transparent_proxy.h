@@ -14,6 +14,8 @@
 #include <assert.h>
 #include <event2/listener.h>
 
+class SpliceRelay;
+
 class TransparentProxy
 {
 protected:
@@ -45,6 +47,9 @@ public:
 
   static void readcb(struct bufferevent *bev, void *ctx);
 
+  static void start_splicing(struct bufferevent *b_out, struct bufferevent *b_in);
+  static void splice_done_cb(SpliceRelay *relay, int error, void *arg);
+
   static void accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
             struct sockaddr *a, int slen, void *p);
 
@@ -52,9 +57,10 @@ public:
      This will receive a chop_conn that failed/ignored to handshake
      and turn it into a transparent circuit to the cover server, hence
      it acts similar to accept_cb except that the downstream connection
-     is already established.
+     is already established. Whatever was read from it before that
+     is moved out of apriori_data and sent on first.
    */
-  void transparentize_connection(conn_t* conn_in, uint8_t* apriori_data, size_t apriori_data_length);
+  void transparentize_connection(conn_t* conn_in, evbuffer* apriori_data);
 
   void set_upstream_address(const std::string& upstream_address)
   {
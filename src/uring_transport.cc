@@ -0,0 +1,741 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "uring_transport.h"
+
+#include <event2/buffer.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <deque>
+#include <set>
+#include <vector>
+#endif
+
+static UringTransport::stats_t the_stats;
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+namespace {
+
+const unsigned int RING_ENTRIES = 256;
+const unsigned int READ_SLOTS = 64;
+const size_t READ_SLOT_SIZE = 16*1024;
+const int SEND_IOVS = 16;
+
+/* The low bits of an operation's user_data; the rest is the socket. */
+enum uring_op { op_POLL = 1, op_READ = 2, op_SEND = 3, op_MASK = 7 };
+
+struct uring_sock
+{
+  evutil_socket_t fd;
+  struct bufferevent *ring_end;  // ours; its partner is the caller's
+  struct evbuffer *sending;      // handed to the kernel
+  struct msghdr msg;
+  struct iovec iov[SEND_IOVS];
+  int slot;                      // of the read in flight
+  unsigned int in_flight;
+  bool polling : 1;
+  bool reading : 1;
+  bool send_pending : 1;
+  bool waiting_slot : 1;
+  bool read_eof : 1;
+  bool eof_delivered : 1;
+  bool shut_wr_wanted : 1;
+  bool closing : 1;
+  bool failed : 1;
+};
+
+struct uring_state
+{
+  struct event_base *base;
+  int fd;
+  int event_fd;
+  struct event *completions;
+  struct event *submitter;
+
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned sq_entries;
+  struct io_uring_sqe *sqes;
+  unsigned to_submit;
+
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_map, *cq_map;
+  size_t sq_map_len, cq_map_len, sqes_len;
+
+  uint8_t *slots;
+  std::vector<int> free_slots;
+  std::deque<uring_sock *> slot_waiters;
+  std::set<uring_sock *> socks;
+};
+
+uring_state *ring;
+
+void ring_readcb(struct bufferevent *, void *arg);
+void ring_writecb(struct bufferevent *, void *arg);
+
+int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+int
+sys_io_uring_enter(int fd, unsigned to_submit)
+{
+  return syscall(__NR_io_uring_enter, fd, to_submit, 0, 0, NULL, 0);
+}
+
+int
+sys_io_uring_register(int fd, unsigned opcode, const void *arg, unsigned n)
+{
+  return syscall(__NR_io_uring_register, fd, opcode, arg, n);
+}
+
+void
+submit()
+{
+  while (ring->to_submit) {
+    int n = sys_io_uring_enter(ring->fd, ring->to_submit);
+    the_stats.enters++;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      // EAGAIN and EBUSY clear as completions are reaped, and we
+      // submit again after every reaping
+      if (errno != EAGAIN && errno != EBUSY)
+        log_warn("io_uring_enter: %s", strerror(errno));
+      return;
+    }
+    ring->to_submit -= n;
+    the_stats.submitted += n;
+  }
+}
+
+void
+submit_cb(evutil_socket_t, short, void *)
+{
+  submit();
+}
+
+/** The next free submission entry, cleared, or NULL if the ring is
+    full even after submitting what is in it. */
+struct io_uring_sqe *
+get_sqe()
+{
+  unsigned tail = *ring->sq_tail;
+  if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+    submit();
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+      return NULL;
+  }
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof *sqe);
+  ring->sq_array[index] = index;
+  return sqe;
+}
+
+/** Queues sqe for the next io_uring_enter, at the end of this pass
+    of the event loop. */
+void
+queue_sqe(struct io_uring_sqe *sqe, uring_sock *s, uring_op op)
+{
+  sqe->user_data = (uintptr_t)s | op;
+  __atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+  ring->to_submit++;
+  s->in_flight++;
+  event_active(ring->submitter, 0, 0);
+}
+
+struct bufferevent *
+user_end(uring_sock *s)
+{
+  return bufferevent_pair_get_partner(s->ring_end);
+}
+
+void
+destroy(uring_sock *s)
+{
+  ring->socks.erase(s);
+  bufferevent_free(s->ring_end);
+  evbuffer_free(s->sending);
+  close(s->fd);
+  delete s;
+}
+
+/** A closing socket goes once nothing is in flight and, unless it
+    failed, what it was given has gone out. */
+void
+maybe_destroy(uring_sock *s)
+{
+  if (s->closing && !s->in_flight &&
+      (s->failed || (!evbuffer_get_length(s->sending) &&
+                     !evbuffer_get_length(bufferevent_get_input(s->ring_end)))))
+    destroy(s);
+}
+
+void
+fail(uring_sock *s, int err, short what)
+{
+  s->failed = true;
+  struct bufferevent *user = user_end(s);
+  if (user && !s->closing) {
+    EVUTIL_SET_SOCKET_ERROR(err);
+    bufferevent_trigger_event(user, BEV_EVENT_ERROR|what, 0);
+  }
+}
+
+void
+start_poll(uring_sock *s)
+{
+  if (s->polling || s->reading || s->waiting_slot || s->read_eof ||
+      s->closing || s->failed ||
+      evbuffer_get_length(bufferevent_get_output(s->ring_end)) >=
+      UringTransport::MAX_QUEUED)
+    return;
+
+  struct io_uring_sqe *sqe = get_sqe();
+  if (!sqe) {
+    fail(s, EAGAIN, BEV_EVENT_READING);
+    return;
+  }
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = s->fd;
+  sqe->poll32_events = POLLIN;
+  s->polling = true;
+  queue_sqe(sqe, s, op_POLL);
+}
+
+void
+start_read(uring_sock *s)
+{
+  if (ring->free_slots.empty()) {
+    s->waiting_slot = true;
+    ring->slot_waiters.push_back(s);
+    return;
+  }
+
+  struct io_uring_sqe *sqe = get_sqe();
+  if (!sqe) {
+    fail(s, EAGAIN, BEV_EVENT_READING);
+    return;
+  }
+  s->slot = ring->free_slots.back();
+  ring->free_slots.pop_back();
+  sqe->opcode = IORING_OP_READ_FIXED;
+  sqe->fd = s->fd;
+  sqe->addr = (uintptr_t)(ring->slots + s->slot * READ_SLOT_SIZE);
+  sqe->len = READ_SLOT_SIZE;
+  sqe->buf_index = s->slot;
+  s->reading = true;
+  queue_sqe(sqe, s, op_READ);
+}
+
+void
+release_slot(int slot)
+{
+  ring->free_slots.push_back(slot);
+  while (!ring->free_slots.empty() && !ring->slot_waiters.empty()) {
+    uring_sock *s = ring->slot_waiters.front();
+    ring->slot_waiters.pop_front();
+    s->waiting_slot = false;
+    start_read(s);
+  }
+}
+
+/** EOF goes to the caller once everything before it has. */
+void
+maybe_deliver_eof(uring_sock *s)
+{
+  struct bufferevent *user = user_end(s);
+  if (s->read_eof && !s->eof_delivered && user && !s->closing &&
+      !evbuffer_get_length(bufferevent_get_output(s->ring_end))) {
+    s->eof_delivered = true;
+    bufferevent_flush(s->ring_end, EV_WRITE, BEV_FINISHED);
+  }
+}
+
+void
+maybe_shutdown_write(uring_sock *s)
+{
+  struct bufferevent *user = user_end(s);
+  if (s->shut_wr_wanted && !s->send_pending && !s->failed &&
+      !evbuffer_get_length(s->sending) &&
+      !evbuffer_get_length(bufferevent_get_input(s->ring_end)) &&
+      (!user || !evbuffer_get_length(bufferevent_get_output(user)))) {
+    s->shut_wr_wanted = false;
+    shutdown(s->fd, SHUT_WR);
+  }
+}
+
+void
+start_send(uring_sock *s)
+{
+  if (s->send_pending || s->failed)
+    return;
+
+  struct evbuffer *input = bufferevent_get_input(s->ring_end);
+  if (!evbuffer_get_length(s->sending)) {
+    evbuffer_add_buffer(s->sending, input);
+    if (!s->closing)
+      bufferevent_enable(s->ring_end, EV_READ);
+  }
+  if (!evbuffer_get_length(s->sending)) {
+    maybe_shutdown_write(s);
+    return;
+  }
+
+  struct evbuffer_iovec v[SEND_IOVS];
+  int n = evbuffer_peek(s->sending, -1, NULL, v, SEND_IOVS);
+  if (n > SEND_IOVS)
+    n = SEND_IOVS;
+  for (int i = 0; i < n; i++) {
+    s->iov[i].iov_base = v[i].iov_base;
+    s->iov[i].iov_len = v[i].iov_len;
+  }
+  memset(&s->msg, 0, sizeof s->msg);
+  s->msg.msg_iov = s->iov;
+  s->msg.msg_iovlen = n;
+
+  struct io_uring_sqe *sqe = get_sqe();
+  if (!sqe) {
+    fail(s, EAGAIN, BEV_EVENT_WRITING);
+    return;
+  }
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = s->fd;
+  sqe->addr = (uintptr_t)&s->msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  s->send_pending = true;
+  queue_sqe(sqe, s, op_SEND);
+}
+
+void
+poll_done(uring_sock *s, int res)
+{
+  s->polling = false;
+  if (s->closing)
+    return;
+  if (res < 0)
+    fail(s, -res, BEV_EVENT_READING);
+  else
+    start_read(s);
+}
+
+void
+read_done(uring_sock *s, int res)
+{
+  s->reading = false;
+  if (res > 0 && !s->closing)
+    evbuffer_add(bufferevent_get_output(s->ring_end),
+                 ring->slots + s->slot * READ_SLOT_SIZE, res);
+  release_slot(s->slot);
+  if (s->closing)
+    return;
+
+  if (res == -EAGAIN)
+    start_poll(s);
+  else if (res < 0)
+    fail(s, -res, BEV_EVENT_READING);
+  else if (res == 0) {
+    s->read_eof = true;
+    maybe_deliver_eof(s);
+  } else if ((size_t)res == READ_SLOT_SIZE)
+    start_read(s);   // there is likely more
+  else
+    start_poll(s);
+}
+
+void
+send_done(uring_sock *s, int res)
+{
+  s->send_pending = false;
+  if (res < 0 && res != -EAGAIN && res != -EINTR) {
+    fail(s, -res, BEV_EVENT_WRITING);
+    return;
+  }
+  if (res > 0)
+    evbuffer_drain(s->sending, res);
+  start_send(s);
+}
+
+void
+completions_cb(evutil_socket_t fd, short, void *)
+{
+  uint64_t n;
+  if (read(fd, &n, sizeof n) < 0 && errno != EAGAIN)
+    log_warn("io_uring eventfd: %s", strerror(errno));
+
+  unsigned head = *ring->cq_head;
+  while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    uintptr_t data = cqe->user_data;
+    int res = cqe->res;
+    __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+    the_stats.completed++;
+
+    uring_sock *s = (uring_sock *)(data & ~(uintptr_t)op_MASK);
+    s->in_flight--;
+    switch (data & op_MASK) {
+    case op_POLL: poll_done(s, res); break;
+    case op_READ: read_done(s, res); break;
+    case op_SEND: send_done(s, res); break;
+    }
+    maybe_destroy(s);
+  }
+  submit();
+}
+
+/* The caller wrote to its end of the pair. */
+void
+ring_readcb(struct bufferevent *bev, void *arg)
+{
+  uring_sock *s = (uring_sock *)arg;
+  start_send(s);
+  if (s->closing) {
+    maybe_destroy(s);
+    return;
+  }
+  if (evbuffer_get_length(bufferevent_get_input(bev)) >= UringTransport::MAX_QUEUED)
+    bufferevent_disable(bev, EV_READ);
+}
+
+/* The caller took what we had read. */
+void
+ring_writecb(struct bufferevent *, void *arg)
+{
+  uring_sock *s = (uring_sock *)arg;
+  if (s->read_eof)
+    maybe_deliver_eof(s);
+  else
+    start_poll(s);
+}
+
+uring_sock *
+sock_of(struct bufferevent *bev)
+{
+  if (!ring)
+    return NULL;
+  struct bufferevent *partner = bufferevent_pair_get_partner(bev);
+  if (!partner)
+    return NULL;
+  bufferevent_data_cb readcb;
+  void *arg;
+  bufferevent_getcb(partner, &readcb, NULL, NULL, &arg);
+  return readcb == ring_readcb ? (uring_sock *)arg : NULL;
+}
+
+bool
+map_ring(uring_state *r, const struct io_uring_params &p)
+{
+  r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    r->sq_map_len = r->cq_map_len = std::max(r->sq_map_len, r->cq_map_len);
+
+  r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_map == MAP_FAILED)
+    return false;
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    r->cq_map = r->sq_map;
+  else {
+    r->cq_map = mmap(NULL, r->cq_map_len, PROT_READ|PROT_WRITE,
+                     MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_map == MAP_FAILED)
+      return false;
+  }
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = (struct io_uring_sqe *)
+    mmap(NULL, r->sqes_len, PROT_READ|PROT_WRITE,
+         MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    r->sqes = NULL;
+    return false;
+  }
+
+  uint8_t *sq = (uint8_t *)r->sq_map, *cq = (uint8_t *)r->cq_map;
+  r->sq_head = (unsigned *)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->sq_entries = p.sq_entries;
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return true;
+}
+
+void
+unmap_ring(uring_state *r)
+{
+  if (r->sqes)
+    munmap(r->sqes, r->sqes_len);
+  if (r->cq_map && r->cq_map != MAP_FAILED && r->cq_map != r->sq_map)
+    munmap(r->cq_map, r->cq_map_len);
+  if (r->sq_map && r->sq_map != MAP_FAILED)
+    munmap(r->sq_map, r->sq_map_len);
+}
+
+} // anonymous namespace
+
+bool
+UringTransport::init(struct event_base *base)
+{
+  if (ring)
+    return true;
+
+  struct io_uring_params p;
+  memset(&p, 0, sizeof p);
+  int fd = sys_io_uring_setup(RING_ENTRIES, &p);
+  if (fd < 0) {
+    log_info("io_uring: %s", strerror(errno));
+    return false;
+  }
+  // we rely on the kernel keeping completions that overflow the ring
+  // and on its copying what a submission points to when it is
+  // submitted, not when it is started
+  if (!(p.features & IORING_FEAT_NODROP) ||
+      !(p.features & IORING_FEAT_SUBMIT_STABLE)) {
+    log_info("io_uring: kernel too old");
+    close(fd);
+    return false;
+  }
+
+  uring_state *r = new uring_state();
+  r->base = base;
+  r->fd = fd;
+  r->event_fd = -1;
+
+  std::vector<struct iovec> iov(READ_SLOTS);
+  r->slots = (uint8_t *)mmap(NULL, READ_SLOTS * READ_SLOT_SIZE,
+                             PROT_READ|PROT_WRITE,
+                             MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (r->slots == MAP_FAILED)
+    r->slots = NULL;
+  for (unsigned int i = 0; r->slots && i < READ_SLOTS; i++) {
+    iov[i].iov_base = r->slots + i * READ_SLOT_SIZE;
+    iov[i].iov_len = READ_SLOT_SIZE;
+    r->free_slots.push_back(READ_SLOTS - 1 - i);
+  }
+
+  if (!map_ring(r, p) || !r->slots ||
+      sys_io_uring_register(fd, IORING_REGISTER_BUFFERS, &iov[0], READ_SLOTS) ||
+      (r->event_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0 ||
+      sys_io_uring_register(fd, IORING_REGISTER_EVENTFD, &r->event_fd, 1) ||
+      !(r->completions = event_new(base, r->event_fd, EV_READ|EV_PERSIST,
+                                   completions_cb, NULL)) ||
+      !(r->submitter = event_new(base, -1, 0, submit_cb, NULL)) ||
+      event_add(r->completions, NULL)) {
+    log_warn("io_uring: failed to set up the ring: %s", strerror(errno));
+    ring = r;
+    free_all();
+    return false;
+  }
+
+  ring = r;
+  log_info("io_uring: %u entries, %u registered read buffers",
+           p.sq_entries, READ_SLOTS);
+  return true;
+}
+
+void
+UringTransport::free_all()
+{
+  if (!ring)
+    return;
+
+  // closing the ring cancels what is in flight
+  if (ring->completions)
+    event_free(ring->completions);
+  if (ring->submitter)
+    event_free(ring->submitter);
+  unmap_ring(ring);
+  close(ring->fd);
+  if (ring->event_fd >= 0)
+    close(ring->event_fd);
+  while (!ring->socks.empty())
+    destroy(*ring->socks.begin());
+  if (ring->slots)
+    munmap(ring->slots, READ_SLOTS * READ_SLOT_SIZE);
+
+  log_debug("io_uring: %llu enters for %llu operations, %llu completions",
+            the_stats.enters, the_stats.submitted, the_stats.completed);
+  delete ring;
+  ring = NULL;
+}
+
+bool
+UringTransport::active()
+{
+  return ring != NULL;
+}
+
+struct bufferevent *
+UringTransport::socket_new(struct event_base *base, evutil_socket_t fd)
+{
+  if (!ring || base != ring->base)
+    return bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+
+  struct bufferevent *pair[2];
+  if (bufferevent_pair_new(base, BEV_OPT_DEFER_CALLBACKS, pair))
+    return NULL;
+
+  uring_sock *s = new uring_sock();
+  s->fd = fd;
+  s->ring_end = pair[0];
+  s->sending = evbuffer_new();
+  if (!s->sending) {
+    bufferevent_free(pair[0]);
+    bufferevent_free(pair[1]);
+    delete s;
+    return NULL;
+  }
+  ring->socks.insert(s);
+
+  bufferevent_setcb(s->ring_end, ring_readcb, ring_writecb, NULL, s);
+  bufferevent_enable(s->ring_end, EV_READ|EV_WRITE);
+  start_poll(s);
+  return pair[1];
+}
+
+void
+UringTransport::free(struct bufferevent *bev)
+{
+  uring_sock *s = sock_of(bev);
+  if (!s) {
+    bufferevent_free(bev);
+    return;
+  }
+
+  evbuffer_add_buffer(bufferevent_get_input(s->ring_end),
+                      bufferevent_get_output(bev));
+  bufferevent_free(bev);
+  s->closing = true;
+  if (s->waiting_slot) {
+    ring->slot_waiters.erase(std::find(ring->slot_waiters.begin(),
+                                       ring->slot_waiters.end(), s));
+    s->waiting_slot = false;
+  }
+  // wakes the poll; sending goes on
+  if (s->polling)
+    shutdown(s->fd, SHUT_RD);
+  start_send(s);
+  maybe_destroy(s);
+}
+
+evutil_socket_t
+UringTransport::getfd(struct bufferevent *bev)
+{
+  uring_sock *s = sock_of(bev);
+  return s ? s->fd : bufferevent_getfd(bev);
+}
+
+bool
+UringTransport::on_ring(struct bufferevent *bev)
+{
+  return sock_of(bev) != NULL;
+}
+
+size_t
+UringTransport::queued_bytes(struct bufferevent *bev)
+{
+  uring_sock *s = sock_of(bev);
+  if (!s)
+    return 0;
+  return evbuffer_get_length(bufferevent_get_input(s->ring_end)) +
+    evbuffer_get_length(s->sending);
+}
+
+void
+UringTransport::shutdown_write(struct bufferevent *bev)
+{
+  uring_sock *s = sock_of(bev);
+  if (!s) {
+    shutdown(bufferevent_getfd(bev), SHUT_WR);
+    return;
+  }
+  s->shut_wr_wanted = true;
+  start_send(s);
+}
+
+#else // !HAVE_LINUX_IO_URING_H
+
+bool
+UringTransport::init(struct event_base *)
+{
+  log_info("io_uring: not supported by this build");
+  return false;
+}
+
+void
+UringTransport::free_all()
+{
+}
+
+bool
+UringTransport::active()
+{
+  return false;
+}
+
+struct bufferevent *
+UringTransport::socket_new(struct event_base *base, evutil_socket_t fd)
+{
+  return bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+}
+
+void
+UringTransport::free(struct bufferevent *bev)
+{
+  bufferevent_free(bev);
+}
+
+evutil_socket_t
+UringTransport::getfd(struct bufferevent *bev)
+{
+  return bufferevent_getfd(bev);
+}
+
+bool
+UringTransport::on_ring(struct bufferevent *)
+{
+  return false;
+}
+
+size_t
+UringTransport::queued_bytes(struct bufferevent *)
+{
+  return 0;
+}
+
+void
+UringTransport::shutdown_write(struct bufferevent *bev)
+{
+  shutdown(bufferevent_getfd(bev), SHUT_WR);
+}
+
+#endif
+
+const UringTransport::stats_t&
+UringTransport::stats()
+{
+  return the_stats;
+}
@@ -0,0 +1,87 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#ifndef URING_TRANSPORT_H
+#define URING_TRANSPORT_H
+
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+
+/**
+   An io_uring transport for the sockets we accept (--io-uring): the
+   downstream connections of a server and the upstream connections of
+   a client.
+
+   Everything above the socket keeps talking to a bufferevent: with
+   the transport on, the bufferevent it gets is one end of a
+   bufferevent pair, and the transport drives the other end from the
+   ring. The ring is bridged into the event loop through an eventfd
+   it signals on completions; submissions made during one pass of
+   the loop go to the kernel in a single io_uring_enter.
+
+   Receives wait for a poll to report the socket readable and then
+   read into one of a pool of buffers registered with the kernel, so
+   idle connections hold no buffer. Sends hand the kernel the chains
+   of the outgoing evbuffer as they are. Flow control matches the
+   socket bufferevents: a direction stops once MAX_QUEUED bytes are
+   waiting on the other side of the pair.
+
+   Because the bufferevent's output empties as soon as the transport
+   has taken it, a freed connection lingers in the transport until
+   what it was given has been sent, and shutdown(SHUT_WR) has to go
+   through shutdown_write so that it comes after that data.
+*/
+class UringTransport
+{
+public:
+  enum { MAX_QUEUED = 256*1024 };
+
+  struct stats_t {
+    unsigned long long enters;      // io_uring_enter calls
+    unsigned long long submitted;   // operations submitted
+    unsigned long long completed;   // completions reaped
+  };
+
+  /**
+     Sets the ring up on base. All sockets stay on libevent if this
+     fails or was never called.
+
+     @return false if io_uring is not available here
+  */
+  static bool init(struct event_base *base);
+
+  /** Tears the ring down, closing the sockets still lingering. */
+  static void free_all();
+
+  /** True once init() has succeeded. */
+  static bool active();
+
+  static const stats_t& stats();
+
+  /**
+     A bufferevent for the connected socket fd, which it will close:
+     a socket bufferevent, or one bridged to the ring if the
+     transport is active. Free it with free().
+  */
+  static struct bufferevent *socket_new(struct event_base *base,
+                                        evutil_socket_t fd);
+
+  static void free(struct bufferevent *bev);
+
+  /** The socket under bev, which may be on the ring. */
+  static evutil_socket_t getfd(struct bufferevent *bev);
+
+  /** True if bev was bridged to the ring by socket_new(). */
+  static bool on_ring(struct bufferevent *bev);
+
+  /** Bytes the transport has taken from bev's output that the kernel
+      has not accepted yet; 0 for a bufferevent not on the ring. */
+  static size_t queued_bytes(struct bufferevent *bev);
+
+  /** shutdown(SHUT_WR) of the socket under bev, once everything
+      written to bev before it has gone out. */
+  static void shutdown_write(struct bufferevent *bev);
+};
+
+#endif
@@ -7,6 +7,8 @@
 
 #include <event2/dns.h>
 
+#include <time.h>
+
 #include <errno.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -126,9 +128,126 @@ get_evdns_base(void)
   return the_evdns_base;
 }
 
+static void start_peer_name_lookups(void);
+
 int
 init_evdns_base(struct event_base *base)
 {
   the_evdns_base = evdns_base_new(base, 1);
-  return the_evdns_base == NULL ? -1 : 0;
+  if (the_evdns_base == NULL)
+    return -1;
+
+  start_peer_name_lookups();
+  return 0;
+}
+
+/* Reverse DNS cache, used to fill in the Host header of the requests
+   we make to our peers.  Keyed by the numeric address without port.
+   A failed lookup is remembered for a while too, so that we don't ask
+   again for every request; if we had a name before, we keep using it
+   rather than have the Host header change back and forth. */
+
+#define PEER_NAME_MIN_TTL       60
+#define PEER_NAME_MAX_TTL       86400
+#define PEER_NAME_NEGATIVE_TTL  300
+
+struct peer_name_entry
+{
+  std::string name;
+  time_t expires;
+  bool pending;
+
+  peer_name_entry() : expires(0), pending(false) {}
+};
+
+typedef std::map<std::string, peer_name_entry> peer_name_cache_t;
+static peer_name_cache_t peer_name_cache;
+
+static void
+peer_name_resolved_cb(int result, char type, int count, int ttl,
+                      void *addresses, void *arg)
+{
+  peer_name_cache_t::value_type *entry = (peer_name_cache_t::value_type *)arg;
+
+  entry->second.pending = false;
+  if (result == DNS_ERR_NONE && type == DNS_PTR && count > 0) {
+    entry->second.name = *(const char **)addresses;
+    ttl = ttl < PEER_NAME_MIN_TTL ? PEER_NAME_MIN_TTL
+      : ttl > PEER_NAME_MAX_TTL ? PEER_NAME_MAX_TTL : ttl;
+    entry->second.expires = time(NULL) + ttl;
+    log_debug("%s is %s for %d seconds", entry->first.c_str(),
+              entry->second.name.c_str(), ttl);
+  } else {
+    entry->second.expires = time(NULL) + PEER_NAME_NEGATIVE_TTL;
+    log_debug("reverse lookup of %s failed: %s", entry->first.c_str(),
+              evdns_err_to_string(result));
+  }
+}
+
+static void
+start_peer_name_lookup(peer_name_cache_t::value_type &entry)
+{
+  if (!the_evdns_base || entry.second.pending)
+    return;
+
+  struct in_addr in4;
+  struct in6_addr in6;
+  struct evdns_request *req = NULL;
+
+  if (evutil_inet_pton(AF_INET, entry.first.c_str(), &in4) == 1)
+    req = evdns_base_resolve_reverse(the_evdns_base, &in4, 0,
+                                     peer_name_resolved_cb, &entry);
+  else if (evutil_inet_pton(AF_INET6, entry.first.c_str(), &in6) == 1)
+    req = evdns_base_resolve_reverse_ipv6(the_evdns_base, &in6, 0,
+                                          peer_name_resolved_cb, &entry);
+
+  if (req)
+    entry.second.pending = true;
+  else
+    entry.second.expires = time(NULL) + PEER_NAME_NEGATIVE_TTL;
+}
+
+static void
+start_peer_name_lookups(void)
+{
+  for (peer_name_cache_t::iterator i = peer_name_cache.begin();
+       i != peer_name_cache.end(); i++)
+    if (i->second.expires == 0)
+      start_peer_name_lookup(*i);
+}
+
+/* Strips the port and the brackets around IPv6 addresses from the
+   output of printable_address(). */
+static std::string
+peer_host_part(const char *peername)
+{
+  std::string host(peername);
+  if (host[0] == '[') {
+    size_t end = host.find(']');
+    return host.substr(1, end == std::string::npos ? end : end - 1);
+  }
+  return host.substr(0, host.find(':'));
+}
+
+const char *
+lookup_peer_name(const char *peername)
+{
+  peer_name_cache_t::value_type &entry =
+    *peer_name_cache.insert(std::make_pair(peer_host_part(peername),
+                                      peer_name_entry())).first;
+
+  if (entry.second.expires <= time(NULL))
+    start_peer_name_lookup(entry); // we still serve the stale name
+
+  return entry.second.name.empty() ? NULL : entry.second.name.c_str();
+}
+
+void
+prefetch_peer_names(const struct evutil_addrinfo *ai)
+{
+  for (; ai; ai = ai->ai_next) {
+    char *peername = printable_address(ai->ai_addr, ai->ai_addrlen);
+    lookup_peer_name(peername);
+    free(peername);
+  }
 }
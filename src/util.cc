@@ -714,3 +714,91 @@ void encode_data_to_hex(uint8_t* data, size_t data_len, uint8_t* hexed_data)
 
 }
 
+static const char alnum_digits[] =
+  "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+
+/* Characters needed for a group of 0 to 8 bytes: the least k with
+   62^k >= 256^n. */
+static const size_t alnum_group_chars[9] = { 0, 2, 3, 5, 6, 7, 9, 10, 11 };
+
+size_t alnum_encoded_len(size_t data_len)
+{
+  return data_len / 8 * 11 + alnum_group_chars[data_len % 8];
+}
+
+size_t alnum_decoded_len(size_t chars)
+{
+  size_t n = 0;
+  while (n < 7 && alnum_group_chars[n + 1] <= chars % 11)
+    n++;
+  return chars / 11 * 8 + n;
+}
+
+void encode_data_to_alnum(const uint8_t* data, size_t data_len,
+                          uint8_t* alnum_data)
+{
+  log_assert(alnum_data || data_len == 0);
+
+  while (data_len > 0) {
+    size_t n = data_len < 8 ? data_len : 8;
+    uint64_t v = 0;
+    for (size_t i = 0; i < n; i++)
+      v = v << 8 | data[i];
+
+    size_t chars = alnum_group_chars[n];
+    for (size_t i = chars; i > 0; i--) {
+      alnum_data[i - 1] = alnum_digits[v % 62];
+      v /= 62;
+    }
+
+    data += n;
+    data_len -= n;
+    alnum_data += chars;
+  }
+}
+
+static int alnum_digit_value(uint8_t c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'A' && c <= 'Z')
+    return c - 'A' + 10;
+  if (c >= 'a' && c <= 'z')
+    return c - 'a' + 36;
+  return -1;
+}
+
+ssize_t decode_alnum_to_data(const uint8_t* alnum_data, size_t len,
+                             uint8_t* data)
+{
+  ssize_t written = 0;
+
+  while (len > 0) {
+    size_t chars = len < 11 ? len : 11;
+    size_t n = alnum_decoded_len(chars);
+    if (alnum_group_chars[n] != chars)
+      return -1;
+
+    uint64_t v = 0;
+    for (size_t i = 0; i < chars; i++) {
+      int d = alnum_digit_value(alnum_data[i]);
+      if (d < 0 || v > (UINT64_MAX - d) / 62)
+        return -1;
+      v = v * 62 + d;
+    }
+    if (n < 8 && v >> (8 * n))
+      return -1;
+
+    for (size_t i = n; i > 0; i--) {
+      data[i - 1] = v & 0xFF;
+      v >>= 8;
+    }
+
+    alnum_data += chars;
+    len -= chars;
+    data += n;
+    written += n;
+  }
+
+  return written;
+}
@@ -165,6 +165,17 @@ char *printable_address(struct sockaddr *addr, socklen_t addrlen);
 struct evdns_base *get_evdns_base(void);
 int init_evdns_base(struct event_base *base);
 
+/** Return the DNS name of the host at PEERNAME, an address in the
+    form printable_address() produces, if it is in the reverse DNS
+    cache.  Otherwise start resolving it in the background and return
+    NULL.  Never blocks. */
+const char *lookup_peer_name(const char *peername);
+
+/** Start resolving the names of all addresses in the list AI so that
+    they are in the cache by the time we need them.  Can be called
+    before init_evdns_base, the lookups start then. */
+void prefetch_peer_names(const struct evutil_addrinfo *ai);
+
 /***** String functions. *****/
 
 static inline int ascii_isspace(unsigned char c)
@@ -382,5 +393,36 @@ std::string relativize_url(const std::string& absolute_url);
 */
 void encode_data_to_hex(uint8_t* data, size_t data_len, uint8_t* hexed_data);
 
+/**
+  Base-62 radix packing for text covers that can take any letter or
+  digit: every 8 bytes of data become 11 characters of [0-9A-Za-z],
+  and a trailing group of n bytes the fewest characters that hold
+  256^n values. That is about 5.8 bits per character, against 4 for
+  hex.
+*/
+size_t alnum_encoded_len(size_t data_len);
+
+/** The most data that CHARS characters of alnum encoding can carry. */
+size_t alnum_decoded_len(size_t chars);
+
+/**
+  @param data the buffer which contains the raw data
+  @param data_len the length of data in data buffer in number of bytes
+  @param alnum_data must have room for alnum_encoded_len(data_len)
+         characters; it is not NUL-terminated.
+*/
+void encode_data_to_alnum(const uint8_t* data, size_t data_len,
+                          uint8_t* alnum_data);
+
+/**
+  Inverse of encode_data_to_alnum.
+
+  @return the number of bytes written to data, or -1 if alnum_data
+          is not a valid encoding (a character out of the alphabet, a
+          group out of range, or a length no data encodes to).
+*/
+ssize_t decode_alnum_to_data(const uint8_t* alnum_data, size_t len,
+                             uint8_t* data);
+
 
 #endif